@@ -5,53 +5,224 @@
 #include<variant>
 #include<string>
 #include<memory>
+#include<optional>
+#include<utility>
+#include<mutex>
+#include<shared_mutex>
 #include "fraction.h"
 #include "page_manager.h"
+#include "key_search.h"
 #include "content_storage.h"
 #include "page_cache.h"
 #include "writer_queue.h"
 #include "wal.h"
+#include "version_manager.h"
+
+template <typename KeyType, typename ValueType>
+class BTree;
+
+/*
+ Where a tree keeps its files, and whether it picks up where the last run
+ left off. By default a tree starts out empty. With recover_from_wal it
+ reopens the page file as its page table was last saved (see
+ BTree::checkpoint), redoes the WAL's committed changes since then and
+ undoes what it saved of transactions that never committed, or starts
+ empty if no page table was ever saved there.
+*/
+struct BTreeOptions {
+    std::string page_file_path = "btree.db";
+    std::string wal_path = "btree.wal";
+    bool recover_from_wal = false;
+    size_t cache_pages = 50;  // Page cache capacity
+};
+
+/*
+*   Cursor over the keys in [lo, hi], returned by BTree::scan and scanReverse.
+*   It follows the leaf sibling links, so a range costs one descent plus one
+*   page fetch per leaf, and asks the cache to read ahead the next leaf in the
+*   direction we're moving. The current entry is copied out of the leaf, so
+*   key() and value() stay valid until the cursor moves.
+*   Every step searches for the key after (or before) the current one, so the
+*   cursor stays correct while other threads split or merge the leaf under it.
+*   A leaf that was merged away sends the cursor back through the root.
+*   A cursor opened at a snapshot (scanAt) shows the keys as they were when
+*   the snapshot began, however the leaves have changed since.
+*/
+template <typename KeyType, typename ValueType>
+class BTreeCursor {
+    private:
+        BTree<KeyType, ValueType>* tree;
+        PageCache<KeyType>* page_cache;
+        std::shared_ptr<Page<KeyType>> leaf;
+        KeyType lo;
+        KeyType hi;
+        KeyType current_key;
+        ValueType current_value;
+        bool is_valid;
+        TransactionId snapshot;  // 0 for the current contents
+
+        void seek(const KeyType& from, bool inclusive, bool forward);
+        void seekLeaf(const KeyType& from, bool inclusive, bool forward);
+        void settleAtSnapshot(KeyType from, bool inclusive, bool forward);
+
+    public:
+        BTreeCursor(BTree<KeyType, ValueType>* tree, PageCache<KeyType>* cache,
+                    const KeyType& lo, const KeyType& hi, bool forward, TransactionId snapshot = 0);
+
+        bool valid() const { return is_valid; }
+        const KeyType& key() const { return current_key; }
+        const ValueType& value() const { return current_value; }
+        void next();
+        void prev();
+};
 
 /*
 *   BTree that stores the BTreeNodes, ensures it is balanced
 *
+*   Safe to use from many threads. Readers crab down with shared latches,
+*   holding a parent only until its child is latched. Writers first try the
+*   same descent and latch just the leaf exclusively. Only when the leaf has
+*   to split or underflow do they start over from the root with exclusive
+*   latches, releasing the ones above a node that can't propagate a change.
+*   Latches are always taken top-down, and left to right between siblings.
+*
+*   Snapshot reads (beginSnapshot) see the tree as it was when the snapshot
+*   began, without holding anything between reads. Leaves only ever hold
+*   the current values: while a snapshot is open, every write first puts
+*   the value it overwrites (or the key's absence) into version_manager as
+*   a before-image, and snapshot reads check there after reading the leaf.
+*   Writes hold snapshot_gate shared from start to end, and beginSnapshot and
+*   endSnapshot take it exclusively, so a write that touches several leaves
+*   saves before-images for all of its keys or for none of them.
+*   The same hook keeps what the current transaction overwrote in
+*   undo_images, for abortTransaction and checkpoints (see saveState). With
+*   no snapshot open, that and the shared gate are all writers pay.
 */
 template <typename KeyType, typename ValueType>
 class BTree {
     private:
         std::shared_ptr<Page<KeyType>> root;
+        mutable std::shared_mutex root_latch;  // Guards which page is the root
         int maxKeysPerNode;  // Maximum keys in each node
         ContentStorage<KeyType> content_storage;
         PageCache<KeyType> page_cache;
         WriterQueue<KeyType> writer_queue;
         WALManager<KeyType> wal_manager;
         uint64_t current_transaction;
-        
-        void insertNonFull(std::shared_ptr<Page<KeyType>> root, const KeyType& key, const ValueType& value);
-        void splitChild(std::shared_ptr<Page<KeyType>> parent, int index, std::shared_ptr<Page<KeyType>> child);
+        std::mutex transaction_mutex;
+        // What every key the current transaction changed held before it (nullopt if it wasn't
+        // there), to roll it back on abort and to log as UNDO records when a checkpoint saves
+        // its changes. undo_mutex is taken after transaction_mutex
+        std::unordered_map<KeyType, std::optional<std::vector<uint8_t>>> undo_images;
+        std::mutex undo_mutex;
+        bool recovering;  // Redone changes aren't the current transaction's
+        VersionManager<KeyType> version_manager;  // Snapshots, and the before-images they still need
+        mutable std::shared_mutex snapshot_gate;  // Held shared by writes, exclusively to begin or end a snapshot
+
+        // Latch held on the leaf findLeaf returns, shared for readers, exclusive for writers
+        struct LeafLatch {
+            std::shared_ptr<Page<KeyType>> page;  // Keeps the page alive until the latch is gone
+            std::shared_lock<std::shared_mutex> shared;
+            std::optional<PageWriteGuard<KeyType>> exclusive;
+        };
+
+        // Exclusive latches a pessimistic delete holds from the top down, reset once released
+        using LatchPath = std::vector<std::unique_ptr<PageWriteGuard<KeyType>>>;
+
+        void insertPessimistic(const KeyType& key, const std::vector<uint8_t>& value);
+        std::shared_ptr<Page<KeyType>> splitChild(const std::shared_ptr<Page<KeyType>>& parent, int index,
+                                                  const std::shared_ptr<Page<KeyType>>& child,
+                                                  const KeyType& key, size_t len);
+        size_t splitPoint(const Page<KeyType>& node, const KeyType& key, size_t len, bool& key_goes_right) const;
 
-        void deleteFromNode(std::shared_ptr<Page<KeyType>> node, const KeyType& key);
-        void borrowFromLeft(std::shared_ptr<Page<KeyType>> parent, int index);
-        void borrowFromRight(std::shared_ptr<Page<KeyType>> parent, int index);
-        void mergeNodes(std::shared_ptr<Page<KeyType>> parent, int index);
+        void deletePessimistic(const KeyType& key);
+        bool deleteFromNode(const std::shared_ptr<Page<KeyType>>& node, const KeyType& key,
+                            LatchPath& path, std::unique_lock<std::shared_mutex>& root_lock);
+        void fixUnderflow(const std::shared_ptr<Page<KeyType>>& parent, size_t index);
+        void borrowFromLeft(const std::shared_ptr<Page<KeyType>>& parent, size_t index,
+                            const std::shared_ptr<Page<KeyType>>& left, const std::shared_ptr<Page<KeyType>>& child);
+        void borrowFromRight(const std::shared_ptr<Page<KeyType>>& parent, size_t index,
+                             const std::shared_ptr<Page<KeyType>>& child, const std::shared_ptr<Page<KeyType>>& right);
+        void mergeNodes(const std::shared_ptr<Page<KeyType>>& parent, size_t index,
+                        const std::shared_ptr<Page<KeyType>>& left, const std::shared_ptr<Page<KeyType>>& right);
+
+        // Returns the leaf with latch held on it. upper_fence, if given, is set to the
+        // smallest key that belongs right of the leaf (if any).
+        std::shared_ptr<Page<KeyType>> findLeaf(const KeyType& key, LeafLatch& latch, bool exclusive,
+                                                std::optional<KeyType>* upper_fence = nullptr);
+        void insertKey(const KeyType& key, const std::vector<uint8_t>& serialized_value);
+        void eraseKey(const KeyType& key);
+        void recoverFromWAL(uint64_t from_lsn);
+        uint64_t saveState();
+        bool insertIntoLeaf(Page<KeyType>& leaf, const std::vector<std::pair<KeyType, ValueType>>& entries,
+                            size_t begin, size_t end);
+        void bulkLoadEntries(std::vector<std::pair<KeyType, ValueType>> entries, double fill_factor);
+        uint64_t activeTransaction();
+        void clearUndoImages();
+
+        // In-place modification helpers
+        std::shared_ptr<Page<KeyType>> createNode(bool is_leaf);
+        std::shared_ptr<Page<KeyType>> createDetachedNode(bool is_leaf);
+        void markPageDirty(const std::shared_ptr<Page<KeyType>>& page);
+        void saveBeforeImage(const Page<KeyType>& leaf, const KeyType& key);
+        static void upsertIntoLeaf(Page<KeyType>& leaf, const KeyType& key, const uint8_t* value, size_t len);
+        size_t minKeys() const { return maxKeysPerNode / 2 > 0 ? maxKeysPerNode / 2 : 1; }
+
+        // Node fill, in keys and in bytes. Every page has to serialize into PAGE_SIZE_BYTES
+        static void checkEntrySize(const KeyType& key, size_t len);
+        bool needsSplit(const Page<KeyType>& node, const KeyType& key, size_t len) const;
+        bool isUnderfull(const Page<KeyType>& node) const;
+        bool canLose(const Page<KeyType>& node, size_t bytes) const;
+        bool canBorrow(const Page<KeyType>& parent, size_t separator, const Page<KeyType>& sibling,
+                       const Page<KeyType>& child, bool from_left) const;
+        bool canMerge(const Page<KeyType>& parent, size_t separator, const Page<KeyType>& left,
+                      const Page<KeyType>& right) const;
+
+        friend class BTreeCursor<KeyType, ValueType>;
 
     public:
-        BTree(int maxKeys);
+        explicit BTree(int maxKeys, const BTreeOptions& options = BTreeOptions());
         ~BTree();
         void insert(const KeyType& key, const ValueType& value);
+        void insertBatch(std::vector<std::pair<KeyType, ValueType>> entries);
+        std::vector<std::optional<ValueType>> multiGet(const std::vector<KeyType>& keys); // Results in input order
         void deleteKey(const KeyType& key);
-        ValueType* search(const KeyType& key); // Public search method
+
+        // Build the tree bottom-up from (key, value) pairs, the tree must be empty.
+        // fill_factor in (0, 1] is how full leaves and internal nodes are packed.
+        template <typename Iterator>
+        void bulkLoad(Iterator begin, Iterator end, double fill_factor = 1.0) {
+            bulkLoadEntries(std::vector<std::pair<KeyType, ValueType>>(begin, end), fill_factor);
+        }
+        ValueType* search(const KeyType& key); // Heap-allocated result, prefer lookup
+        std::optional<ValueType> lookup(const KeyType& key);
+        bool lookup(const KeyType& key, ValueType& value); // Decodes into value, returns false if missing
+        BTreeCursor<KeyType, ValueType> scan(const KeyType& lo, const KeyType& hi);        // Ascending from lo
+        BTreeCursor<KeyType, ValueType> scanReverse(const KeyType& lo, const KeyType& hi); // Descending from hi
         void printStorageStats() const;
-        void flush(); // To flush all pending writes
+        void flush(); // To flush all pending writes, and make them survive a restart
+        // Write every page and save the page table, returns the WAL LSN a restart redoes from
+        uint64_t checkpoint();
+        // Write a snapshot file for read-only replicas (see ReadOnlyBTree), holds off writes meanwhile
+        size_t exportSnapshot(const std::string& path);
         
         void beginTransaction();
         void commitTransaction();
         void abortTransaction();
+
+        // Consistent reads of the tree as of beginSnapshot, writers keep going meanwhile.
+        // Every snapshot has to be ended, the before-images it needs are kept until then
+        TransactionId beginSnapshot();
+        void endSnapshot(TransactionId snapshot);
+        bool lookupAt(TransactionId snapshot, const KeyType& key, ValueType& value);
+        std::optional<ValueType> lookupAt(TransactionId snapshot, const KeyType& key);
+        BTreeCursor<KeyType, ValueType> scanAt(TransactionId snapshot, const KeyType& lo, const KeyType& hi);
+        BTreeCursor<KeyType, ValueType> scanReverseAt(TransactionId snapshot, const KeyType& lo, const KeyType& hi);
         
         // Accessors for job scheduler integration
         WALManager<KeyType>& getWALManager() { return wal_manager; }
         PageCache<KeyType>& getPageCache() { return page_cache; }
-
-        Page<KeyType> findKey(std::shared_ptr<Page<KeyType>> node, const KeyType& key);
+        ContentStorage<KeyType>& getContentStorage() { return content_storage; }
+        VersionManager<KeyType>& getVersionManager() { return version_manager; }
 
 };
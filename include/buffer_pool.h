@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "page_manager.h"
+
+/*
+ One mapping holding num_frames page-aligned frames of PAGE_SIZE_BYTES,
+ frame i at base + i * PAGE_SIZE_BYTES. With huge pages requested it first
+ tries MAP_HUGETLB (the mapping is rounded up to whole huge pages), then
+ falls back to normal pages with a transparent huge page hint.
+*/
+class FrameArena {
+private:
+    uint8_t* base;
+    size_t num_frames;
+    size_t mapped_bytes;
+    bool huge_pages;  // Backed by MAP_HUGETLB
+
+public:
+    FrameArena(size_t frames, bool use_huge_pages);
+    ~FrameArena();
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    uint8_t* frame(size_t index) const { return base + index * PAGE_SIZE_BYTES; }
+    size_t frames() const { return num_frames; }
+    size_t bytes() const { return num_frames * PAGE_SIZE_BYTES; }
+    size_t mappedBytes() const { return mapped_bytes; }
+    bool onHugePages() const { return huge_pages; }
+};
+
+/*
+ Fixed set of page frames for PageCache. Every frame has a preallocated
+ Page whose value bytes live in the frame's arena memory, and which is
+ recycled rather than freed when the cache evicts it: the next page loaded
+ into the frame reuses its vectors, so a cache miss allocates nothing once
+ the frames have warmed up.
+ Each frame hands out copies of one shared_ptr created up front, holding
+ one is what pins the page, the cache only evicts a frame that nobody
+ outside the pool holds (see isPinned).
+*/
+template <typename KeyType>
+class BufferPool {
+private:
+    FrameArena arena;
+    std::vector<Page<KeyType>> pages;                   // Frame i's page, never reallocated
+    std::vector<std::shared_ptr<Page<KeyType>>> anchors; // Point at pages[i], delete nothing
+    std::vector<uint32_t> free_frames;
+    std::vector<uint32_t> orphaned_frames;  // Out of the cache but still held, freed once they aren't
+    mutable std::mutex free_mutex;
+
+    void reclaimOrphans();  // Caller holds free_mutex
+
+    void resetFrame(size_t frame);
+
+public:
+    BufferPool(size_t frames, bool use_huge_pages = false);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // A cleared frame, or -1 if all of them are in use
+    int32_t acquire();
+    void release(int32_t frame);  // The frame must not be pinned
+    void releaseWhenUnpinned(int32_t frame);  // Now, or by a later acquire once nobody holds it
+
+    const std::shared_ptr<Page<KeyType>>& page(int32_t frame) const { return anchors[frame]; }
+    bool isPinned(int32_t frame) const { return anchors[frame].use_count() > 1; }
+
+    // Stats
+    size_t frameCount() const { return pages.size(); }
+    size_t freeFrames() const;
+    const FrameArena& getArena() const { return arena; }
+};
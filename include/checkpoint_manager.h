@@ -3,6 +3,7 @@
 #include <atomic>
 #include <string>
 #include <memory>
+#include <functional>
 #include "wal.h"
 #include "page_cache.h"
 #include "job_scheduler.h"
@@ -17,7 +18,10 @@ private:
     // Checkpoint configuration
     std::chrono::milliseconds checkpoint_interval;
     size_t wal_size_threshold;  // Trigger checkpoint when WAL exceeds this size
-    size_t dirty_page_threshold; // Trigger checkpoint when dirty pages exceed this
+    size_t dirty_page_threshold; // Trigger checkpoint when dirty pages exceed this, also pages flushed per slice
+    std::chrono::milliseconds flush_pause;  // Between slices of a checkpoint's page writes
+    std::atomic<bool> truncate_wal;  // Drop the log before each checkpoint's redo LSN, see setTruncateWAL
+    std::function<uint64_t()> save_page_table;  // See setPageTableSaver
     
     // Checkpoint tracking
     std::atomic<uint64_t> last_checkpoint_lsn;
@@ -42,7 +46,7 @@ public:
     void start();
     void stop();
     
-    // Manual checkpoint
+    // Manual checkpoint, fuzzy: logs begin and end records and flushes in between
     bool performCheckpoint();
     
     // Automatic checkpoint triggers
@@ -53,6 +57,13 @@ public:
     void setCheckpointInterval(std::chrono::milliseconds interval);
     void setWALSizeThreshold(size_t threshold);
     void setDirtyPageThreshold(size_t threshold);
+    void setFlushPause(std::chrono::milliseconds pause);
+    // Whether each checkpoint (and the cleanup job) drops the WAL segments before its redo
+    // LSN. On by default, the WAL never drops what a saved page table still redoes
+    void setTruncateWAL(bool enabled);
+    // Run save once a checkpoint's pages are written, e.g. [&tree] { return tree.checkpoint(); }.
+    // The LSN it returns, where a restart redoes from, becomes the checkpoint's redo LSN
+    void setPageTableSaver(std::function<uint64_t()> save);
     
     // Statistics
     struct CheckpointStats {
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/*
+ CRC32C (Castagnoli), the checksum on WAL records and page images. Pass
+ the previous result as crc to checksum data in pieces, start with 0.
+ The CPU's CRC32C instructions (SSE4.2 on x86, the ARMv8 CRC extension)
+ are used when it has them, checked once at startup, otherwise a
+ slicing-by-8 table that handles 8 bytes per step.
+*/
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+// The table version, always available (and used to check the hardware one)
+uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t size);
+
+// Name of the implementation crc32c picked: "sse4.2", "armv8" or "slicing-by-8"
+const char* crc32cImplementation();
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <type_traits>
+
+// Non-owning view over a run of bytes inside a page image or buffer
+struct ByteView {
+    const uint8_t* data;
+    size_t size;
+};
+
+/*
+ Codec turns keys and values into the bytes we store in pages (and back).
+ Fixed-width types are copied as-is, so a View is just the value itself.
+ Types that need a different layout get their own specialization below.
+*/
+template <typename T>
+struct Codec {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Codec needs a specialization for types that aren't trivially copyable");
+
+    using View = T;
+
+    static size_t encodedSize(const T&) { return sizeof(T); }
+    static constexpr size_t minEncodedSize() { return sizeof(T); }  // What view() reads at least
+
+    static void encode(const T& value, uint8_t* out) {
+        std::memcpy(out, &value, sizeof(T));
+    }
+
+    static void append(const T& value, std::vector<uint8_t>& out) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    // The encoded bytes without copying them anywhere
+    static ByteView bytes(const T& value) {
+        return {reinterpret_cast<const uint8_t*>(&value), sizeof(T)};
+    }
+
+    static View view(const uint8_t* bytes, size_t) {
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    static T decode(const uint8_t* bytes, size_t len) { return view(bytes, len); }
+
+    static void decodeInto(const uint8_t* bytes, size_t, T& out) {
+        std::memcpy(&out, bytes, sizeof(T));
+    }
+};
+
+/*
+ Strings are stored as their raw characters, the length comes from
+ the slot/cell they live in so no terminator or length prefix is needed.
+*/
+template <>
+struct Codec<std::string> {
+    using View = std::string_view;
+
+    static size_t encodedSize(const std::string& value) { return value.size(); }
+    static constexpr size_t minEncodedSize() { return 0; }
+
+    static void encode(const std::string& value, uint8_t* out) {
+        std::memcpy(out, value.data(), value.size());
+    }
+
+    static void append(const std::string& value, std::vector<uint8_t>& out) {
+        out.insert(out.end(), value.begin(), value.end());
+    }
+
+    static ByteView bytes(const std::string& value) {
+        return {reinterpret_cast<const uint8_t*>(value.data()), value.size()};
+    }
+
+    static View view(const uint8_t* bytes, size_t len) {
+        return View(reinterpret_cast<const char*>(bytes), len);
+    }
+
+    static std::string decode(const uint8_t* bytes, size_t len) {
+        return std::string(reinterpret_cast<const char*>(bytes), len);
+    }
+
+    // Reuses out's buffer, so repeated lookups into the same string don't allocate
+    static void decodeInto(const uint8_t* bytes, size_t len, std::string& out) {
+        out.assign(reinterpret_cast<const char*>(bytes), len);
+    }
+};
@@ -1,14 +1,214 @@
 #pragma once
-#include <string>
-#include <vector>
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <functional>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+/*
+ 128-bit hash of a page's content. ContentStorage treats two pages with
+ the same hash as the same content and keeps only one copy, so it has to
+ be wide enough that a collision never happens in practice: at 64 bits a
+ few billion pages already make one likely, at 128 bits it takes around
+ 2^64. {0, 0} is never produced and means "no hash yet".
+*/
+struct ContentHash {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool empty() const { return low == 0 && high == 0; }
+    bool operator==(const ContentHash& other) const { return low == other.low && high == other.high; }
+    bool operator!=(const ContentHash& other) const { return !(*this == other); }
+
+    static ContentHash computeHash(const void* data, size_t size);
+    static ContentHash computeHash(const std::vector<uint8_t>& data) {
+        return computeHash(data.data(), data.size());
+    }
+};
+
+// 32 hex digits, high half first
+inline std::ostream& operator<<(std::ostream& out, const ContentHash& hash) {
+    static const char digits[] = "0123456789abcdef";
+    char text[32];
+    for (int i = 0; i < 16; ++i) {
+        text[i] = digits[(hash.high >> (60 - 4 * i)) & 0xf];
+        text[16 + i] = digits[(hash.low >> (60 - 4 * i)) & 0xf];
+    }
+    return out.write(text, sizeof(text));
+}
+
+/*
+ Streaming ContentHash, fed the page's fields one piece at a time so
+ nothing has to be gathered into a buffer first. It is built like XXH3's
+ long input path: eight 64-bit lanes take a 64-byte stripe at a time, each
+ lane adds a 32x32->64 bit multiply of its input mixed with a secret (and
+ the raw input to its neighbour lane), the secret slides by one lane per
+ stripe and the lanes are scrambled every 16 stripes. At the end the lanes
+ are folded into two independent 64-bit halves with 128-bit multiplies.
+ The loop has no dependencies between lanes, so the compiler vectorizes it.
+ Only pieces smaller than a stripe are buffered.
+*/
+class ContentHasher {
+private:
+    static constexpr size_t LANES = 8;
+    static constexpr size_t STRIPE_BYTES = LANES * sizeof(uint64_t);
+    static constexpr size_t STRIPES_PER_ROUND = 16;
+
+    static constexpr uint64_t PRIME32_1 = 0x9E3779B1u;
+    static constexpr uint64_t PRIME32_2 = 0x85EBCA77u;
+    static constexpr uint64_t PRIME32_3 = 0xC2B2AE3Du;
+    static constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+    static constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+    static constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+    static constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+    static constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+    /*
+     Secret lanes: [0, 23) are mixed into stripes (stripe i of a round
+     starts at lane i), [24, 32) scramble, [32, 48) fold the two halves.
+     Generated with splitmix64, any well mixed constants would do.
+    */
+    static constexpr size_t SECRET_LANES = 48;
+    using Secret = std::array<uint64_t, SECRET_LANES>;
+
+    static constexpr Secret makeSecret() {
+        Secret secret{};
+        uint64_t state = PRIME64_1;
+        for (size_t i = 0; i < SECRET_LANES; ++i) {
+            state += 0x9E3779B97F4A7C15ull;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            secret[i] = z ^ (z >> 31);
+        }
+        return secret;
+    }
+
+    static const Secret& secret() {
+        static constexpr Secret value = makeSecret();
+        return value;
+    }
+
+    std::array<uint64_t, LANES> acc;
+    size_t round_stripes = 0;  // Stripes taken since the last scramble
+    uint64_t total_bytes = 0;
+    uint8_t pending[STRIPE_BYTES];
+    size_t pending_bytes = 0;
+
+    static uint64_t load64(const uint8_t* bytes) {
+        uint64_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+
+    // Low and high 64 bits of a 128-bit product, XORed
+    static uint64_t mulFold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+        uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+        uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+        uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+        uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+        uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+        uint64_t lower = (cross << 32) | (lo_lo & 0xffffffff);
+        return lower ^ upper;
+#endif
+    }
+
+    static uint64_t avalanche(uint64_t h) {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ull;
+        return h ^ (h >> 32);
+    }
+
+    static void accumulateStripe(std::array<uint64_t, LANES>& lanes, size_t& stripes, const uint8_t* stripe) {
+        const uint64_t* key = secret().data() + stripes;
+        for (size_t i = 0; i < LANES; ++i) {
+            uint64_t data = load64(stripe + i * sizeof(uint64_t));
+            uint64_t keyed = data ^ key[i];
+            lanes[i ^ 1] += data;
+            lanes[i] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+        if (++stripes == STRIPES_PER_ROUND) {
+            const uint64_t* scramble = secret().data() + 24;
+            for (size_t i = 0; i < LANES; ++i) {
+                lanes[i] = ((lanes[i] ^ (lanes[i] >> 47)) ^ scramble[i]) * PRIME32_1;
+            }
+            stripes = 0;
+        }
+    }
+
+    static uint64_t mergeLanes(const std::array<uint64_t, LANES>& lanes, const uint64_t* key, uint64_t start) {
+        uint64_t result = start;
+        for (size_t i = 0; i < LANES; i += 2) {
+            result += mulFold64(lanes[i] ^ key[i], lanes[i + 1] ^ key[i + 1]);
+        }
+        return avalanche(result);
+    }
 
-class ContentHash {
 public:
-    static std::string computeHash(const std::vector<uint8_t>& data) {
-        std::hash<std::string> hasher;
-        std::string data_str(data.begin(), data.end());
-        return std::to_string(hasher(data_str));
+    ContentHasher()
+        : acc{PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1} {}
+
+    void update(const void* data, size_t size) {
+        if (size == 0) {
+            return;  // data may be null then (an empty vector)
+        }
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        total_bytes += size;
+
+        if (pending_bytes > 0) {
+            size_t take = size < STRIPE_BYTES - pending_bytes ? size : STRIPE_BYTES - pending_bytes;
+            std::memcpy(pending + pending_bytes, bytes, take);
+            pending_bytes += take;
+            bytes += take;
+            size -= take;
+            if (pending_bytes < STRIPE_BYTES) {
+                return;
+            }
+            accumulateStripe(acc, round_stripes, pending);
+            pending_bytes = 0;
+        }
+        // Whole stripes straight from the caller's memory
+        for (; size >= STRIPE_BYTES; bytes += STRIPE_BYTES, size -= STRIPE_BYTES) {
+            accumulateStripe(acc, round_stripes, bytes);
+        }
+        std::memcpy(pending, bytes, size);
+        pending_bytes = size;
+    }
+
+    // Fixed-width values (lengths, IDs, flags) as their in-memory bytes
+    template <typename T>
+    void updateValue(const T& value) {
+        update(&value, sizeof(value));
+    }
+
+    // The hash of everything so far, the hasher can keep going afterwards
+    ContentHash finish() const {
+        std::array<uint64_t, LANES> lanes = acc;
+        size_t stripes = round_stripes;
+        if (pending_bytes > 0) {
+            // Zero padded, the length folded in below keeps "a" and "a\0" apart
+            uint8_t last[STRIPE_BYTES] = {};
+            std::memcpy(last, pending, pending_bytes);
+            accumulateStripe(lanes, stripes, last);
+        }
+
+        ContentHash hash;
+        hash.low = mergeLanes(lanes, secret().data() + 32, total_bytes * PRIME64_1);
+        hash.high = mergeLanes(lanes, secret().data() + 40, ~(total_bytes * PRIME64_2));
+        if (hash.empty()) {
+            hash.low = 1;  // {0, 0} is reserved
+        }
+        return hash;
     }
 };
+
+inline ContentHash ContentHash::computeHash(const void* data, size_t size) {
+    ContentHasher hasher;
+    hasher.update(data, size);
+    return hasher.finish();
+}
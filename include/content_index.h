@@ -0,0 +1,128 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "content_hash.h"
+#include "page_id.h"
+
+// Where a unique piece of content lives in the page file
+struct ContentBlock {
+    uint64_t block_id;   // Block in the page file holding the page image
+    PageId page_id;      // First page ID that stored this content
+    size_t key_count;
+    size_t data_bytes;
+    uint32_t refs;       // Page IDs pointing at this content
+};
+
+/*
+ Dedup index of ContentStorage: content hash -> ContentBlock, as one flat
+ array probed linearly from the slot the hash's low bits pick. The hashes
+ are uniformly mixed already, so they index the table directly, and a
+ lookup touches one or two neighbouring slots instead of chasing a bucket
+ list. A slot with an empty hash is free. The table doubles when it gets
+ over 3/4 full and is never shrunk, erase shifts the entries after the
+ hole back instead of leaving tombstones. Not thread safe, the owner locks.
+*/
+class ContentIndex {
+private:
+    struct Slot {
+        ContentHash hash;  // empty() = free slot
+        ContentBlock block;
+    };
+
+    std::vector<Slot> slots;  // Power of two long
+    size_t count = 0;
+
+    size_t home(const ContentHash& hash) const { return hash.low & (slots.size() - 1); }
+
+    // The slot holding hash, or the free slot where it would go
+    size_t probe(const ContentHash& hash) const {
+        size_t mask = slots.size() - 1;
+        size_t index = home(hash);
+        while (!slots[index].hash.empty() && slots[index].hash != hash) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void grow() {
+        std::vector<Slot> old_slots(slots.size() * 2);
+        old_slots.swap(slots);
+        for (const Slot& slot : old_slots) {
+            if (!slot.hash.empty()) {
+                slots[probe(slot.hash)] = slot;
+            }
+        }
+    }
+
+public:
+    explicit ContentIndex(size_t initial_slots = 1024) {
+        size_t capacity = 16;
+        while (capacity < initial_slots) {
+            capacity *= 2;
+        }
+        slots.resize(capacity);
+    }
+
+    const ContentBlock* find(const ContentHash& hash) const {
+        const Slot& slot = slots[probe(hash)];
+        return slot.hash.empty() ? nullptr : &slot.block;
+    }
+
+    ContentBlock* find(const ContentHash& hash) {
+        Slot& slot = slots[probe(hash)];
+        return slot.hash.empty() ? nullptr : &slot.block;
+    }
+
+    bool contains(const ContentHash& hash) const { return find(hash) != nullptr; }
+
+    // Adds hash -> block unless the hash is already there. False if it was
+    bool insert(const ContentHash& hash, const ContentBlock& block) {
+        if ((count + 1) * 4 > slots.size() * 3) {
+            grow();
+        }
+        Slot& slot = slots[probe(hash)];
+        if (!slot.hash.empty()) {
+            return false;
+        }
+        slot.hash = hash;
+        slot.block = block;
+        count++;
+        return true;
+    }
+
+    /*
+     Remove hash. Entries further along the probe run move back into the
+     hole when it lies between their home slot and where they are, so every
+     entry stays reachable from its home without tombstones.
+    */
+    bool erase(const ContentHash& hash) {
+        size_t mask = slots.size() - 1;
+        size_t hole = probe(hash);
+        if (slots[hole].hash.empty()) {
+            return false;
+        }
+        for (size_t next = (hole + 1) & mask; !slots[next].hash.empty(); next = (next + 1) & mask) {
+            size_t wanted = home(slots[next].hash);
+            if (((next - wanted) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole].hash = ContentHash{};
+        count--;
+        return true;
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return slots.size(); }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (const Slot& slot : slots) {
+            if (!slot.hash.empty()) {
+                fn(slot.hash, slot.block);
+            }
+        }
+    }
+};
@@ -1,99 +1,996 @@
 #pragma once
 #include <unordered_map>
+#include <cstddef>
 #include <vector>
 #include <memory>
 #include <string>
+#include <mutex>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
 #include <iostream>
+#include <chrono>
+#include <shared_mutex>
+#include <algorithm>
+#include <sys/stat.h>
 #include "page_manager.h"
+#include "page_file.h"
+#include "mapped_snapshot.h"
+#include "checksum.h"
+#include "content_index.h"
+#include "job_scheduler.h"
+#include "log.h"
+
+/*
+ Page table file, saved next to the page file (its path plus ".table") by
+ ContentStorage::savePageTable. It is what lets a later run reopen the
+ page file: which block each page ID's content is in, and where the tree
+ and its WAL redo start. Blocks are PAGE_SIZE_BYTES like the page file's:
+ the header in block 0, then the PageTableEntry array padded to whole
+ blocks. It is written to a new file that replaces the old one with a
+ rename, so a crash leaves one table or the other, never half of each.
+*/
+constexpr uint32_t PAGE_TABLE_MAGIC = 0x4C425450; // "PTBL"
+constexpr uint32_t PAGE_TABLE_FORMAT_VERSION = 1;
+
+struct PageTableHeader {
+    uint32_t magic;
+    uint32_t format_version;
+    uint32_t page_size;
+    uint32_t table_checksum;  // CRC32C of the entries
+    PageId root_page_id;
+    PageId next_page_id;
+    uint64_t redo_lsn;        // WAL redo starts here, everything before is in the pages
+    uint64_t num_pages;       // Entries, starting in block 1
+};
+
+struct PageTableEntry {
+    PageId page_id;
+    uint64_t block_id;
+    uint64_t hash_low;   // Key of the content in the dedup index
+    uint64_t hash_high;
+    uint64_t key_count;
+    uint64_t data_bytes;
+};
 
 template <typename KeyType>
 class ContentStorage {
+public:
+    /*
+     Everything storeSnapshots needs of a page, taken while the caller holds
+     the page's latch, so the latch is dropped again before any IO happens.
+    */
+    struct PageSnapshot {
+        PageId page_id = 0;
+        uint64_t version = 0;
+        ContentHash content_hash;
+        bool deleted = false;
+        size_t key_count = 0;
+        size_t data_bytes = 0;
+        const uint8_t* image = nullptr;  // PAGE_SIZE_BYTES page image, unused for deleted pages
+    };
+
 private:
-    // Map content hash to actual page data
-    std::unordered_map<std::string, std::shared_ptr<Page<KeyType>>> content_map;
-    
+    // Backing page file, every unique content block occupies one fixed-size block
+    PageFile page_file;
+
+    // Map content hash to the block holding that content
+    ContentIndex content_map;
+
     // Map page ID to content hash for reverse lookup
-    std::unordered_map<uint16_t, std::string> page_to_hash;
-    
+    std::unordered_map<PageId, ContentHash> page_to_hash;
+
+    // Version of the page image each page ID currently points at
+    std::unordered_map<PageId, uint64_t> page_versions;
+
     // Next available page ID
-    uint16_t next_page_id = 1;
+    PageId next_page_id = 1;
 
-public:
-    // Store a page and return its page ID
-    uint16_t storePage(const Page<KeyType>& page) {
-        // Update the page's content hash
-        Page<KeyType> page_copy = page;
-        page_copy.updateContentHash();
-        std::string content_hash = page_copy.getContentHash();
-        
-        // Check if we already have this content
-        auto it = content_map.find(content_hash);
-        if (it != content_map.end()) {
-            // Content already exists, return existing page ID
-            std::cout << "Deduplication: Found existing content with hash " << content_hash 
-                      << ", reusing page ID " << it->second->header.page_id << std::endl;
-            return it->second->header.page_id;
-        }
-        
-        // New content, assign a new page ID
-        page_copy.header.page_id = next_page_id++;
-        page_to_hash[page_copy.header.page_id] = content_hash;
-        content_map[content_hash] = std::make_shared<Page<KeyType>>(page_copy);
-        
-        std::cout << "Stored new content with hash " << content_hash 
-                  << " as page ID " << page_copy.header.page_id << std::endl;
-        return page_copy.header.page_id;
-    }
-    
-    // Retrieve a page by its page ID
-    std::shared_ptr<Page<KeyType>> getPage(uint16_t page_id) {
+    // Writer threads and cache evictions call into storage concurrently
+    mutable std::mutex storage_mutex;
+
+    // Pages written through storePage, and how many of them were deduplicated
+    size_t pages_stored = 0;
+    size_t dedup_hits = 0;
+    size_t hash_collisions = 0;  // Hash matches whose bytes didn't, see findContent
+
+    /*
+     Content nobody refers to anymore. Its block can't be reused right away,
+     a reader may have looked it up just before and still be reading it:
+     readers hold reuse_latch shared from lookup to the end of the read, and
+     collectGarbage takes it exclusively once before freeing dead blocks.
+     Content that dies is retired first: the saved page table may still
+     point at its block, so it only becomes dead once a newer table is saved.
+    */
+    std::vector<uint64_t> dead_blocks;
+    std::vector<uint64_t> retired_blocks;
+    mutable std::shared_mutex reuse_latch;
+    size_t pages_released = 0;     // Page IDs dropped because the page was deleted
+    size_t blocks_reclaimed = 0;   // Dead blocks handed back to the page file
+    size_t table_entries_dropped = 0;  // Index, page table and page version entries dropped
+
+    /*
+     Page IDs released since the last collection, and before it. Their
+     page_versions entries still turn away late flushes of older copies,
+     collectGarbage drops them once they have waited a full interval.
+    */
+    std::vector<PageId> released_pages;
+    std::vector<PageId> expiring_pages;
+
+    // What the page table we reopened with says, see loadedState
+    bool reopened = false;
+    PageId saved_root_page_id = 0;
+    uint64_t saved_redo_lsn = 0;
+
+    // Recurring collectGarbage job, see startGarbageCollection
+    JobScheduler* gc_scheduler = nullptr;
+    std::string gc_job_name;
+
+    // Resolve page ID -> content hash -> block
+    bool lookupBlock(PageId page_id, uint64_t& block_id, ContentHash* content_hash,
+                     uint64_t* version = nullptr) const {
+        std::lock_guard<std::mutex> lock(storage_mutex);
         auto hash_it = page_to_hash.find(page_id);
         if (hash_it == page_to_hash.end()) {
+            return false;
+        }
+
+        const ContentBlock* content = content_map.find(hash_it->second);
+        if (!content) {
+            return false; // Content not found (shouldn't happen)
+        }
+
+        block_id = content->block_id;
+        if (content_hash) {
+            *content_hash = hash_it->second;
+        }
+        if (version) {
+            auto version_it = page_versions.find(page_id);
+            *version = version_it != page_versions.end() ? version_it->second : 0;
+        }
+        return true;
+    }
+
+    static constexpr uint64_t NO_BLOCK = ~uint64_t(0);
+
+    /*
+     Whether two page images hold the same content. Pages sharing a block
+     differ in their page ID (and so in their checksum), every other byte
+     has to match.
+    */
+    static bool sameContent(const uint8_t* a, const uint8_t* b) {
+        constexpr size_t checksum_end = offsetof(PageImageHeader, checksum) + sizeof(uint32_t);
+        constexpr size_t id_start = offsetof(PageImageHeader, page_id);
+        constexpr size_t id_end = id_start + sizeof(PageId);
+        return std::memcmp(a, b, offsetof(PageImageHeader, checksum)) == 0 &&
+               std::memcmp(a + checksum_end, b + checksum_end, id_start - checksum_end) == 0 &&
+               std::memcmp(a + id_end, b + id_end, PAGE_SIZE_BYTES - id_end) == 0;
+    }
+
+    // Whether the content indexed under key is image. Caller holds storage_mutex
+    bool holdsContent(const ContentHash& key, const uint8_t* image) const {
+        thread_local AlignedPageBuffer stored;
+        const ContentBlock* block = content_map.find(key);
+        if (!block) {
+            return false;
+        }
+        page_file.readBlock(block->block_id, stored.data());
+        return sameContent(stored.data(), image);
+    }
+
+    // Where to index content whose hash is taken by different content, see findContent
+    static ContentHash probeNext(const ContentHash& key) {
+        ContentHash next{key.low + 0x9E3779B97F4A7C15ull, key.high ^ 0xC2B2AE3D27D4EB4Full};
+        return next.empty() ? ContentHash{1, 0} : next;
+    }
+
+    /*
+     Look up the stored content that is image. A matching hash isn't taken
+     on trust, the block's bytes are compared; on a collision the next
+     probe key is tried. Returns whether it was found, either way key ends
+     up where image is (or is to be) indexed. pending(key) gives the image
+     of content indexed under key but not stored yet (storePages), or null.
+     Caller holds storage_mutex.
+    */
+    template <typename Pending>
+    bool findContent(ContentHash& key, const uint8_t* image, Pending&& pending) {
+        while (true) {
+            const uint8_t* other = pending(key);
+            if (other) {
+                if (sameContent(other, image)) {
+                    return true;
+                }
+            } else if (content_map.contains(key)) {
+                if (holdsContent(key, image)) {
+                    return true;
+                }
+            } else {
+                return false;
+            }
+            hash_collisions++;
+            key = probeNext(key);
+        }
+    }
+
+    bool findContent(ContentHash& key, const uint8_t* image) {
+        return findContent(key, image, [](const ContentHash&) -> const uint8_t* { return nullptr; });
+    }
+
+    /*
+     Does this snapshot need a block of its own? Not when it would be
+     ignored, is unchanged, or its content is stored already (or is about
+     to be, by an earlier snapshot of the same batch). Caller holds storage_mutex.
+    */
+    bool needsBlock(const PageSnapshot* snapshots, size_t index, const std::vector<uint64_t>& blocks) const {
+        const PageSnapshot& snapshot = snapshots[index];
+        if (snapshot.deleted) {
+            return false;
+        }
+        auto version_it = page_versions.find(snapshot.page_id);
+        if (version_it != page_versions.end() && snapshot.version < version_it->second) {
+            return false;
+        }
+        auto previous = page_to_hash.find(snapshot.page_id);
+        if ((previous != page_to_hash.end() && previous->second == snapshot.content_hash) ||
+            content_map.contains(snapshot.content_hash)) {
+            return false;
+        }
+        for (size_t i = 0; i < index; ++i) {
+            if (blocks[i] != NO_BLOCK && snapshots[i].content_hash == snapshot.content_hash) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     Point the snapshot's page ID at its content. block is where its image
+     was written already (NO_BLOCK if none was); the checks run again since
+     that was decided, the block dies unused if another store got here first.
+     Caller holds storage_mutex.
+    */
+    void commitSnapshot(const PageSnapshot& snapshot, uint64_t block) {
+        PageId page_id = snapshot.page_id;
+
+        // A flush of an older copy of this page can arrive after a newer one, don't go backwards
+        auto version_it = page_versions.find(page_id);
+        if (version_it != page_versions.end() && snapshot.version < version_it->second) {
+            discardBlock(block);
+            return;
+        }
+        page_versions[page_id] = snapshot.version;  // Kept for deleted pages a while, see released_pages
+
+        // A merged away page (or an old root) is gone for good, drop it and its reference
+        if (snapshot.deleted) {
+            releasePage(page_id);
+            return;
+        }
+
+        auto previous = page_to_hash.find(page_id);
+        if (previous != page_to_hash.end() && previous->second == snapshot.content_hash &&
+            holdsContent(previous->second, snapshot.image)) {
+            discardBlock(block);
+            return;  // Flushed again without changes
+        }
+        pages_stored++;
+
+        // Content we already have, point this page at the existing block
+        ContentHash key = snapshot.content_hash;
+        if (findContent(key, snapshot.image)) {
+            content_map.find(key)->refs++;
+            dedup_hits++;
+            discardBlock(block);
+        } else {
+            if (block == NO_BLOCK) {
+                // Its content was released (or collided) since the batch was planned, write it now
+                block = page_file.allocateBlock();
+                page_file.writeBlock(block, snapshot.image);
+            }
+            content_map.insert(key, {block, page_id, snapshot.key_count, snapshot.data_bytes, 1});
+        }
+        repointPage(page_id, key);
+    }
+
+    // A block written for content that got stored elsewhere, nobody has seen it
+    void discardBlock(uint64_t block) {
+        if (block != NO_BLOCK) {
+            dead_blocks.push_back(block);
+        }
+    }
+
+    // Write a page that already has its ID, serialized straight from the caller's page
+    PageId storeWithId(const Page<KeyType>& page) {
+        thread_local AlignedPageBuffer buffer;
+        PageSnapshot snapshot = snapshotPage(page, buffer.data());
+        storeSnapshots(&snapshot, 1);
+        return snapshot.page_id;
+    }
+
+    // Give the page ID's reference on its old content (if any) to content_hash, which is already counted
+    void repointPage(PageId page_id, const ContentHash& content_hash) {
+        auto it = page_to_hash.find(page_id);
+        if (it == page_to_hash.end()) {
+            page_to_hash.emplace(page_id, content_hash);
+            return;
+        }
+        ContentHash old_hash = it->second;
+        it->second = content_hash;
+        releaseContent(old_hash);
+    }
+
+    // Drop one reference, content nobody points at anymore leaves the index and its block dies
+    void releaseContent(const ContentHash& content_hash) {
+        ContentBlock* block = content_map.find(content_hash);
+        if (!block || --block->refs > 0) {
+            return;
+        }
+        retired_blocks.push_back(block->block_id);
+        content_map.erase(content_hash);
+        table_entries_dropped++;
+    }
+
+    void releasePage(PageId page_id) {
+        auto it = page_to_hash.find(page_id);
+        if (it == page_to_hash.end()) {
+            return;
+        }
+        ContentHash content_hash = it->second;
+        page_to_hash.erase(it);
+        releaseContent(content_hash);
+        released_pages.push_back(page_id);
+        pages_released++;
+        table_entries_dropped++;
+    }
+
+    // The snapshot file for exportSnapshot, written to a new file at path
+    void writeSnapshot(const std::string& path, const std::vector<SnapshotPageEntry>& table,
+                       const std::vector<uint64_t>& source_blocks, PageId root_page_id) {
+        PageFile out(path, PageFile::OpenMode::CreateNew);
+        out.allocateBlock();  // Block 0, the header goes in last
+
+        // Page images, copied over in batches
+        constexpr size_t BATCH_PAGES = 64;
+        AlignedPageBuffer batch(BATCH_PAGES);
+        for (size_t next = 0; next < source_blocks.size();) {
+            uint32_t count = static_cast<uint32_t>(std::min(BATCH_PAGES, source_blocks.size() - next));
+            for (uint32_t i = 0; i < count; ++i) {
+                page_file.readBlock(source_blocks[next + i], batch.page(i));
+            }
+            out.writeBlocks(out.allocateBlocks(count), batch.data(), count);
+            next += count;
+        }
+
+        // Page table, padded to whole blocks
+        size_t table_bytes = table.size() * sizeof(SnapshotPageEntry);
+        uint32_t table_blocks = static_cast<uint32_t>((table_bytes + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES);
+        AlignedPageBuffer table_buffer(table_blocks);
+        std::memcpy(table_buffer.data(), table.data(), table_bytes);
+        uint64_t table_block = out.allocateBlocks(table_blocks);
+        out.writeBlocks(table_block, table_buffer.data(), table_blocks);
+
+        AlignedPageBuffer header_buffer;
+        SnapshotHeader header{};
+        header.magic = SNAPSHOT_MAGIC;
+        header.format_version = SNAPSHOT_FORMAT_VERSION;
+        header.page_size = PAGE_SIZE_BYTES;
+        header.table_checksum = crc32c(0, table.data(), table_bytes);
+        header.root_page_id = root_page_id;
+        header.num_images = source_blocks.size();
+        header.num_pages = table.size();
+        header.table_block = table_block;
+        std::memcpy(header_buffer.data(), &header, sizeof(header));
+        out.writeBlock(0, header_buffer.data());
+        out.sync();
+    }
+
+    static std::string tablePath(const std::string& page_file_path) { return page_file_path + ".table"; }
+
+    static bool hasPageTable(const std::string& page_file_path) {
+        struct stat st;
+        return ::stat(tablePath(page_file_path).c_str(), &st) == 0;
+    }
+
+    // The page table file for savePageTable, written to a new file at path
+    static void writePageTable(const std::string& path, PageTableHeader header,
+                               const std::vector<PageTableEntry>& table) {
+        PageFile out(path, PageFile::OpenMode::CreateNew);
+        out.allocateBlock();  // Block 0, the header goes in last
+
+        size_t table_bytes = table.size() * sizeof(PageTableEntry);
+        uint32_t table_blocks = static_cast<uint32_t>((table_bytes + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES);
+        if (table_blocks > 0) {
+            AlignedPageBuffer table_buffer(table_blocks);
+            std::memcpy(table_buffer.data(), table.data(), table_bytes);
+            out.writeBlocks(out.allocateBlocks(table_blocks), table_buffer.data(), table_blocks);
+        }
+
+        AlignedPageBuffer header_buffer;
+        header.magic = PAGE_TABLE_MAGIC;
+        header.format_version = PAGE_TABLE_FORMAT_VERSION;
+        header.page_size = PAGE_SIZE_BYTES;
+        header.table_checksum = crc32c(0, table.data(), table_bytes);
+        header.num_pages = table.size();
+        std::memcpy(header_buffer.data(), &header, sizeof(header));
+        out.writeBlock(0, header_buffer.data());
+        out.sync();
+    }
+
+    /*
+     Rebuild the index from the saved page table, right after the page file
+     was opened. Blocks the table doesn't point at were written after it
+     was saved (or were free already), they go on the free list.
+    */
+    void loadPageTable() {
+        std::string path = tablePath(page_file.getPath());
+        PageFile in(path, PageFile::OpenMode::Open);
+        auto corrupt = [&](const std::string& what) {
+            return std::runtime_error("ContentStorage: page table " + path + " " + what);
+        };
+        if (in.getNumBlocks() == 0) {
+            throw corrupt("is empty");
+        }
+        AlignedPageBuffer header_buffer;
+        in.readBlock(0, header_buffer.data());
+        PageTableHeader header;
+        std::memcpy(&header, header_buffer.data(), sizeof(header));
+        if (header.magic != PAGE_TABLE_MAGIC || header.format_version != PAGE_TABLE_FORMAT_VERSION ||
+            header.page_size != PAGE_SIZE_BYTES) {
+            throw corrupt("isn't a page table this version can read");
+        }
+        size_t table_bytes = header.num_pages * sizeof(PageTableEntry);
+        uint32_t table_blocks = static_cast<uint32_t>((table_bytes + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES);
+        if (in.getNumBlocks() < 1 + static_cast<uint64_t>(table_blocks)) {
+            throw corrupt("is cut short");
+        }
+        std::vector<PageTableEntry> table(header.num_pages);
+        AlignedPageBuffer block;
+        for (uint32_t i = 0; i < table_blocks; ++i) {
+            in.readBlock(1 + i, block.data());
+            size_t offset = static_cast<size_t>(i) * PAGE_SIZE_BYTES;
+            std::memcpy(reinterpret_cast<uint8_t*>(table.data()) + offset, block.data(),
+                        std::min(PAGE_SIZE_BYTES, table_bytes - offset));
+        }
+        if (crc32c(0, table.data(), table_bytes) != header.table_checksum) {
+            throw corrupt("failed its checksum");
+        }
+
+        uint64_t num_blocks = page_file.getNumBlocks();
+        std::vector<bool> referenced(num_blocks, false);
+        for (const PageTableEntry& entry : table) {
+            if (entry.block_id >= num_blocks) {
+                throw corrupt("points past the end of " + page_file.getPath());
+            }
+            ContentHash key{entry.hash_low, entry.hash_high};
+            page_to_hash[entry.page_id] = key;  // No page_versions entry, this run's versions start over
+            if (ContentBlock* content = content_map.find(key)) {
+                content->refs++;
+            } else {
+                content_map.insert(key, {entry.block_id, entry.page_id, entry.key_count, entry.data_bytes, 1});
+                referenced[entry.block_id] = true;
+            }
+        }
+        if (page_to_hash.find(header.root_page_id) == page_to_hash.end()) {
+            throw corrupt("hasn't got its root page");
+        }
+
+        std::vector<uint64_t> unused;
+        for (uint64_t block_id = 0; block_id < num_blocks; ++block_id) {
+            if (!referenced[block_id]) {
+                unused.push_back(block_id);
+            }
+        }
+        page_file.freeBlocks(unused);
+        next_page_id = header.next_page_id;
+        saved_root_page_id = header.root_page_id;
+        saved_redo_lsn = header.redo_lsn;
+        reopened = true;
+
+        LOG_INFO("ContentStorage: Reopened " << page_file.getPath() << " with " << table.size()
+                 << " pages in " << content_map.size() << " blocks (" << unused.size() << " free)");
+    }
+
+public:
+    /*
+     With reopen, a page file whose page table was saved by an earlier run
+     is opened as that table left it (see loadedState). Otherwise, or when
+     there is no table, the storage starts out empty.
+    */
+    explicit ContentStorage(const std::string& page_file_path = "btree.db", bool reopen = false)
+        : page_file(page_file_path, reopen && hasPageTable(page_file_path) ? PageFile::OpenMode::Open
+                                                                           : PageFile::OpenMode::Truncate) {
+        if (reopen && hasPageTable(page_file_path)) {
+            loadPageTable();
+        } else {
+            std::remove(tablePath(page_file_path).c_str());  // It described the file we just emptied
+        }
+    }
+
+    ~ContentStorage() {
+        stopGarbageCollection();
+    }
+
+    ContentStorage(const ContentStorage&) = delete;
+    ContentStorage& operator=(const ContentStorage&) = delete;
+
+    // Whether we reopened a saved page table, and the root and redo LSN saved with it
+    bool loadedState(PageId& root_page_id, uint64_t& redo_lsn) const {
+        root_page_id = saved_root_page_id;
+        redo_lsn = saved_redo_lsn;
+        return reopened;
+    }
+
+    /*
+     Store a page and return its page ID. The caller holds the page's latch
+     (at least shared), so the page isn't changed here, except that its
+     content hash is cached. A page that was never stored needs an ID first,
+     that one case goes through a copy.
+    */
+    PageId storePage(const Page<KeyType>& page) {
+        if (page.header.page_id == 0) {
+            Page<KeyType> page_copy = page;
+            return storePage(std::move(page_copy));
+        }
+        return storeWithId(page);
+    }
+
+    // Same for a page the caller is done with, a page without an ID gets it in place
+    PageId storePage(Page<KeyType>&& page) {
+        if (page.header.page_id == 0) {
+            page.header.page_id = allocatePageId();
+        }
+        return storeWithId(page);
+    }
+
+    /*
+     Snapshot a page with an ID for storeSnapshots, serializing it into
+     image (PAGE_SIZE_BYTES, aligned). The caller holds the page's latch, at
+     least shared. Pages that weren't modified since they were last hashed
+     aren't hashed again (see Page::getContentHash).
+    */
+    static PageSnapshot snapshotPage(const Page<KeyType>& page, uint8_t* image) {
+        PageSnapshot snapshot;
+        snapshot.page_id = page.header.page_id;
+        snapshot.version = page.latch.version.load();
+        snapshot.deleted = (page.header.flags & PAGE_FLAG_DELETED) != 0;
+        if (!snapshot.deleted) {
+            snapshot.content_hash = page.getContentHash();
+            snapshot.key_count = page.keys.size();
+            snapshot.data_bytes = page.data.size();
+            size_t image_size = serializePage(page, image, PAGE_SIZE_BYTES);
+            std::memset(image + image_size, 0, PAGE_SIZE_BYTES - image_size);
+            snapshot.image = image;
+        }
+        return snapshot;
+    }
+
+    /*
+     Store a batch of snapshots. Blocks for new content are picked under
+     storage_mutex, the images are written without it (one pwritev per run
+     of consecutive blocks), and only then do the page IDs point at them, so
+     readers never find a block before its image is there and concurrent
+     writers overlap their IO instead of queueing on the lock.
+    */
+    void storeSnapshots(const PageSnapshot* snapshots, size_t count) {
+        std::vector<uint64_t> blocks(count, NO_BLOCK);
+        std::vector<PageFile::BlockWrite> writes;
+        {
+            std::lock_guard<std::mutex> lock(storage_mutex);
+            for (size_t i = 0; i < count; ++i) {
+                if (needsBlock(snapshots, i, blocks)) {
+                    blocks[i] = page_file.allocateBlock();
+                    writes.push_back({blocks[i], snapshots[i].image});
+                }
+            }
+        }
+
+        if (!writes.empty()) {
+            try {
+                page_file.writeBlockList(writes);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(storage_mutex);
+                for (uint64_t block : blocks) {
+                    discardBlock(block);
+                }
+                throw;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(storage_mutex);
+        for (size_t i = 0; i < count; ++i) {
+            commitSnapshot(snapshots[i], blocks[i]);
+        }
+    }
+
+    /*
+     Store many pages in one go, e.g. a bulk load. Every page must already
+     have its page ID. New content is packed into consecutive blocks and
+     written with one pwrite per batch instead of one per page. Nothing
+     points at the blocks until all of them are written, so a page that
+     doesn't serialize (or a failed write) leaves the index as it was.
+    */
+    void storePages(const std::vector<std::shared_ptr<Page<KeyType>>>& pages) {
+        constexpr size_t BATCH_PAGES = 64;
+        AlignedPageBuffer batch(BATCH_PAGES);
+
+        // What to do with each page once everything is on disk: index it under key, with
+        // its own block if its content is new, or NO_BLOCK if that is stored already
+        struct PlannedPage {
+            Page<KeyType>* page;
+            ContentHash key;
+            uint64_t block;
+            bool unchanged;
+        };
+        struct HashOfContent {
+            size_t operator()(const ContentHash& hash) const { return static_cast<size_t>(hash.low); }
+        };
+        std::vector<PlannedPage> planned;
+        planned.reserve(pages.size());
+        std::unordered_map<ContentHash, uint64_t, HashOfContent> planned_content;  // Key -> its new block
+        std::vector<uint64_t> allocated;
+        thread_local AlignedPageBuffer written;
+
+        std::lock_guard<std::mutex> lock(storage_mutex);
+        size_t next = 0;
+        try {
+            while (next < pages.size()) {
+                // Serialize new content into the batch until it is full
+                uint64_t first_block = page_file.getNumBlocks();
+                uint32_t batch_count = 0;
+
+                // New content of this call: in the batch, or written with an earlier one
+                auto pending = [&](const ContentHash& key) -> const uint8_t* {
+                    auto it = planned_content.find(key);
+                    if (it == planned_content.end()) {
+                        return nullptr;
+                    }
+                    if (it->second >= first_block) {
+                        return batch.page(static_cast<uint32_t>(it->second - first_block));
+                    }
+                    page_file.readBlock(it->second, written.data());
+                    return written.data();
+                };
+
+                for (; next < pages.size() && batch_count < BATCH_PAGES; ++next) {
+                    Page<KeyType>& page = *pages[next];
+                    if (page.header.page_id == 0) {
+                        throw std::logic_error("storePages needs pages with assigned IDs");
+                    }
+                    uint8_t* image = batch.page(batch_count);
+                    serializePage(page, image, PAGE_SIZE_BYTES);
+
+                    PlannedPage plan{&page, page.getContentHash(), NO_BLOCK, false};
+                    auto previous = page_to_hash.find(page.header.page_id);
+                    plan.unchanged = previous != page_to_hash.end() && previous->second == plan.key &&
+                                     holdsContent(plan.key, image);
+                    if (!plan.unchanged && !findContent(plan.key, image, pending)) {
+                        plan.block = first_block + batch_count++;
+                        planned_content.emplace(plan.key, plan.block);
+                    }
+                    planned.push_back(plan);
+                }
+
+                if (batch_count > 0) {
+                    // We hold storage_mutex, so nobody else can allocate in between
+                    page_file.allocateBlocks(batch_count);
+                    for (uint32_t i = 0; i < batch_count; ++i) {
+                        allocated.push_back(first_block + i);
+                    }
+                    page_file.writeBlocks(first_block, batch.data(), batch_count);
+                }
+            }
+        } catch (...) {
+            // Nobody has seen these blocks, they go back with the next collection
+            for (uint64_t block : allocated) {
+                discardBlock(block);
+            }
+            throw;
+        }
+
+        // Everything is written, point the page IDs at it
+        for (const PlannedPage& plan : planned) {
+            Page<KeyType>& page = *plan.page;
+            page_versions[page.header.page_id] = page.latch.version.load();
+            if (plan.unchanged) {
+                continue;
+            }
+            if (plan.block == NO_BLOCK) {
+                content_map.find(plan.key)->refs++;  // Deduplicated
+            } else {
+                content_map.insert(plan.key, {plan.block, page.header.page_id,
+                                              page.keys.size(), page.data.size(), 1});
+            }
+            repointPage(page.header.page_id, plan.key);
+        }
+
+        LOG_DEBUG("Stored " << pages.size() << " pages as " << allocated.size()
+                  << " new content blocks");
+    }
+
+    // Reserve a page ID for a new page that will be stored later (e.g. by the writer queue)
+    PageId allocatePageId() {
+        std::lock_guard<std::mutex> lock(storage_mutex);
+        return next_page_id++;
+    }
+
+    // Retrieve a page by its page ID, reading its block from the page file
+    std::shared_ptr<Page<KeyType>> getPage(PageId page_id) {
+        auto page = std::make_shared<Page<KeyType>>();
+        if (!readPage(page_id, *page)) {
             return nullptr; // Page not found
         }
-        
-        auto content_it = content_map.find(hash_it->second);
-        if (content_it == content_map.end()) {
-            return nullptr; // Content not found (shouldn't happen)
+        return page;
+    }
+
+    // Same, into a page the caller owns (e.g. a buffer pool frame). False if there's no such page
+    bool readPage(PageId page_id, Page<KeyType>& page) {
+        uint64_t block_id;
+        uint64_t version;
+        ContentHash content_hash;
+        thread_local AlignedPageBuffer buffer;
+        {
+            // Blocks are never overwritten while they are live (new content gets its own
+            // block), and reuse_latch keeps a block that dies now from being reused under us
+            std::shared_lock<std::shared_mutex> reuse(reuse_latch);
+            if (!lookupBlock(page_id, block_id, &content_hash, &version)) {
+                return false;
+            }
+            page_file.readBlock(block_id, buffer.data());
+        }
+
+        deserializePageInto<KeyType>(buffer.data(), buffer.size(), page);
+        // Deduplicated blocks are shared, so the image may carry another page's ID
+        page.header.page_id = page_id;
+        page.latch.version.store(version);
+        page.setContentHash(content_hash);  // No need to hash it again until it changes
+        return true;
+    }
+
+    // Copy a page's raw image into buffer (PAGE_SIZE_BYTES long) so it can be read through a PageView
+    bool readPageImage(PageId page_id, uint8_t* buffer) {
+        std::shared_lock<std::shared_mutex> reuse(reuse_latch);
+        uint64_t block_id;
+        if (!lookupBlock(page_id, block_id, nullptr)) {
+            return false;
         }
-        
-        return content_it->second;
+        page_file.readBlock(block_id, buffer);
+        return true;
     }
-    
+
+    // Start reading a page's block in the background, see PageFile::prefetchBlock
+    void prefetchPage(PageId page_id) {
+        uint64_t block_id;
+        if (lookupBlock(page_id, block_id, nullptr)) {
+            page_file.prefetchBlock(block_id);
+        }
+    }
+
+    // Force all written blocks to disk
+    void sync() {
+        page_file.sync();
+    }
+
+    /*
+     Save the page table, so a later run can reopen the page file in the
+     state it is in now (see loadPageTable), with root_page_id as its root
+     and WAL redo starting at redo_lsn. Like exportSnapshot, this only
+     covers what has been stored: the caller flushes first and keeps writers
+     out. The blocks are synced before the table goes out, and blocks that
+     retired since the last save only become dead once this one is durable.
+    */
+    void savePageTable(PageId root_page_id, uint64_t redo_lsn) {
+        PageTableHeader header{};
+        header.root_page_id = root_page_id;
+        header.redo_lsn = redo_lsn;
+        std::vector<PageTableEntry> table;
+        std::vector<uint64_t> retired;
+        {
+            std::lock_guard<std::mutex> lock(storage_mutex);
+            if (page_to_hash.find(root_page_id) == page_to_hash.end()) {
+                throw std::logic_error("savePageTable: the root page was never stored, flush first");
+            }
+            table.reserve(page_to_hash.size());
+            for (const auto& [page_id, content_hash] : page_to_hash) {
+                const ContentBlock* content = content_map.find(content_hash);
+                if (!content) {
+                    continue;
+                }
+                table.push_back({page_id, content->block_id, content_hash.low, content_hash.high,
+                                 content->key_count, content->data_bytes});
+            }
+            header.next_page_id = next_page_id;
+            retired.swap(retired_blocks);
+        }
+
+        std::string path = tablePath(page_file.getPath());
+        std::string tmp_path = path + ".tmp";
+        try {
+            page_file.sync();
+            std::remove(tmp_path.c_str());  // Left behind by a save that failed
+            writePageTable(tmp_path, header, table);
+            if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+                throw std::runtime_error("savePageTable: can't rename " + tmp_path + " to " + path +
+                                         " (" + std::strerror(errno) + ")");
+            }
+            page_file.syncDirectory();
+        } catch (...) {
+            std::remove(tmp_path.c_str());
+            std::lock_guard<std::mutex> lock(storage_mutex);
+            retired_blocks.insert(retired_blocks.end(), retired.begin(), retired.end());
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(storage_mutex);
+        dead_blocks.insert(dead_blocks.end(), retired.begin(), retired.end());
+        LOG_DEBUG("ContentStorage: Saved the page table of " << table.size() << " pages, redo from LSN "
+                  << redo_lsn);
+    }
+
+    /*
+     Write every stored page to a snapshot file (see mapped_snapshot.h) that
+     replicas open with ReadOnlyBTree. Only what has been stored is in it, the
+     caller flushes first and keeps writers out, or the snapshot may mix
+     pages from before and after a change. Pages sharing content share their
+     image in the snapshot too. The file is written as path.tmp and renamed
+     into place once complete, so a failed export leaves an older snapshot
+     at path alone. Returns the number of pages.
+    */
+    size_t exportSnapshot(const std::string& path, PageId root_page_id) {
+        // Holding reuse_latch keeps the blocks we are about to copy from being reused
+        std::shared_lock<std::shared_mutex> reuse(reuse_latch);
+        std::vector<SnapshotPageEntry> table;
+        std::vector<uint64_t> source_blocks;  // Snapshot block i + 1 is a copy of page file block source_blocks[i]
+        {
+            std::lock_guard<std::mutex> lock(storage_mutex);
+            std::unordered_map<uint64_t, uint64_t> snapshot_blocks;
+            table.reserve(page_to_hash.size());
+            for (const auto& [page_id, content_hash] : page_to_hash) {
+                const ContentBlock* content = content_map.find(content_hash);
+                if (!content) {
+                    continue;
+                }
+                auto inserted = snapshot_blocks.emplace(content->block_id, source_blocks.size() + 1);
+                if (inserted.second) {
+                    source_blocks.push_back(content->block_id);
+                }
+                table.push_back({page_id, inserted.first->second});
+            }
+        }
+        std::sort(table.begin(), table.end(),
+                  [](const SnapshotPageEntry& a, const SnapshotPageEntry& b) { return a.page_id < b.page_id; });
+        if (!std::binary_search(table.begin(), table.end(), SnapshotPageEntry{root_page_id, 0},
+                                [](const SnapshotPageEntry& a, const SnapshotPageEntry& b) { return a.page_id < b.page_id; })) {
+            throw std::logic_error("exportSnapshot: the root page was never stored, flush first");
+        }
+
+        std::string tmp_path = path + ".tmp";
+        if (page_file.isFile(path) || page_file.isFile(tmp_path)) {
+            throw std::invalid_argument("exportSnapshot: " + path + " is the live page file");
+        }
+        std::remove(tmp_path.c_str());  // Left behind by an export that failed
+        try {
+            writeSnapshot(tmp_path, table, source_blocks, root_page_id);
+        } catch (...) {
+            std::remove(tmp_path.c_str());
+            throw;
+        }
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            int error = errno;
+            std::remove(tmp_path.c_str());
+            throw std::runtime_error("exportSnapshot: can't rename " + tmp_path + " to " + path +
+                                     " (" + std::strerror(error) + ")");
+        }
+
+        LOG_INFO("ContentStorage: Exported " << table.size() << " pages (" << source_blocks.size()
+                 << " images) to snapshot " << path);
+        return table.size();
+    }
+
+    /*
+     Free the blocks of content that died since the last run. Waiting for
+     reuse_latch once is enough: every read that could still have found one
+     of these blocks started before it died, and has finished by then.
+     Also forgets the versions of pages released before the last run.
+     Returns the number of blocks freed.
+    */
+    size_t collectGarbage() {
+        std::vector<uint64_t> blocks;
+        {
+            std::lock_guard<std::mutex> lock(storage_mutex);
+            blocks.swap(dead_blocks);
+            for (PageId page_id : expiring_pages) {
+                table_entries_dropped += page_versions.erase(page_id);
+            }
+            expiring_pages.swap(released_pages);
+            released_pages.clear();
+        }
+        if (blocks.empty()) {
+            return 0;
+        }
+        { std::unique_lock<std::shared_mutex> drain(reuse_latch); }
+
+        // Under storage_mutex, page file allocation must not race with trimming its end
+        std::lock_guard<std::mutex> lock(storage_mutex);
+        page_file.freeBlocks(blocks);
+        blocks_reclaimed += blocks.size();
+        return blocks.size();
+    }
+
+    // Run collectGarbage on the scheduler every interval, until stopped or destroyed
+    bool startGarbageCollection(JobScheduler* scheduler,
+                                std::chrono::milliseconds interval = std::chrono::seconds(30)) {
+        if (!scheduler || !scheduler->isRunning()) {
+            LOG_WARN("ContentStorage: Job scheduler not running");
+            return false;
+        }
+        stopGarbageCollection();
+        gc_job_name = "content_gc_" + page_file.getPath();
+        if (!scheduler->addRecurringJob(gc_job_name, interval, [this]() {
+                collectGarbage();
+                return true;
+            }, "Content Garbage Collection", JobPriority::LOW)) {
+            return false;
+        }
+        gc_scheduler = scheduler;
+        return true;
+    }
+
+    void stopGarbageCollection() {
+        if (gc_scheduler) {
+            gc_scheduler->removeRecurringJob(gc_job_name);
+            gc_scheduler = nullptr;
+        }
+    }
+
     // Get statistics about storage usage
     void printStats() const {
+        std::lock_guard<std::mutex> lock(storage_mutex);
         std::cout << "\n=== Content Storage Statistics ===" << std::endl;
         std::cout << "Total unique content blocks: " << content_map.size() << std::endl;
+        std::cout << "Dedup index slots: " << content_map.capacity() << std::endl;
         std::cout << "Total page IDs assigned: " << page_to_hash.size() << std::endl;
+        std::cout << "Pages stored: " << pages_stored << " (" << dedup_hits << " deduplicated, "
+                  << hash_collisions << " hash collisions)" << std::endl;
         std::cout << "Next available page ID: " << next_page_id << std::endl;
-        
+        std::cout << "Page file size: " << page_file.getFileSize() << " bytes ("
+                  << page_file.getNumBlocks() << " blocks)" << std::endl;
+        std::cout << "Blocks written/read: " << page_file.getBlocksWritten() << "/"
+                  << page_file.getBlocksRead() << " (" << page_file.getWriteCalls() << " write calls)" << std::endl;
+        std::cout << "Deleted pages released: " << pages_released << std::endl;
+        std::cout << "Table entries dropped: " << table_entries_dropped << std::endl;
+        std::cout << "Garbage collected: " << blocks_reclaimed << " blocks ("
+                  << blocks_reclaimed * PAGE_SIZE_BYTES << " bytes reclaimed, "
+                  << page_file.getBlocksTrimmed() << " blocks cut off the file), "
+                  << dead_blocks.size() << " dead blocks waiting, " << retired_blocks.size()
+                  << " kept for the saved page table, "
+                  << page_file.getFreeBlocks() << " free for reuse" << std::endl;
+
         if (content_map.size() > 0) {
             size_t total_keys = 0;
             size_t total_data = 0;
-            for (const auto& pair : content_map) {
-                total_keys += pair.second->keys.size();
-                total_data += pair.second->data.size();
-            }
+            content_map.forEach([&](const ContentHash&, const ContentBlock& block) {
+                total_keys += block.key_count;
+                total_data += block.data_bytes;
+            });
             std::cout << "Total keys stored: " << total_keys << std::endl;
             std::cout << "Total data bytes: " << total_data << std::endl;
         }
         std::cout << "===================================" << std::endl;
     }
-    
+
     // Check if a page with given content already exists
     bool hasContent(const Page<KeyType>& page) {
-        Page<KeyType> page_copy = page;
-        page_copy.updateContentHash();
-        return content_map.find(page_copy.getContentHash()) != content_map.end();
+        return getPageIdForContent(page) != 0;
     }
-    
+
     // Get the page ID for existing content
-    uint16_t getPageIdForContent(const Page<KeyType>& page) {
-        Page<KeyType> page_copy = page;
-        page_copy.updateContentHash();
-        auto it = content_map.find(page_copy.getContentHash());
-        if (it != content_map.end()) {
-            return it->second->header.page_id;
+    PageId getPageIdForContent(const Page<KeyType>& page) {
+        thread_local AlignedPageBuffer image;
+        ContentHash key = page.getContentHash();
+        serializePage(page, image.data(), PAGE_SIZE_BYTES);
+        std::lock_guard<std::mutex> lock(storage_mutex);
+        if (findContent(key, image.data())) {
+            return content_map.find(key)->page_id;
         }
         return 0;
     }
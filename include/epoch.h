@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+/*
+ Epoch-based reclamation, for structures that readers walk without locks
+ while someone else unlinks parts of them. A reader pins the current epoch
+ for as long as it is inside (Guard). Whatever gets unlinked is retired
+ into the current epoch's limbo instead of being freed. Once no reader
+ pinned at that epoch or an earlier one is left, nothing can still reach
+ those objects, and tryReclaim frees them.
+
+ Only three epochs are ever live: the epoch advances from e to e + 1 once
+ nobody is pinned at e - 1, and what was retired during e - 1 is freed then.
+ Readers only pay for two atomic increments (and a load).
+*/
+class EpochManager {
+private:
+    std::atomic<uint64_t> global_epoch;
+    std::atomic<size_t> pinned[3];                  // Readers inside, per epoch % 3
+    mutable std::mutex limbo_mutex;                 // The limbo lists, and advancing the epoch
+    std::vector<std::shared_ptr<void>> limbo[3];    // Retired during the epoch, per epoch % 3
+    size_t retired_count;
+    size_t reclaimed_count;
+
+public:
+    class Guard {
+    private:
+        EpochManager* manager;
+        uint64_t epoch;
+
+    public:
+        explicit Guard(EpochManager& manager);
+        ~Guard();
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    EpochManager();
+    ~EpochManager() = default;
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    Guard enter() { return Guard(*this); }  // Pin the current epoch until the guard goes away
+
+    // Free these once no reader can reach them, they must be unlinked already
+    void retire(std::vector<std::shared_ptr<void>>&& objects);
+    size_t tryReclaim();  // Advance the epoch if nobody holds it back, returns objects freed
+
+    uint64_t currentEpoch() const { return global_epoch.load(); }
+    size_t awaitingReclaim() const;
+};
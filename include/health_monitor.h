@@ -6,6 +6,7 @@
 #include <mutex>
 #include <memory>
 #include <functional>
+#include <string>
 #include "job_scheduler.h"
 
 enum class ComponentType {
@@ -64,6 +65,16 @@ private:
     std::string health_check_job_name;
     std::chrono::milliseconds check_interval;
     
+    // Metrics sampled before each check, and the Prometheus file written after it
+    struct MetricSource {
+        ComponentType type;
+        std::string metric_name;
+        std::function<double()> sample;
+    };
+    std::vector<MetricSource> metric_sources;
+    std::string metrics_export_path;
+    mutable std::mutex sources_mutex;
+    
     // Recovery actions
     std::unordered_map<ComponentType, std::function<bool()>> recovery_actions;
     std::atomic<size_t> recovery_attempts;
@@ -101,6 +112,8 @@ public:
     void addMetric(ComponentType type, const std::string& metric_name, 
                    double warning_threshold, double critical_threshold);
     void registerRecoveryAction(ComponentType type, std::function<bool()> recovery_func);
+    // Sampled on every health check, e.g. [] { return metrics::cacheHitRatio(); }
+    void addMetricSource(ComponentType type, const std::string& metric_name, std::function<double()> source);
     
     // Metric updates
     void updateMetric(ComponentType type, const std::string& metric_name, double value);
@@ -134,6 +147,7 @@ public:
     void setAlertCallback(std::function<void(ComponentType, HealthStatus, const std::string&)> callback);
     void setMaxConsecutiveFailures(size_t max_failures);
     void setRecoveryCooldown(std::chrono::minutes cooldown);
+    void setMetricsExportPath(const std::string& path);  // Empty turns the export off
     
 private:
     // Job scheduler function
@@ -1,6 +1,7 @@
 #pragma once
 #include <thread>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
@@ -9,6 +10,7 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <cstdint>
 
 enum class JobType {
     CHECKPOINT,
@@ -38,7 +40,7 @@ public:
     uint64_t job_id;
     JobType type;
     JobPriority priority;
-    JobStatus status;
+    std::atomic<JobStatus> status;  // PENDING -> RUNNING or CANCELLED is a compare-exchange
     std::chrono::steady_clock::time_point created_at;
     std::chrono::steady_clock::time_point scheduled_at;
     std::chrono::milliseconds timeout;
@@ -52,7 +54,7 @@ public:
           scheduled_at(std::chrono::steady_clock::now()),
           timeout(to), execute_func(func), description(desc) {}
           
-    // For priority queue ordering
+    // Scheduling order: higher priority first, then the one due earlier
     bool operator<(const Job& other) const {
         if (priority != other.priority) {
             return priority < other.priority;
@@ -61,19 +63,97 @@ public:
     }
 };
 
-// Job scheduler class
+/*
+ Hierarchical timer wheel, in ticks of TICK (one millisecond). Level 0 has
+ a slot per tick, each level up a slot per whole rotation of the level
+ below, so four levels of 64 slots reach about four and a half hours out
+ and anything later waits in an overflow list. Adding a timer is O(1).
+ Advancing moves a tick at a time: when a level's rotation completes, the
+ next slot of the level above is cascaded down into it, and the level 0
+ slot of the tick expires. Not thread-safe, the scheduler locks around it.
+*/
+template<typename Task>
+class TimerWheel {
+public:
+    static constexpr std::chrono::milliseconds TICK{1};
+    static constexpr size_t LEVELS = 4;
+    static constexpr size_t SLOT_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+    static constexpr uint64_t NO_EVENT = UINT64_MAX;
+
+    explicit TimerWheel(uint64_t start_tick = 0) : current(start_tick), count(0) {}
+
+    void add(uint64_t deadline, Task task);
+    // Process every tick up to `now`, appending the tasks that came due
+    void advance(uint64_t now, std::vector<Task>& expired);
+    // First tick at which advance has anything to do, NO_EVENT if the wheel is empty
+    uint64_t nextEvent() const;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear();
+
+private:
+    struct Timer {
+        uint64_t deadline;
+        Task task;
+    };
+
+    uint64_t current;  // Last tick processed
+    size_t count;
+    std::vector<Timer> slots[LEVELS][SLOTS];
+    std::vector<Timer> overflow;  // Beyond the top level
+
+    void place(Timer&& timer);  // deadline >= current, a deadline of current expires with this tick
+};
+
+/*
+ Job scheduler. Every worker owns a deque per priority. Jobs scheduled from
+ a worker go to its own deques, others round-robin over the workers. A
+ worker runs its oldest job of the highest priority that any worker has
+ queued, stealing the newest one of that priority from another worker when
+ its own deque is empty, and sleeps while nothing at all is queued.
+ Delayed jobs, recurring jobs and timeouts sit in a timer wheel, whose
+ thread sleeps until the next timer is due instead of polling.
+*/
 class JobScheduler {
 private:
+    static constexpr size_t PRIORITY_LEVELS = 4;
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<Job>> ready[PRIORITY_LEVELS];  // Indexed by JobPriority
+    };
+
+    // Timer wheel entries
+    struct TimerTask {
+        enum class Kind { DELAYED_JOB, RECURRING_JOB, JOB_TIMEOUT };
+        Kind kind;
+        std::shared_ptr<Job> job;        // DELAYED_JOB
+        std::weak_ptr<Job> running_job;  // JOB_TIMEOUT, doesn't keep a finished job around
+        std::string recurring_name;      // RECURRING_JOB
+        uint64_t generation;             // RECURRING_JOB, stale once the job is removed or re-added
+    };
+
     // Thread pool
     std::vector<std::thread> worker_threads;
     size_t num_workers;
     std::atomic<bool> running;
     
-    // Job queue with priority
-    std::priority_queue<std::shared_ptr<Job>> job_queue;
-    std::mutex queue_mutex;
-    std::condition_variable queue_cv;
-    std::condition_variable shutdown_cv;
+    // Ready jobs, per worker
+    std::vector<std::unique_ptr<WorkerQueue>> worker_queues;
+    std::atomic<size_t> next_queue;    // Round-robin for jobs scheduled outside the workers
+    std::atomic<size_t> ready_count[PRIORITY_LEVELS];  // Jobs in all the deques, per priority
+    std::atomic<size_t> pending_jobs;  // Scheduled and neither started nor cancelled yet
+    std::mutex idle_mutex;
+    std::condition_variable work_cv;   // Idle workers wait here for ready_jobs
+    
+    // Delayed jobs, recurring jobs and timeouts
+    TimerWheel<TimerTask> timer_wheel;
+    std::chrono::steady_clock::time_point timer_epoch;  // Tick 0 of the wheel
+    uint64_t timer_wakeup;  // Tick the timer thread sleeps until, NO_EVENT if it waits for a timer
+    std::mutex timer_mutex;
+    std::condition_variable timer_cv;
     
     // Job tracking
     std::unordered_map<uint64_t, std::shared_ptr<Job>> active_jobs;
@@ -87,6 +167,7 @@ private:
     std::atomic<size_t> total_jobs_executed;
     std::atomic<size_t> failed_jobs;
     std::atomic<size_t> successful_jobs;
+    std::atomic<size_t> timed_out_jobs;
     std::chrono::steady_clock::time_point last_health_check;
     
     // Recurring job management
@@ -97,20 +178,29 @@ private:
         std::string description;
         JobPriority priority;
         bool enabled;
+        uint64_t generation;  // Matches the entry of this job in the timer wheel
     };
     std::unordered_map<std::string, RecurringJobInfo> recurring_jobs;
     std::mutex recurring_jobs_mutex;
+    uint64_t next_generation;
     
     // Worker thread functions
     void workerThread(int worker_id);
-    void schedulerThread();
+    void timerThread();
+    
+    // Job queues
+    void enqueueReady(std::shared_ptr<Job> job);
+    std::shared_ptr<Job> takeJob(size_t worker_id);
+    size_t readyJobs() const;
+    void addTimer(std::chrono::steady_clock::time_point when, TimerTask task);
+    uint64_t tickAt(std::chrono::steady_clock::time_point when) const;
     
     // Job execution
     bool executeJob(std::shared_ptr<Job> job);
     void handleJobTimeout(std::shared_ptr<Job> job);
     
     // Recurring job management
-    void scheduleRecurringJobs();
+    void runRecurringJob(const TimerTask& task);
     
 public:
     JobScheduler(size_t num_threads = 4);
@@ -142,7 +232,7 @@ public:
     bool enableRecurringJob(const std::string& name, bool enabled);
     
     // Job management
-    bool cancelJob(uint64_t job_id);
+    bool cancelJob(uint64_t job_id);  // Only jobs that haven't started yet
     JobStatus getJobStatus(uint64_t job_id);
     std::shared_ptr<Job> getJob(uint64_t job_id);
     
@@ -156,6 +246,7 @@ public:
         double success_rate;
         size_t worker_threads;
         bool is_healthy;
+        size_t timed_out;  // Ran past their timeout
     };
     
     SchedulerStats getStats() const;
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BTREE_KEY_SEARCH_AVX2 1
+#endif
+
+/*
+ Key search inside a single node. Both functions return positions in the
+ sorted key array, like std::lower_bound / std::upper_bound:
+    - lowerBound: first key that is not less than key
+    - upperBound: first key that is greater than key (the child to descend into)
+
+ The generic version is a branchless binary search that only needs operator<.
+ Fixed-width integer keys get a specialization below that narrows the range
+ with the same binary search and finishes with a SIMD compare over the
+ last few keys.
+*/
+template <typename KeyType>
+struct KeySearch {
+    static size_t lowerBound(const KeyType* keys, size_t n, const KeyType& key) {
+        const KeyType* base = keys;
+        while (n > 1) {
+            size_t half = n / 2;
+            base = (base[half - 1] < key) ? base + half : base;
+            n -= half;
+        }
+        return (base - keys) + (n == 1 && *base < key);
+    }
+
+    static size_t upperBound(const KeyType* keys, size_t n, const KeyType& key) {
+        const KeyType* base = keys;
+        while (n > 1) {
+            size_t half = n / 2;
+            base = !(key < base[half - 1]) ? base + half : base;
+            n -= half;
+        }
+        return (base - keys) + (n == 1 && !(key < *base));
+    }
+
+    static size_t lowerBound(const std::vector<KeyType>& keys, const KeyType& key) {
+        return lowerBound(keys.data(), keys.size(), key);
+    }
+
+    static size_t upperBound(const std::vector<KeyType>& keys, const KeyType& key) {
+        return upperBound(keys.data(), keys.size(), key);
+    }
+};
+
+namespace key_search_detail {
+
+// Binary search stops once this many int keys are left, they are counted with one scan
+constexpr size_t INT_SCAN_WIDTH = 16;
+
+// Number of keys in [keys, keys + n) that are less than key (or <= key when inclusive)
+inline size_t countBelowScalar(const int* keys, size_t n, int key, bool inclusive) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += inclusive ? (keys[i] <= key) : (keys[i] < key);
+    }
+    return count;
+}
+
+#ifdef BTREE_KEY_SEARCH_AVX2
+/*
+ Compare 8 keys at a time against the search key and count the hits with
+ movemask + popcount. Compiled for AVX2 only here, callers check the CPU first
+ so the rest of the build doesn't need -mavx2.
+*/
+__attribute__((target("avx2,popcnt")))
+inline size_t countBelowAvx2(const int* keys, size_t n, int key, bool inclusive) {
+    const __m256i needle = _mm256_set1_epi32(key);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        // keys < key  <=>  key > keys,  keys <= key  <=>  !(keys > key)
+        __m256i mask = inclusive ? _mm256_cmpgt_epi32(block, needle) : _mm256_cmpgt_epi32(needle, block);
+        int bits = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+        count += inclusive ? 8 - bits : bits;
+    }
+    return count + countBelowScalar(keys + i, n - i, key, inclusive);
+}
+
+inline bool cpuHasAvx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    return has_avx2;
+}
+#endif
+
+inline size_t countBelow(const int* keys, size_t n, int key, bool inclusive) {
+#ifdef BTREE_KEY_SEARCH_AVX2
+    if (cpuHasAvx2()) {
+        return countBelowAvx2(keys, n, key, inclusive);
+    }
+#endif
+    return countBelowScalar(keys, n, key, inclusive);
+}
+
+} // namespace key_search_detail
+
+template <>
+struct KeySearch<int> {
+    static size_t lowerBound(const int* keys, size_t n, int key) {
+        return search(keys, n, key, false);
+    }
+
+    static size_t upperBound(const int* keys, size_t n, int key) {
+        return search(keys, n, key, true);
+    }
+
+    static size_t lowerBound(const std::vector<int>& keys, int key) {
+        return lowerBound(keys.data(), keys.size(), key);
+    }
+
+    static size_t upperBound(const std::vector<int>& keys, int key) {
+        return upperBound(keys.data(), keys.size(), key);
+    }
+
+private:
+    static size_t search(const int* keys, size_t n, int key, bool inclusive) {
+        const int* base = keys;
+        // Invariant: the answer lies in [base, base + n]
+        while (n > key_search_detail::INT_SCAN_WIDTH) {
+            size_t half = n / 2;
+            bool go_right = inclusive ? base[half] <= key : base[half] < key;
+            base = go_right ? base + half : base;
+            n -= half;
+        }
+        return (base - keys) + key_search_detail::countBelow(base, n, key, inclusive);
+    }
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ Log-linear latency histogram: values below 16 get a bucket each, above
+ that every power of two is split into 16 buckets, so a percentile is
+ off by at most 1/16 (6.25%) of its value. Recording is a couple of
+ instructions and no allocation. Not thread-safe, give every thread its
+ own histogram and merge them when it is done.
+*/
+class LatencyHistogram {
+public:
+    static constexpr size_t SUB_BUCKET_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t value);
+    void merge(const LatencyHistogram& other);
+    void reset();
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? min_value : 0; }
+    uint64_t max() const { return max_value; }
+    double mean() const { return total ? static_cast<double>(sum) / total : 0.0; }
+    // Upper bound of the bucket holding the value at this percentile (0 to 100), 0 if empty
+    uint64_t percentile(double percent) const;
+
+    static size_t bucketFor(uint64_t value);
+    static uint64_t bucketUpperBound(size_t bucket);
+
+private:
+    std::array<uint64_t, BUCKETS> counts;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min_value;
+    uint64_t max_value;
+};
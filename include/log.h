@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <sstream>
+#include <string>
+
+/*
+ Level-gated logging. DEBUG is what the hot paths say about every single
+ operation (cache loads, WAL records, stored batches), INFO is lifecycle
+ and maintenance, WARN and ERROR go to std::cerr.
+
+ The level is a runtime switch, Log::setLevel or BTREE_LOG_LEVEL (trace,
+ debug, info, warn, error, off) in the environment, INFO by default. A
+ disabled line costs one relaxed load, its arguments aren't evaluated.
+ Levels below BTREE_MIN_LOG_LEVEL are compiled out altogether, e.g.
+ -DBTREE_MIN_LOG_LEVEL=2 keeps INFO and up.
+
+ A line is formatted on the side and written with a single call and no
+ flush, so lines of different threads don't interleave and nobody waits
+ for the terminal.
+*/
+enum class LogLevel : int {
+    TRACE = 0,
+    DEBUG = 1,
+    INFO = 2,
+    WARN = 3,
+    ERROR = 4,
+    OFF = 5
+};
+
+#ifndef BTREE_MIN_LOG_LEVEL
+#define BTREE_MIN_LOG_LEVEL 0
+#endif
+
+class Log {
+private:
+    static std::atomic<int> current_level;
+
+public:
+    static bool enabled(LogLevel level) {
+        return static_cast<int>(level) >= current_level.load(std::memory_order_relaxed);
+    }
+    static void setLevel(LogLevel level) { current_level.store(static_cast<int>(level)); }
+    static LogLevel level() { return static_cast<LogLevel>(current_level.load()); }
+    static bool parseLevel(const std::string& name, LogLevel& level);  // False if it isn't a level
+    static void write(LogLevel level, const std::string& line);
+};
+
+#define BTREE_LOG(level, message)                                  \
+    do {                                                           \
+        if constexpr (static_cast<int>(level) >= BTREE_MIN_LOG_LEVEL) { \
+            if (Log::enabled(level)) {                             \
+                std::ostringstream log_line;                       \
+                log_line << message;                               \
+                Log::write(level, log_line.str());                 \
+            }                                                      \
+        }                                                          \
+    } while (0)
+
+#define LOG_TRACE(message) BTREE_LOG(LogLevel::TRACE, message)
+#define LOG_DEBUG(message) BTREE_LOG(LogLevel::DEBUG, message)
+#define LOG_INFO(message) BTREE_LOG(LogLevel::INFO, message)
+#define LOG_WARN(message) BTREE_LOG(LogLevel::WARN, message)
+#define LOG_ERROR(message) BTREE_LOG(LogLevel::ERROR, message)
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "page_id.h"
+#include "page_file.h"
+
+/*
+ Snapshot file: a self-contained copy of every page of a tree, written by
+ ContentStorage::exportSnapshot and shipped to read-only replicas, which
+ map it instead of reading it. Blocks are PAGE_SIZE_BYTES, like the page file:
+
+ +----------+----------------------------+--------------------------------+
+ | header   | page images, one per       | page table: SnapshotPageEntry  |
+ | block 0  | unique content, blocks 1.. | sorted by page ID              |
+ +----------+----------------------------+--------------------------------+
+
+ Deduplicated pages share one image here as well. The images carry their
+ own checksums, the page table is covered by the header's.
+*/
+constexpr uint32_t SNAPSHOT_MAGIC = 0x50414E53; // "SNAP"
+constexpr uint32_t SNAPSHOT_FORMAT_VERSION = 1;
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t format_version;
+    uint32_t page_size;
+    uint32_t table_checksum;  // CRC32C of the page table entries
+    PageId root_page_id;
+    uint64_t num_images;      // Page images in blocks [1, 1 + num_images)
+    uint64_t num_pages;       // Page table entries
+    uint64_t table_block;     // First block of the page table
+};
+
+struct SnapshotPageEntry {
+    PageId page_id;
+    uint64_t block;
+};
+
+// How a mapping is going to be read, passed on to the kernel as an madvise hint
+enum class SnapshotAccess {
+    NORMAL,      // Default readahead
+    RANDOM,      // Point lookups, no readahead
+    SEQUENTIAL   // Full scans, aggressive readahead and early reclaim
+};
+
+/*
+ A snapshot file mapped read-only. Opening it only validates the header
+ and the page table, nothing is read into memory up front: page IDs
+ resolve to addresses inside the mapping with a binary search over the
+ mapped page table, and the kernel pages the file in (and out) as it is
+ used. Nothing ever writes the mapping, so any number of threads can
+ read it without locks.
+*/
+class MappedSnapshot {
+private:
+    std::string file_path;
+    int fd;
+    const uint8_t* base;
+    size_t length;
+    SnapshotHeader header;
+    const SnapshotPageEntry* table;  // header.num_pages entries inside the mapping
+
+public:
+    explicit MappedSnapshot(const std::string& path, SnapshotAccess access = SnapshotAccess::RANDOM);
+    ~MappedSnapshot();
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    // The page's PAGE_SIZE_BYTES image in the mapping, nullptr if the snapshot hasn't got it
+    const uint8_t* pageImage(PageId page_id) const;
+
+    void advise(SnapshotAccess access) const;  // For the whole mapping
+    void prefetch(PageId page_id) const;       // Start paging in one page, never blocks
+
+    PageId rootPageId() const { return header.root_page_id; }
+    uint64_t pageCount() const { return header.num_pages; }
+    uint64_t imageCount() const { return header.num_images; }
+    size_t size() const { return length; }
+    const std::string& getPath() const { return file_path; }
+};
@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/*
+ Process-wide engine metrics, read while the engine runs (HealthMonitor
+ metric sources, the Prometheus file for the API server).
+
+ Counters and histograms are per thread: the first time a thread records
+ anything it gets its own block of cells, which only it ever writes, with
+ a relaxed load and store, so recording takes no lock, no read-modify-write
+ and no cache line another thread writes to. Reading sums every thread's
+ block and what threads that exited left behind. Gauges are a single value
+ set by whoever owns what they measure.
+*/
+namespace metrics {
+
+constexpr size_t MAX_COUNTERS = 32;
+constexpr size_t MAX_HISTOGRAMS = 8;
+constexpr size_t HISTOGRAM_BUCKETS = 64;  // Bucket i counts values in [2^(i-1), 2^i), bucket 0 zeroes
+
+class Counter {
+private:
+    size_t id;
+
+public:
+    Counter(const char* name, const char* help);
+    void add(uint64_t n = 1);
+    uint64_t value() const;
+};
+
+// Latencies in nanoseconds
+class Histogram {
+private:
+    size_t id;
+
+public:
+    struct Snapshot {
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+    };
+
+    Histogram(const char* name, const char* help);
+    void record(uint64_t nanos);
+    Snapshot snapshot() const;
+};
+
+class Gauge {
+private:
+    std::atomic<double> current;
+
+public:
+    Gauge(const char* name, const char* help);
+    void set(double value) { current.store(value, std::memory_order_relaxed); }
+    double value() const { return current.load(std::memory_order_relaxed); }
+};
+
+// Every metric in the Prometheus text format
+std::string prometheusText();
+// Written to a temporary file and renamed over path, a reader never sees half of it
+bool writePrometheusFile(const std::string& path);
+
+// The engine's metrics
+extern Counter cache_hits;
+extern Counter cache_misses;
+extern Counter cache_evictions;
+extern Counter wal_bytes;
+extern Counter wal_fsyncs;
+extern Histogram wal_fsync_latency;
+extern Gauge writer_queue_depth;
+extern Counter writer_pages_written;
+extern Counter btree_splits;
+
+double cacheHitRatio();  // Hits over lookups, 0 before the first one
+
+}  // namespace metrics
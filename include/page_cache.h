@@ -1,56 +1,115 @@
 #pragma once
 #include <unordered_map>
-#include <list>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include <chrono>
+#include <iterator>
+#include <vector>
+#include <utility>
+#include <cstdint>
 #include "page_manager.h"
 #include "content_storage.h"
+#include "replacement_policy.h"
+#include "buffer_pool.h"
 
 // with metadata
 template <typename KeyType>
 struct CachedPage {
     std::shared_ptr<Page<KeyType>> page;
     bool is_dirty;
-    std::chrono::steady_clock::time_point last_accessed;
+    uint64_t rec_lsn;  // While dirty, redo from this LSN brings the page up to date
+    int32_t frame;     // Buffer pool frame holding the page, -1 if it lives on the heap
+    uint32_t pin_count = 0;  // Explicit pins, see PageCache::pinPage
     
-    CachedPage(std::shared_ptr<Page<KeyType>> p, bool dirty = false) 
-        : page(p), is_dirty(dirty), last_accessed(std::chrono::steady_clock::now()) {}
+    CachedPage(std::shared_ptr<Page<KeyType>> p, bool dirty = false, uint64_t lsn = 0, int32_t f = -1) 
+        : page(p), is_dirty(dirty), rec_lsn(lsn), frame(f) {}
+
+    // Pinned, or held by someone besides the cache (and the frame's own anchor)
+    bool inUse() const { return pin_count > 0 || page.use_count() > (frame >= 0 ? 2 : 1); }
+};
+
+// Occupancy and hit counters of one cache shard
+struct PageCacheShardStats {
+    size_t pages;
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
 };
 
+/*
+ Pages are spread over shards by page ID, each shard has its own lock, map
+ and replacement policy, so threads working on different pages don't
+ serialize on one cache lock. With CLOCK and 2Q a hit only needs the shard
+ lock shared (the policy just sets a reference bit), only misses, evictions
+ and dirty-state changes take it exclusively.
+ Pages live in the frames of a BufferPool with max_size frames. Only when
+ every frame is in use (the cache is over capacity because everything is
+ pinned) does a page get loaded onto the heap instead.
+*/
 template <typename KeyType>
 class PageCache {
 private:
-    // Core cache storage
-    std::unordered_map<uint16_t, CachedPage<KeyType>> cache;
-    
-    // LRU tracking
-    std::list<uint16_t> lru_order;
-    std::unordered_map<uint16_t, typename std::list<uint16_t>::iterator> lru_iterators;
-    
-    // For thread safety
-    mutable std::mutex cache_mutex;
-    
+    struct Shard {
+        std::unordered_map<PageId, CachedPage<KeyType>> cache;
+        std::unique_ptr<ReplacementPolicy> replacement_policy;  // See replacement_policy.h
+        mutable std::shared_mutex mutex;
+        size_t capacity;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+
+    BufferPool<KeyType> buffer_pool;
+    std::vector<std::unique_ptr<Shard>> shards;
+    bool shared_hits;  // The policy allows hits under a shared shard lock
+
     size_t max_cache_size;
     
     // Reference to content storage
     ContentStorage<KeyType>* content_storage;
+    std::atomic<uint64_t> heap_pages{0};  // Pages that found no free frame
     
-    void updateLRU(uint16_t page_id);
-    void evictLRU();
-    void evictIfNeeded();
+    Shard& shardFor(PageId page_id) const { return *shards[page_id % shards.size()]; }
+    bool evictOne(Shard& shard);  // False if every page in the shard is pinned
+    void evictIfNeeded(Shard& shard);
     
 public:
-    PageCache(ContentStorage<KeyType>* storage, size_t max_size = 100);
+    // num_shards 0 picks one per core, but no more than one per 16 pages of max_size.
+    // huge_pages asks for the buffer pool arena on huge pages, if the system has them.
+    PageCache(ContentStorage<KeyType>* storage, size_t max_size = 100,
+              ReplacementPolicyType policy = ReplacementPolicyType::TWO_Q, size_t num_shards = 0,
+              bool huge_pages = false);
     ~PageCache();
     
-    // These are the main cache operations
-    std::shared_ptr<Page<KeyType>> getPage(uint16_t page_id);
-    void putPage(uint16_t page_id, std::shared_ptr<Page<KeyType>> page);
-    void markDirty(uint16_t page_id);
+    // These are the main cache operations. A shared_ptr from the cache pins the
+    // page, it isn't evicted (and its frame isn't reused) while anyone holds one.
+    std::shared_ptr<Page<KeyType>> getPage(PageId page_id);
+    std::shared_ptr<Page<KeyType>> newPage(PageId page_id, bool is_leaf);  // Empty page in a frame, clean
+    // rec_lsn is a WAL LSN at or before the change that dirtied the page, it is
+    // kept until the page is clean again (0 = redo from the start of the log)
+    void putPage(PageId page_id, std::shared_ptr<Page<KeyType>> page, uint64_t rec_lsn = 0);
+    bool markDirty(PageId page_id, uint64_t rec_lsn = 0);  // False if the page isn't cached
+    void prefetch(PageId page_id);   // Readahead hint for a page we'll need soon
+
+    // Keep a cached page resident without holding it, every pin needs an unpin
+    bool pinPage(PageId page_id);    // False if the page isn't cached
+    void unpinPage(PageId page_id);
     
     // Cache management
-    std::vector<std::pair<uint16_t, std::shared_ptr<Page<KeyType>>>> getDirtyPages();
-    void clearDirtyFlag(uint16_t page_id);
+    std::vector<std::pair<PageId, std::shared_ptr<Page<KeyType>>>> getDirtyPages();
+    void clearDirtyFlag(PageId page_id);
+    void clearDirtyFlag(PageId page_id, uint64_t flushed_version);  // Only if unchanged since flush
     void flushAll();
+    size_t evictAll();  // Drops every page nobody is using, writing back dirty ones. Returns how many
+
+    // Fuzzy checkpoints
+    std::vector<std::pair<PageId, uint64_t>> getDirtyPageTable();  // (page ID, rec_lsn) of every dirty page
+    size_t flushPages(const std::vector<PageId>& page_ids);        // Those still dirty, returns how many
+    uint64_t oldestDirtyLSN();                                       // UINT64_MAX if nothing is dirty
+
+    // Stats
+    size_t shardCount() const { return shards.size(); }
+    std::vector<PageCacheShardStats> getShardStats() const;
+    void printStats() const;
 };
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+struct iovec;
+
+// Every block in the page file is this large, and block N lives at offset N * PAGE_SIZE_BYTES
+constexpr size_t PAGE_SIZE_BYTES = 8192;
+
+// Alignment for IO buffers, so the same buffers can later be used with O_DIRECT
+constexpr size_t PAGE_IO_ALIGNMENT = 4096;
+
+/*
+ A buffer of one or more PAGE_SIZE_BYTES pages aligned to PAGE_IO_ALIGNMENT.
+ Used to stage page images before pwrite and after pread.
+*/
+class AlignedPageBuffer {
+private:
+    uint8_t* buffer;
+    size_t num_pages;
+
+public:
+    explicit AlignedPageBuffer(size_t pages = 1);
+    ~AlignedPageBuffer();
+
+    AlignedPageBuffer(const AlignedPageBuffer&) = delete;
+    AlignedPageBuffer& operator=(const AlignedPageBuffer&) = delete;
+
+    uint8_t* data() { return buffer; }
+    const uint8_t* data() const { return buffer; }
+    uint8_t* page(size_t index) { return buffer + index * PAGE_SIZE_BYTES; }
+    size_t size() const { return num_pages * PAGE_SIZE_BYTES; }
+    size_t pages() const { return num_pages; }
+};
+
+/*
+ PageFile is a flat file of fixed-size blocks. It knows nothing about
+ page contents, it only moves PAGE_SIZE_BYTES images between memory and disk.
+ We use pread/pwrite so concurrent writer threads never share a file cursor.
+ Blocks the owner is done with go on a free list: their disk space is given
+ back (a hole is punched), allocateBlock hands them out again lowest first,
+ and free blocks at the end of the file are cut off it.
+*/
+class PageFile {
+private:
+    std::string file_path;
+    int fd;
+
+    // Blocks [0, num_blocks) have been handed out
+    std::atomic<uint64_t> num_blocks;
+
+    // Freed blocks below num_blocks, highest first so the lowest is popped next
+    std::vector<uint64_t> free_blocks;
+    mutable std::mutex alloc_mutex;  // Allocation, freeing and trimming
+    std::atomic<size_t> blocks_freed;
+    std::atomic<size_t> blocks_trimmed;
+
+    std::atomic<size_t> blocks_written;
+    mutable std::atomic<size_t> blocks_read;
+    std::atomic<size_t> write_calls;  // pwrite/pwritev system calls
+
+    size_t max_blocks_per_write = 64;  // iovecs per pwritev, at most IOV_MAX
+
+    void writeVector(uint64_t first_block, struct iovec* iov, size_t count);
+
+public:
+    // Truncate starts over on whatever is at path, CreateNew refuses to open an existing file,
+    // Open keeps what is there (a page file reopened with its saved page table)
+    enum class OpenMode { Truncate, CreateNew, Open };
+
+    explicit PageFile(const std::string& path, OpenMode mode = OpenMode::Truncate);
+    ~PageFile();
+
+    PageFile(const PageFile&) = delete;
+    PageFile& operator=(const PageFile&) = delete;
+
+    // Block allocation
+    uint64_t allocateBlock();                // Reuses a free block if there is one
+    uint64_t allocateBlocks(uint32_t count); // Returns the first of count consecutive blocks, at the end
+    // Nobody may read these blocks anymore, they are reused by later allocations
+    void freeBlocks(const std::vector<uint64_t>& blocks);
+
+    // Block IO, buffers must be PAGE_SIZE_BYTES long (count * PAGE_SIZE_BYTES for writeBlocks)
+    void writeBlock(uint64_t block_id, const uint8_t* buffer);
+    void writeBlocks(uint64_t first_block, const uint8_t* buffer, uint32_t count);
+    // Page images going to arbitrary blocks, see writeBlockList
+    struct BlockWrite {
+        uint64_t block_id;
+        const uint8_t* buffer;
+    };
+    void writeBlockList(std::vector<BlockWrite>& writes);  // Sorts writes by block
+    void setMaxBlocksPerWrite(size_t blocks);
+    void readBlock(uint64_t block_id, uint8_t* buffer) const;
+    void prefetchBlock(uint64_t block_id) const; // Readahead hint, never blocks on IO
+    void sync();
+    void syncDirectory() const;  // Makes creating or renaming files next to this one durable
+
+    // Statistics
+    uint64_t getNumBlocks() const { return num_blocks.load(); }
+    size_t getFileSize() const { return static_cast<size_t>(num_blocks.load()) * PAGE_SIZE_BYTES; }
+    size_t getBlocksWritten() const { return blocks_written.load(); }
+    size_t getBlocksRead() const { return blocks_read.load(); }
+    size_t getWriteCalls() const { return write_calls.load(); }
+    size_t getBlocksFreed() const { return blocks_freed.load(); }
+    size_t getBlocksTrimmed() const { return blocks_trimmed.load(); }  // Freed at the end and cut off
+    size_t getFreeBlocks() const;
+    const std::string& getPath() const { return file_path; }
+    bool isFile(const std::string& path) const;  // Whether path names this file (same device and inode)
+};
@@ -0,0 +1,6 @@
+#pragma once
+#include <cstdint>
+
+// Identifies a page for its whole life, IDs are never reused. 0 means no page
+// (a leaf without a sibling, a record that isn't about any one page).
+using PageId = uint64_t;
@@ -2,19 +2,34 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
 #include "content_hash.h"
-// #include "hash_util.h"  // Commented out to avoid Botan dependency
+#include "page_id.h"
+#include "codec.h"
+#include "checksum.h"
+#include "page_file.h"
 
 struct PageHeader {
-    uint16_t page_id;
+    PageId page_id;
     uint16_t num_slots; // number of records
     uint16_t free_space_offset;  // Start of free space
     uint16_t free_space_size;    // Bytes of free space
-    std::string checksum;           // SHA hash
-    std::string content_hash;       // Content-addressable hash
+    uint32_t checksum;              // CRC32C of data, see updatePageChecksum
+    mutable ContentHash content_hash;  // Content-addressable hash, cached by Page::getContentHash
     uint8_t flags;               // e.g, for dirty, deleted, etc
+    PageId prev_leaf;            // Leaf sibling links for range scans, 0 = none
+    PageId next_leaf;
 };
 
+// PageHeader::flags bits
+constexpr uint8_t PAGE_FLAG_DELETED = 0x01;  // Unlinked from the tree by a merge or root collapse
+
 struct SlotEntry {
     uint16_t id;
     uint16_t offset;  // Offset from start of page
@@ -22,40 +37,421 @@ struct SlotEntry {
     uint8_t is_deleted;  // Logical deletion flag
 };
 
+/*
+ Page versions come from one global counter, so a later modification always
+ has a bigger version, even if the page was evicted and reloaded as a new object.
+*/
+inline uint64_t nextPageVersion() {
+    static std::atomic<uint64_t> version_counter{0};
+    return version_counter.fetch_add(1) + 1;
+}
+
+/*
+ Reader/writer latch that lives inside every in-memory page. The tree takes it
+ exclusively while mutating a page in place, and the writer queue / cache take
+ it shared while they snapshot the page for storage. version changes on every
+ modification so a flush can tell whether the page changed after its snapshot,
+ and storage can ignore snapshots older than the one it already has.
+ Copying a page gives the copy a fresh, unlocked latch.
+*/
+struct PageLatch {
+    mutable std::shared_mutex mutex;
+    std::atomic<uint64_t> version{0};
+
+    PageLatch() = default;
+    PageLatch(const PageLatch&) {}
+    PageLatch& operator=(const PageLatch&) { return *this; }
+};
+
+/*
+ Allocator for a page's value bytes. A page that sits in a buffer pool frame
+ (see buffer_pool.h) hands its frame's PAGE_SIZE_BYTES of arena memory to
+ the first allocation, which BufferPool makes up front by reserving a page
+ worth. Only if the bytes outgrow the frame do they move to the heap. Copies
+ of a page never share the frame, they always allocate on the heap.
+*/
+struct FrameAllocator {
+    using value_type = uint8_t;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::false_type;
+    using propagate_on_container_swap = std::false_type;
+    template <typename U> struct rebind { using other = FrameAllocator; };  // Only ever bytes
+
+    uint8_t* frame = nullptr;  // nullptr for pages outside the pool
+
+    FrameAllocator() = default;
+    explicit FrameAllocator(uint8_t* frame_memory) : frame(frame_memory) {}
+
+    uint8_t* allocate(size_t n) {
+        if (frame && n <= PAGE_SIZE_BYTES) {
+            return frame;
+        }
+        return static_cast<uint8_t*>(::operator new(n));
+    }
+    void deallocate(uint8_t* p, size_t) {
+        if (p != frame) {
+            ::operator delete(p);
+        }
+    }
+
+    FrameAllocator select_on_container_copy_construction() const { return FrameAllocator(); }
+    bool operator==(const FrameAllocator& other) const { return frame == other.frame; }
+    bool operator!=(const FrameAllocator& other) const { return frame != other.frame; }
+};
+
+using PageBytes = std::vector<uint8_t, FrameAllocator>;
+
+/*
+ Hash-once state of a page: dirty says header.content_hash is out of date.
+ PageWriteGuard sets it after every in-place modification, and the hash is
+ only recomputed the next time somebody asks for it, so a page flushed
+ several times between modifications is hashed once. Flushers ask while
+ holding the page's latch shared, mutex makes sure only one of them
+ computes. Copies keep the state of the page they were copied from.
+*/
+struct PageHashState {
+    mutable std::mutex mutex;
+    mutable std::atomic<bool> dirty{true};  // Cleared by the const Page::getContentHash
+
+    PageHashState() = default;
+    PageHashState(const PageHashState& other) : dirty(other.dirty.load()) {}
+    PageHashState& operator=(const PageHashState& other) {
+        dirty.store(other.dirty.load());
+        return *this;
+    }
+};
+
 template <typename KeyType> 
 struct Page {
     PageHeader header;
     bool is_leaf;
+    PageLatch latch;
+    PageHashState hash_state;
 
     // Internal-node-only
     std::vector<KeyType> keys;
-    std::vector<uint16_t> children; // Page IDs of child pages
+    std::vector<PageId> children; // Page IDs of child pages
 
+    // Leaf-only, value i lives at data[slot_directory[i].offset, + length)
     std::vector<SlotEntry> slot_directory;
-    std::vector<uint8_t> data; // Raw bytes of PAGE_SIZE - header/slots
+    PageBytes data; // Raw bytes of PAGE_SIZE - header/slots
     
-    // Content-addressable storage methods
-    void updateContentHash() {
-        std::vector<uint8_t> content;
-        
-        // Add keys to content
+    // Leaf value access through the slot directory, values can be any length
+    ByteView valueAt(size_t index) const {
+        const SlotEntry& slot = slot_directory[index];
+        return {data.data() + slot.offset, slot.length};
+    }
+
+    void insertValue(size_t index, const uint8_t* bytes, size_t len) {
+        // Slots hold 16-bit offsets and lengths, past that they would wrap
+        if (data.size() + len > UINT16_MAX) {
+            throw std::length_error("page values would take more than 64 KB");
+        }
+        SlotEntry slot{static_cast<uint16_t>(index), static_cast<uint16_t>(data.size()),
+                       static_cast<uint16_t>(len), 0};
+        data.insert(data.end(), bytes, bytes + len);
+        slot_directory.insert(slot_directory.begin() + index, slot);
+        renumberSlots(index);
+    }
+
+    void eraseValue(size_t index) {
+        SlotEntry removed = slot_directory[index];
+        data.erase(data.begin() + removed.offset, data.begin() + removed.offset + removed.length);
+        slot_directory.erase(slot_directory.begin() + index);
+        // Close the gap left in data
+        for (auto& slot : slot_directory) {
+            if (slot.offset > removed.offset) slot.offset -= removed.length;
+        }
+        renumberSlots(index);
+    }
+
+    void renumberSlots(size_t from) {
+        for (size_t i = from; i < slot_directory.size(); ++i) {
+            slot_directory[i].id = static_cast<uint16_t>(i);
+        }
+    }
+
+    /*
+     Content-addressable storage methods. The hash covers what the page
+     means, not how it is laid out, and is streamed straight out of the
+     page's own vectors: leaf flag and flags, then length-prefixed keys,
+     children, sibling links (leaves) and length-prefixed values in slot order.
+    */
+    ContentHash computeContentHash() const {
+        ContentHasher hasher;
+        const uint8_t kind[2] = {static_cast<uint8_t>(is_leaf ? 1 : 0), header.flags};
+        hasher.update(kind, sizeof(kind));
+
         for (const auto& key : keys) {
-            const uint8_t* key_bytes = reinterpret_cast<const uint8_t*>(&key);
-            content.insert(content.end(), key_bytes, key_bytes + sizeof(KeyType));
+            ByteView bytes = Codec<KeyType>::bytes(key);
+            hasher.updateValue(static_cast<uint32_t>(bytes.size));
+            hasher.update(bytes.data, bytes.size);
         }
-        
-        // Add data to content
-        content.insert(content.end(), data.begin(), data.end());
-        
-        header.content_hash = ContentHash::computeHash(content);
+
+        // Internal nodes are defined by where they point
+        hasher.update(children.data(), children.size() * sizeof(PageId));
+
+        // So are leaves, through their sibling links
+        if (is_leaf) {
+            const PageId links[2] = {header.prev_leaf, header.next_leaf};
+            hasher.update(links, sizeof(links));
+        }
+
+        // Values in slot order, so the data layout itself doesn't matter
+        for (size_t i = 0; i < slot_directory.size(); ++i) {
+            ByteView value = valueAt(i);
+            hasher.updateValue(static_cast<uint32_t>(value.size));
+            hasher.update(value.data, value.size);
+        }
+
+        return hasher.finish();
     }
-    
-    std::string getContentHash() const {
+
+    // Rehash now, for pages only the caller can see
+    void updateContentHash() {
+        header.content_hash = computeContentHash();
+        hash_state.dirty.store(false, std::memory_order_release);
+    }
+
+    // The page changed, the next getContentHash has to rehash it
+    void invalidateContentHash() {
+        hash_state.dirty.store(true, std::memory_order_release);
+    }
+
+    // Set the hash to one that is known to match, e.g. from storage's index
+    void setContentHash(const ContentHash& hash) {
+        header.content_hash = hash;
+        hash_state.dirty.store(false, std::memory_order_release);
+    }
+
+    /*
+     The content hash, recomputed only if the page changed since it was
+     last hashed. Safe with the latch held shared: writers of the cached
+     hash hold hash_state.mutex, and nobody can modify the page meanwhile.
+    */
+    ContentHash getContentHash() const {
+        if (hash_state.dirty.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(hash_state.mutex);
+            if (hash_state.dirty.load(std::memory_order_relaxed)) {
+                header.content_hash = computeContentHash();
+                hash_state.dirty.store(false, std::memory_order_release);
+            }
+        }
         return header.content_hash;
     }
     
     bool hasSameContent(const Page<KeyType>& other) const {
-        return header.content_hash == other.header.content_hash;
+        return getContentHash() == other.getContentHash();
+    }
+};
+
+/*
+ Holds a page's latch exclusively for an in-place modification, and gives
+ the page a new version when released so pending flushes know they are stale
+ (and a stale content hash, see PageHashState).
+*/
+template <typename KeyType>
+class PageWriteGuard {
+private:
+    Page<KeyType>& page;
+    std::unique_lock<std::shared_mutex> lock;
+
+public:
+    explicit PageWriteGuard(Page<KeyType>& p) : page(p), lock(p.latch.mutex) {}
+    ~PageWriteGuard() {
+        page.invalidateContentHash();
+        page.latch.version.store(nextPageVersion());
+    }
+
+    PageWriteGuard(const PageWriteGuard&) = delete;
+    PageWriteGuard& operator=(const PageWriteGuard&) = delete;
+};
+
+/*
+ Serialized page image, this is what lives in a page file block:
+
+ +------------------+----------------------+-----------+-------------------+
+ | PageImageHeader  | SlotEntry[num_slots] | free      | cells (grow down) |
+ +------------------+----------------------+-----------+-------------------+
+
+ Slot i points at the cell for key i. A cell is [u16 key_len][key bytes][payload],
+ where the payload is the value bytes in a leaf, or the u64 page ID of the child
+ to the right of key i in an internal page (the leftmost child is in the header).
+*/
+constexpr uint32_t PAGE_IMAGE_MAGIC = 0x50434442; // "BDCP"
+
+struct PageImageHeader {
+    uint32_t magic;
+    uint32_t checksum;           // CRC32C of the whole image, with this field as zero
+    PageId page_id;
+    PageId leftmost_child;       // Internal pages only
+    PageId prev_leaf;            // Leaf pages only, 0 = no sibling
+    PageId next_leaf;
+    uint16_t num_slots;
+    uint16_t free_space_offset;  // First byte after the slot directory
+    uint16_t cell_offset;        // First byte of the cell area
+    uint8_t is_leaf;
+    uint8_t flags;
+};
+
+// CRC32C of a page image, skipping over its checksum field
+inline uint32_t pageImageChecksum(const uint8_t* image, size_t size) {
+    constexpr size_t field = offsetof(PageImageHeader, checksum);
+    uint32_t crc = crc32c(0, image, field);
+    return crc32c(crc, image + field + sizeof(uint32_t), size - field - sizeof(uint32_t));
+}
+
+/*
+ What a page takes once serialized. Every key costs its slot and its cell,
+ however many keys the page has, so the tree checks pages against
+ PAGE_SIZE_BYTES as well as against its key count. A cell may take at most
+ half of the room after the header: any two cells then share a page, and
+ splitting a leaf by bytes always makes room for the cell being inserted.
+ Keys are capped too, so internal pages take a useful number of separators.
+*/
+constexpr size_t PAGE_CELL_SPACE = PAGE_SIZE_BYTES - sizeof(PageImageHeader);
+constexpr size_t MAX_CELL_BYTES = PAGE_CELL_SPACE / 2;
+constexpr size_t MAX_KEY_BYTES = 1024;
+
+// Bytes of a key with payload bytes after it (its value, or a child ID), slot included
+template <typename KeyType>
+inline size_t cellBytes(const KeyType& key, size_t payload) {
+    return sizeof(SlotEntry) + sizeof(uint16_t) + Codec<KeyType>::encodedSize(key) + payload;
+}
+
+// The most a separator pulled up into an internal page can take
+template <typename KeyType>
+constexpr size_t maxSeparatorBytes() {
+    return sizeof(SlotEntry) + sizeof(uint16_t) + sizeof(PageId) +
+           (std::is_trivially_copyable<KeyType>::value ? sizeof(KeyType) : MAX_KEY_BYTES);
+}
+
+// Size of the page's image, serializePage throws once this is over PAGE_SIZE_BYTES
+template <typename KeyType>
+size_t pageImageBytes(const Page<KeyType>& page) {
+    size_t key_bytes = 0;
+    if (std::is_trivially_copyable<KeyType>::value) {
+        key_bytes = page.keys.size() * sizeof(KeyType);
+    } else {
+        for (const auto& key : page.keys) {
+            key_bytes += Codec<KeyType>::encodedSize(key);
+        }
+    }
+    size_t payload = page.is_leaf ? page.data.size() : page.keys.size() * sizeof(PageId);
+    return sizeof(PageImageHeader) + page.keys.size() * (sizeof(SlotEntry) + sizeof(uint16_t)) +
+           key_bytes + payload;
+}
+
+/*
+ Read-only view over a serialized page image, e.g. a pread buffer or a
+ mapped file. Nothing is copied into vectors, keys and values are decoded
+ straight out of the image, so lookups through a view never allocate.
+ The image's checksum is verified up front, a torn or damaged block throws.
+*/
+template <typename KeyType>
+class PageView {
+private:
+    const uint8_t* image;
+    size_t image_size;
+    PageImageHeader header;
+
+    /*
+     The checksum only says the image is what was written, not that it was
+     written right, so every slot is checked against the image before its
+     cell is read: it has to lie inside the cell area and hold its key (and
+     child ID, in an internal page).
+    */
+    SlotEntry slotAt(uint16_t index) const {
+        if (index >= header.num_slots) {
+            throw std::out_of_range("page image slot " + std::to_string(index) + " out of range");
+        }
+        SlotEntry slot;
+        std::memcpy(&slot, image + sizeof(PageImageHeader) + index * sizeof(SlotEntry), sizeof(SlotEntry));
+        size_t payload = header.is_leaf ? 0 : sizeof(PageId);
+        if (slot.offset < header.cell_offset || static_cast<size_t>(slot.offset) + slot.length > image_size ||
+            slot.length < sizeof(uint16_t) + payload) {
+            throw std::runtime_error("corrupt page image slot " + std::to_string(index));
+        }
+        return slot;
+    }
+
+    uint16_t keyLength(const SlotEntry& slot) const {
+        uint16_t len;
+        std::memcpy(&len, image + slot.offset, sizeof(len));
+        size_t payload = header.is_leaf ? 0 : sizeof(PageId);
+        if (len < Codec<KeyType>::minEncodedSize() || sizeof(uint16_t) + len + payload > slot.length) {
+            throw std::runtime_error("corrupt page image cell at offset " + std::to_string(slot.offset));
+        }
+        return len;
+    }
+
+public:
+    PageView(const uint8_t* buffer, size_t size) : image(buffer), image_size(size) {
+        if (size < sizeof(PageImageHeader)) {
+            throw std::runtime_error("page image is smaller than its header");
+        }
+        std::memcpy(&header, image, sizeof(header));
+        if (header.magic != PAGE_IMAGE_MAGIC) {
+            throw std::runtime_error("not a page image (bad magic)");
+        }
+        if (pageImageChecksum(image, image_size) != header.checksum) {
+            throw std::runtime_error("page image checksum mismatch");
+        }
+        if (header.free_space_offset > header.cell_offset || header.cell_offset > image_size ||
+            sizeof(PageImageHeader) + header.num_slots * sizeof(SlotEntry) != header.free_space_offset) {
+            throw std::runtime_error("corrupt page image header");
+        }
+    }
+
+    PageId pageId() const { return header.page_id; }
+    bool isLeaf() const { return header.is_leaf != 0; }
+    uint16_t numKeys() const { return header.num_slots; }
+    uint8_t flags() const { return header.flags; }
+    PageId prevLeaf() const { return header.prev_leaf; }
+    PageId nextLeaf() const { return header.next_leaf; }
+    uint32_t checksum() const { return header.checksum; }
+
+    typename Codec<KeyType>::View keyAt(uint16_t index) const {
+        SlotEntry slot = slotAt(index);
+        return Codec<KeyType>::view(image + slot.offset + sizeof(uint16_t), keyLength(slot));
+    }
+
+    // Leaf pages: bytes of the value stored with key index
+    ByteView valueAt(uint16_t index) const {
+        SlotEntry slot = slotAt(index);
+        size_t prefix = sizeof(uint16_t) + keyLength(slot);
+        return {image + slot.offset + prefix, slot.length - prefix};
+    }
+
+    // Internal pages: child index in [0, numKeys()]
+    PageId childAt(uint16_t index) const {
+        if (index == 0) return header.leftmost_child;
+        SlotEntry slot = slotAt(index - 1);
+        PageId child;
+        std::memcpy(&child, image + slot.offset + slot.length - sizeof(child), sizeof(child));
+        return child;
+    }
+
+    // Index of the first key >= key
+    uint16_t lowerBound(const KeyType& key) const {
+        uint16_t lo = 0, hi = header.num_slots;
+        while (lo < hi) {
+            uint16_t mid = lo + (hi - lo) / 2;
+            if (keyAt(mid) < key) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Index of the first key > key, which is also the child to descend into
+    uint16_t upperBound(const KeyType& key) const {
+        uint16_t lo = 0, hi = header.num_slots;
+        while (lo < hi) {
+            uint16_t mid = lo + (hi - lo) / 2;
+            if (key < keyAt(mid)) hi = mid;
+            else lo = mid + 1;
+        }
+        return lo;
     }
 };
 
@@ -71,3 +467,15 @@ bool deleteRecord(Page<KeyType> *page, uint16_t slot_id);
 template <typename KeyType>
 void updatePageChecksum(Page<KeyType> *page);
 
+// Page image encoding used by the page file, returns bytes written into buffer.
+// Throws std::length_error if the page doesn't fit in capacity bytes.
+template <typename KeyType>
+size_t serializePage(const Page<KeyType>& page, uint8_t* buffer, size_t capacity);
+
+template <typename KeyType>
+Page<KeyType> deserializePage(const uint8_t* buffer, size_t size);
+
+// Same, into an existing (e.g. recycled) page, reusing the memory its vectors already have
+template <typename KeyType>
+void deserializePageInto(const uint8_t* buffer, size_t size, Page<KeyType>& page);
+
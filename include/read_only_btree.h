@@ -0,0 +1,70 @@
+#pragma once
+
+#include<string>
+#include<optional>
+#include "page_manager.h"
+#include "mapped_snapshot.h"
+
+template <typename KeyType, typename ValueType>
+class ReadOnlyBTree;
+
+/*
+*   Cursor over the keys in [lo, hi] of a ReadOnlyBTree, like BTreeCursor
+*   but straight over the mapped leaves: the snapshot never changes, so it
+*   keeps its place by leaf and slot instead of searching again, and asks
+*   the kernel to page in the next leaf while it reads the current one.
+*/
+template <typename KeyType, typename ValueType>
+class ReadOnlyCursor {
+    private:
+        const ReadOnlyBTree<KeyType, ValueType>* tree;
+        std::optional<PageView<KeyType>> leaf;  // Current leaf, checked once when we got to it
+        size_t slot;                            // Of the current entry in leaf
+        KeyType lo;
+        KeyType hi;
+        KeyType current_key;
+        ValueType current_value;
+        bool is_valid;
+
+        void settle(size_t pos, bool forward);
+
+    public:
+        ReadOnlyCursor(const ReadOnlyBTree<KeyType, ValueType>* tree, const KeyType& lo, const KeyType& hi, bool forward);
+
+        bool valid() const { return is_valid; }
+        const KeyType& key() const { return current_key; }
+        const ValueType& value() const { return current_value; }
+        void next();
+        void prev();
+};
+
+/*
+*   Read-only B+Tree over a snapshot file, for replicas. Pages are read
+*   through PageViews over the mapped file, there is no page cache, no
+*   content storage, no writer queue and no WAL, and no latches since
+*   nothing is ever modified. Opening it costs a few checks, whatever
+*   isn't used is never read. Safe to use from any number of threads.
+*/
+template <typename KeyType, typename ValueType>
+class ReadOnlyBTree {
+    private:
+        MappedSnapshot snapshot;
+
+        PageView<KeyType> view(PageId page_id) const;
+        PageView<KeyType> findLeaf(const KeyType& key) const;
+
+        friend class ReadOnlyCursor<KeyType, ValueType>;
+
+    public:
+        explicit ReadOnlyBTree(const std::string& snapshot_path, SnapshotAccess access = SnapshotAccess::RANDOM);
+
+        bool lookup(const KeyType& key, ValueType& value) const; // Decodes into value, returns false if missing
+        std::optional<ValueType> lookup(const KeyType& key) const;
+        ValueType* search(const KeyType& key) const; // Heap-allocated result, prefer lookup
+        ReadOnlyCursor<KeyType, ValueType> scan(const KeyType& lo, const KeyType& hi) const;        // Ascending from lo
+        ReadOnlyCursor<KeyType, ValueType> scanReverse(const KeyType& lo, const KeyType& hi) const; // Descending from hi
+
+        // E.g. SEQUENTIAL before a report that scans everything, RANDOM (the default) for lookups
+        void setAccessPattern(SnapshotAccess access) { snapshot.advise(access); }
+        uint64_t pageCount() const { return snapshot.pageCount(); }
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "page_id.h"
+
+/*
+ Which pages PageCache drops when it is full:
+    LRU:    least recently used first. Every hit moves the page to the front
+            of a list, and a single range scan pushes everything else out.
+    CLOCK:  second chance. A hit only sets the page's reference bit, the
+            clock hand clears bits as it sweeps and evicts the first page
+            whose bit is clear.
+    TWO_Q:  2Q. New pages go through a FIFO (A1in) and leave it after one
+            round, unless they come back soon after (their ID is still in
+            the A1out ghost list), then they join the hot set (Am). Hits
+            don't move anything, Am is kept as a CLOCK. Pages a scan reads
+            once never get into Am, so hot internal nodes stay cached.
+*/
+enum class ReplacementPolicyType {
+    LRU,
+    CLOCK,
+    TWO_Q
+};
+
+/*
+ Interface every replacement policy implements. The cache calls it under
+ its own lock, except that recordAccess of CLOCK and TWO_Q only reads the
+ policy's tables and sets an atomic bit, so concurrent hits don't contend
+ on anything but that bit (see concurrentAccess).
+*/
+class ReplacementPolicy {
+public:
+    virtual ~ReplacementPolicy() = default;
+
+    virtual void recordInsert(PageId page_id) = 0;  // The page was just added to the cache
+    virtual void recordAccess(PageId page_id) = 0;  // Cache hit
+    virtual void recordRemove(PageId page_id) = 0;  // The page left the cache some other way
+
+    // Choose a page to evict, skipping those can_evict says no to (pinned
+    // pages). The victim is forgotten right away. False if nothing can go.
+    virtual bool evict(const std::function<bool(PageId)>& can_evict, PageId& victim) = 0;
+
+    // True if recordAccess may run concurrently with itself
+    virtual bool concurrentAccess() const = 0;
+    virtual const char* name() const = 0;
+};
+
+std::unique_ptr<ReplacementPolicy> makeReplacementPolicy(ReplacementPolicyType type, size_t capacity);
+
+// Least recently used, the cache's original policy
+class LRUPolicy : public ReplacementPolicy {
+private:
+    std::list<PageId> lru_order;  // Most recently used first
+    std::unordered_map<PageId, std::list<PageId>::iterator> lru_iterators;
+
+public:
+    void recordInsert(PageId page_id) override;
+    void recordAccess(PageId page_id) override;
+    void recordRemove(PageId page_id) override;
+    bool evict(const std::function<bool(PageId)>& can_evict, PageId& victim) override;
+    bool concurrentAccess() const override { return false; }
+    const char* name() const override { return "LRU"; }
+};
+
+/*
+ Pages on a clock face, each with a reference bit. Slots are reused once
+ their page is gone, the bits live in a deque so they never move.
+*/
+class ClockRing {
+private:
+    std::vector<PageId> pages;  // 0 marks a free slot
+    mutable std::deque<std::atomic<bool>> referenced;  // Set by hits, see reference
+    std::unordered_map<PageId, size_t> slots;
+    std::vector<size_t> free_slots;
+    size_t hand = 0;
+
+public:
+    void add(PageId page_id);
+    void remove(PageId page_id);
+    bool contains(PageId page_id) const { return slots.count(page_id) > 0; }
+    void reference(PageId page_id) const;  // Only reads the tables
+    bool evict(const std::function<bool(PageId)>& can_evict, PageId& victim);
+    size_t size() const { return slots.size(); }
+};
+
+class ClockPolicy : public ReplacementPolicy {
+private:
+    ClockRing ring;
+
+public:
+    void recordInsert(PageId page_id) override { ring.add(page_id); }
+    void recordAccess(PageId page_id) override { ring.reference(page_id); }
+    void recordRemove(PageId page_id) override { ring.remove(page_id); }
+    bool evict(const std::function<bool(PageId)>& can_evict, PageId& victim) override {
+        return ring.evict(can_evict, victim);
+    }
+    bool concurrentAccess() const override { return true; }
+    const char* name() const override { return "CLOCK"; }
+};
+
+/*
+ 2Q (Johnson and Shasha) with Am kept as a CLOCK instead of an LRU list.
+ A1in holds up to a quarter of the cache, A1out remembers the IDs of the
+ last half a cache worth of pages evicted from A1in.
+*/
+class TwoQueuePolicy : public ReplacementPolicy {
+private:
+    size_t max_in;       // Kin
+    size_t max_ghosts;   // Kout
+    std::list<PageId> a1_in;  // Newest first
+    std::unordered_map<PageId, std::list<PageId>::iterator> in_iterators;
+    std::list<PageId> a1_out;  // Newest first, page IDs only
+    std::unordered_map<PageId, std::list<PageId>::iterator> ghost_iterators;
+    ClockRing am;
+
+    bool evictFromIn(const std::function<bool(PageId)>& can_evict, PageId& victim);
+    void addGhost(PageId page_id);
+
+public:
+    explicit TwoQueuePolicy(size_t capacity);
+    void recordInsert(PageId page_id) override;
+    void recordAccess(PageId page_id) override;
+    void recordRemove(PageId page_id) override;
+    bool evict(const std::function<bool(PageId)>& can_evict, PageId& victim) override;
+    bool concurrentAccess() const override { return true; }
+    const char* name() const override { return "2Q"; }
+};
@@ -1,75 +1,152 @@
 #pragma once
 #include <unordered_map>
+#include <map>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
 #include <chrono>
 #include <memory>
+#include <limits>
+#include <optional>
 #include "page_manager.h"
+#include "epoch.h"
 
 // Transaction timestamp for MVCC
 using TransactionId = uint64_t;
 using Timestamp = std::chrono::steady_clock::time_point;
 
+/*
+ Logical commit timestamps. Every commit that wrote something takes the
+ next one, and a transaction reads the snapshot of everything committed
+ up to the last timestamp handed out before it began.
+*/
+using CommitTimestamp = uint64_t;
+constexpr CommitTimestamp TIMESTAMP_INFINITY = std::numeric_limits<CommitTimestamp>::max();
+
+/*
+ One version of a key. It is visible to the snapshots in [begin_ts, end_ts):
+ begin_ts is the commit timestamp of the transaction that wrote it (infinity
+ until that commits), end_ts the one of the transaction that replaced or
+ deleted it (infinity while it is current). Both are stamped at commit,
+ so checking a version needs no transaction lookups.
+ Readers walk a chain through `older` without locks, `older_owner` is
+ what keeps that version alive, and only changes under the chain's mutex.
+*/
 template<typename KeyType>
-struct VersionedRecord {
+struct VersionedRecord : std::enable_shared_from_this<VersionedRecord<KeyType>> {
     KeyType key;
     std::vector<uint8_t> data;
     TransactionId created_by;
-    TransactionId deleted_by;  // 0 if not deleted
+    std::atomic<TransactionId> deleted_by;  // 0 if not deleted
+    std::atomic<CommitTimestamp> begin_ts;
+    std::atomic<CommitTimestamp> end_ts;
     Timestamp created_at;
     Timestamp deleted_at;
-    bool is_deleted;
+    std::atomic<bool> is_deleted;
+    bool is_tombstone;  // A before-image of a key that didn't exist, see recordBeforeImage
+    std::atomic<VersionedRecord*> older;  // Next older version of the key, chains are newest first
+    std::shared_ptr<VersionedRecord> older_owner;
     
     VersionedRecord(const KeyType& k, const std::vector<uint8_t>& d, TransactionId txn_id)
         : key(k), data(d), created_by(txn_id), deleted_by(0), 
-          created_at(std::chrono::steady_clock::now()), is_deleted(false) {}
+          begin_ts(TIMESTAMP_INFINITY), end_ts(TIMESTAMP_INFINITY),
+          created_at(std::chrono::steady_clock::now()), is_deleted(false), is_tombstone(false),
+          older(nullptr) {}
+
+    bool visibleAt(CommitTimestamp snapshot) const {
+        return begin_ts.load(std::memory_order_acquire) <= snapshot &&
+               snapshot < end_ts.load(std::memory_order_acquire);
+    }
+};
+
+// The versions of one key. Writers and cleanup of the key take write_mutex, readers never do
+template<typename KeyType>
+struct VersionChain {
+    std::atomic<VersionedRecord<KeyType>*> newest{nullptr};
+    std::shared_ptr<VersionedRecord<KeyType>> newest_owner;
+    std::mutex write_mutex;
 };
 
 template<typename KeyType>
 struct Transaction {
     TransactionId id;
+    CommitTimestamp snapshot_ts;  // Sees what committed at or before this
+    CommitTimestamp commit_ts;    // TIMESTAMP_INFINITY until committed
     Timestamp start_time;
     Timestamp commit_time;
     bool is_committed;
     bool is_aborted;
+    bool read_only;  // Refuses writes and keeps no read set
+    std::mutex sets_mutex;  // The sets below, a transaction may be shared by threads
     std::vector<KeyType> read_set;
     std::vector<KeyType> write_set;
+    std::vector<std::shared_ptr<VersionedRecord<KeyType>>> created;  // begin_ts stamped at commit
+    std::vector<std::shared_ptr<VersionedRecord<KeyType>>> ended;    // end_ts stamped at commit
     
-    Transaction(TransactionId txn_id) 
-        : id(txn_id), start_time(std::chrono::steady_clock::now()),
-          is_committed(false), is_aborted(false) {}
+    Transaction(TransactionId txn_id, CommitTimestamp snapshot = 0, bool is_read_only = false)
+        : id(txn_id), snapshot_ts(snapshot), commit_ts(TIMESTAMP_INFINITY),
+          start_time(std::chrono::steady_clock::now()),
+          is_committed(false), is_aborted(false), read_only(is_read_only) {}
 };
 
 template<typename KeyType>
 class VersionManager {
 private:
-    // Version storage: key -> list of versions (newest first)
-    std::unordered_map<KeyType, std::vector<std::shared_ptr<VersionedRecord<KeyType>>>> versions;
+    // Version storage: key -> its chain. Ordered, so that a range scan can find the keys
+    // with versions in its range, and cleanup can pick up where its last slice stopped
+    std::map<KeyType, std::unique_ptr<VersionChain<KeyType>>> versions;
     
-    // Active transactions
+    // Active transactions, and aborted ones whose versions cleanupAbortedTransactions still has to drop
     std::unordered_map<TransactionId, std::shared_ptr<Transaction<KeyType>>> active_transactions;
-    std::unordered_map<TransactionId, std::shared_ptr<Transaction<KeyType>>> committed_transactions;
+    std::vector<std::shared_ptr<Transaction<KeyType>>> aborted_transactions;
+    size_t committed_count = 0;
+    std::atomic<size_t> active_count;  // active_transactions.size(), readable without the lock
     
-    // Transaction ID generation
+    // Snapshot timestamp -> active transactions reading it. The oldest one is the low-water
+    // mark: versions that ended at or before it are invisible to every transaction
+    std::map<CommitTimestamp, size_t> active_snapshots;
+    std::atomic<CommitTimestamp> low_water_mark;
+
+    // Transaction ID generation, and the last commit timestamp handed out
     std::atomic<TransactionId> next_transaction_id;
+    std::atomic<CommitTimestamp> last_commit_ts;
     
-    // Version cleanup tracking
+    // Version cleanup tracking. Cleanup unlinks versions and retires them to
+    // epochs, which frees them once no reader can be looking at them any more
+    EpochManager epochs;
+    std::mutex cleanup_mutex;  // One cleanup at a time, guards the cleanup state below
+    std::optional<KeyType> cleanup_cursor;  // Last key the previous slice pruned, none to start over
+    std::vector<KeyType> emptied_chains;    // Found empty, to erase from versions when it is free
     std::atomic<size_t> total_versions;
     std::atomic<size_t> cleaned_versions;
     Timestamp last_cleanup;
     
-    // Synchronization
-    mutable std::mutex versions_mutex;
-    mutable std::mutex transactions_mutex;
+    // Synchronization. versions_mutex guards the map itself: everyone holds it shared, only
+    // adding or erasing a key takes it exclusively. Lock order: versions, chain, transactions
+    mutable std::shared_mutex versions_mutex;
+    mutable std::shared_mutex transactions_mutex;
     
     // Configuration
     std::chrono::hours version_retention_period;
     size_t max_versions_per_key;
+    size_t cleanup_slice_size;  // Keys one cleanupOldVersions call looks at
     
     // Helper methods
-    bool isVisible(const std::shared_ptr<VersionedRecord<KeyType>>& version, TransactionId reader_txn) const;
-    std::shared_ptr<VersionedRecord<KeyType>> findVisibleVersion(const KeyType& key, TransactionId reader_txn) const;
+    TransactionId startTransaction(bool read_only);
+    void endTransaction(const Transaction<KeyType>& txn);  // Takes it out of the low-water mark
+    void updateLowWaterMark();
+    std::shared_ptr<Transaction<KeyType>> findActive(TransactionId txn_id) const;
+    template<typename Fn>
+    bool withChain(const KeyType& key, bool create, Fn&& fn);
+    bool addVersion(TransactionId txn_id, const KeyType& key, const std::vector<uint8_t>& data);
+    static bool isVisible(const VersionedRecord<KeyType>& version, const Transaction<KeyType>& reader);
+    static VersionedRecord<KeyType>* findVisibleVersion(const VersionChain<KeyType>& chain, const Transaction<KeyType>& reader);
+    bool hasWriteConflict(const VersionChain<KeyType>& chain, const VersionedRecord<KeyType>* visible,
+                          const Transaction<KeyType>& writer) const;
+    size_t pruneChain(VersionChain<KeyType>& chain, CommitTimestamp low_water, Timestamp cutoff_time,
+                      std::vector<std::shared_ptr<void>>& retired);
+    void eraseEmptiedChains();
     
 public:
     VersionManager(std::chrono::hours retention = std::chrono::hours(24), size_t max_versions = 100);
@@ -77,6 +154,7 @@ public:
     
     // Transaction management
     TransactionId beginTransaction();
+    TransactionId beginReadOnlyTransaction();  // Snapshot reads only, cheaper: no read set, no commit timestamp
     bool commitTransaction(TransactionId txn_id);
     bool abortTransaction(TransactionId txn_id);
     bool isTransactionActive(TransactionId txn_id) const;
@@ -87,10 +165,24 @@ public:
     bool remove(TransactionId txn_id, const KeyType& key);
     std::shared_ptr<VersionedRecord<KeyType>> read(TransactionId txn_id, const KeyType& key);
     
-    // Version cleanup
+    /*
+     Before-images, for a store that keeps the current value of every key
+     itself and only needs old ones while transactions are looking (BTree
+     snapshots): the versions of a key, newest first, are what it was before
+     each change made since the oldest active snapshot began. A transaction
+     that reads nothing here sees the store's current value. A manager is
+     used either this way or with insert/update/remove, never both.
+    */
+    bool hasActiveTransactions() const { return active_count.load() > 0; }
+    void recordBeforeImage(const KeyType& key, const std::vector<uint8_t>* before);  // nullptr: key didn't exist
+    // The first key from `from` on (or back from it) that has versions, false if none
+    bool findVersionedKey(const KeyType& from, bool inclusive, bool forward, KeyType& key) const;
+
+    // Version cleanup, a bounded slice of the keys per call (see setCleanupSliceSize)
     size_t cleanupOldVersions();
     size_t cleanupAbortedTransactions();
     bool canCleanupVersion(const std::shared_ptr<VersionedRecord<KeyType>>& version) const;
+    CommitTimestamp lowWaterMark() const { return low_water_mark.load(); }
     
     // Statistics and monitoring
     struct VersionStats {
@@ -101,6 +193,8 @@ public:
         size_t cleaned_versions;
         double cleanup_efficiency;
         std::chrono::steady_clock::time_point last_cleanup_time;
+        CommitTimestamp low_water_mark;
+        size_t awaiting_reclaim;  // Unlinked, not freed yet
     };
     
     VersionStats getStats() const;
@@ -109,4 +203,5 @@ public:
     // Configuration
     void setRetentionPeriod(std::chrono::hours period);
     void setMaxVersionsPerKey(size_t max_versions);
+    void setCleanupSliceSize(size_t keys);
 };
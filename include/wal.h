@@ -2,10 +2,19 @@
 #include <fstream>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <atomic>
 #include <chrono>
 #include <string>
 #include <cstdint>
+#include <functional>
+#include <utility>
+#include <memory>
+#include <initializer_list>
+#include <unordered_set>
+#include <unordered_map>
+#include "page_id.h"
 
 enum class WALRecordType : uint8_t {
     INSERT = 1,
@@ -13,83 +22,260 @@ enum class WALRecordType : uint8_t {
     UPDATE = 3,
     CHECKPOINT = 4,
     COMMIT = 5,
-    ABORT = 6
+    ABORT = 6,
+    BULK_LOAD = 7,
+    INSERT_BATCH = 8,
+    CHECKPOINT_BEGIN = 9,
+    CHECKPOINT_END = 10,
+    UNDO = 11
 };
 
-struct WALRecordHeader {
+/*
+ On-disk record format. Every record is a fixed 8 byte frame header
+ followed by its body, integers in the body are LEB128 varints:
+    frame:  [u32 body size][u32 CRC32C of the body and the u64 start position]
+                                                       little endian
+    body:   type byte (low 7 bits WALRecordType, WAL_FLAG_PAGE_REDO)
+            transaction ID
+            page ID                                    only with WAL_FLAG_PAGE_REDO
+            INSERT/DELETE:  key size, key, data size, data
+            UPDATE:         key size, key, old size, old data, new size, new data
+            UNDO:           key size, key, 1 and data size, data (or 0 if the key wasn't there)
+            INSERT_BATCH:   entry count, then per entry key size, key, value size, value
+            BULK_LOAD:      root page ID, page count, key count
+            CHECKPOINT_BEGIN: transaction count, transaction IDs,
+                            page count, then per page its ID and rec LSN
+            CHECKPOINT_END: begin LSN, redo LSN
+            COMMIT/ABORT/CHECKPOINT: nothing more
+ Keys are stored with Codec. The LSN isn't stored at all, it is the end
+ position of the record in the log. Summing up the start position too
+ means a stale record left in a recycled segment file never checks out.
+*/
+constexpr size_t WAL_FRAME_HEADER_BYTES = 8;
+
+// Set on records that carry the page they changed (page-level redo), a
+// record without it is logical and gets redone by key
+constexpr uint8_t WAL_FLAG_PAGE_REDO = 0x80;
+
+// A record as it comes back out of the log
+template<typename KeyType>
+struct WALRecord {
     WALRecordType type;
-    uint32_t record_size;
-    uint64_t transaction_id;
-    uint64_t lsn;  // Log sequence number
-    uint32_t checksum;
-    std::chrono::steady_clock::time_point timestamp;
-    
-    WALRecordHeader(WALRecordType t, uint32_t size, uint64_t txn_id, uint64_t sequence_num)
-        : type(t), record_size(size), transaction_id(txn_id), lsn(sequence_num), 
-          checksum(0), timestamp(std::chrono::steady_clock::now()) {}
+    uint64_t lsn = 0;
+    uint64_t transaction_id = 0;
+    PageId page_id = 0;  // Non-zero only for page-level records
+    KeyType key{};
+    std::vector<uint8_t> old_data;  // DELETE, UPDATE and UNDO, for rollback
+    bool had_key = false;           // UNDO, false if the key wasn't there (old_data is empty)
+    std::vector<uint8_t> new_data;  // INSERT and UPDATE, redo
+    std::vector<std::pair<KeyType, std::vector<uint8_t>>> entries;  // INSERT_BATCH
+
+    // BULK_LOAD. The loaded pages are forced to the page file before
+    // this is logged, so the record only has to say what was loaded.
+    PageId root_page_id = 0;
+    uint64_t num_pages = 0;
+    uint64_t num_keys = 0;
+
+    // CHECKPOINT_BEGIN, what was going on when the checkpoint started
+    std::vector<uint64_t> active_transactions;
+    std::vector<std::pair<PageId, uint64_t>> dirty_pages;  // Page ID, rec LSN
+    // CHECKPOINT_END
+    uint64_t checkpoint_begin_lsn = 0;
+    uint64_t redo_lsn = 0;
 };
 
-// WAL record for data operations
-template<typename KeyType>
-struct WALDataRecord {
-    WALRecordHeader header;
-    uint16_t page_id;
-    KeyType key;
-    std::vector<uint8_t> old_data;  // For rollback
-    std::vector<uint8_t> new_data;  // Redo
-    
-    WALDataRecord(WALRecordType type, uint64_t txn_id, uint64_t lsn, 
-                  uint16_t pid, const KeyType& k)
-        : header(type, sizeof(WALDataRecord), txn_id, lsn), 
-          page_id(pid), key(k) {}
+// A piece of a record body handed to the log
+struct WALBytes {
+    const uint8_t* data;
+    size_t size;
 };
 
-// WAL manager class
+// What WALManager::recover found in the log and did with it
+struct RecoveryStats {
+    uint64_t redo_lsn = 0;        // Where analysis and redo started
+    uint64_t end_lsn = 0;         // End of the intact log
+    size_t committed = 0;         // Transactions that committed after redo_lsn
+    size_t redone = 0;            // Changes handed to apply, a batch counts once per entry
+    size_t skipped = 0;           // Changes of transactions that never committed
+    size_t undone = 0;            // UNDO records applied, of transactions that never committed
+    size_t bulk_loads = 0;        // BULK_LOAD records, their pages aren't in the log
+    size_t threads = 0;
+};
+
+/*
+ Group commit knobs. The flusher writes and fdatasyncs everything buffered
+ as soon as it is idle and a commit is waiting. A non-zero max_delay makes
+ it wait up to that long after the first waiting commit, or until max_batch
+ commits are waiting, so more commits share one fdatasync.
+*/
+struct GroupCommitOptions {
+    std::chrono::microseconds max_delay{0};
+    size_t max_batch = 64;
+};
+
+/*
+ Log buffer geometry. Records are copied into a pre-allocated ring of
+ WAL_LOG_BUFFER_BYTES, a record can't be bigger than the whole ring.
+ Each thread appending a record holds one of WAL_INSERT_SLOTS slots while
+ it copies, so the flusher can tell which bytes are still being filled in.
+*/
+constexpr size_t WAL_LOG_BUFFER_BYTES = 4 * 1024 * 1024;
+constexpr size_t WAL_INSERT_SLOTS = 64;
+
+/*
+ Segment files. The log is cut into files of a fixed size, named after the
+ WAL path plus the segment number (btree.wal.0000000000000003 holds log
+ positions [3 * size, 4 * size)). Files are preallocated when they are
+ created, and a record never crosses into the next file: one that doesn't
+ fit leaves a pad marker (an empty frame) and starts the next segment.
+ Segments that are wholly before the last checkpoint can be truncated,
+ up to WAL_SPARE_SEGMENTS of them are kept and renamed for reuse.
+*/
+constexpr size_t WAL_SEGMENT_FILE_BYTES = 16 * 1024 * 1024;
+constexpr size_t WAL_MIN_SEGMENT_FILE_BYTES = 64 * 1024;
+constexpr size_t WAL_SPARE_SEGMENTS = 2;
+
+/*
+ WAL manager class. An LSN is a byte position in the log: a record's LSN is
+ the position right after its last byte, so "durable up to LSN x" means
+ every byte before x is on disk. Appending a record is lock-free, a single
+ fetch_add on next_lsn reserves its bytes (and assigns its LSN), and every
+ thread copies its record into the ring in parallel (a CAS instead when
+ the record has to skip to the next segment file).
+*/
 template<typename KeyType>
 class WALManager {
 private:
-    std::string wal_file_path;
-    std::ofstream wal_file;
+    std::string wal_file_path;  // Segment files are this plus a number
     std::mutex wal_mutex;
     
-    std::atomic<uint64_t> next_lsn;
+    // Segment files, segment_mutex guards the numbers and the files themselves
+    size_t segment_size;
+    size_t max_record_bytes;       // A record has to fit in the ring and in one segment
+    std::mutex segment_mutex;
+    uint64_t first_segment;        // Oldest segment still on disk
+    uint64_t end_segment;          // One past the newest file, spares included
+    std::atomic<size_t> segment_files;
+    std::atomic<uint64_t> log_start_lsn;  // Nothing before here is kept
+    int segment_fd;                // Only the flusher thread writes, to this file
+    uint64_t open_segment;
+    
+    std::atomic<uint64_t> next_lsn;  // End of the reserved log, the next record starts here
     std::atomic<uint64_t> next_transaction_id;
-    std::atomic<uint64_t> last_checkpoint_lsn;
+    std::atomic<uint64_t> last_checkpoint_lsn;  // Redo point of the last complete checkpoint
+    std::atomic<uint64_t> retain_lsn;           // A saved page table redoes from here, see retainFrom
+    std::mutex transaction_mutex;
+    std::unordered_map<uint64_t, uint64_t> active_transactions;  // Begun, not committed or aborted yet, to
+                                                                 // the LSN each began at
     
-    // Need buffer for batching writes
-    std::vector<uint8_t> write_buffer;
-    size_t buffer_size_limit;
+    // Ring of log segments, byte position p lives at log_buffer[p % WAL_LOG_BUFFER_BYTES]
+    std::unique_ptr<uint8_t[]> log_buffer;
+    size_t buffer_size_limit;  // Wake the flusher once this many bytes are waiting
+    // Start position of the record each slot is copying, SLOT_IDLE when free
+    std::atomic<uint64_t> insert_slots[WAL_INSERT_SLOTS];
+
+    // Group commit, everything below is guarded by wal_mutex except the atomics
+    GroupCommitOptions group_commit;
+    std::thread flusher_thread;
+    std::condition_variable flush_cv;    // Wakes the flusher
+    std::condition_variable durable_cv;  // Wakes threads waiting for their LSN to be durable
+    std::atomic<uint64_t> durable_lsn;   // Everything up to here is on disk
+    uint64_t wanted_lsn;                 // Highest LSN someone is waiting on
+    size_t pending_commits;
+    std::chrono::steady_clock::time_point first_pending_commit;
+    std::atomic<bool> flush_requested;
+    bool stop_flusher;
+    std::string flush_error;  // Set if a write or fdatasync failed, the WAL can't continue
+    std::atomic<bool> flush_failed;
     
-    uint32_t calculateChecksum(const void* data, size_t size);
-    void flushBuffer();
+    uint32_t calculateChecksum(uint32_t crc, const void* data, size_t size);
+    uint64_t appendRecord(std::initializer_list<WALBytes> body);
+    bool decodeRecord(const uint8_t* body, size_t size, WALRecord<KeyType>& record);
+    uint64_t recoverLogEnd();
+    std::atomic<uint64_t>& claimInsertSlot();
+    void copyToBuffer(uint64_t position, const uint8_t* bytes, size_t size);
+    void requestFlush();
+    uint64_t filledLSN();
+    void waitDurable(std::unique_lock<std::mutex>& lock, uint64_t lsn, bool force);
+    void flusherLoop();
+    void writeRange(uint64_t from, uint64_t to);
+    std::string segmentPath(uint64_t segment) const;
+    int openSegment(uint64_t segment);
+    void findSegments();
+    void clearSegment(const std::string& path, uint64_t keep);
+    void clearSegmentsFrom(uint64_t position);
+    void syncDirectory();
     
 public:
-    WALManager(const std::string& wal_path, size_t buffer_limit = 4096);
+    WALManager(const std::string& wal_path, size_t buffer_limit = 4096,
+               GroupCommitOptions options = GroupCommitOptions(),
+               size_t segment_bytes = WAL_SEGMENT_FILE_BYTES);
     ~WALManager();
     
     uint64_t beginTransaction();
     void commitTransaction(uint64_t txn_id);
     void abortTransaction(uint64_t txn_id);
     
-    // Data operation logging
-    uint64_t logInsert(uint64_t txn_id, uint16_t page_id, const KeyType& key, 
+    // Data operation logging. A page_id of 0 logs the change logically (redone
+    // by key), anything else marks it as a change to that page
+    uint64_t logInsert(uint64_t txn_id, PageId page_id, const KeyType& key, 
                        const std::vector<uint8_t>& data);
-    uint64_t logDelete(uint64_t txn_id, uint16_t page_id, const KeyType& key, 
+    uint64_t logDelete(uint64_t txn_id, PageId page_id, const KeyType& key, 
                        const std::vector<uint8_t>& old_data);
-    uint64_t logUpdate(uint64_t txn_id, uint16_t page_id, const KeyType& key,
+    uint64_t logUpdate(uint64_t txn_id, PageId page_id, const KeyType& key,
                        const std::vector<uint8_t>& old_data, 
                        const std::vector<uint8_t>& new_data);
+    uint64_t logInsertBatch(uint64_t txn_id,
+                            const std::vector<std::pair<KeyType, std::vector<uint8_t>>>& entries);
+    uint64_t logBulkLoad(uint64_t txn_id, PageId root_page_id, uint64_t num_pages, uint64_t num_keys);
+    // What key held before the still open txn_id changed it, nullptr if it wasn't there. Logged when
+    // pages holding the change are saved, so a restart can put it back (see recover)
+    uint64_t logUndo(uint64_t txn_id, const KeyType& key, const std::vector<uint8_t>* old_data);
     
-    // Checkpoint management
+    // Checkpoint management. writeCheckpoint is a sharp checkpoint, every
+    // page must have been flushed already. A fuzzy checkpoint logs its begin
+    // with the dirty page table (page ID, rec LSN), flushes those pages while
+    // work goes on, and then logs its end with the LSN redo has to start at.
     uint64_t writeCheckpoint();
+    uint64_t beginCheckpoint(const std::vector<std::pair<PageId, uint64_t>>& dirty_pages);
+    uint64_t endCheckpoint(uint64_t begin_lsn, uint64_t redo_lsn);  // Returns once it is durable
     uint64_t getLastCheckpointLSN() const { return last_checkpoint_lsn.load(); }
+    // Where the oldest transaction still running began (the current LSN if none is), every
+    // record of a running transaction is at or after it
+    uint64_t oldestActiveLSN();
     
     // Recovery operations
+    struct RedoHandlers {
+        std::function<void(PageId, const KeyType&, const std::vector<uint8_t>&)> on_insert;
+        std::function<void(PageId, const KeyType&, const std::vector<uint8_t>&)> on_delete;
+        std::function<void(PageId, const KeyType&, const std::vector<uint8_t>&,
+                           const std::vector<uint8_t>&)> on_update;
+    };
+    // Visit every intact record with an LSN at or after from_lsn, in log order.
+    // Stops at the first torn or corrupt record and returns where the log ends.
+    uint64_t readRecords(uint64_t from_lsn, const std::function<void(const WALRecord<KeyType>&)>& visit);
     void replay(uint64_t from_lsn = 0);
+    void replay(uint64_t from_lsn, const RedoHandlers& handlers);
+
+    // Crash recovery from from_lsn. An analysis pass finds the transactions
+    // that committed, then their INSERT/DELETE/UPDATE changes, and the UNDO
+    // records of the others, are handed to apply on num_threads workers
+    // (0 = one per core). Changes are split by page ID, or by key for logical
+    // records, and each worker applies its share in log order. Batches
+    // arrive as one INSERT per entry.
+    RecoveryStats recover(uint64_t from_lsn, size_t num_threads,
+                          const std::function<void(const WALRecord<KeyType>&)>& apply);
+    // Drop the segment files that lie wholly before up_to_lsn, the last
+    // checkpoint, the retained LSN and the durable LSN, whichever comes first
     void truncate(uint64_t up_to_lsn);
+    // Recovery of a saved page table starts at lsn (see BTree::checkpoint), keep the records from there
+    void retainFrom(uint64_t lsn) { retain_lsn.store(lsn); }
     
     // Utility
     void sync();  // Force write to disk
     uint64_t getCurrentLSN() const { return next_lsn.load(); }
-    size_t getWALSize() const;
+    uint64_t getDurableLSN() const { return durable_lsn.load(); }
+    uint64_t getLogStartLSN() const { return log_start_lsn.load(); }
+    size_t getWALSize() const { return next_lsn.load() - log_start_lsn.load(); }  // Log bytes kept
+    size_t getWALDiskSize() const { return segment_files.load() * segment_size; }
 };
@@ -1,62 +1,97 @@
 #pragma once
-#include <queue>
+#include <deque>
+#include <unordered_map>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <exception>
 #include "page_manager.h"
 #include "content_storage.h"
 #include "page_cache.h"
 
 template <typename KeyType>
 struct WriteRequest {
-    uint16_t page_id;
+    PageId page_id;
     std::shared_ptr<Page<KeyType>> page;
-    std::chrono::steady_clock::time_point timestamp;
-    
-    WriteRequest(uint16_t id, std::shared_ptr<Page<KeyType>> p) 
+    std::chrono::steady_clock::time_point timestamp;  // When the page was first queued
+
+    WriteRequest(PageId id, std::shared_ptr<Page<KeyType>> p)
         : page_id(id), page(p), timestamp(std::chrono::steady_clock::now()) {}
 };
 
+/*
+ Pages waiting to be written, coalesced per page: a page that is queued
+ again before a writer got to it keeps its one entry (and its place in
+ line), pointing at the latest page object, so a hot page is written once
+ per round instead of once per modification. Writers snapshot the page
+ when they store it, so whatever they write is its newest state.
+ Nothing is ever dropped. Once max_queue pages are waiting, throttle()
+ blocks the threads producing more until the writers catch up. enqueueWrite
+ itself never blocks, the tree calls it with page latches held, which the
+ writers may need to make progress.
+ A page that fails to store is queued again (unless a newer request for it
+ came in meanwhile) and its writer backs off for a while. The error is
+ kept for waitForEmpty to throw. Once stopping, failed pages are left
+ dirty in the cache for flushAll instead.
+*/
 template <typename KeyType>
 class WriterQueue {
 private:
-    // Queue
-    std::queue<WriteRequest<KeyType>> write_queue;
-    std::mutex queue_mutex;
-    std::condition_variable queue_cv;
-    std::condition_variable empty_cv;
-    
+    // Pending writes, one per page, in the order the pages were first queued
+    std::unordered_map<PageId, WriteRequest<KeyType>> pending;
+    std::deque<PageId> pending_order;
+    size_t in_flight = 0;  // Taken by a writer, not stored yet
+    mutable std::mutex queue_mutex;
+    std::condition_variable queue_cv;   // Work is waiting, or stopping
+    std::condition_variable space_cv;   // Below max_queue_size again
+    std::condition_variable empty_cv;   // Nothing pending or in flight, or a write failed
+    std::exception_ptr write_error;     // First failure since waitForEmpty last threw
+
     // Thread
     std::vector<std::thread> writer_threads;
     std::atomic<bool> running;
     size_t num_writer_threads;
-    
+
     // References to other components
     ContentStorage<KeyType>* content_storage;
     PageCache<KeyType>* page_cache;
-    
+
     // Configuration
     size_t max_queue_size;
-    std::chrono::milliseconds batch_timeout;
-    
+    size_t max_batch_size;
+
+    // Statistics
+    std::atomic<size_t> pages_queued{0};
+    std::atomic<size_t> writes_coalesced{0};
+    std::atomic<size_t> pages_written{0};
+    std::atomic<size_t> batches_written{0};
+    std::atomic<size_t> throttle_waits{0};
+    std::atomic<size_t> write_failures{0};
+
     // Worker thread function
     void writerWorker(int worker_id);
-    
+
     // Batch processing
-    std::vector<WriteRequest<KeyType>> getBatch(size_t max_batch_size);
-    void processBatch(const std::vector<WriteRequest<KeyType>>& batch, int worker_id);
-    
+    std::vector<WriteRequest<KeyType>> getBatch();
+    bool processBatch(const std::vector<WriteRequest<KeyType>>& batch, int worker_id, AlignedPageBuffer& images);
+    void requeueFailed(const std::vector<WriteRequest<KeyType>>& batch, const std::vector<size_t>& failed,
+                       std::exception_ptr error);
+
 public:
-    WriterQueue(ContentStorage<KeyType>* storage, PageCache<KeyType>* cache, 
-                size_t num_threads = 2, size_t max_queue = 1000);
+    WriterQueue(ContentStorage<KeyType>* storage, PageCache<KeyType>* cache,
+                size_t num_threads = 2, size_t max_queue = 1000, size_t max_batch = 64);
     ~WriterQueue();
-    
-    // Queue operations
-    bool enqueueWrite(uint16_t page_id, std::shared_ptr<Page<KeyType>> page);
+
+    // Queue operations, true if the page wasn't queued yet (false: merged into its pending write)
+    bool enqueueWrite(PageId page_id, std::shared_ptr<Page<KeyType>> page);
+    void throttle();  // Blocks while the queue is full, call without holding page latches
     void start();
     void stop();
-    void waitForEmpty();
+    void waitForEmpty();  // Until every queued page has been stored, throws if one failed
+
+    size_t pendingWrites() const;
+    void printStats() const;
 };
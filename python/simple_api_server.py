@@ -4,6 +4,7 @@ Simple FastAPI server for demonstration
 """
 import asyncio
 import logging
+import os
 from typing import Optional, Dict, Any
 import uvicorn
 from fastapi import FastAPI, HTTPException
@@ -26,6 +27,9 @@ db_health_status = Gauge('db_health_status', 'Database health status (1=healthy,
 db_total_keys = Gauge('db_total_keys', 'Total number of keys in database')
 db_memory_usage = Gauge('db_memory_usage_bytes', 'Memory usage in bytes')
 
+# Engine metrics, the Prometheus text file the HealthMonitor writes on every check
+ENGINE_METRICS_FILE = os.environ.get("BTREE_METRICS_FILE", "btree_metrics.prom")
+
 # FastAPI app
 app = FastAPI(
     title="Custom Database Engine API",
@@ -211,8 +215,14 @@ async def clear_demo_data():
 
 @app.get("/metrics")
 async def get_metrics():
-    """Prometheus metrics endpoint"""
-    return Response(generate_latest(), media_type=CONTENT_TYPE_LATEST)
+    """Prometheus metrics endpoint, with the engine's metrics appended when they are exported"""
+    body = generate_latest()
+    try:
+        with open(ENGINE_METRICS_FILE, "rb") as f:
+            body += f.read()
+    except FileNotFoundError:
+        pass
+    return Response(body, media_type=CONTENT_TYPE_LATEST)
 
 if __name__ == "__main__":
     print("Starting FastAPI Database Server (Demo Mode)")
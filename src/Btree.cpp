@@ -1,64 +1,214 @@
 #include "btree.h"
 #include "fraction.h"
+#include "log.h"
+#include "metrics.h"
 #include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+/*
+ A WAL LSN at or before the records of the tree operation the calling thread
+ is running, so every page it dirties only needs redo from there. The cache
+ keeps it as the page's rec LSN for fuzzy checkpoints. Outside of an
+ operation it is 0, which means redo from the start of the log.
+*/
+static thread_local uint64_t operation_lsn = 0;
+
+struct OperationLSNScope {
+    uint64_t previous;
+    explicit OperationLSNScope(uint64_t lsn) : previous(operation_lsn) { operation_lsn = lsn; }
+    ~OperationLSNScope() { operation_lsn = previous; }
+};
 
 /*
  BTree Constructor Implementation, that initializes storage,
  cache, writer queue, and WAL manager.
-
- TODO: add mutexes for thread safety
  */
 template <typename KeyType, typename ValueType>
-BTree<KeyType, ValueType>::BTree(int maxKeys) 
-    : maxKeysPerNode(maxKeys), 
-      page_cache(&content_storage, 50),
+BTree<KeyType, ValueType>::BTree(int maxKeys, const BTreeOptions& options)
+    : maxKeysPerNode(maxKeys),
+      content_storage(options.page_file_path, options.recover_from_wal),
+      page_cache(&content_storage, options.cache_pages),
       // Use 2 threads for writer queue for better throughput
       writer_queue(&content_storage, &page_cache, 2),
-      // Just make the WAL file "btree.wal" with 8KB pages, can change
-      wal_manager("btree.wal", 8192),
-      current_transaction(0) {
-    
+      wal_manager(options.wal_path, 8192),
+      current_transaction(0),
+      recovering(false),
+      // Before-images are only kept while a snapshot can still see them
+      version_manager(std::chrono::hours(0)) {
+
     writer_queue.start();
-    
+
     // Start first transaction
     current_transaction = wal_manager.beginTransaction();
-    
-    // Initially, the tree is empty, so we create a root node
-    // and mark it as a leaf (all data starts at the leaf level in B+ Trees)
-    uint16_t root_id = content_storage.storePage(createPage<KeyType>(true));
-    root = page_cache.getPage(root_id);
+
+    PageId saved_root;
+    uint64_t redo_lsn;
+    if (content_storage.loadedState(saved_root, redo_lsn)) {
+        // Pick up where the page table was last saved, and redo what committed since
+        root = page_cache.getPage(saved_root);
+        if (!root) {
+            throw std::runtime_error("BTree: the saved root page " + std::to_string(saved_root) +
+                                     " can't be read from " + options.page_file_path);
+        }
+        recoverFromWAL(redo_lsn);
+    } else {
+        if (options.recover_from_wal) {
+            LOG_WARN("BTree: No page table was saved for " << options.page_file_path
+                     << ", nothing to recover, starting empty");
+        }
+        // Initially, the tree is empty, so we create a root node
+        // and mark it as a leaf (all data starts at the leaf level in B+ Trees)
+        root = createNode(true);
+        markPageDirty(root);
+    }
+
+    // From here on a restart finds this tree, not whatever the page table held before
+    saveState();
 }
 
 /*
- BTree destructor to stop writer queue, sync WAL file and flush pending writes.
+ Redo the committed changes in the WAL since the page table was saved, in
+ parallel, on top of the pages it points at, and undo what the saved pages
+ hold of transactions that never committed. Records are logical, so they
+ are split up by key, and applying them doesn't log anything new.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::recoverFromWAL(uint64_t from_lsn) {
+    recovering = true;
+    RecoveryStats stats = wal_manager.recover(from_lsn, 0, [this](const WALRecord<KeyType>& record) {
+        OperationLSNScope operation(record.lsn);
+        if (record.type == WALRecordType::DELETE || (record.type == WALRecordType::UNDO && !record.had_key)) {
+            eraseKey(record.key);
+            return;
+        }
+        if (record.type == WALRecordType::UNDO) {
+            insertKey(record.key, record.old_data);
+            return;
+        }
+        // A value of another type (a tree sharing the WAL file) can't be ours
+        if (std::is_trivially_copyable<ValueType>::value && record.new_data.size() != sizeof(ValueType)) {
+            return;
+        }
+        insertKey(record.key, record.new_data);
+    });
+    recovering = false;
+
+    if (stats.bulk_loads > 0) {
+        LOG_WARN("BTree: " << stats.bulk_loads << " bulk loads in the WAL can't be recovered, "
+                 << "the run crashed before their pages made it into the page table");
+    }
+    if (stats.redone > 0 || stats.undone > 0) {
+        LOG_INFO("BTree: Recovered " << stats.redone << " changes from the WAL, undid " << stats.undone
+                 << " of transactions that never committed");
+    }
+}
+
+/*
+ BTree destructor to stop writer queue, write every page and save the
+ page table, and sync the WAL. A failure is only logged: the WAL still
+ has the committed changes, and the next run recovers them.
 */
 template <typename KeyType, typename ValueType>
 BTree<KeyType, ValueType>::~BTree() {
     if (current_transaction != 0) {
         wal_manager.commitTransaction(current_transaction);
+        current_transaction = 0;
     }
-    
+
     writer_queue.stop();
-    page_cache.flushAll();
+    try {
+        saveState();
+    } catch (const std::exception& e) {
+        LOG_ERROR("BTree: Failed to save the tree on close: " << e.what());
+    }
     wal_manager.sync();
 }
 
 /*
- Flush pending writes if needed.
+ Flush pending writes, and save the page table so they survive a restart.
 */
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::flush() {
+    checkpoint();
+}
+
+/*
+ Write every dirty page and save the page table with the current root. A
+ tree reopened with recover_from_wal starts from the pages as they are now
+ and redoes the WAL from the returned LSN. Holds off writes meanwhile, so
+ no split or merge is saved halfway.
+*/
+template <typename KeyType, typename ValueType>
+uint64_t BTree<KeyType, ValueType>::checkpoint() {
+    std::unique_lock<std::shared_mutex> gate(snapshot_gate);
     writer_queue.waitForEmpty();
+    return saveState();
+}
+
+/*
+ The work of checkpoint, the caller keeps writes out. The pages also hold
+ the changes of the transaction still open, so what its keys held before
+ goes into the log first, a restart puts that back unless it commits. The
+ log is durable past all of it before the page table is saved.
+*/
+template <typename KeyType, typename ValueType>
+uint64_t BTree<KeyType, ValueType>::saveState() {
     page_cache.flushAll();
+    // Every change logged so far is in the pages we just wrote
+    uint64_t redo_lsn = wal_manager.getCurrentLSN();
+    {
+        std::lock_guard<std::mutex> lock(transaction_mutex);
+        std::lock_guard<std::mutex> undo_lock(undo_mutex);
+        if (current_transaction != 0) {
+            for (const auto& image : undo_images) {
+                wal_manager.logUndo(current_transaction, image.first, image.second ? &*image.second : nullptr);
+            }
+        }
+    }
+    wal_manager.sync();
+    PageId root_page_id;
+    {
+        std::shared_lock<std::shared_mutex> root_lock(root_latch);
+        root_page_id = root->header.page_id;
+    }
+    content_storage.savePageTable(root_page_id, redo_lsn);
+    wal_manager.retainFrom(redo_lsn);
+    return redo_lsn;
+}
+
+/*
+ Checkpoint, then copy every page into a snapshot file that ReadOnlyBTree
+ maps. Writes are held off until the copy is done, like for checkpoint, so
+ no split or merge ends up in the snapshot halfway. Returns the number of
+ pages exported.
+*/
+template <typename KeyType, typename ValueType>
+size_t BTree<KeyType, ValueType>::exportSnapshot(const std::string& path) {
+    std::unique_lock<std::shared_mutex> gate(snapshot_gate);
+    writer_queue.waitForEmpty();
+    saveState();
+    PageId root_page_id;
+    {
+        std::shared_lock<std::shared_mutex> root_lock(root_latch);
+        root_page_id = root->header.page_id;
+    }
+    return content_storage.exportSnapshot(path, root_page_id);
 }
 
 /*
- Transaction management methods.
+ Transaction management methods. All threads share the current
+ transaction, transaction_mutex keeps begin/commit from racing.
 */
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::beginTransaction() {
+    std::lock_guard<std::mutex> lock(transaction_mutex);
     if (current_transaction != 0) {
         wal_manager.commitTransaction(current_transaction);
+        clearUndoImages();
     }
     current_transaction = wal_manager.beginTransaction();
 }
@@ -68,22 +218,237 @@ void BTree<KeyType, ValueType>::beginTransaction() {
 */
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::commitTransaction() {
+    std::lock_guard<std::mutex> lock(transaction_mutex);
     // First make sure there is an actual active transaction
     if (current_transaction != 0) {
         wal_manager.commitTransaction(current_transaction);
+        clearUndoImages();
         current_transaction = 0;
     }
 }
 
 /*
- Use the WAL manager to abort a transaction in case of errors.
+ Roll the current transaction back and log its abort. Every key it changed
+ gets back what it held before, as ordinary logged changes of the
+ transaction, so a checkpoint taken meanwhile stays correct too. Writes
+ running meanwhile would be rolled back with it, or not at all.
 */
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::abortTransaction() {
-    if (current_transaction != 0) {
-        wal_manager.abortTransaction(current_transaction);
-        current_transaction = 0;
+    // Writes take the gate before transaction_mutex, so do we
+    std::shared_lock<std::shared_mutex> gate(snapshot_gate);
+    std::lock_guard<std::mutex> lock(transaction_mutex);
+    if (current_transaction == 0) {
+        return;
+    }
+    std::unordered_map<KeyType, std::optional<std::vector<uint8_t>>> images;
+    {
+        std::lock_guard<std::mutex> undo_lock(undo_mutex);
+        images = undo_images;
+    }
+    for (const auto& image : images) {
+        OperationLSNScope operation(wal_manager.getCurrentLSN());
+        if (image.second) {
+            wal_manager.logInsert(current_transaction, 0, image.first, *image.second);
+            insertKey(image.first, *image.second);
+        } else {
+            wal_manager.logDelete(current_transaction, 0, image.first, std::vector<uint8_t>());
+            eraseKey(image.first);
+        }
+    }
+    wal_manager.abortTransaction(current_transaction);
+    clearUndoImages();
+    current_transaction = 0;
+}
+
+// The current transaction is done, forget what it changed
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::clearUndoImages() {
+    std::lock_guard<std::mutex> undo_lock(undo_mutex);
+    undo_images.clear();
+}
+
+// Ensure we have an active transaction, otherwise make one
+template <typename KeyType, typename ValueType>
+uint64_t BTree<KeyType, ValueType>::activeTransaction() {
+    std::lock_guard<std::mutex> lock(transaction_mutex);
+    if (current_transaction == 0) {
+        current_transaction = wal_manager.beginTransaction();
+    }
+    return current_transaction;
+}
+
+/*
+ Create a brand new node. It gets a page ID and a buffer pool frame right
+ away, and becomes dirty with its first markPageDirty, the writer queue
+ stores it in the background along with every other modified page.
+*/
+template <typename KeyType, typename ValueType>
+std::shared_ptr<Page<KeyType>> BTree<KeyType, ValueType>::createNode(bool is_leaf) {
+    return page_cache.newPage(content_storage.allocatePageId(), is_leaf);
+}
+
+// A node only the caller sees, like createNode but on the heap and not cached (bulk loads)
+template <typename KeyType, typename ValueType>
+std::shared_ptr<Page<KeyType>> BTree<KeyType, ValueType>::createDetachedNode(bool is_leaf) {
+    auto node = std::make_shared<Page<KeyType>>(createPage<KeyType>(is_leaf));
+    node->header.page_id = content_storage.allocatePageId();
+    return node;
+}
+
+/*
+ After modifying a page in place, mark it dirty in the cache (or put it back
+ if it was evicted in the meantime) and hand the same shared_ptr to the writer
+ queue. Nothing is copied here, the writer snapshots the page when it flushes.
+ Our shared_ptr pins the page, the cache never evicts it while we hold it, so
+ this may be called with latches held. The writer just waits for them.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::markPageDirty(const std::shared_ptr<Page<KeyType>>& page) {
+    // No need to invalidate its content hash: PageWriteGuard did, and pages modified without
+    // one are new and were never hashed. Doing it here, maybe unlatched, would race with writers
+    PageId page_id = page->header.page_id;
+    if (!page_cache.markDirty(page_id, operation_lsn)) {
+        page_cache.putPage(page_id, page, operation_lsn);
+    }
+    writer_queue.enqueueWrite(page_id, page);
+}
+
+/*
+ Put a key into a leaf the caller holds exclusively, an existing key
+ just gets its value replaced.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::upsertIntoLeaf(Page<KeyType>& leaf, const KeyType& key, const uint8_t* value, size_t len) {
+    // Find the sorted position for the new key
+    size_t pos = KeySearch<KeyType>::lowerBound(leaf.keys, key);
+
+    if (pos < leaf.keys.size() && leaf.keys[pos] == key) {
+        // Key already exists, replace its value
+        leaf.eraseValue(pos);
+    } else {
+        leaf.keys.insert(leaf.keys.begin() + pos, key);
+    }
+    // Insert the value slot at the same position so keys and values stay aligned
+    leaf.insertValue(pos, value, len);
+}
+
+/*
+ Called with the leaf held exclusively, right before key changes in it.
+ Keep what the key holds now (or that it isn't there) for the current
+ transaction, if it is the first change to key in it, and for the open
+ snapshots if there are any. The caller holds snapshot_gate shared, so no
+ snapshot begins or ends until its whole operation is done: every key it
+ changes gets the answer its first one got.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::saveBeforeImage(const Page<KeyType>& leaf, const KeyType& key) {
+    bool snapshots = version_manager.hasActiveTransactions();
+    if (recovering && !snapshots) {
+        return;
+    }
+    size_t pos = KeySearch<KeyType>::lowerBound(leaf.keys, key);
+    std::optional<std::vector<uint8_t>> before;
+    if (pos < leaf.keys.size() && leaf.keys[pos] == key) {
+        ByteView bytes = leaf.valueAt(pos);
+        before.emplace(bytes.data, bytes.data + bytes.size);
+    }
+    if (snapshots) {
+        version_manager.recordBeforeImage(key, before ? &*before : nullptr);
+    }
+    if (!recovering) {
+        std::lock_guard<std::mutex> undo_lock(undo_mutex);
+        undo_images.try_emplace(key, std::move(before));
+    }
+}
+
+/*
+ Reject a key or value too big for the tree before anything is logged.
+ Keys are capped at MAX_KEY_BYTES and a whole cell at MAX_CELL_BYTES, so a
+ leaf split by bytes always has room for the cell that caused it.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::checkEntrySize(const KeyType& key, size_t len) {
+    if (Codec<KeyType>::encodedSize(key) > MAX_KEY_BYTES) {
+        throw std::length_error("key is longer than " + std::to_string(MAX_KEY_BYTES) + " bytes");
+    }
+    if (cellBytes(key, len) > MAX_CELL_BYTES) {
+        throw std::length_error("key and value take more than " + std::to_string(MAX_CELL_BYTES) +
+                                " bytes, they don't fit in half a page");
+    }
+}
+
+/*
+ Whether node has to split before key goes in. A leaf needs room for the
+ key (unless it already has it) and for its value, an internal node for
+ one more separator of any size.
+*/
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::needsSplit(const Page<KeyType>& node, const KeyType& key, size_t len) const {
+    size_t max_keys = static_cast<size_t>(maxKeysPerNode);
+    if (!node.is_leaf) {
+        return node.keys.size() >= max_keys ||
+               pageImageBytes(node) + maxSeparatorBytes<KeyType>() > PAGE_SIZE_BYTES;
     }
+    size_t pos = KeySearch<KeyType>::lowerBound(node.keys, key);
+    size_t bytes = pageImageBytes(node) + len;
+    if (pos < node.keys.size() && node.keys[pos] == key) {
+        bytes -= node.slot_directory[pos].length;
+    } else if (node.keys.size() >= max_keys) {
+        return true;
+    } else {
+        bytes += cellBytes(key, 0);
+    }
+    return bytes > PAGE_SIZE_BYTES;
+}
+
+// Too few keys, and less than half a page of them
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::isUnderfull(const Page<KeyType>& node) const {
+    return node.keys.size() < minKeys() && pageImageBytes(node) < PAGE_SIZE_BYTES / 2;
+}
+
+// Whether node stays filled without one of its cells, bytes long
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::canLose(const Page<KeyType>& node, size_t bytes) const {
+    return node.keys.size() > minKeys() || pageImageBytes(node) >= PAGE_SIZE_BYTES / 2 + bytes;
+}
+
+/*
+ Whether sibling can give child its edge key through parent->keys[separator]:
+ sibling stays filled, and child and parent still fit their pages (the
+ separator is replaced by a key of another length).
+*/
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::canBorrow(const Page<KeyType>& parent, size_t separator, const Page<KeyType>& sibling,
+                                          const Page<KeyType>& child, bool from_left) const {
+    if (sibling.keys.empty()) {
+        return false;
+    }
+    size_t edge = from_left ? sibling.keys.size() - 1 : 0;
+    size_t payload = child.is_leaf ? sibling.slot_directory[edge].length : sizeof(PageId);
+    if (!canLose(sibling, cellBytes(sibling.keys[edge], payload))) {
+        return false;
+    }
+    // A leaf gets the key itself, an internal node the separator above it
+    const KeyType& moved = child.is_leaf ? sibling.keys[edge] : parent.keys[separator];
+    const KeyType& new_separator = child.is_leaf && !from_left ? sibling.keys[1] : sibling.keys[edge];
+    size_t parent_bytes = pageImageBytes(parent) - Codec<KeyType>::encodedSize(parent.keys[separator]) +
+                          Codec<KeyType>::encodedSize(new_separator);
+    return pageImageBytes(child) + cellBytes(moved, payload) <= PAGE_SIZE_BYTES && parent_bytes <= PAGE_SIZE_BYTES;
+}
+
+// Whether right fits into left, along with parent->keys[separator] if they are internal
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::canMerge(const Page<KeyType>& parent, size_t separator, const Page<KeyType>& left,
+                                         const Page<KeyType>& right) const {
+    size_t keys = left.keys.size() + right.keys.size();
+    size_t bytes = pageImageBytes(left) + pageImageBytes(right) - sizeof(PageImageHeader);
+    if (!left.is_leaf) {
+        keys++;
+        bytes += cellBytes(parent.keys[separator], sizeof(PageId));
+    }
+    return keys <= static_cast<size_t>(maxKeysPerNode) && bytes <= PAGE_SIZE_BYTES;
 }
 
 /*
@@ -94,310 +459,625 @@ void BTree<KeyType, ValueType>::abortTransaction() {
 */
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::insert(const KeyType& key, const ValueType& value) {
-    // Ensure we have an active transaction, otherwise make one
-    if (current_transaction == 0) {
-        current_transaction = wal_manager.beginTransaction();
-    }
-    
     // Serialize the value for WAL logging because we need to store it
     std::vector<uint8_t> serialized_value;
-    // Serialize the value to binary data
-    const uint8_t* value_bytes = reinterpret_cast<const uint8_t*>(&value);
-    serialized_value.assign(value_bytes, value_bytes + sizeof(ValueType));
-    
-    if (!root) {
-        // Create new root if the tree is empty using content storage
-        uint16_t root_id = content_storage.storePage(createPage<KeyType>(true));
-        // Then assign the root from the page cache
-        root = page_cache.getPage(root_id);
-        wal_manager.logInsert(current_transaction, root_id, key, serialized_value);
-        
-    } else if (root->keys.size() == maxKeysPerNode) { // If root is full, need to split
-        Page<KeyType> new_root_page = createPage<KeyType>(false);
-        new_root_page.children.push_back(root->header.page_id); // Page ID of the old root
-        // Split the old root and move a key up to the new root, use shared_ptr because of cache
-        splitChild(std::make_shared<Page<KeyType>>(new_root_page), 0, root);
-        
-        // Store the new root using cache and writer queue
-        page_cache.putPage(new_root_page.header.page_id, std::make_shared<Page<KeyType>>(new_root_page));
-        writer_queue.enqueueWrite(new_root_page.header.page_id, std::make_shared<Page<KeyType>>(new_root_page));
-        root = page_cache.getPage(new_root_page.header.page_id);
-    }
-    
-    // Log the insert operation for all cases so that we can rollback if needed (WAL)
-    wal_manager.logInsert(current_transaction, root->header.page_id, key, serialized_value);
-
-    insertNonFull(root, key, value);   
-}
-
-/*
- Find a specific node in our B+Tree given a key, using
- B+Tree traversal rules.
-*/
-template <typename KeyType, typename ValueType>
-Page<KeyType> BTree<KeyType, ValueType>::findKey(std::shared_ptr<Page<KeyType>> node, const KeyType& key){
-    size_t idx = 0;
-    // Find the first key greater than or equal to key
-    while (idx < node->keys.size() && key > node->keys[idx]) {
-        idx++;
-    }
-    if (node->is_leaf) { // If leaf node, just return
-        if (idx < node->keys.size() && node->keys[idx] == key) {
-            return *node;
-        } else {
-            // Make sure the key actually exists
-            throw std::runtime_error("key not found");
-        }
-    } else { // If not leaf, need to find the child
-        if (idx < node->keys.size() && node->keys[idx] == key) {
-            idx++;
-        }
-        if (idx < node->children.size()) {
-            // Load child page from cache
-            auto child_page = page_cache.getPage(node->children[idx]);
-            if (child_page) {
-                return findKey(child_page, key);
-            } else {
-                throw std::runtime_error("child page not found");
+    Codec<ValueType>::append(value, serialized_value);
+    checkEntrySize(key, serialized_value.size());
+
+    // Wait for the writers if too many pages are pending, no latches held yet
+    writer_queue.throttle();
+    std::shared_lock<std::shared_mutex> gate(snapshot_gate);
+
+    // Log the insert operation so that we can rollback if needed (WAL). It is
+    // logged by key, splits can move it to another leaf before it is redone
+    OperationLSNScope operation(wal_manager.getCurrentLSN());
+    wal_manager.logInsert(activeTransaction(), 0, key, serialized_value);
+
+    insertKey(key, serialized_value);
+}
+
+/*
+ Insert an already serialized value without logging, the caller already
+ wrote the WAL record (or is redoing one).
+ Most inserts only touch one leaf, so first try optimistically: crab down
+ with shared latches, latch the leaf exclusively and insert if it has room
+ (or already has the key). Only a full leaf takes the pessimistic path.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::insertKey(const KeyType& key, const std::vector<uint8_t>& serialized_value) {
+    {
+        LeafLatch latch;
+        auto leaf = findLeaf(key, latch, true);
+        if (leaf) {
+            if (!needsSplit(*leaf, key, serialized_value.size())) {
+                saveBeforeImage(*leaf, key);
+                upsertIntoLeaf(*leaf, key, serialized_value.data(), serialized_value.size());
+                latch.exclusive.reset();
+                markPageDirty(leaf);
+                return;
             }
-        } else {
-            throw std::runtime_error("key not found");
         }
     }
+
+    insertPessimistic(key, serialized_value);
 }
 
 /*
- Function that traverses tree and inserts into a node that isn't full.
- Helper for the insert method.
+ Insert that may have to split. root_latch is held until the root is known
+ to have room, then we crab down with exclusive latches on just a parent and
+ its child. Full children are split before we enter them, so a split never
+ has to go back up the tree.
 */
 template <typename KeyType, typename ValueType>
-void BTree<KeyType, ValueType>::insertNonFull(std::shared_ptr<Page<KeyType>> node, const KeyType& key, const ValueType& value) {
-    // Start from the last key and find the location to insert
-    int i = node->keys.size() - 1;
+void BTree<KeyType, ValueType>::insertPessimistic(const KeyType& key, const std::vector<uint8_t>& value) {
+    std::unique_lock<std::shared_mutex> root_lock(root_latch);
+    if (!root) {
+        // Create new root if the tree is empty
+        root = createNode(true);
+        markPageDirty(root);
+    }
 
-    if (node->is_leaf) { // If its a leaf node, insert the key and value
-        // Create a copy of the node to modify
-        Page<KeyType> modified_node = *node;
-        
-        modified_node.keys.push_back(key);
-        
-        // Serialize the value to binary data for storage
-        std::vector<uint8_t> serialized_value;
-        const uint8_t* value_bytes = reinterpret_cast<const uint8_t*>(&value);
-        serialized_value.assign(value_bytes, value_bytes + sizeof(ValueType));
-        
-        // Insert the serialized value into the data vector
-        modified_node.data.insert(modified_node.data.end(), serialized_value.begin(), serialized_value.end());
-        
-        // Sort both keys and data together, simple insertion sort for small number of keys
-        for (int j = modified_node.keys.size() - 1; j > 0 && modified_node.keys[j] < modified_node.keys[j - 1]; --j) {
-            std::swap(modified_node.keys[j], modified_node.keys[j - 1]); // Swap keys
-            
-            // Swap the corresponding data blocks, each value is sizeof(ValueType)
-            size_t value_size = sizeof(ValueType);
-            size_t offset1 = j * value_size;
-            size_t offset2 = (j - 1) * value_size;
-            
-            // Swap the data bytes
-            for (size_t k = 0; k < value_size; ++k) {
-                std::swap(modified_node.data[offset1 + k], modified_node.data[offset2 + k]);
-            }
-        }
-        
-        // Store the modified page using cache and writer queue
-        page_cache.putPage(modified_node.header.page_id, std::make_shared<Page<KeyType>>(modified_node));
-        writer_queue.enqueueWrite(modified_node.header.page_id, std::make_shared<Page<KeyType>>(modified_node));
-        node = page_cache.getPage(modified_node.header.page_id);
-        
-    } else {
-        // Find child to descend into using key comparison
-        while (i >= 0 && key < node->keys[i])
-            i--;
-        i++;
+    std::shared_ptr<Page<KeyType>> node = root;
+    auto guard = std::make_unique<PageWriteGuard<KeyType>>(*node);
+
+    if (needsSplit(*node, key, value.size())) { // If root is full, need to split
+        auto new_root = createNode(false);
+        auto new_root_guard = std::make_unique<PageWriteGuard<KeyType>>(*new_root);
+        new_root->children.push_back(node->header.page_id); // Page ID of the old root
+        // Split the old root and move a key up to the new root
+        splitChild(new_root, 0, node, key, value.size());
+        root = new_root;
+        guard = std::move(new_root_guard);
+        node = new_root;
+    }
+    root_lock.unlock();
+
+    while (!node->is_leaf) {
+        // Find child to descend into, keys equal to a separator live on its right
+        size_t i = KeySearch<KeyType>::upperBound(node->keys, key);
 
         // Load child page from cache
-        auto child_page = page_cache.getPage(node->children[i]);
-        if (!child_page) {
+        auto child = page_cache.getPage(node->children[i]);
+        if (!child) {
             throw std::runtime_error("child page not found");
         }
-        
+        auto child_guard = std::make_unique<PageWriteGuard<KeyType>>(*child);
+
         // If the child is full, you need to split it
-        if (child_page->keys.size() == maxKeysPerNode) {
-            splitChild(node, i, child_page);
-            // Check which child to go to after split
-            if (key > node->keys[i]) i++;
+        if (needsSplit(*child, key, value.size())) {
+            auto half = splitChild(node, i, child, key, value.size());
+            // Continue into the half the key belongs in
+            if (half != child) {
+                child_guard = std::make_unique<PageWriteGuard<KeyType>>(*half);
+                child = half;
+            }
+        }
+
+        // The parent is released only now that the child is latched
+        guard = std::move(child_guard);
+        node = child;
+    }
+
+    saveBeforeImage(*node, key);
+    upsertIntoLeaf(*node, key, value.data(), value.size());
+    guard.reset();
+    markPageDirty(node);
+}
+
+/*
+ Where to split node so key (with a value of len bytes) fits after. Nodes
+ out of keys split in the middle. A leaf out of bytes is cut where its
+ bytes balance, counting the new cell where it will land, so the side that
+ takes it has room: no cell is bigger than half a page. Returns the number
+ of keys node keeps, and sets whether the key belongs in the new sibling.
+*/
+template <typename KeyType, typename ValueType>
+size_t BTree<KeyType, ValueType>::splitPoint(const Page<KeyType>& node, const KeyType& key, size_t len,
+                                             bool& key_goes_right) const {
+    size_t n = node.keys.size();
+    if (!node.is_leaf || pageImageBytes(node) + cellBytes(key, len) <= PAGE_SIZE_BYTES) {
+        size_t mid = n / 2;
+        key_goes_right = !(key < node.keys[mid]);
+        return mid;
+    }
+
+    size_t pos = KeySearch<KeyType>::lowerBound(node.keys, key);
+    bool exists = pos < n && node.keys[pos] == key;
+    std::vector<size_t> cells;
+    cells.reserve(n + 1);
+    size_t total = 0;
+    for (size_t i = 0; i <= n; ++i) {
+        if (i == pos) {
+            cells.push_back(cellBytes(key, len));
+            total += cells.back();
+            if (exists) continue;
         }
+        if (i < n) {
+            cells.push_back(cellBytes(node.keys[i], node.slot_directory[i].length));
+            total += cells.back();
+        }
+    }
 
-        // Recursively insert into child
-        insertNonFull(child_page, key, value);
+    size_t cut = 1;
+    size_t best = SIZE_MAX;
+    size_t left = 0;
+    for (size_t i = 1; i < cells.size(); ++i) {
+        left += cells[i - 1];
+        size_t heavier = std::max(left, total - left);
+        if (heavier < best) {
+            best = heavier;
+            cut = i;
+        }
     }
+    key_goes_right = pos >= cut;
+    // Cells before the cut include the new one when it lands on the left
+    return key_goes_right || exists ? cut : cut - 1;
 }
 
 /*
- Function to split a child node in case it's full.
- Helper function for insert.
+ Function to split a child node that has no room for key. The caller holds
+ parent and child exclusively. The upper half moves into a new right sibling:
+    - Leaf: right gets keys [mid, n) and a copy of its first key goes up
+    - Internal: keys[mid] moves up, right gets keys (mid, n) and their children
+ A leaf split by bytes may send the key right of everything that moves, the
+ separator is then the key itself. The new sibling is filled before
+ anything points at it. Returns the half the key belongs in.
 */
 template <typename KeyType, typename ValueType>
-void BTree<KeyType, ValueType>::splitChild(std::shared_ptr<Page<KeyType>> parent, int index, std::shared_ptr<Page<KeyType>> child) {
-    // In a B+Tree, the middle key moves up to the parent
-    int mid = maxKeysPerNode / 2;
+std::shared_ptr<Page<KeyType>> BTree<KeyType, ValueType>::splitChild(const std::shared_ptr<Page<KeyType>>& parent, int index,
+                                                                     const std::shared_ptr<Page<KeyType>>& child,
+                                                                     const KeyType& key, size_t len) {
+    bool key_goes_right = false;
+    size_t mid = splitPoint(*child, key, len, key_goes_right);
+    metrics::btree_splits.add();
 
-    // Create copies to modify
-    Page<KeyType> modified_child = *child;
     // Use the leaf status of the original child
-    Page<KeyType> new_child_page = createPage<KeyType>(child->is_leaf);
-
-    // Copy second half of keys/values to the new node
-    new_child_page.keys.assign(modified_child.keys.begin() + mid + 1, modified_child.keys.end()); // Copy keys
-    modified_child.keys.resize(mid); // Keep the mid key in left for b+ tree
-
-    if (modified_child.is_leaf) { // If it's a leaf, assign values
-        size_t value_size = sizeof(ValueType);
-        size_t start_offset = (mid + 1) * value_size;
-        new_child_page.data.assign(modified_child.data.begin() + start_offset, modified_child.data.end());
-        modified_child.data.resize((mid + 1) * value_size);  // Keep the mid key in left for b+ tree
-
-    } else { // If not leaf, copy children
-        new_child_page.children.assign(modified_child.children.begin() + mid + 1, modified_child.children.end());
-        modified_child.children.resize(mid + 1);
-    }
-
-    // Store both modified pages using cache and writer queue
-    page_cache.putPage(modified_child.header.page_id, std::make_shared<Page<KeyType>>(modified_child));
-    writer_queue.enqueueWrite(modified_child.header.page_id, std::make_shared<Page<KeyType>>(modified_child));
-    
-    uint16_t new_child_id = content_storage.storePage(new_child_page);  // New page needs ID first
-    page_cache.putPage(new_child_id, std::make_shared<Page<KeyType>>(new_child_page));
-    writer_queue.enqueueWrite(new_child_id, std::make_shared<Page<KeyType>>(new_child_page));
-    
+    auto new_child = createNode(child->is_leaf);
+    KeyType separator;
+    {
+        PageWriteGuard<KeyType> guard(*new_child);
+
+        if (child->is_leaf) { // If it's a leaf, move values along with their keys
+            new_child->keys.assign(child->keys.begin() + mid, child->keys.end());
+            for (size_t i = mid; i < child->slot_directory.size(); ++i) {
+                ByteView value = child->valueAt(i);
+                new_child->insertValue(i - mid, value.data, value.size);
+            }
+            while (child->slot_directory.size() > mid) {
+                child->eraseValue(child->slot_directory.size() - 1);
+            }
+            child->keys.resize(mid);
+            separator = new_child->keys.empty() || (key_goes_right && key < new_child->keys.front())
+                ? key : new_child->keys.front();
+
+            // Link the new leaf in right after child
+            new_child->header.prev_leaf = child->header.page_id;
+            new_child->header.next_leaf = child->header.next_leaf;
+            child->header.next_leaf = new_child->header.page_id;
+
+        } else { // If not leaf, the middle key moves up and children are split around it
+            separator = child->keys[mid];
+            new_child->keys.assign(child->keys.begin() + mid + 1, child->keys.end());
+            new_child->children.assign(child->children.begin() + mid + 1, child->children.end());
+            child->keys.resize(mid);
+            child->children.resize(mid + 1);
+        }
+    }
+    // Into the cache before anything links to it, others can only find it through the cache
+    markPageDirty(new_child);
+
     // Update parent
-    parent->children.insert(parent->children.begin() + index + 1, new_child_id); // Insert new child page ID
-    parent->keys.insert(parent->keys.begin() + index, modified_child.keys[mid]); // Insert the mid key into parent
+    parent->children.insert(parent->children.begin() + index + 1, new_child->header.page_id); // Insert new child page ID
+    parent->keys.insert(parent->keys.begin() + index, separator); // Insert the separator into parent
+
+    // The leaf after the new one has to point back at it. It is right of child,
+    // and leaves are latched left to right, so this can't deadlock.
+    if (new_child->is_leaf && new_child->header.next_leaf != 0) {
+        auto next_leaf = page_cache.getPage(new_child->header.next_leaf);
+        if (next_leaf) {
+            {
+                PageWriteGuard<KeyType> guard(*next_leaf);
+                next_leaf->header.prev_leaf = new_child->header.page_id;
+            }
+            markPageDirty(next_leaf);
+        }
+    }
+
+    // Store the other two pages using cache and writer queue
+    markPageDirty(child);
+    markPageDirty(parent);
+    return key_goes_right ? new_child : child;
 }
 
 /*
- Helper function to delete a key from the B+Tree.
+ Sort (key, value) pairs by key, unless they already are, and drop
+ duplicate keys. The last value for a key wins, like repeated inserts.
+*/
+template <typename KeyType, typename ValueType>
+static void sortAndDedupe(std::vector<std::pair<KeyType, ValueType>>& entries) {
+    auto key_less = [](const std::pair<KeyType, ValueType>& a, const std::pair<KeyType, ValueType>& b) {
+        return a.first < b.first;
+    };
+    if (!std::is_sorted(entries.begin(), entries.end(), key_less)) {
+        std::stable_sort(entries.begin(), entries.end(), key_less);
+    }
+    size_t unique = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (unique > 0 && !(entries[unique - 1].first < entries[i].first)) {
+            entries[unique - 1].second = std::move(entries[i].second);
+        } else {
+            if (unique != i) entries[unique] = std::move(entries[i]);
+            unique++;
+        }
+    }
+    entries.resize(unique);
+}
+
+/*
+ Split n entries into nodes for one level of a bulk load. We aim for
+ target entries per node, but every node has to hold between min_fill and
+ max_fill entries so that later deletes and inserts see a valid tree.
+ Sizes are spread evenly, so they differ by at most one.
+*/
+static std::vector<size_t> planNodeSizes(size_t n, size_t min_fill, size_t max_fill, size_t target) {
+    if (n <= target) {
+        return {n};
+    }
+    size_t fewest = (n + max_fill - 1) / max_fill;
+    size_t most = std::max<size_t>(1, n / min_fill);
+    size_t nodes = std::min(std::max((n + target - 1) / target, fewest), std::max(most, fewest));
+
+    std::vector<size_t> sizes(nodes, n / nodes);
+    for (size_t i = 0; i < n % nodes; ++i) {
+        sizes[i]++;
+    }
+    return sizes;
+}
+
+/*
+ Bulk load, builds the tree bottom-up instead of inserting key by key:
+    - Sort the input and drop duplicate keys (see sortAndDedupe)
+    - Pack leaves to the fill factor (or as full as their page allows) and link
+      them left to right
+    - Build each internal level from the one below, a child's separator is
+      the smallest key in its subtree
+    - Write every page through ContentStorage in sequential batches, sync,
+      and log one BULK_LOAD record for the whole load
+    - Checkpoint, a BULK_LOAD can't be redone, the saved page table is what
+      makes the load survive a restart
+ Pages skip the cache and writer queue, they are loaded on demand afterwards.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::bulkLoadEntries(std::vector<std::pair<KeyType, ValueType>> entries, double fill_factor) {
+    if (!(fill_factor > 0.0 && fill_factor <= 1.0)) {
+        throw std::invalid_argument("bulkLoad fill factor must be in (0, 1]");
+    }
+    // Nobody can reach the tree through the root while we replace it
+    std::shared_lock<std::shared_mutex> gate(snapshot_gate);
+    std::unique_lock<std::shared_mutex> root_lock(root_latch);
+    if (root) {
+        std::shared_lock<std::shared_mutex> latch(root->latch.mutex);
+        if (!root->is_leaf || !root->keys.empty()) {
+            throw std::logic_error("bulkLoad needs an empty tree");
+        }
+    }
+    // The loaded keys don't get before-images, a snapshot of the empty tree would see them
+    if (version_manager.hasActiveTransactions()) {
+        throw std::logic_error("bulkLoad can't run while snapshots are open");
+    }
+
+    sortAndDedupe(entries);
+    if (entries.empty()) {
+        return;
+    }
+    for (const auto& entry : entries) {
+        checkEntrySize(entry.first, Codec<ValueType>::encodedSize(entry.second));
+    }
+
+    size_t max_keys = maxKeysPerNode;
+    size_t target = std::max<size_t>(1, static_cast<size_t>(max_keys * fill_factor));
+    std::vector<std::shared_ptr<Page<KeyType>>> pages;
+
+    // Leaf level
+    std::vector<std::shared_ptr<Page<KeyType>>> level;
+    std::vector<KeyType> low_keys;
+    std::vector<uint8_t> value_bytes;
+    size_t next = 0;
+    for (size_t count : planNodeSizes(entries.size(), minKeys(), max_keys, target)) {
+        // Big values may not fit count keys in a page, the rest go to another leaf
+        size_t chunk_end = next + count;
+        while (next < chunk_end) {
+            auto leaf = createDetachedNode(true);
+            leaf->keys.reserve(chunk_end - next);
+            for (; next < chunk_end; ++next) {
+                value_bytes.clear();
+                Codec<ValueType>::append(entries[next].second, value_bytes);
+                if (!leaf->keys.empty() && needsSplit(*leaf, entries[next].first, value_bytes.size())) {
+                    break;
+                }
+                leaf->keys.push_back(entries[next].first);
+                leaf->insertValue(leaf->keys.size() - 1, value_bytes.data(), value_bytes.size());
+            }
+            if (!level.empty()) {
+                level.back()->header.next_leaf = leaf->header.page_id;
+                leaf->header.prev_leaf = level.back()->header.page_id;
+            }
+            low_keys.push_back(leaf->keys.front());
+            level.push_back(leaf);
+        }
+    }
+
+    // Internal levels, an internal node holds one more child than keys
+    while (level.size() > 1) {
+        std::vector<std::shared_ptr<Page<KeyType>>> parents;
+        std::vector<KeyType> parent_low_keys;
+        next = 0;
+        for (size_t count : planNodeSizes(level.size(), minKeys() + 1, max_keys + 1, target + 1)) {
+            // Long keys may leave no room for count separators, likewise
+            size_t chunk_end = next + count;
+            while (next < chunk_end) {
+                auto node = createDetachedNode(false);
+                parent_low_keys.push_back(low_keys[next]);
+                node->children.push_back(level[next++]->header.page_id);
+                for (; next < chunk_end && !needsSplit(*node, low_keys[next], 0); ++next) {
+                    node->keys.push_back(low_keys[next]);
+                    node->children.push_back(level[next]->header.page_id);
+                }
+                parents.push_back(node);
+            }
+        }
+        pages.insert(pages.end(), level.begin(), level.end());
+        level.swap(parents);
+        low_keys.swap(parent_low_keys);
+    }
+    pages.push_back(level.front());
+
+    // Pages have to be on disk before the WAL says the load happened
+    content_storage.storePages(pages);
+    content_storage.sync();
+
+    // The empty root the tree started with is unreachable now, let its page go
+    std::shared_ptr<Page<KeyType>> old_root = root;
+    root = level.front();
+    if (old_root) {
+        {
+            PageWriteGuard<KeyType> guard(*old_root);
+            old_root->header.flags |= PAGE_FLAG_DELETED;
+        }
+        markPageDirty(old_root);
+    }
+
+    uint64_t txn_id = wal_manager.beginTransaction();
+    wal_manager.logBulkLoad(txn_id, root->header.page_id, pages.size(), entries.size());
+    wal_manager.commitTransaction(txn_id);
+
+    root_lock.unlock();
+    gate.unlock();
+    checkpoint();
+}
+
+/*
+ Delete a key from the B+Tree. The delete is logged first, like an insert,
+ so recovery can redo it. It is logged by key and without the old value,
+ there is no undo
 */
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::deleteKey(const KeyType& key) {
-    if (!root) return; // If tree is empty, nothing to delete
-    deleteFromNode(root, key);
+    writer_queue.throttle();
+    std::shared_lock<std::shared_mutex> gate(snapshot_gate);
+    OperationLSNScope operation(wal_manager.getCurrentLSN());
+    wal_manager.logDelete(activeTransaction(), 0, key, std::vector<uint8_t>());
+    eraseKey(key);
+}
 
-    // If root is now empty and has a child, make child the new root
-    if (!root->is_leaf && root->keys.empty()) {
-        auto child_page = page_cache.getPage(root->children[0]);
-        if (child_page) {
-            root = child_page;
-        } else { // If child not found, create a new root
-            uint16_t root_id = content_storage.storePage(createPage<KeyType>(true));
-            root = page_cache.getPage(root_id);
+/*
+ Helper function to delete a key without logging. Like insert, first try
+ optimistically with only the leaf latched exclusively: a missing key, or a
+ leaf that stays filled without it (see canLose), needs nothing else.
+ Otherwise the delete may borrow or merge, and goes the pessimistic way
+ from the root.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::eraseKey(const KeyType& key) {
+    {
+        LeafLatch latch;
+        auto leaf = findLeaf(key, latch, true);
+        if (!leaf) return; // If tree is empty, nothing to delete
+
+        size_t idx = KeySearch<KeyType>::lowerBound(leaf->keys, key);
+        if (idx == leaf->keys.size() || !(leaf->keys[idx] == key)) {
+            return; // Key not found
+        }
+        if (canLose(*leaf, cellBytes(key, leaf->slot_directory[idx].length))) {
+            // Remove the key and the corresponding value slot
+            saveBeforeImage(*leaf, key);
+            leaf->keys.erase(leaf->keys.begin() + idx);
+            leaf->eraseValue(idx);
+            latch.exclusive.reset();
+            markPageDirty(leaf);
+            return;
         }
     }
+
+    deletePessimistic(key);
 }
 
 /*
- Helper function to delete a key from a specific node.
+ Delete that may borrow or merge. Starts with root_latch and the root held
+ exclusively, deleteFromNode lets go of everything above a child that has
+ keys to spare, since no underflow can reach past it.
 */
 template <typename KeyType, typename ValueType>
-void BTree<KeyType, ValueType>::deleteFromNode(std::shared_ptr<Page<KeyType>> node, const KeyType& key) {
-    size_t idx = 0;
-    // Traverse to find the first key greater than or equal to key
-    while (idx < node->keys.size() && key > node->keys[idx]) {
-        idx++;
+void BTree<KeyType, ValueType>::deletePessimistic(const KeyType& key) {
+    std::unique_lock<std::shared_mutex> root_lock(root_latch);
+    if (!root) return;
+
+    std::shared_ptr<Page<KeyType>> old_root = root;
+    LatchPath path;
+    path.push_back(std::make_unique<PageWriteGuard<KeyType>>(*old_root));
+    deleteFromNode(old_root, key, path, root_lock);
+
+    // Still holding root_latch means the root may have lost its last key,
+    // if so make its only child the new root
+    if (!root_lock.owns_lock() || old_root->is_leaf) {
+        return;
     }
+    std::shared_ptr<Page<KeyType>> child_page;
+    {
+        PageWriteGuard<KeyType> guard(*old_root);
+        if (!old_root->keys.empty()) {
+            return;
+        }
+        child_page = page_cache.getPage(old_root->children[0]);
+        old_root->header.flags |= PAGE_FLAG_DELETED;
+    }
+    markPageDirty(old_root);
+
+    if (child_page) {
+        root = child_page;
+    } else { // If child not found, create a new root
+        root = createNode(true);
+        markPageDirty(root);
+    }
+}
+
+/*
+ Helper function to delete a key below node, whose exclusive latch is the
+ last one in path. Returns true if node is left underfull, the
+ caller (which still holds the parent) then fixes that with fixUnderflow.
+ Whenever the child we descend into has keys to spare, every latch above
+ it is released early, along with root_latch.
+*/
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::deleteFromNode(const std::shared_ptr<Page<KeyType>>& node, const KeyType& key,
+                                               LatchPath& path, std::unique_lock<std::shared_mutex>& root_lock) {
+    size_t depth = path.size() - 1;
 
     if (node->is_leaf) { // If leaf node, just delete the key
-        if (idx < node->keys.size() && node->keys[idx] == key) {
-            // Create a copy to modify because of cache
-            Page<KeyType> modified_node = *node;
-            
-            // Remove the key
-            modified_node.keys.erase(modified_node.keys.begin() + idx);
-            
-            // Remove the corresponding data block
-            size_t value_size = sizeof(ValueType);
-            size_t start_offset = idx * value_size;
-            modified_node.data.erase(modified_node.data.begin() + start_offset, modified_node.data.begin() + start_offset + value_size);
-            
-            // Store the modified page using cache and writer queue
-            page_cache.putPage(modified_node.header.page_id, std::make_shared<Page<KeyType>>(modified_node));
-            writer_queue.enqueueWrite(modified_node.header.page_id, std::make_shared<Page<KeyType>>(modified_node));
-            node = page_cache.getPage(modified_node.header.page_id);
-        } else {
-            // Key not found
-            return;
+        size_t idx = KeySearch<KeyType>::lowerBound(node->keys, key);
+        bool removed = idx < node->keys.size() && node->keys[idx] == key;
+        if (removed) {
+            // Remove the key and the corresponding value slot
+            saveBeforeImage(*node, key);
+            node->keys.erase(node->keys.begin() + idx);
+            node->eraseValue(idx);
         }
-    } else { // If not leaf, need to find the child to delete from
-        if (idx < node->keys.size() && node->keys[idx] == key) {
-            idx++;
+        bool underflow = removed && isUnderfull(*node);
+        path.pop_back();
+        if (removed) {
+            markPageDirty(node);
         }
+        return underflow;
+    }
 
-        // Load child page from cache
-        auto child_page = page_cache.getPage(node->children[idx]);
-        if (!child_page) {
-            throw std::runtime_error("child page not found");
-        }
-        
-        deleteFromNode(child_page, key); // Delete from child
+    // Keys equal to a separator live in its right subtree
+    size_t idx = KeySearch<KeyType>::upperBound(node->keys, key);
+
+    // Load child page from cache
+    auto child_page = page_cache.getPage(node->children[idx]);
+    if (!child_page) {
+        throw std::runtime_error("child page not found");
+    }
+    path.push_back(std::make_unique<PageWriteGuard<KeyType>>(*child_page));
 
-        // Fix underflow (not enough keys in child)
-        if (child_page->keys.size() < (maxKeysPerNode + 1) / 2) {
-            // TODO: Handle underflow by borrowing from siblings or merging
-            // For now, just leave as is since we don't have proper sibling handling
+    if (canLose(*child_page, child_page->is_leaf ? MAX_CELL_BYTES : maxSeparatorBytes<KeyType>())) {
+        // The child can't underflow, so nothing above it changes
+        for (size_t i = 0; i <= depth; ++i) {
+            path[i].reset();
+        }
+        if (root_lock.owns_lock()) {
+            root_lock.unlock();
         }
     }
-}
 
+    bool child_underflow = deleteFromNode(child_page, key, path, root_lock); // Delete from child
+
+    // Fix underflow (not enough keys in child) by borrowing from a sibling, or merging
+    bool underflow = false;
+    if (path[depth] && child_underflow) {
+        fixUnderflow(node, idx);
+        underflow = isUnderfull(*node);
+    }
+    path.pop_back();
+    return underflow;
+}
 
 /*
- Attempt to borrow a key from the left sibling which happens 
- when there is an underflow in the child node, because of B+Tree properties.
+ The child at index is underfull. The caller holds parent exclusively,
+ the child was released on the way back up so that it and its siblings can
+ be latched left to right here. Borrow from a sibling with keys to spare,
+ or merge with one, if the pages involved still fit.
 */
 template <typename KeyType, typename ValueType>
-void BTree<KeyType, ValueType>::borrowFromLeft(std::shared_ptr<Page<KeyType>> parent, int index) {
-    auto child_page = page_cache.getPage(parent->children[index]);
-    auto sibling_page = page_cache.getPage(parent->children[index - 1]);
-    
-    if (!child_page || !sibling_page) {
+void BTree<KeyType, ValueType>::fixUnderflow(const std::shared_ptr<Page<KeyType>>& parent, size_t index) {
+    std::shared_ptr<Page<KeyType>> left = index > 0 ? page_cache.getPage(parent->children[index - 1]) : nullptr;
+    std::shared_ptr<Page<KeyType>> child = page_cache.getPage(parent->children[index]);
+    std::shared_ptr<Page<KeyType>> right = index + 1 < parent->children.size() ? page_cache.getPage(parent->children[index + 1]) : nullptr;
+
+    if (!child || (index > 0 && !left) || (index + 1 < parent->children.size() && !right)) {
         throw std::runtime_error("child or sibling page not found");
     }
-    
-    // Create copies to modify, we can't modify directly because of cache
-    Page<KeyType> modified_child = *child_page;
-    Page<KeyType> modified_sibling = *sibling_page;
 
+    std::optional<PageWriteGuard<KeyType>> left_guard;
+    std::optional<PageWriteGuard<KeyType>> child_guard;
+    std::optional<PageWriteGuard<KeyType>> right_guard;
+    if (left) left_guard.emplace(*left);
+    child_guard.emplace(*child);
+    if (right) right_guard.emplace(*right);
+
+    // An optimistic insert may have refilled the leaf since we let go of it
+    if (!isUnderfull(*child)) {
+        return;
+    }
+
+    if (left && canBorrow(*parent, index - 1, *left, *child, true)) {
+        borrowFromLeft(parent, index, left, child);
+    } else if (right && canBorrow(*parent, index, *right, *child, false)) {
+        borrowFromRight(parent, index, child, right);
+    } else if (left && canMerge(*parent, index - 1, *left, *child)) {
+        // The merge latches the leaf after child, which may be right
+        right_guard.reset();
+        mergeNodes(parent, index - 1, left, child);
+    } else if (right && canMerge(*parent, index, *child, *right)) {
+        mergeNodes(parent, index, child, right);
+    }
+    // Otherwise the siblings are too full in bytes to take child's keys, it stays underfull
+}
+
+/*
+ Attempt to borrow a key from the left sibling which happens
+ when there is an underflow in the child node, because of B+Tree properties.
+ The caller holds parent, sibling and child exclusively.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::borrowFromLeft(const std::shared_ptr<Page<KeyType>>& parent, size_t index,
+                                               const std::shared_ptr<Page<KeyType>>& sibling_page,
+                                               const std::shared_ptr<Page<KeyType>>& child_page) {
     // If it is a leaf just borrow the last key from its sibling
-    if (modified_child.is_leaf) {
-        modified_child.keys.insert(modified_child.keys.begin(), modified_sibling.keys.back()); // Insert at the beginning
-        
-        // Borrow the corresponding data
-        size_t value_size = sizeof(ValueType);
-        size_t sibling_offset = (modified_sibling.keys.size() - 1) * value_size;
-        modified_child.data.insert(modified_child.data.begin(), 
-                          modified_sibling.data.begin() + sibling_offset,
-                          modified_sibling.data.begin() + sibling_offset + value_size);
-        
-        modified_sibling.keys.pop_back(); // Remove the last key from sibling
-        modified_sibling.data.resize(modified_sibling.data.size() - value_size); // Remove the last value from sibling
-        parent->keys[index - 1] = modified_child.keys[0]; // Update the parent key
-        
-        // Store modified pages using cache and writer queue
-        page_cache.putPage(modified_child.header.page_id, std::make_shared<Page<KeyType>>(modified_child));
-        writer_queue.enqueueWrite(modified_child.header.page_id, std::make_shared<Page<KeyType>>(modified_child));
-        page_cache.putPage(modified_sibling.header.page_id, std::make_shared<Page<KeyType>>(modified_sibling));
-        writer_queue.enqueueWrite(modified_sibling.header.page_id, std::make_shared<Page<KeyType>>(modified_sibling));
+    if (child_page->is_leaf) {
+        child_page->keys.insert(child_page->keys.begin(), sibling_page->keys.back()); // Insert at the beginning
+
+        // Borrow the corresponding value
+        size_t sibling_last = sibling_page->slot_directory.size() - 1;
+        ByteView value = sibling_page->valueAt(sibling_last);
+        child_page->insertValue(0, value.data, value.size);
+
+        sibling_page->keys.pop_back(); // Remove the last key from sibling
+        sibling_page->eraseValue(sibling_last); // Remove the last value from sibling
+        parent->keys[index - 1] = child_page->keys[0]; // Update the parent key
     } else { // If not leaf, borrow the last key and child pointer
-        modified_child.keys.insert(modified_child.keys.begin(), parent->keys[index - 1]);
-        parent->keys[index - 1] = modified_sibling.keys.back(); // Update the parent key
-        modified_sibling.keys.pop_back(); // Remove the last key from sibling
+        child_page->keys.insert(child_page->keys.begin(), parent->keys[index - 1]);
+        parent->keys[index - 1] = sibling_page->keys.back(); // Update the parent key
+        sibling_page->keys.pop_back(); // Remove the last key from sibling
 
-        modified_child.children.insert(modified_child.children.begin(), modified_sibling.children.back());
-        modified_sibling.children.pop_back();
-        
-        // Store modified pages in content storage
-        content_storage.storePage(modified_child);
-        content_storage.storePage(modified_sibling);
+        child_page->children.insert(child_page->children.begin(), sibling_page->children.back());
+        sibling_page->children.pop_back();
     }
+
+    // Store modified pages using cache and writer queue
+    markPageDirty(child_page);
+    markPageDirty(sibling_page);
+    markPageDirty(parent);
 }
 
 /*
@@ -407,117 +1087,542 @@ void BTree<KeyType, ValueType>::borrowFromLeft(std::shared_ptr<Page<KeyType>> pa
  from either side depending on the position of the child.
 */
 template <typename KeyType, typename ValueType>
-void BTree<KeyType, ValueType>::borrowFromRight(std::shared_ptr<Page<KeyType>> parent, int index) {
-    auto child_page = content_storage.getPage(parent->children[index]);
-    auto sibling_page = content_storage.getPage(parent->children[index + 1]);
-    
-    if (!child_page || !sibling_page) {
-        throw std::runtime_error("child or sibling page not found");
-    }
-    
-    // Create copies to modify
-    Page<KeyType> modified_child = *child_page;
-    Page<KeyType> modified_sibling = *sibling_page;
-
-    if (modified_child.is_leaf) { // If leaf, just borrow the first key from sibling
-        modified_child.keys.push_back(modified_sibling.keys.front());
-        
-        // Borrow the corresponding data
-        size_t value_size = sizeof(ValueType);
-        modified_child.data.insert(modified_child.data.end(),
-                          modified_sibling.data.begin(),
-                          modified_sibling.data.begin() + value_size);
-        
-        modified_sibling.keys.erase(modified_sibling.keys.begin());
-        modified_sibling.data.erase(modified_sibling.data.begin(), modified_sibling.data.begin() + value_size);
-        parent->keys[index] = modified_sibling.keys.front();
-        
-        // Store modified pages in content storage
-        content_storage.storePage(modified_child);
-        content_storage.storePage(modified_sibling);
+void BTree<KeyType, ValueType>::borrowFromRight(const std::shared_ptr<Page<KeyType>>& parent, size_t index,
+                                                const std::shared_ptr<Page<KeyType>>& child_page,
+                                                const std::shared_ptr<Page<KeyType>>& sibling_page) {
+    if (child_page->is_leaf) { // If leaf, just borrow the first key from sibling
+        child_page->keys.push_back(sibling_page->keys.front());
+
+        // Borrow the corresponding value
+        ByteView value = sibling_page->valueAt(0);
+        child_page->insertValue(child_page->slot_directory.size(), value.data, value.size);
+
+        sibling_page->keys.erase(sibling_page->keys.begin());
+        sibling_page->eraseValue(0);
+        parent->keys[index] = sibling_page->keys.front();
     } else { // If not leaf, borrow the first key and child pointer
-        modified_child.keys.push_back(parent->keys[index]);
-        parent->keys[index] = modified_sibling.keys.front();
-        modified_sibling.keys.erase(modified_sibling.keys.begin());
+        child_page->keys.push_back(parent->keys[index]);
+        parent->keys[index] = sibling_page->keys.front();
+        sibling_page->keys.erase(sibling_page->keys.begin());
 
-        modified_child.children.push_back(modified_sibling.children.front());
-        modified_sibling.children.erase(modified_sibling.children.begin());
-        
-        // Store modified pages in content storage
-        content_storage.storePage(modified_child);
-        content_storage.storePage(modified_sibling);
+        child_page->children.push_back(sibling_page->children.front());
+        sibling_page->children.erase(sibling_page->children.begin());
     }
+
+    // Store modified pages using cache and writer queue
+    markPageDirty(child_page);
+    markPageDirty(sibling_page);
+    markPageDirty(parent);
 }
 
 /*
  Helper function to merge two nodes in case borrowing is not possible.
+ Everything in the right node moves into the left one. The caller holds
+ parent, left and right exclusively. The right page is flagged deleted so
+ a cursor still sitting on it knows to find its way back through the root,
+ and when it is flushed storage drops its page ID and content reference.
 */
 template <typename KeyType, typename ValueType>
-void BTree<KeyType, ValueType>::mergeNodes(std::shared_ptr<Page<KeyType>> parent, int index) {
-    // Get left and right pages from content storage, so we can modify them
-    auto left_page = content_storage.getPage(parent->children[index]);
-    auto right_page = content_storage.getPage(parent->children[index + 1]);
-    
-    if (!left_page || !right_page) {
-        throw std::runtime_error("left or right page not found");
-    }
-    
-    // Create copies to modify, we can't modify directly because of cache
-    Page<KeyType> modified_left = *left_page;
-    Page<KeyType> modified_right = *right_page;
-
-    if (!modified_left.is_leaf) { // If not leaf, merge keys and children
-        modified_left.keys.push_back(parent->keys[index]); // Move the parent key down
-        modified_left.keys.insert(modified_left.keys.end(), modified_right.keys.begin(), modified_right.keys.end()); // Merge keys
-        modified_left.children.insert(modified_left.children.end(), modified_right.children.begin(), modified_right.children.end());
+void BTree<KeyType, ValueType>::mergeNodes(const std::shared_ptr<Page<KeyType>>& parent, size_t index,
+                                           const std::shared_ptr<Page<KeyType>>& left_page,
+                                           const std::shared_ptr<Page<KeyType>>& right_page) {
+    if (!left_page->is_leaf) { // If not leaf, merge keys and children
+        left_page->keys.push_back(parent->keys[index]); // Move the parent key down
+        left_page->keys.insert(left_page->keys.end(), right_page->keys.begin(), right_page->keys.end()); // Merge keys
+        left_page->children.insert(left_page->children.end(), right_page->children.begin(), right_page->children.end());
     } else { // If leaf, merge keys and values
-        modified_left.keys.insert(modified_left.keys.end(), modified_right.keys.begin(), modified_right.keys.end()); // Merge keys
-        modified_left.data.insert(modified_left.data.end(), modified_right.data.begin(), modified_right.data.end());
+        left_page->keys.insert(left_page->keys.end(), right_page->keys.begin(), right_page->keys.end()); // Merge keys
+        for (size_t i = 0; i < right_page->slot_directory.size(); ++i) {
+            ByteView value = right_page->valueAt(i);
+            left_page->insertValue(left_page->slot_directory.size(), value.data, value.size);
+        }
+        left_page->header.next_leaf = right_page->header.next_leaf;
     }
+    right_page->header.flags |= PAGE_FLAG_DELETED;
 
     parent->keys.erase(parent->keys.begin() + index); // Remove the parent key
     parent->children.erase(parent->children.begin() + index + 1); // Remove the right child
-    
-    // Store modified pages in content storage
-    content_storage.storePage(modified_left);
+
+    // The leaf after right_page points back at left_page now, it is further right so latching it is safe
+    if (left_page->is_leaf && left_page->header.next_leaf != 0) {
+        auto next_leaf = page_cache.getPage(left_page->header.next_leaf);
+        if (next_leaf) {
+            {
+                PageWriteGuard<KeyType> guard(*next_leaf);
+                next_leaf->header.prev_leaf = left_page->header.page_id;
+            }
+            markPageDirty(next_leaf);
+        }
+    }
+
+    // Store modified pages using cache and writer queue
+    markPageDirty(left_page);
+    markPageDirty(right_page);
+    markPageDirty(parent);
 }
 
 /*
- Search method to find a value given a key in the B+Tree using 
- our helper findKey function.
+ Walk from the root to the leaf that would hold key, crabbing with shared
+ latches: a node is released only once its child is latched, so the path
+ can't change under us. The leaf comes back latched in latch, exclusively
+ if asked. Each cached page is held only by its shared_ptr, nothing is copied.
 */
 template <typename KeyType, typename ValueType>
-ValueType* BTree<KeyType, ValueType>::search(const KeyType& key) {
-    if (!root) return nullptr;
-    
-    try {
-        Page<KeyType> node = findKey(root, key);
-        // Find the key in the node and return its value
-        for (size_t i = 0; i < node.keys.size(); i++) {
-            if (node.keys[i] == key) {
-                // Deserialize the value from binary data
-                size_t value_size = sizeof(ValueType);
-                size_t offset = i * value_size;
-                if (offset + value_size <= node.data.size()) {
-                    ValueType* result = new ValueType();
-                    std::memcpy(result, &node.data[offset], value_size);
-                    return result;
-                }
+std::shared_ptr<Page<KeyType>> BTree<KeyType, ValueType>::findLeaf(const KeyType& key, LeafLatch& latch, bool exclusive,
+                                                                   std::optional<KeyType>* upper_fence) {
+    if (upper_fence) {
+        upper_fence->reset();
+    }
+
+    std::shared_lock<std::shared_mutex> root_lock(root_latch);
+    std::shared_ptr<Page<KeyType>> node = root;
+    // The internal node we hold latched, its shared_ptr pins it while it is
+    std::shared_ptr<Page<KeyType>> latched_node;
+    std::shared_lock<std::shared_mutex> node_latch;
+
+    while (node) {
+        // is_leaf never changes after a page is created, so it can be read unlatched
+        if (node->is_leaf) {
+            latch.page = node;
+            if (exclusive) {
+                latch.exclusive.emplace(*node);
+            } else {
+                latch.shared = std::shared_lock<std::shared_mutex>(node->latch.mutex);
             }
+            return node;
         }
+
+        // Latch the child before letting go of its parent
+        std::shared_lock<std::shared_mutex> child_latch(node->latch.mutex);
+        node_latch = std::move(child_latch);
+        latched_node = node;
+        if (root_lock.owns_lock()) {
+            root_lock.unlock();
+        }
+
+        // Keys equal to a separator live in its right subtree
+        size_t idx = KeySearch<KeyType>::upperBound(node->keys, key);
+        if (idx >= node->children.size()) {
+            return nullptr;
+        }
+        // The separator right of the child bounds everything below it, deeper ones are tighter
+        if (upper_fence && idx < node->keys.size()) {
+            *upper_fence = node->keys[idx];
+        }
+        node = page_cache.getPage(node->children[idx]);
+    }
+    return nullptr;
+}
+
+/*
+ Point lookup, the value is decoded straight from the leaf's slot into the
+ caller's value.
+*/
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::lookup(const KeyType& key, ValueType& value) {
+    LeafLatch latch;
+    auto leaf = findLeaf(key, latch, false);
+    if (!leaf) {
+        return false;
+    }
+
+    size_t idx = KeySearch<KeyType>::lowerBound(leaf->keys, key);
+    if (idx < leaf->keys.size() && leaf->keys[idx] == key) {
+        ByteView bytes = leaf->valueAt(idx);
+        Codec<ValueType>::decodeInto(bytes.data, bytes.size, value);
+        return true;
+    }
+    return false;
+}
+
+template <typename KeyType, typename ValueType>
+std::optional<ValueType> BTree<KeyType, ValueType>::lookup(const KeyType& key) {
+    ValueType value{};
+    if (!lookup(key, value)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+/*
+ Older search API, kept for existing callers. The caller owns
+ (and has to delete) the returned value.
+*/
+template <typename KeyType, typename ValueType>
+ValueType* BTree<KeyType, ValueType>::search(const KeyType& key) {
+    ValueType value{};
+    if (!lookup(key, value)) {
         return nullptr;
-    } catch (const std::runtime_error& e) {
-        return nullptr;
     }
+    return new ValueType(std::move(value));
+}
+
+/*
+ Snapshots are read-only transactions of version_manager, its commit
+ timestamps order them against the before-images writers record.
+ Ending one lets go of the before-images nobody needs any more.
+*/
+template <typename KeyType, typename ValueType>
+TransactionId BTree<KeyType, ValueType>::beginSnapshot() {
+    // Waits for the writes in progress, see saveBeforeImage
+    std::unique_lock<std::shared_mutex> gate(snapshot_gate);
+    return version_manager.beginReadOnlyTransaction();
+}
+
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::endSnapshot(TransactionId snapshot) {
+    bool ended;
+    {
+        std::unique_lock<std::shared_mutex> gate(snapshot_gate);
+        ended = version_manager.commitTransaction(snapshot);
+    }
+    if (ended) {
+        version_manager.cleanupOldVersions();
+    }
+}
+
+/*
+ Lookup as of the snapshot: read the leaf first, then the before-images.
+ A write recorded its image before changing the leaf, so if we saw the
+ change the image is there for us.
+*/
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::lookupAt(TransactionId snapshot, const KeyType& key, ValueType& value) {
+    bool found = lookup(key, value);
+    auto before = version_manager.read(snapshot, key);
+    if (!before) {
+        return found;  // Unchanged since the snapshot began
+    }
+    if (before->is_tombstone) {
+        return false;
+    }
+    Codec<ValueType>::decodeInto(before->data.data(), before->data.size(), value);
+    return true;
+}
+
+template <typename KeyType, typename ValueType>
+std::optional<ValueType> BTree<KeyType, ValueType>::lookupAt(TransactionId snapshot, const KeyType& key) {
+    ValueType value{};
+    if (!lookupAt(snapshot, key, value)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+/*
+ Insert many pairs with one WAL record. Keys are sorted first, then
+ every run of keys that lands in the same leaf is applied to it together:
+ one descent, one latch, and one write request for the leaf. When a leaf
+ doesn't have room for its run, one key goes through the normal insert
+ path (which splits), and we try again with the rest.
+*/
+template <typename KeyType, typename ValueType>
+void BTree<KeyType, ValueType>::insertBatch(std::vector<std::pair<KeyType, ValueType>> entries) {
+    sortAndDedupe(entries);
+    if (entries.empty()) {
+        return;
+    }
+
+    std::vector<std::pair<KeyType, std::vector<uint8_t>>> log_entries;
+    log_entries.reserve(entries.size());
+    for (const auto& entry : entries) {
+        std::vector<uint8_t> serialized_value;
+        Codec<ValueType>::append(entry.second, serialized_value);
+        checkEntrySize(entry.first, serialized_value.size());
+        log_entries.emplace_back(entry.first, std::move(serialized_value));
+    }
+    writer_queue.throttle();
+    std::shared_lock<std::shared_mutex> gate(snapshot_gate);
+    OperationLSNScope operation(wal_manager.getCurrentLSN());
+    wal_manager.logInsertBatch(activeTransaction(), log_entries);
+
+    size_t next = 0;
+    while (next < entries.size()) {
+        bool applied = false;
+        size_t end = next + 1;
+        {
+            std::optional<KeyType> fence;
+            LeafLatch latch;
+            auto leaf = findLeaf(entries[next].first, latch, true, &fence);
+
+            while (end < entries.size() && (!fence || entries[end].first < *fence)) {
+                end++;
+            }
+
+            if (leaf && insertIntoLeaf(*leaf, entries, next, end)) {
+                latch.exclusive.reset();
+                markPageDirty(leaf);
+                applied = true;
+            }
+        }
+
+        if (applied) {
+            next = end;
+        } else {
+            insertKey(log_entries[next].first, log_entries[next].second);
+            next++;
+        }
+    }
+}
+
+/*
+ Upsert entries [begin, end) into a leaf the caller holds exclusively, if
+ they all fit without a split, in keys and in bytes. Returns false (and
+ changes nothing) otherwise.
+*/
+template <typename KeyType, typename ValueType>
+bool BTree<KeyType, ValueType>::insertIntoLeaf(Page<KeyType>& leaf, const std::vector<std::pair<KeyType, ValueType>>& entries,
+                                               size_t begin, size_t end) {
+    size_t new_keys = 0;
+    size_t bytes = pageImageBytes(leaf);
+    for (size_t i = begin; i < end; ++i) {
+        size_t pos = KeySearch<KeyType>::lowerBound(leaf.keys, entries[i].first);
+        if (pos == leaf.keys.size() || !(leaf.keys[pos] == entries[i].first)) {
+            new_keys++;
+            bytes += cellBytes(entries[i].first, 0);
+        } else {
+            bytes -= leaf.slot_directory[pos].length;
+        }
+        bytes += Codec<ValueType>::encodedSize(entries[i].second);
+    }
+    if (leaf.keys.size() + new_keys > static_cast<size_t>(maxKeysPerNode) || bytes > PAGE_SIZE_BYTES) {
+        return false;
+    }
+
+    std::vector<uint8_t> serialized_value;
+    for (size_t i = begin; i < end; ++i) {
+        serialized_value.clear();
+        Codec<ValueType>::append(entries[i].second, serialized_value);
+        saveBeforeImage(leaf, entries[i].first);
+        upsertIntoLeaf(leaf, entries[i].first, serialized_value.data(), serialized_value.size());
+    }
+    return true;
+}
+
+/*
+ Look up many keys at once. Keys are visited in sorted order, so every
+ leaf is reached with one descent and searched for all of its keys under
+ one latch. Results line up with the input keys.
+*/
+template <typename KeyType, typename ValueType>
+std::vector<std::optional<ValueType>> BTree<KeyType, ValueType>::multiGet(const std::vector<KeyType>& keys) {
+    std::vector<std::optional<ValueType>> results(keys.size());
+
+    std::vector<size_t> order(keys.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+    size_t next = 0;
+    while (next < order.size()) {
+        std::optional<KeyType> fence;
+        LeafLatch latch;
+        auto leaf = findLeaf(keys[order[next]], latch, false, &fence);
+        if (!leaf) {
+            next++;
+            continue;
+        }
+
+        do {
+            const KeyType& key = keys[order[next]];
+            size_t idx = KeySearch<KeyType>::lowerBound(leaf->keys, key);
+            if (idx < leaf->keys.size() && leaf->keys[idx] == key) {
+                ByteView bytes = leaf->valueAt(idx);
+                results[order[next]] = Codec<ValueType>::decode(bytes.data, bytes.size);
+            }
+            next++;
+        } while (next < order.size() && (!fence || keys[order[next]] < *fence));
+    }
+
+    return results;
+}
+
+/*
+ Range scans. Both descend once to the leaf holding the start of the range,
+ after that the cursor only follows sibling links.
+*/
+template <typename KeyType, typename ValueType>
+BTreeCursor<KeyType, ValueType> BTree<KeyType, ValueType>::scan(const KeyType& lo, const KeyType& hi) {
+    return BTreeCursor<KeyType, ValueType>(this, &page_cache, lo, hi, true);
+}
+
+template <typename KeyType, typename ValueType>
+BTreeCursor<KeyType, ValueType> BTree<KeyType, ValueType>::scanReverse(const KeyType& lo, const KeyType& hi) {
+    return BTreeCursor<KeyType, ValueType>(this, &page_cache, lo, hi, false);
+}
+
+template <typename KeyType, typename ValueType>
+BTreeCursor<KeyType, ValueType> BTree<KeyType, ValueType>::scanAt(TransactionId snapshot, const KeyType& lo, const KeyType& hi) {
+    return BTreeCursor<KeyType, ValueType>(this, &page_cache, lo, hi, true, snapshot);
+}
+
+template <typename KeyType, typename ValueType>
+BTreeCursor<KeyType, ValueType> BTree<KeyType, ValueType>::scanReverseAt(TransactionId snapshot, const KeyType& lo, const KeyType& hi) {
+    return BTreeCursor<KeyType, ValueType>(this, &page_cache, lo, hi, false, snapshot);
+}
+
+template <typename KeyType, typename ValueType>
+BTreeCursor<KeyType, ValueType>::BTreeCursor(BTree<KeyType, ValueType>* tree, PageCache<KeyType>* cache,
+                                             const KeyType& lo, const KeyType& hi, bool forward, TransactionId snapshot)
+    : tree(tree), page_cache(cache), leaf(), lo(lo), hi(hi),
+      current_key(), current_value(), is_valid(false), snapshot(snapshot) {
+    seek(forward ? lo : hi, true, forward);
+}
+
+template <typename KeyType, typename ValueType>
+void BTreeCursor<KeyType, ValueType>::seek(const KeyType& from, bool inclusive, bool forward) {
+    if (snapshot == 0) {
+        seekLeaf(from, inclusive, forward);
+        return;
+    }
+    KeyType start = from;  // Usually current_key, which seekLeaf overwrites
+    seekLeaf(start, inclusive, forward);
+    settleAtSnapshot(start, inclusive, forward);
+}
+
+/*
+ seekLeaf found the next entry the leaves have now, but the snapshot may
+ not have had it, or a different value for it, or keys in between that
+ were deleted since. Those all have before-images, so take whichever
+ comes first of the leaf's key and the next key with versions, and ask
+ the version manager what the snapshot saw for it. Keys the snapshot
+ didn't have are stepped over.
+*/
+template <typename KeyType, typename ValueType>
+void BTreeCursor<KeyType, ValueType>::settleAtSnapshot(KeyType from, bool inclusive, bool forward) {
+    VersionManager<KeyType>& versions = tree->version_manager;
+
+    while (true) {
+        // Versioned keys from where the leaf search started, up to the key it found
+        KeyType versioned;
+        bool in_leaf = is_valid;
+        if (versions.findVersionedKey(from, inclusive, forward, versioned) &&
+            !(versioned < lo) && !(hi < versioned) &&
+            (!is_valid || (forward ? versioned < current_key : current_key < versioned))) {
+            current_key = versioned;  // Not in the leaves now, the snapshot may still have it
+            in_leaf = false;
+        } else if (!is_valid) {
+            return;
+        }
+
+        auto before = versions.read(snapshot, current_key);
+        if (before ? !before->is_tombstone : in_leaf) {
+            if (before) {
+                Codec<ValueType>::decodeInto(before->data.data(), before->data.size(), current_value);
+            }
+            is_valid = true;
+            return;
+        }
+
+        // The snapshot didn't have this key, go on past it
+        from = current_key;
+        inclusive = false;
+        seekLeaf(from, false, forward);
+    }
+}
+
+/*
+ Load the first entry after from (forward) or before it (backward), or from
+ itself when inclusive. Leaves are searched by key rather than by position,
+ so splits and merges between two steps don't make us skip or repeat keys.
+ The cursor becomes invalid once it leaves [lo, hi] or runs out of leaves.
+ A sibling that storage no longer has sends us back through the root, a
+ leaf chain that keeps pointing at missing pages is reported as corrupt.
+*/
+template <typename KeyType, typename ValueType>
+void BTreeCursor<KeyType, ValueType>::seekLeaf(const KeyType& from, bool inclusive, bool forward) {
+    typename BTree<KeyType, ValueType>::LeafLatch latch;
+    constexpr int MAX_MISSING_SIBLINGS = 8;
+    int missing_siblings = 0;
+    if (leaf) {
+        latch.page = leaf;
+        latch.shared = std::shared_lock<std::shared_mutex>(leaf->latch.mutex);
+    }
+
+    while (true) {
+        if (!leaf || (leaf->header.flags & PAGE_FLAG_DELETED)) {
+            // No leaf yet, or ours was merged away, find where from lives now
+            if (latch.shared.owns_lock()) {
+                latch.shared.unlock();
+            }
+            leaf = tree->findLeaf(from, latch, false);
+            if (!leaf) {
+                break;
+            }
+            PageId readahead_id = forward ? leaf->header.next_leaf : leaf->header.prev_leaf;
+            if (readahead_id != 0) {
+                page_cache->prefetch(readahead_id);
+            }
+        }
+
+        const std::vector<KeyType>& keys = leaf->keys;
+        bool include_from = forward == inclusive;
+        size_t pos = include_from ? KeySearch<KeyType>::lowerBound(keys, from) : KeySearch<KeyType>::upperBound(keys, from);
+        if (forward ? pos < keys.size() : pos > 0) {
+            size_t slot = forward ? pos : pos - 1;
+            current_key = keys[slot];
+            ByteView bytes = leaf->valueAt(slot);
+            Codec<ValueType>::decodeInto(bytes.data, bytes.size, current_value);
+            is_valid = !(current_key < lo) && !(hi < current_key);
+            if (!is_valid) {
+                leaf.reset();
+            }
+            return;
+        }
+
+        PageId sibling_id = forward ? leaf->header.next_leaf : leaf->header.prev_leaf;
+        latch.shared.unlock();
+        if (sibling_id == 0) {
+            break;
+        }
+
+        leaf = page_cache->getPage(sibling_id);
+        if (!leaf) {
+            // Merged away and already dropped by storage, go through the root. Its
+            // unlink may still be on its way, but not forever
+            if (++missing_siblings > MAX_MISSING_SIBLINGS) {
+                throw std::runtime_error("leaf chain points at missing page " + std::to_string(sibling_id));
+            }
+            std::this_thread::yield();
+            continue;
+        }
+        latch.page = leaf;
+        latch.shared = std::shared_lock<std::shared_mutex>(leaf->latch.mutex);
+        PageId readahead_id = forward ? leaf->header.next_leaf : leaf->header.prev_leaf;
+        if (readahead_id != 0) {
+            page_cache->prefetch(readahead_id);
+        }
+    }
+
+    is_valid = false;
+    leaf.reset();
+}
+
+template <typename KeyType, typename ValueType>
+void BTreeCursor<KeyType, ValueType>::next() {
+    if (!is_valid) return;
+    seek(current_key, false, true);
+}
+
+template <typename KeyType, typename ValueType>
+void BTreeCursor<KeyType, ValueType>::prev() {
+    if (!is_valid) return;
+    seek(current_key, false, false);
 }
 
 // Print storage statistics
 template <typename KeyType, typename ValueType>
 void BTree<KeyType, ValueType>::printStorageStats() const {
     content_storage.printStats();
+    page_cache.printStats();
+    writer_queue.printStats();
 }
 
 // Explicit template instantiations
 template class BTree<int, std::string>;
 template class BTree<std::string, std::string>;
 template class BTree<int, int>;
+template class BTreeCursor<int, std::string>;
+template class BTreeCursor<std::string, std::string>;
+template class BTreeCursor<int, int>;
@@ -0,0 +1,725 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <functional>
+#include <filesystem>
+#include <stdexcept>
+#include <cstdlib>
+#include "btree.h"
+#include "page_cache.h"
+#include "wal.h"
+#include "writer_queue.h"
+#include "latency_histogram.h"
+#include "log.h"
+
+/*
+ YCSB-style benchmark of the tree and the components under it. Every run
+ loads `keys` records, then `threads` threads do `ops` operations between
+ them, drawn from the workload's mix, and each operation is timed into a
+ per-thread histogram of its kind. One JSON object per run goes to stdout
+ (--format text prints a table instead), so results can be diffed and
+ tracked. The engine logs only warnings and errors (to stderr) while it
+ runs, BTREE_LOG_LEVEL in the environment overrides that.
+
+ Workloads, as in YCSB:
+    A  50% read, 50% update             B  95% read, 5% update
+    C  100% read                        D  95% read, 5% insert, reads favour new keys
+    E  95% scan (1-100 keys), 5% insert F  50% read, 50% read-modify-write
+
+ Components:
+    btree   BTree<int, std::string>, the whole stack
+    cache   PageCache::getPage on one page per key range, writes mark the page dirty
+    wal     WALManager, one committed transaction per write, reads are skipped
+    writer  WriterQueue::enqueueWrite of the page a write changed, reads are skipped
+
+ A cold run measures right after loading, with the page cache emptied (or
+ a new one), a warm one first does an untimed pass of reads.
+*/
+
+namespace {
+
+enum class OpKind { READ, UPDATE, INSERT, SCAN, READ_MODIFY_WRITE };
+constexpr size_t OP_KINDS = 5;
+
+const char* opName(OpKind kind) {
+    switch (kind) {
+        case OpKind::READ: return "read";
+        case OpKind::UPDATE: return "update";
+        case OpKind::INSERT: return "insert";
+        case OpKind::SCAN: return "scan";
+        case OpKind::READ_MODIFY_WRITE: return "read_modify_write";
+    }
+    return "unknown";
+}
+
+bool isWrite(OpKind kind) {
+    return kind == OpKind::UPDATE || kind == OpKind::INSERT || kind == OpKind::READ_MODIFY_WRITE;
+}
+
+struct Workload {
+    char name;
+    double mix[OP_KINDS];  // Proportion of each OpKind, sums to 1
+    bool latest;           // Reads favour the most recently inserted keys (D)
+};
+
+const Workload WORKLOADS[] = {
+    {'A', {0.50, 0.50, 0.00, 0.00, 0.00}, false},
+    {'B', {0.95, 0.05, 0.00, 0.00, 0.00}, false},
+    {'C', {1.00, 0.00, 0.00, 0.00, 0.00}, false},
+    {'D', {0.95, 0.00, 0.05, 0.00, 0.00}, true},
+    {'E', {0.00, 0.00, 0.05, 0.95, 0.00}, false},
+    {'F', {0.50, 0.00, 0.00, 0.00, 0.50}, false},
+};
+
+struct Options {
+    std::string component = "all";
+    std::string workload = "all";
+    size_t keys = 100000;
+    size_t ops = 100000;
+    size_t value_size = 100;
+    size_t threads = 4;
+    std::string distribution = "zipfian";
+    std::string cache = "warm";
+    int node_keys = 32;        // BTree keys per node, and keys per page for cache and writer (see keysPerPage)
+    size_t cache_pages = 256;  // Page cache capacity, of the tree's cache too
+    std::string format = "json";
+    std::string dir = "bench_data";
+    uint64_t seed = 42;
+};
+
+/*
+ YCSB's Zipfian generator (Gray et al., "Quickly generating billion-record
+ synthetic databases"), theta 0.99: rank 0 is the most popular. Zeta is
+ computed once per item count, which is O(items).
+*/
+class ZipfianGenerator {
+private:
+    uint64_t items;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+    explicit ZipfianGenerator(uint64_t n, double t = 0.99)
+        : items(std::max<uint64_t>(n, 2)), theta(t), zetan(zeta(items, t)), alpha(1.0 / (1.0 - t)) {
+        double zeta2 = zeta(2, t);
+        eta = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    uint64_t next(double u) const {
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta)) {
+            return 1;
+        }
+        uint64_t rank = static_cast<uint64_t>(items * std::pow(eta * u - eta + 1, alpha));
+        return std::min(rank, items - 1);
+    }
+};
+
+// Spreads the popular ranks over the key space, like YCSB's scrambled Zipfian
+uint64_t scramble(uint64_t rank) {
+    uint64_t x = rank + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ Picks the keys and kinds of operations for one thread. Inserted keys are
+ taken from a counter shared by all threads, past the loaded ones.
+*/
+class OperationGenerator {
+private:
+    const Workload& workload;
+    const ZipfianGenerator* zipf;
+    std::atomic<uint64_t>& key_count;
+    std::mt19937_64 rng;
+    std::uniform_real_distribution<double> unit{0.0, 1.0};
+
+public:
+    OperationGenerator(const Workload& w, const ZipfianGenerator* z, std::atomic<uint64_t>& keys, uint64_t seed)
+        : workload(w), zipf(z), key_count(keys), rng(seed) {}
+
+    OpKind nextKind() {
+        double u = unit(rng);
+        for (size_t i = 0; i < OP_KINDS; ++i) {
+            if (u < workload.mix[i]) {
+                return static_cast<OpKind>(i);
+            }
+            u -= workload.mix[i];
+        }
+        return OpKind::READ;
+    }
+
+    // An existing key
+    int nextKey() {
+        uint64_t count = key_count.load(std::memory_order_relaxed);
+        uint64_t offset;
+        if (zipf) {
+            uint64_t rank = zipf->next(unit(rng));
+            if (workload.latest) {
+                offset = rank < count ? count - 1 - rank : 0;
+            } else {
+                offset = scramble(rank) % count;
+            }
+        } else if (workload.latest) {
+            // Uniform still leans on the newest tenth for D
+            uint64_t recent = std::max<uint64_t>(1, count / 10);
+            offset = count - 1 - rng() % recent;
+        } else {
+            offset = rng() % count;
+        }
+        return static_cast<int>(offset);
+    }
+
+    int newKey() { return static_cast<int>(key_count.fetch_add(1)); }
+    size_t scanLength() { return 1 + rng() % 100; }
+};
+
+struct ThreadResult {
+    LatencyHistogram latency[OP_KINDS];
+    uint64_t found = 0;  // Reads that hit, a sanity check that the run did work
+};
+
+struct RunResult {
+    std::string component;
+    char workload;
+    double seconds = 0;
+    uint64_t operations = 0;
+    LatencyHistogram latency[OP_KINDS];
+    LatencyHistogram all;
+    uint64_t found = 0;
+    std::map<std::string, double> extra;  // Component specific numbers
+};
+
+/*
+ The part the components share: start the threads, have each run its share
+ of the operations through `run_op` (which returns false for operations the
+ component doesn't do, those aren't counted), and merge the histograms.
+*/
+using OperationFn = std::function<bool(OpKind, OperationGenerator&, ThreadResult&)>;
+
+void runThreads(const Options& options, const Workload& workload, const ZipfianGenerator* zipf,
+                std::atomic<uint64_t>& key_count, const OperationFn& run_op, RunResult& result) {
+    std::vector<ThreadResult> thread_results(options.threads);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> go(false);
+
+    for (size_t t = 0; t < options.threads; ++t) {
+        threads.emplace_back([&, t] {
+            OperationGenerator generator(workload, zipf, key_count, options.seed * 7919 + t);
+            size_t share = options.ops / options.threads + (t < options.ops % options.threads ? 1 : 0);
+            ready.fetch_add(1);
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            ThreadResult& mine = thread_results[t];
+            for (size_t i = 0; i < share; ++i) {
+                OpKind kind = generator.nextKind();
+                auto start = std::chrono::steady_clock::now();
+                if (!run_op(kind, generator, mine)) {
+                    continue;
+                }
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                mine.latency[static_cast<size_t>(kind)].record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            }
+        });
+    }
+
+    while (ready.load() < options.threads) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const auto& mine : thread_results) {
+        for (size_t k = 0; k < OP_KINDS; ++k) {
+            result.latency[k].merge(mine.latency[k]);
+            result.all.merge(mine.latency[k]);
+        }
+        result.found += mine.found;
+    }
+    result.operations = result.all.count();
+}
+
+std::string makeValue(size_t size, uint64_t salt) {
+    std::string value(size, 'v');
+    for (size_t i = 0; i < size; ++i) {
+        value[i] = static_cast<char>('a' + (salt + i * 31) % 26);
+    }
+    return value;
+}
+
+std::vector<uint8_t> valueBytes(size_t size, uint64_t salt) {
+    std::string value = makeValue(size, salt);
+    return std::vector<uint8_t>(value.begin(), value.end());
+}
+
+void removeFiles(const std::string& prefix) {
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        if (entry.path().filename().string().rfind(prefix, 0) == 0) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+// Untimed reads over the workload's distribution, what makes a run warm
+template <typename ReadFn>
+void warmUp(const Options& options, const Workload& workload, const ZipfianGenerator* zipf,
+            std::atomic<uint64_t>& key_count, ReadFn&& read) {
+    if (options.cache != "warm") {
+        return;
+    }
+    OperationGenerator generator(workload, zipf, key_count, options.seed);
+    size_t passes = std::min(options.keys, options.ops);
+    for (size_t i = 0; i < passes; ++i) {
+        read(generator.nextKey());
+    }
+}
+
+/*
+ Components
+*/
+
+void benchBTree(const Options& options, const Workload& workload, const ZipfianGenerator* zipf,
+                RunResult& result) {
+    removeFiles("btree.");
+    {
+        BTreeOptions tree_options;
+        tree_options.cache_pages = options.cache_pages;
+        BTree<int, std::string> tree(options.node_keys, tree_options);
+        std::vector<std::pair<int, std::string>> records;
+        records.reserve(options.keys);
+        for (size_t i = 0; i < options.keys; ++i) {
+            records.emplace_back(static_cast<int>(i), makeValue(options.value_size, i));
+        }
+        tree.bulkLoad(records.begin(), records.end());
+        tree.flush();
+        records.clear();
+        if (options.cache == "cold") {
+            tree.getPageCache().evictAll();  // Loading left the cache full of fresh pages
+        }
+
+        std::atomic<uint64_t> key_count(options.keys);
+        warmUp(options, workload, zipf, key_count, [&](int key) {
+            std::string value;
+            tree.lookup(key, value);
+        });
+
+        runThreads(options, workload, zipf, key_count,
+                   [&](OpKind kind, OperationGenerator& generator, ThreadResult& mine) {
+            std::string value;
+            switch (kind) {
+                case OpKind::READ:
+                    mine.found += tree.lookup(generator.nextKey(), value);
+                    break;
+                case OpKind::UPDATE: {
+                    int key = generator.nextKey();
+                    tree.insert(key, makeValue(options.value_size, key + 1));
+                    break;
+                }
+                case OpKind::INSERT: {
+                    int key = generator.newKey();
+                    tree.insert(key, makeValue(options.value_size, key));
+                    break;
+                }
+                case OpKind::SCAN: {
+                    int lo = generator.nextKey();
+                    int hi = lo + static_cast<int>(generator.scanLength()) - 1;
+                    for (auto cursor = tree.scan(lo, hi); cursor.valid(); cursor.next()) {
+                        mine.found++;
+                    }
+                    break;
+                }
+                case OpKind::READ_MODIFY_WRITE: {
+                    int key = generator.nextKey();
+                    if (tree.lookup(key, value)) {
+                        mine.found++;
+                        value[0] = value[0] == 'z' ? 'a' : value[0] + 1;
+                        tree.insert(key, value);
+                    }
+                    break;
+                }
+            }
+            return true;
+        }, result);
+
+        tree.flush();
+        result.extra["cache_pages"] = options.cache_pages;
+    }
+    removeFiles("btree.");
+}
+
+// node_keys keys per page, or as many as fit in one when values are big
+size_t keysPerPage(const Options& options) {
+    size_t fit = PAGE_CELL_SPACE / cellBytes(0, options.value_size);
+    return std::max<size_t>(1, std::min<size_t>(options.node_keys, fit));
+}
+
+// Pages of keysPerPage keys each, stored in `storage`, for the cache and writer runs
+std::vector<PageId> storeLeafPages(ContentStorage<int>& storage, const Options& options) {
+    size_t keys_per_page = keysPerPage(options);
+    size_t page_count = (options.keys + keys_per_page - 1) / keys_per_page;
+    std::vector<PageId> page_ids;
+    page_ids.reserve(page_count);
+    for (size_t p = 0; p < page_count; ++p) {
+        Page<int> page = createPage<int>(true);
+        for (size_t i = 0; i < keys_per_page; ++i) {
+            int key = static_cast<int>(p * keys_per_page + i);
+            std::vector<uint8_t> value = valueBytes(options.value_size, key);
+            page.keys.push_back(key);
+            page.insertValue(i, value.data(), value.size());
+        }
+        page_ids.push_back(storage.storePage(std::move(page)));
+    }
+    return page_ids;
+}
+
+void benchPageCache(const Options& options, const Workload& workload, const ZipfianGenerator* zipf,
+                    RunResult& result) {
+    removeFiles("bench_cache.");
+    {
+        ContentStorage<int> storage("bench_cache.db");
+        std::vector<PageId> page_ids = storeLeafPages(storage, options);
+        PageCache<int> cache(&storage, options.cache_pages);
+        size_t keys_per_page = keysPerPage(options);
+
+        // Inserted keys past the last page go to the last page, the cache doesn't grow
+        auto pageOf = [&](int key) {
+            return page_ids[std::min<size_t>(key / keys_per_page, page_ids.size() - 1)];
+        };
+
+        std::atomic<uint64_t> key_count(options.keys);
+        warmUp(options, workload, zipf, key_count, [&](int key) { cache.getPage(pageOf(key)); });
+
+        runThreads(options, workload, zipf, key_count,
+                   [&](OpKind kind, OperationGenerator& generator, ThreadResult& mine) {
+            int key = kind == OpKind::INSERT ? generator.newKey() : generator.nextKey();
+            if (kind == OpKind::SCAN) {
+                size_t pages = (generator.scanLength() + keys_per_page - 1) / keys_per_page;
+                for (size_t i = 0; i < pages; ++i) {
+                    mine.found += cache.getPage(pageOf(key + static_cast<int>(i * keys_per_page))) != nullptr;
+                }
+                return true;
+            }
+            PageId page_id = pageOf(key);
+            mine.found += cache.getPage(page_id) != nullptr;
+            if (isWrite(kind)) {
+                cache.markDirty(page_id);
+            }
+            return true;
+        }, result);
+
+        uint64_t hits = 0, misses = 0;
+        for (const auto& shard : cache.getShardStats()) {
+            hits += shard.hits;
+            misses += shard.misses;
+        }
+        result.extra["pages"] = page_ids.size();
+        result.extra["cache_pages"] = options.cache_pages;
+        result.extra["hit_ratio"] = hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0;
+    }
+    removeFiles("bench_cache.");
+}
+
+void benchWAL(const Options& options, const Workload& workload, const ZipfianGenerator* zipf,
+              RunResult& result) {
+    removeFiles("bench.wal");
+    {
+        WALManager<int> wal("bench.wal");
+        std::atomic<uint64_t> key_count(options.keys);
+        uint64_t start_lsn = wal.getCurrentLSN();
+
+        runThreads(options, workload, zipf, key_count,
+                   [&](OpKind kind, OperationGenerator& generator, ThreadResult&) {
+            if (!isWrite(kind)) {
+                return false;
+            }
+            int key = kind == OpKind::INSERT ? generator.newKey() : generator.nextKey();
+            uint64_t txn = wal.beginTransaction();
+            if (kind == OpKind::INSERT) {
+                wal.logInsert(txn, 0, key, valueBytes(options.value_size, key));
+            } else {
+                wal.logUpdate(txn, 0, key, valueBytes(options.value_size, key),
+                              valueBytes(options.value_size, key + 1));
+            }
+            wal.commitTransaction(txn);
+            return true;
+        }, result);
+
+        result.extra["log_bytes"] = static_cast<double>(wal.getCurrentLSN() - start_lsn);
+    }
+    removeFiles("bench.wal");
+}
+
+void benchWriterQueue(const Options& options, const Workload& workload, const ZipfianGenerator* zipf,
+                      RunResult& result) {
+    removeFiles("bench_writer.");
+    {
+        ContentStorage<int> storage("bench_writer.db");
+        std::vector<PageId> page_ids = storeLeafPages(storage, options);
+        PageCache<int> cache(&storage, options.cache_pages);
+        WriterQueue<int> queue(&storage, &cache, 2);
+        queue.start();
+
+        // The pages writes go to, shared with the writers like the tree's pages are
+        std::vector<std::shared_ptr<Page<int>>> pages;
+        for (PageId page_id : page_ids) {
+            pages.push_back(cache.getPage(page_id));
+        }
+        size_t keys_per_page = keysPerPage(options);
+
+        std::atomic<uint64_t> key_count(options.keys);
+        runThreads(options, workload, zipf, key_count,
+                   [&](OpKind kind, OperationGenerator& generator, ThreadResult&) {
+            if (!isWrite(kind)) {
+                return false;
+            }
+            int key = kind == OpKind::INSERT ? generator.newKey() : generator.nextKey();
+            size_t index = std::min<size_t>(key / keys_per_page, pages.size() - 1);
+            const auto& page = pages[index];
+            {
+                PageWriteGuard<int> guard(*page);
+                if (!page->data.empty()) {
+                    page->data[key % page->data.size()]++;
+                }
+            }
+            queue.enqueueWrite(page_ids[index], page);
+            queue.throttle();
+            return true;
+        }, result);
+
+        auto drain_start = std::chrono::steady_clock::now();
+        queue.waitForEmpty();
+        result.extra["drain_ms"] = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - drain_start).count();
+        queue.stop();
+    }
+    removeFiles("bench_writer.");
+}
+
+/*
+ Output
+*/
+
+void writeJson(std::ostream& out, const Options& options, const RunResult& result) {
+    out << std::setprecision(12) << "{\"component\":\"" << result.component << "\""
+        << ",\"workload\":\"" << result.workload << "\""
+        << ",\"distribution\":\"" << options.distribution << "\""
+        << ",\"cache\":\"" << options.cache << "\""
+        << ",\"threads\":" << options.threads
+        << ",\"keys\":" << options.keys
+        << ",\"value_size\":" << options.value_size
+        << ",\"operations\":" << result.operations
+        << ",\"seconds\":" << result.seconds
+        << ",\"ops_per_sec\":" << (result.seconds > 0 ? result.operations / result.seconds : 0.0)
+        << ",\"found\":" << result.found;
+    for (const auto& [name, value] : result.extra) {
+        out << ",\"" << name << "\":" << value;
+    }
+    out << ",\"latency_ns\":{";
+    bool first = true;
+    auto histogram = [&](const char* name, const LatencyHistogram& h) {
+        if (h.count() == 0) {
+            return;
+        }
+        out << (first ? "" : ",") << "\"" << name << "\":{"
+            << "\"count\":" << h.count()
+            << ",\"mean\":" << static_cast<uint64_t>(h.mean())
+            << ",\"p50\":" << h.percentile(50)
+            << ",\"p99\":" << h.percentile(99)
+            << ",\"p999\":" << h.percentile(99.9)
+            << ",\"max\":" << h.max() << "}";
+        first = false;
+    };
+    histogram("all", result.all);
+    for (size_t k = 0; k < OP_KINDS; ++k) {
+        histogram(opName(static_cast<OpKind>(k)), result.latency[k]);
+    }
+    out << "}}" << std::endl;
+}
+
+void writeText(std::ostream& out, const Options& options, const RunResult& result) {
+    out << result.component << " workload " << result.workload << " (" << options.distribution << ", "
+        << options.cache << ", " << options.threads << " threads): " << result.operations << " ops in "
+        << std::fixed << std::setprecision(3) << result.seconds << "s, "
+        << std::setprecision(0) << (result.seconds > 0 ? result.operations / result.seconds : 0.0)
+        << " ops/s" << std::endl;
+    for (size_t k = 0; k < OP_KINDS; ++k) {
+        const LatencyHistogram& h = result.latency[k];
+        if (h.count() == 0) {
+            continue;
+        }
+        out << "    " << std::left << std::setw(18) << opName(static_cast<OpKind>(k)) << std::right
+            << " p50 " << std::setw(9) << h.percentile(50) << "ns"
+            << "  p99 " << std::setw(9) << h.percentile(99) << "ns"
+            << "  p999 " << std::setw(9) << h.percentile(99.9) << "ns"
+            << "  max " << std::setw(9) << h.max() << "ns" << std::endl;
+    }
+    for (const auto& [name, value] : result.extra) {
+        out << "    " << name << ": " << std::setprecision(3) << value << std::endl;
+    }
+    out.unsetf(std::ios::fixed);
+}
+
+void printUsage(std::ostream& out) {
+    out << "Usage: benchmark [options]\n"
+        << "  --component all|btree|cache|wal|writer   (all)\n"
+        << "  --workload all|A|B|C|D|E|F               (all)\n"
+        << "  --keys N                                 records loaded (100000)\n"
+        << "  --ops N                                  operations per run (100000)\n"
+        << "  --value-size BYTES                       (100)\n"
+        << "  --threads N                              (4)\n"
+        << "  --distribution uniform|zipfian           (zipfian)\n"
+        << "  --cache warm|cold                        (warm)\n"
+        << "  --node-keys N                            keys per node/page (32)\n"
+        << "  --cache-pages N                          page cache size (256)\n"
+        << "  --format json|text                       (json, one object per run)\n"
+        << "  --dir PATH                               scratch directory (bench_data)\n"
+        << "  --seed N                                 (42)\n";
+}
+
+Options parseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string name = argv[i];
+        if (name == "--help" || name == "-h") {
+            printUsage(std::cout);
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("missing value for " + name);
+        }
+        std::string value = argv[++i];
+        if (name == "--component") options.component = value;
+        else if (name == "--workload") options.workload = value;
+        else if (name == "--keys") options.keys = std::stoull(value);
+        else if (name == "--ops") options.ops = std::stoull(value);
+        else if (name == "--value-size") options.value_size = std::stoull(value);
+        else if (name == "--threads") options.threads = std::stoull(value);
+        else if (name == "--distribution") options.distribution = value;
+        else if (name == "--cache") options.cache = value;
+        else if (name == "--node-keys") options.node_keys = std::stoi(value);
+        else if (name == "--cache-pages") options.cache_pages = std::stoull(value);
+        else if (name == "--format") options.format = value;
+        else if (name == "--dir") options.dir = value;
+        else if (name == "--seed") options.seed = std::stoull(value);
+        else throw std::invalid_argument("unknown option " + name);
+    }
+
+    if (options.distribution != "uniform" && options.distribution != "zipfian") {
+        throw std::invalid_argument("distribution must be uniform or zipfian");
+    }
+    if (options.cache != "warm" && options.cache != "cold") {
+        throw std::invalid_argument("cache must be warm or cold");
+    }
+    if (options.format != "json" && options.format != "text") {
+        throw std::invalid_argument("format must be json or text");
+    }
+    if (options.keys == 0 || options.threads == 0 || options.node_keys < 3) {
+        throw std::invalid_argument("keys and threads must be positive, node-keys at least 3");
+    }
+    if (cellBytes(0, options.value_size) > MAX_CELL_BYTES) {
+        throw std::invalid_argument("value-size can be at most " +
+                                    std::to_string(MAX_CELL_BYTES - cellBytes(0, 0)) + " bytes");
+    }
+    return options;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    try {
+        options = parseOptions(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "benchmark: " << e.what() << std::endl;
+        printUsage(std::cerr);
+        return 1;
+    }
+
+    using BenchFn = void (*)(const Options&, const Workload&, const ZipfianGenerator*, RunResult&);
+    const std::pair<const char*, BenchFn> components[] = {
+        {"btree", benchBTree}, {"cache", benchPageCache}, {"wal", benchWAL}, {"writer", benchWriterQueue},
+    };
+
+    std::filesystem::create_directories(options.dir);
+    std::filesystem::current_path(options.dir);
+
+    // Only results on stdout while we measure, unless BTREE_LOG_LEVEL asks for the engine's logging
+    if (!std::getenv("BTREE_LOG_LEVEL")) {
+        Log::setLevel(LogLevel::WARN);
+    }
+
+    // Zeta is computed once, for the loaded keys
+    std::unique_ptr<ZipfianGenerator> zipf;
+    if (options.distribution == "zipfian") {
+        zipf = std::make_unique<ZipfianGenerator>(options.keys);
+    }
+
+    int status = 0;
+    bool matched = false;
+    for (const auto& [component, bench] : components) {
+        if (options.component != "all" && options.component != component) {
+            continue;
+        }
+        for (const Workload& workload : WORKLOADS) {
+            if (options.workload != "all" && options.workload != std::string(1, workload.name)) {
+                continue;
+            }
+            matched = true;
+            RunResult result;
+            result.component = component;
+            result.workload = workload.name;
+            try {
+                bench(options, workload, zipf.get(), result);
+            } catch (const std::exception& e) {
+                std::cerr << "benchmark: " << component << " workload " << workload.name
+                          << " failed: " << e.what() << std::endl;
+                status = 1;
+                continue;
+            }
+            if (result.operations == 0) {
+                continue;  // Nothing this component does, e.g. workload C for the WAL
+            }
+            if (options.format == "json") {
+                writeJson(std::cout, options, result);
+            } else {
+                writeText(std::cout, options, result);
+            }
+        }
+    }
+
+    if (!matched) {
+        std::cerr << "benchmark: nothing matches --component " << options.component
+                  << " --workload " << options.workload << std::endl;
+        return 1;
+    }
+    return status;
+}
@@ -0,0 +1,158 @@
+#include "buffer_pool.h"
+#include "log.h"
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <sys/mman.h>
+
+namespace {
+
+constexpr size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+}  // namespace
+
+/*
+ Map the arena up front and fault it in (MAP_POPULATE), so the memory is
+ really there from the start and a frame's first use doesn't page fault.
+*/
+FrameArena::FrameArena(size_t frames, bool use_huge_pages)
+    : base(nullptr), num_frames(frames), mapped_bytes(0), huge_pages(false) {
+    if (frames == 0) {
+        throw std::invalid_argument("Buffer pool needs at least one frame");
+    }
+
+    void* memory = MAP_FAILED;
+    if (use_huge_pages) {
+        mapped_bytes = (bytes() + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        memory = ::mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        huge_pages = memory != MAP_FAILED;
+    }
+    if (memory == MAP_FAILED) {
+        // No huge pages reserved (or none asked for), regular pages it is
+        mapped_bytes = bytes();
+        memory = ::mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error(std::string("Failed to map buffer pool arena (") + std::strerror(errno) + ")");
+        }
+        if (use_huge_pages) {
+            ::madvise(memory, mapped_bytes, MADV_HUGEPAGE);  // Only a hint
+        }
+    }
+    base = static_cast<uint8_t*>(memory);
+}
+
+FrameArena::~FrameArena() {
+    ::munmap(base, mapped_bytes);
+}
+
+/*
+ Build every frame's page with its value bytes in the arena. The pages are
+ never moved after this, the anchors point straight at them.
+*/
+template <typename KeyType>
+BufferPool<KeyType>::BufferPool(size_t frames, bool use_huge_pages)
+    : arena(frames, use_huge_pages) {
+    pages.reserve(frames);
+    anchors.reserve(frames);
+    free_frames.reserve(frames);
+
+    for (size_t i = 0; i < frames; ++i) {
+        pages.push_back(Page<KeyType>{PageHeader{}, true, PageLatch{}, PageHashState{}, {}, {}, {},
+                                      PageBytes(FrameAllocator(arena.frame(i)))});
+        pages.back().data.reserve(PAGE_SIZE_BYTES);  // Takes the frame
+    }
+    for (size_t i = 0; i < frames; ++i) {
+        anchors.emplace_back(&pages[i], [](Page<KeyType>*) {});
+        free_frames.push_back(static_cast<uint32_t>(frames - 1 - i));  // Hand out frame 0 first
+    }
+
+    LOG_INFO("BufferPool: " << frames << " frames, " << arena.bytes() / 1024 << " KB arena"
+             << (arena.onHugePages() ? " on huge pages" : ""));
+}
+
+/*
+ Clear a frame for its next page. The vectors keep their capacity, and
+ value bytes that had outgrown the frame onto the heap come back to it.
+*/
+template <typename KeyType>
+void BufferPool<KeyType>::resetFrame(size_t frame) {
+    Page<KeyType>& page = pages[frame];
+    page.header = PageHeader{};
+    page.is_leaf = true;
+    page.latch.version.store(0);
+    page.invalidateContentHash();
+    page.keys.clear();
+    page.children.clear();
+    page.slot_directory.clear();
+
+    if (page.data.data() != arena.frame(frame)) {
+        // Same allocator on both sides, so swapping is fine. The heap buffer dies with spilled
+        PageBytes spilled(FrameAllocator(arena.frame(frame)));
+        spilled.swap(page.data);
+    }
+    page.data.clear();
+    page.data.reserve(PAGE_SIZE_BYTES);
+}
+
+template <typename KeyType>
+int32_t BufferPool<KeyType>::acquire() {
+    std::lock_guard<std::mutex> lock(free_mutex);
+    if (free_frames.empty()) {
+        reclaimOrphans();
+    }
+    if (free_frames.empty()) {
+        return -1;
+    }
+    uint32_t frame = free_frames.back();
+    free_frames.pop_back();
+    return static_cast<int32_t>(frame);
+}
+
+template <typename KeyType>
+void BufferPool<KeyType>::release(int32_t frame) {
+    if (isPinned(frame)) {
+        throw std::logic_error("Releasing a pinned buffer pool frame");
+    }
+    resetFrame(frame);
+    std::lock_guard<std::mutex> lock(free_mutex);
+    free_frames.push_back(static_cast<uint32_t>(frame));
+}
+
+/*
+ A frame the cache dropped while someone still held its page (the cache
+ entry got a newer copy). Nobody can find the frame through the cache any
+ more, so its holders only go away, and the frame is free once they did.
+*/
+template <typename KeyType>
+void BufferPool<KeyType>::releaseWhenUnpinned(int32_t frame) {
+    if (!isPinned(frame)) {
+        release(frame);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(free_mutex);
+    orphaned_frames.push_back(static_cast<uint32_t>(frame));
+}
+
+template <typename KeyType>
+void BufferPool<KeyType>::reclaimOrphans() {
+    auto still_held = std::partition(orphaned_frames.begin(), orphaned_frames.end(),
+                                     [this](uint32_t frame) { return isPinned(frame); });
+    for (auto it = still_held; it != orphaned_frames.end(); ++it) {
+        resetFrame(*it);
+        free_frames.push_back(*it);
+    }
+    orphaned_frames.erase(still_held, orphaned_frames.end());
+}
+
+template <typename KeyType>
+size_t BufferPool<KeyType>::freeFrames() const {
+    std::lock_guard<std::mutex> lock(free_mutex);
+    return free_frames.size();
+}
+
+template class BufferPool<int>;
+template class BufferPool<std::string>;
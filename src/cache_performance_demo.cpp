@@ -36,11 +36,10 @@ int main() {
     start = std::chrono::high_resolution_clock::now();
     
     int successful_searches = 0;
+    std::string value;
     for (int i = 1; i <= 50; ++i) {
-        auto result = tree.search(i);
-        if (result) {
+        if (tree.lookup(i, value)) {
             successful_searches++;
-            delete result;
         }
     }
     
@@ -57,10 +56,8 @@ int main() {
     successful_searches = 0;
     for (int round = 0; round < 3; ++round) {
         for (int i = 1; i <= 20; ++i) {
-            auto result = tree.search(i);
-            if (result) {
+            if (tree.lookup(i, value)) {
                 successful_searches++;
-                delete result;
             }
         }
     }
@@ -100,10 +97,9 @@ int main() {
     std::vector<int> test_keys = {1, 25, 50, 75, 100};
     
     for (int key : test_keys) {
-        auto result = tree.search(key);
+        auto result = tree.lookup(key);
         if (result) {
             std::cout << "Key " << key << ": " << *result << std::endl;
-            delete result;
         } else {
             std::cout << "Key " << key << ": NOT FOUND" << std::endl;
         }
@@ -1,5 +1,9 @@
 #include "checkpoint_manager.h"
+#include "log.h"
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 template<typename KeyType>
 CheckpointManager<KeyType>::CheckpointManager(WALManager<KeyType>* wal, PageCache<KeyType>* cache, 
@@ -8,15 +12,15 @@ CheckpointManager<KeyType>::CheckpointManager(WALManager<KeyType>* wal, PageCach
                                               size_t wal_threshold, size_t dirty_threshold)
     : wal_manager(wal), page_cache(cache), job_scheduler(scheduler),
       checkpoint_interval(interval), wal_size_threshold(wal_threshold), 
-      dirty_page_threshold(dirty_threshold),
-      last_checkpoint_lsn(0), checkpoints_completed(0), checkpoints_failed(0),
+      dirty_page_threshold(dirty_threshold), flush_pause(std::chrono::milliseconds(10)),
+      truncate_wal(true), last_checkpoint_lsn(0), checkpoints_completed(0), checkpoints_failed(0),
       checkpoint_job_name("checkpoint_recurring"), cleanup_job_name("cleanup_recurring") {
     
     last_checkpoint_time.store(std::chrono::steady_clock::now());
     
-    std::cout << "CheckpointManager: Initialized with " << interval.count() 
-              << "ms interval, WAL threshold: " << wal_threshold 
-              << " bytes, dirty page threshold: " << dirty_threshold << std::endl;
+    LOG_INFO("CheckpointManager: Initialized with " << interval.count()
+             << "ms interval, WAL threshold: " << wal_threshold
+             << " bytes, dirty page threshold: " << dirty_threshold);
 }
 
 template<typename KeyType>
@@ -27,7 +31,7 @@ CheckpointManager<KeyType>::~CheckpointManager() {
 template<typename KeyType>
 void CheckpointManager<KeyType>::start() {
     if (!job_scheduler || !job_scheduler->isRunning()) {
-        std::cerr << "CheckpointManager: Job scheduler not running" << std::endl;
+        LOG_WARN("CheckpointManager: Job scheduler not running");
         return;
     }
     
@@ -49,7 +53,7 @@ void CheckpointManager<KeyType>::start() {
         JobPriority::NORMAL
     );
     
-    std::cout << "CheckpointManager: Started with recurring jobs" << std::endl;
+    LOG_INFO("CheckpointManager: Started with recurring jobs");
 }
 
 template<typename KeyType>
@@ -59,26 +63,72 @@ void CheckpointManager<KeyType>::stop() {
         job_scheduler->removeRecurringJob(cleanup_job_name);
     }
     
-    std::cout << "CheckpointManager: Stopped" << std::endl;
+    LOG_INFO("CheckpointManager: Stopped");
 }
 
+/*
+ Fuzzy checkpoint, the tree keeps working the whole time:
+    1. log CHECKPOINT_BEGIN with the dirty page table (and running transactions)
+    2. write the pages in that table dirty_page_threshold at a time, pausing
+       flush_pause between slices so the checkpoint doesn't hog the disk
+    3. log CHECKPOINT_END with the redo LSN, the oldest rec LSN of a page
+       that is dirty by now (at most the begin LSN), and wait until it is durable.
+       With a page table saver, it saves the tree's page table first, which
+       briefly holds off writes, and the redo LSN is the one saved with it:
+       the LSN a restart redoes from (see BTree::checkpoint), the tree logs
+       what undoes the changes of its open transaction there. Without one, the
+       pages just written may hold changes of a running transaction with
+       nothing to undo them but its records, so the redo LSN stays at or
+       before where the oldest running transaction began
+    4. truncate the WAL up to the redo LSN (unless setTruncateWAL(false)), so
+       the log, and the scan of it when it is opened, stay as short as the
+       checkpoint interval
+ Pages changed during the checkpoint just stay dirty, the redo LSN covers them.
+*/
 template<typename KeyType>
 bool CheckpointManager<KeyType>::performCheckpoint() {
     auto start_time = std::chrono::steady_clock::now();
     
-    std::cout << "CheckpointManager: Starting checkpoint..." << std::endl;
+    LOG_DEBUG("CheckpointManager: Starting checkpoint...");
     
     try {
-        // Step 1: Flush all dirty pages from cache
-        page_cache->flushAll();
+        // Step 1: Log the begin record with the dirty pages
+        auto dirty_pages = page_cache->getDirtyPageTable();
+        uint64_t begin_lsn = wal_manager->beginCheckpoint(dirty_pages);
         
-        // Step 2: Write checkpoint record to WAL
-        uint64_t checkpoint_lsn = wal_manager->writeCheckpoint();
+        // Step 2: Flush them a slice at a time
+        size_t slice = std::max<size_t>(1, dirty_page_threshold);
+        size_t flushed = 0;
+        std::vector<PageId> page_ids;
+        for (size_t next = 0; next < dirty_pages.size(); next += slice) {
+            if (next > 0) {
+                std::this_thread::sleep_for(flush_pause);
+            }
+            page_ids.clear();
+            for (size_t i = next; i < std::min(next + slice, dirty_pages.size()); ++i) {
+                page_ids.push_back(dirty_pages[i].first);
+            }
+            flushed += page_cache->flushPages(page_ids);
+        }
         
-        // Step 3: Ensure WAL is synced to disk
-        wal_manager->sync();
+        // Step 3: Log the end record, it is durable once this returns
+        uint64_t redo_lsn = std::min({begin_lsn, page_cache->oldestDirtyLSN(), wal_manager->oldestActiveLSN()});
+        if (save_page_table) {
+            // Most pages were written above, so this has little left to flush
+            redo_lsn = save_page_table();
+        }
+        uint64_t checkpoint_lsn = wal_manager->endCheckpoint(begin_lsn, redo_lsn);
         
-        // Step 4: Update checkpoint tracking
+        // Step 4: Drop the log before the redo LSN, the checkpoint counts either way
+        if (truncate_wal.load()) {
+            try {
+                wal_manager->truncate(redo_lsn);
+            } catch (const std::exception& e) {
+                LOG_WARN("CheckpointManager: WAL truncation failed, the cleanup job retries it: " << e.what());
+            }
+        }
+        
+        // Step 5: Update checkpoint tracking
         last_checkpoint_lsn.store(checkpoint_lsn);
         last_checkpoint_time.store(std::chrono::steady_clock::now());
         checkpoints_completed.fetch_add(1);
@@ -86,14 +136,15 @@ bool CheckpointManager<KeyType>::performCheckpoint() {
         auto end_time = std::chrono::steady_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
         
-        std::cout << "CheckpointManager: Checkpoint completed successfully (LSN: " 
-                  << checkpoint_lsn << ", duration: " << duration.count() << "ms)" << std::endl;
+        LOG_INFO("CheckpointManager: Checkpoint completed successfully (LSN: "
+                 << checkpoint_lsn << ", redo LSN: " << redo_lsn << ", " << flushed << " of "
+                 << dirty_pages.size() << " pages flushed, duration: " << duration.count() << "ms)");
         
         return true;
         
     } catch (const std::exception& e) {
         checkpoints_failed.fetch_add(1);
-        std::cerr << "CheckpointManager: Checkpoint failed: " << e.what() << std::endl;
+        LOG_ERROR("CheckpointManager: Checkpoint failed: " << e.what());
         return false;
     }
 }
@@ -110,8 +161,8 @@ bool CheckpointManager<KeyType>::shouldCheckpoint() const {
     // Check WAL size trigger
     size_t current_wal_size = wal_manager->getWALSize();
     if (current_wal_size >= wal_size_threshold) {
-        std::cout << "CheckpointManager: WAL size (" << current_wal_size 
-                  << " bytes) exceeds threshold (" << wal_size_threshold << " bytes)" << std::endl;
+        LOG_INFO("CheckpointManager: WAL size (" << current_wal_size
+                 << " bytes) exceeds threshold (" << wal_size_threshold << " bytes)");
         return true;
     }
     
@@ -143,26 +194,23 @@ bool CheckpointManager<KeyType>::checkpointJobFunc() {
 
 template<typename KeyType>
 bool CheckpointManager<KeyType>::cleanupJobFunc() {
-    std::cout << "CheckpointManager: Running WAL cleanup..." << std::endl;
+    LOG_DEBUG("CheckpointManager: Running WAL cleanup...");
     
     try {
         // Get the last successful checkpoint LSN
         uint64_t checkpoint_lsn = last_checkpoint_lsn.load();
         
-        if (checkpoint_lsn > 0) {
-            // Truncate WAL up to the checkpoint (keeping some buffer)
-            uint64_t truncate_lsn = checkpoint_lsn > 100 ? checkpoint_lsn - 100 : 0;
-            
-            if (truncate_lsn > 0) {
-                wal_manager->truncate(truncate_lsn);
-                std::cout << "CheckpointManager: Truncated WAL up to LSN " << truncate_lsn << std::endl;
-            }
+        if (checkpoint_lsn > 0 && truncate_wal.load()) {
+            // Truncate WAL up to the checkpoint, the WAL keeps everything from its redo LSN on
+            wal_manager->truncate(checkpoint_lsn);
+            LOG_INFO("CheckpointManager: Truncated WAL up to LSN " << checkpoint_lsn
+                     << " (" << wal_manager->getWALDiskSize() << " bytes of segments left)");
         }
         
         return true;
         
     } catch (const std::exception& e) {
-        std::cerr << "CheckpointManager: Cleanup failed: " << e.what() << std::endl;
+        LOG_ERROR("CheckpointManager: Cleanup failed: " << e.what());
         return false;
     }
 }
@@ -187,13 +235,30 @@ void CheckpointManager<KeyType>::setCheckpointInterval(std::chrono::milliseconds
 template<typename KeyType>
 void CheckpointManager<KeyType>::setWALSizeThreshold(size_t threshold) {
     wal_size_threshold = threshold;
-    std::cout << "CheckpointManager: Updated WAL size threshold to " << threshold << " bytes" << std::endl;
+    LOG_INFO("CheckpointManager: Updated WAL size threshold to " << threshold << " bytes");
 }
 
 template<typename KeyType>
 void CheckpointManager<KeyType>::setDirtyPageThreshold(size_t threshold) {
     dirty_page_threshold = threshold;
-    std::cout << "CheckpointManager: Updated dirty page threshold to " << threshold << " pages" << std::endl;
+    LOG_INFO("CheckpointManager: Updated dirty page threshold to " << threshold << " pages");
+}
+
+template<typename KeyType>
+void CheckpointManager<KeyType>::setFlushPause(std::chrono::milliseconds pause) {
+    flush_pause = pause;
+    LOG_INFO("CheckpointManager: Updated checkpoint flush pause to " << pause.count() << "ms");
+}
+
+template<typename KeyType>
+void CheckpointManager<KeyType>::setTruncateWAL(bool enabled) {
+    truncate_wal = enabled;
+    LOG_INFO("CheckpointManager: WAL truncation " << (enabled ? "enabled" : "disabled"));
+}
+
+template<typename KeyType>
+void CheckpointManager<KeyType>::setPageTableSaver(std::function<uint64_t()> save) {
+    save_page_table = std::move(save);
 }
 
 template<typename KeyType>
@@ -0,0 +1,144 @@
+#include "checksum.h"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CHECKSUM_CRC32C_SSE42 1
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#define CHECKSUM_CRC32C_ARMV8 1
+#endif
+
+namespace {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78;  // Reflected Castagnoli polynomial
+
+/*
+ tables[0] is the usual byte-at-a-time table. tables[k][b] is the CRC of
+ byte b followed by k zero bytes, so 8 lookups XORed together advance the
+ CRC over 8 input bytes at once.
+*/
+using SliceTables = std::array<std::array<uint32_t, 256>, 8>;
+
+const SliceTables& sliceTables() {
+    static const SliceTables tables = [] {
+        SliceTables t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1u)));
+            }
+            t[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+        return t;
+    }();
+    return tables;
+}
+
+// Loads are little endian, like the CRC itself
+inline uint64_t load64(const uint8_t* bytes) {
+    uint64_t value;
+    std::memcpy(&value, bytes, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+#ifdef CHECKSUM_CRC32C_SSE42
+// Compiled for SSE4.2 only here, crc32c checks the CPU first
+__attribute__((target("sse4.2")))
+uint32_t crc32cSSE42(uint32_t crc, const uint8_t* bytes, size_t size) {
+    uint64_t crc64 = ~crc;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        crc64 = _mm_crc32_u64(crc64, load64(bytes));
+    }
+    uint32_t crc32 = static_cast<uint32_t>(crc64);
+    for (; size > 0; ++bytes, --size) {
+        crc32 = _mm_crc32_u8(crc32, *bytes);
+    }
+    return ~crc32;
+}
+#endif
+
+#ifdef CHECKSUM_CRC32C_ARMV8
+__attribute__((target("+crc")))
+uint32_t crc32cARMv8(uint32_t crc, const uint8_t* bytes, size_t size) {
+    crc = ~crc;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        crc = __crc32cd(crc, load64(bytes));
+    }
+    for (; size > 0; ++bytes, --size) {
+        crc = __crc32cb(crc, *bytes);
+    }
+    return ~crc;
+}
+#endif
+
+using Crc32cFunction = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+uint32_t crc32cSlicing(uint32_t crc, const uint8_t* bytes, size_t size) {
+    const SliceTables& t = sliceTables();
+    crc = ~crc;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word = load64(bytes) ^ crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+              t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    }
+    for (; size > 0; ++bytes, --size) {
+        crc = t[0][(crc ^ *bytes) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+struct Crc32cChoice {
+    Crc32cFunction function;
+    const char* name;
+};
+
+const Crc32cChoice& chosenCrc32c() {
+    static const Crc32cChoice choice = []() -> Crc32cChoice {
+#ifdef CHECKSUM_CRC32C_SSE42
+        if (__builtin_cpu_supports("sse4.2")) {
+            return {crc32cSSE42, "sse4.2"};
+        }
+#endif
+#ifdef CHECKSUM_CRC32C_ARMV8
+#if defined(__ARM_FEATURE_CRC32)
+        return {crc32cARMv8, "armv8"};
+#elif defined(__linux__) && defined(HWCAP_CRC32)
+        if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+            return {crc32cARMv8, "armv8"};
+        }
+#endif
+#endif
+        return {crc32cSlicing, "slicing-by-8"};
+    }();
+    return choice;
+}
+
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+    return chosenCrc32c().function(crc, static_cast<const uint8_t*>(data), size);
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t size) {
+    return crc32cSlicing(crc, static_cast<const uint8_t*>(data), size);
+}
+
+const char* crc32cImplementation() {
+    return chosenCrc32c().name;
+}
@@ -28,8 +28,8 @@ int main() {
         serialized_data.push_back(static_cast<uint8_t>(c));
     }
     
-    page1.data = serialized_data;
-    page2.data = serialized_data;
+    page1.data.assign(serialized_data.begin(), serialized_data.end());
+    page2.data.assign(serialized_data.begin(), serialized_data.end());
     
     // Update content hashes
     page1.updateContentHash();
@@ -44,7 +44,7 @@ int main() {
     
     Page<int> page3 = createPage<int>(true);
     page3.keys = {1, 2, 4}; // Different key
-    page3.data = serialized_data;
+    page3.data.assign(serialized_data.begin(), serialized_data.end());
     page3.updateContentHash();
     
     std::cout << "Page 3 content hash: " << page3.getContentHash() << std::endl;
@@ -25,9 +25,9 @@ int main() {
     std::vector<uint8_t> data2 = {1, 2, 3, 4, 5}; // Same as data1
     std::vector<uint8_t> data3 = {1, 2, 3, 4, 6}; // Different from data1
     
-    std::string hash1 = ContentHash::computeHash(data1);
-    std::string hash2 = ContentHash::computeHash(data2);
-    std::string hash3 = ContentHash::computeHash(data3);
+    ContentHash hash1 = ContentHash::computeHash(data1);
+    ContentHash hash2 = ContentHash::computeHash(data2);
+    ContentHash hash3 = ContentHash::computeHash(data3);
     
     std::cout << "\nHash of data1: " << hash1 << std::endl;
     std::cout << "Hash of data2: " << hash2 << std::endl;
@@ -29,16 +29,14 @@ int main() {
     tree.printStorageStats();
     
     std::cout << "\n5. Testing search functionality..." << std::endl;
-    std::string* result1 = tree.search(1);
-    std::string* result5 = tree.search(5);
+    auto result1 = tree.lookup(1);
+    auto result5 = tree.lookup(5);
     
     if (result1) {
         std::cout << "Found key 1: " << *result1 << std::endl;
-        delete result1;
     }
     if (result5) {
         std::cout << "Found key 5: " << *result5 << std::endl;
-        delete result5;
     }
     
     std::cout << "\n6. Final storage statistics:" << std::endl;
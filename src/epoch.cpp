@@ -0,0 +1,61 @@
+#include "epoch.h"
+
+EpochManager::EpochManager()
+    : global_epoch(0), pinned{}, retired_count(0), reclaimed_count(0) {}
+
+/*
+ Count ourselves in at the current epoch, then check it is still current.
+ If it moved on in between, tryReclaim may not have seen us, so count in
+ again at the new one.
+*/
+EpochManager::Guard::Guard(EpochManager& manager) : manager(&manager), epoch(0) {
+    while (true) {
+        epoch = manager.global_epoch.load();
+        manager.pinned[epoch % 3].fetch_add(1);
+        if (manager.global_epoch.load() == epoch) {
+            return;
+        }
+        manager.pinned[epoch % 3].fetch_sub(1);
+    }
+}
+
+EpochManager::Guard::~Guard() {
+    manager->pinned[epoch % 3].fetch_sub(1);
+}
+
+void EpochManager::retire(std::vector<std::shared_ptr<void>>&& objects) {
+    if (objects.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(limbo_mutex);
+    auto& current = limbo[global_epoch.load() % 3];
+    retired_count += objects.size();
+    current.insert(current.end(), std::make_move_iterator(objects.begin()), std::make_move_iterator(objects.end()));
+    objects.clear();
+}
+
+/*
+ Readers pinned at e - 1 could still be looking at what was retired then,
+ so with any of them left the epoch stays. Otherwise the limbo of e - 1
+ (which e + 2 reuses) is freed, outside the lock, and the epoch advances.
+*/
+size_t EpochManager::tryReclaim() {
+    std::vector<std::shared_ptr<void>> freed;
+    {
+        std::lock_guard<std::mutex> lock(limbo_mutex);
+        uint64_t epoch = global_epoch.load();
+        size_t previous = (epoch + 2) % 3;
+        if (pinned[previous].load() != 0) {
+            return 0;
+        }
+        freed.swap(limbo[previous]);
+        reclaimed_count += freed.size();
+        global_epoch.store(epoch + 1);
+    }
+    return freed.size();
+}
+
+size_t EpochManager::awaitingReclaim() const {
+    std::lock_guard<std::mutex> lock(limbo_mutex);
+    return retired_count - reclaimed_count;
+}
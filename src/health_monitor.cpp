@@ -1,4 +1,5 @@
 #include "health_monitor.h"
+#include "metrics.h"
 #include <iostream>
 #include <algorithm>
 
@@ -71,6 +72,12 @@ void HealthMonitor::addMetric(ComponentType type, const std::string& metric_name
               << it->second->name << std::endl;
 }
 
+void HealthMonitor::addMetricSource(ComponentType type, const std::string& metric_name,
+                                    std::function<double()> source) {
+    std::lock_guard<std::mutex> lock(sources_mutex);
+    metric_sources.push_back({type, metric_name, std::move(source)});
+}
+
 void HealthMonitor::registerRecoveryAction(ComponentType type, std::function<bool()> recovery_func) {
     recovery_actions[type] = recovery_func;
     
@@ -382,7 +389,28 @@ void HealthMonitor::setRecoveryCooldown(std::chrono::minutes cooldown) {
     recovery_cooldown = cooldown;
 }
 
+void HealthMonitor::setMetricsExportPath(const std::string& path) {
+    std::lock_guard<std::mutex> lock(sources_mutex);
+    metrics_export_path = path;
+}
+
+/*
+ Sample the metric sources first, so the check sees fresh values. They
+ run outside health_mutex, since they read other components. The export happens on
+ the same schedule, a scraper reads whatever the last check wrote.
+*/
 bool HealthMonitor::healthCheckJobFunc() {
+    std::string export_path;
+    {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        for (const auto& source : metric_sources) {
+            updateMetric(source.type, source.metric_name, source.sample());
+        }
+        export_path = metrics_export_path;
+    }
+    if (!export_path.empty() && !metrics::writePrometheusFile(export_path)) {
+        std::cerr << "HealthMonitor: Could not write metrics to " << export_path << std::endl;
+    }
     return performHealthCheck();
 }
 
@@ -1,13 +1,132 @@
 #include "job_scheduler.h"
+#include "log.h"
 #include <iostream>
 #include <algorithm>
 
+/*
+ Timer wheel
+*/
+
+template<typename Task>
+void TimerWheel<Task>::add(uint64_t deadline, Task task) {
+    // The current tick is done already, so anything due by now expires with the next one
+    place(Timer{std::max(deadline, current + 1), std::move(task)});
+    count++;
+}
+
+/*
+ The lowest level whose slot covers the deadline, with current in the
+ same rotation of the level above. Level 0 slots hold exactly one tick.
+*/
+template<typename Task>
+void TimerWheel<Task>::place(Timer&& timer) {
+    uint64_t deadline = std::max(timer.deadline, current);
+    for (size_t level = 0; level < LEVELS; ++level) {
+        size_t above = SLOT_BITS * (level + 1);
+        if ((deadline >> above) == (current >> above)) {
+            slots[level][(deadline >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(std::move(timer));
+            return;
+        }
+    }
+    overflow.push_back(std::move(timer));
+}
+
+/*
+ Jumps straight to the tick before the next event, so the cost is in the
+ events, not in the ticks. At a tick where level rotations complete, the
+ highest level is cascaded first since its timers may land in the slot of
+ a lower level that is about to be cascaded as well.
+*/
+template<typename Task>
+void TimerWheel<Task>::advance(uint64_t now, std::vector<Task>& expired) {
+    while (current < now) {
+        uint64_t next = nextEvent();
+        if (next > now) {
+            current = now;
+            return;
+        }
+        current = next;
+
+        size_t top = 0;
+        while (top < LEVELS && (current & ((uint64_t(1) << (SLOT_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        if (top == LEVELS) {
+            std::vector<Timer> cascading;
+            cascading.swap(overflow);
+            for (auto& timer : cascading) {
+                place(std::move(timer));
+            }
+            top = LEVELS - 1;
+        }
+        for (size_t level = top; level > 0; --level) {
+            std::vector<Timer> cascading;
+            cascading.swap(slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+            for (auto& timer : cascading) {
+                place(std::move(timer));
+            }
+        }
+
+        auto& due = slots[0][current & (SLOTS - 1)];
+        for (auto& timer : due) {
+            expired.push_back(std::move(timer.task));
+        }
+        count -= due.size();
+        due.clear();
+    }
+}
+
+/*
+ A level's timers all sit in slots after current's own one in the current
+ rotation of the level above, and a slot of level L is cascaded at the
+ first tick it covers, so the first non-empty slot found going up the
+ levels is the next event.
+*/
+template<typename Task>
+uint64_t TimerWheel<Task>::nextEvent() const {
+    if (count == 0) {
+        return NO_EVENT;
+    }
+    for (size_t level = 0; level < LEVELS; ++level) {
+        size_t shift = SLOT_BITS * level;
+        for (uint64_t slot = (current >> shift) + 1; (slot & (SLOTS - 1)) != 0; ++slot) {
+            if (!slots[level][slot & (SLOTS - 1)].empty()) {
+                return slot << shift;
+            }
+        }
+    }
+    size_t shift = SLOT_BITS * LEVELS;
+    return ((current >> shift) + 1) << shift;  // Only the overflow is left
+}
+
+template<typename Task>
+void TimerWheel<Task>::clear() {
+    for (auto& level : slots) {
+        for (auto& slot : level) {
+            slot.clear();
+        }
+    }
+    overflow.clear();
+    count = 0;
+}
+
+// The worker the calling thread is, so that jobs it schedules stay on its own deques
+namespace {
+thread_local const JobScheduler* worker_scheduler = nullptr;
+thread_local size_t worker_index = 0;
+}
+
 JobScheduler::JobScheduler(size_t num_threads) 
-    : num_workers(num_threads), running(false), next_job_id(1),
-      total_jobs_executed(0), failed_jobs(0), successful_jobs(0),
-      last_health_check(std::chrono::steady_clock::now()) {
+    : num_workers(num_threads), running(false), next_queue(0), ready_count{}, pending_jobs(0),
+      timer_epoch(std::chrono::steady_clock::now()), timer_wakeup(TimerWheel<TimerTask>::NO_EVENT),
+      next_job_id(1), total_jobs_executed(0), failed_jobs(0), successful_jobs(0), timed_out_jobs(0),
+      last_health_check(std::chrono::steady_clock::now()), next_generation(1) {
+    
+    for (size_t i = 0; i < std::max<size_t>(num_workers, 1); ++i) {
+        worker_queues.push_back(std::make_unique<WorkerQueue>());
+    }
     
-    std::cout << "JobScheduler: Initialized with " << num_workers << " worker threads" << std::endl;
+    LOG_INFO("JobScheduler: Initialized with " << num_workers << " worker threads");
 }
 
 JobScheduler::~JobScheduler() {
@@ -26,9 +145,9 @@ void JobScheduler::start() {
         worker_threads.emplace_back(&JobScheduler::workerThread, this, i);
     }
     
-    worker_threads.emplace_back(&JobScheduler::schedulerThread, this);
+    worker_threads.emplace_back(&JobScheduler::timerThread, this);
     
-    std::cout << "JobScheduler: Started with " << num_workers << " workers + 1 scheduler thread" << std::endl;
+    LOG_INFO("JobScheduler: Started with " << num_workers << " workers + 1 timer thread");
 }
 
 void JobScheduler::stop() {
@@ -36,11 +155,19 @@ void JobScheduler::stop() {
         return; // Already stopped
     }
     
-    std::cout << "JobScheduler: Stopping" << std::endl;
+    LOG_INFO("JobScheduler: Stopping");
     
-    // Signal all threads to stop
+    // Signal all threads to stop. Taking each lock once makes sure nobody
+    // is between checking running and going to sleep when we notify
     running.store(false);
-    queue_cv.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+    }
+    work_cv.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex);
+    }
+    timer_cv.notify_all();
     
     // Wait for all threads to finish
     for (auto& thread : worker_threads) {
@@ -50,7 +177,7 @@ void JobScheduler::stop() {
     }
     
     worker_threads.clear();
-    std::cout << "JobScheduler: All threads stopped" << std::endl;
+    LOG_INFO("JobScheduler: All threads stopped");
 }
 
 uint64_t JobScheduler::scheduleJob(JobType type, JobPriority priority, 
@@ -61,19 +188,19 @@ uint64_t JobScheduler::scheduleJob(JobType type, JobPriority priority,
     auto job = std::make_shared<Job>(job_id, type, priority, job_func, description, timeout);
     job->scheduled_at = std::chrono::steady_clock::now() + delay;
     
-    {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        job_queue.push(job);
-    }
-    
     {
         std::lock_guard<std::mutex> lock(jobs_mutex);
         active_jobs[job_id] = job;
     }
+    pending_jobs.fetch_add(1);
     
-    queue_cv.notify_one();
+    if (delay.count() > 0) {
+        addTimer(job->scheduled_at, {TimerTask::Kind::DELAYED_JOB, job, {}, {}, 0});
+    } else {
+        enqueueReady(job);
+    }
     
-    std::cout << "JobScheduler: Scheduled " << description << " (ID: " << job_id << ")" << std::endl;
+    LOG_DEBUG("JobScheduler: Scheduled " << description << " (ID: " << job_id << ")");
     return job_id;
 }
 
@@ -95,7 +222,7 @@ bool JobScheduler::addRecurringJob(const std::string& name, std::chrono::millise
     std::lock_guard<std::mutex> lock(recurring_jobs_mutex);
     
     if (recurring_jobs.find(name) != recurring_jobs.end()) {
-        std::cout << "JobScheduler: Recurring job '" << name << "' already exists" << std::endl;
+        LOG_WARN("JobScheduler: Recurring job '" << name << "' already exists");
         return false;
     }
     
@@ -106,11 +233,13 @@ bool JobScheduler::addRecurringJob(const std::string& name, std::chrono::millise
     info.description = description;
     info.priority = priority;
     info.enabled = true;
+    info.generation = next_generation++;
     
     recurring_jobs[name] = info;
+    addTimer(info.next_execution, {TimerTask::Kind::RECURRING_JOB, nullptr, {}, name, info.generation});
     
-    std::cout << "JobScheduler: Added recurring job '" << name << "' with " 
-              << interval.count() << "ms interval" << std::endl;
+    LOG_INFO("JobScheduler: Added recurring job '" << name << "' with "
+             << interval.count() << "ms interval");
     return true;
 }
 
@@ -123,7 +252,7 @@ bool JobScheduler::removeRecurringJob(const std::string& name) {
     }
     
     recurring_jobs.erase(it);
-    std::cout << "JobScheduler: Removed recurring job '" << name << "'" << std::endl;
+    LOG_INFO("JobScheduler: Removed recurring job '" << name << "'");
     return true;
 }
 
@@ -136,71 +265,189 @@ bool JobScheduler::enableRecurringJob(const std::string& name, bool enabled) {
     }
     
     it->second.enabled = enabled;
-    std::cout << "JobScheduler: " << (enabled ? "Enabled" : "Disabled") 
-              << " recurring job '" << name << "'" << std::endl;
+    LOG_INFO("JobScheduler: " << (enabled ? "Enabled" : "Disabled")
+             << " recurring job '" << name << "'");
     return true;
 }
 
-void JobScheduler::workerThread(int worker_id) {
-    std::cout << "JobScheduler: Worker " << worker_id << " started" << std::endl;
-    
-    while (running.load()) {
-        std::shared_ptr<Job> job;
-        
-        // Get next job from queue
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            
-            // Wait for a job or shutdown signal
-            queue_cv.wait(lock, [this] { 
-                return !job_queue.empty() || !running.load(); 
-            });
-            
-            if (!running.load() && job_queue.empty()) {
-                break; // Shutdown
+/*
+ Within a priority the owner takes its oldest job and thieves the newest,
+ so the two mostly work on opposite ends of a deque. Priorities with
+ nothing queued anywhere are skipped without touching the deques.
+*/
+std::shared_ptr<Job> JobScheduler::takeJob(size_t worker_id) {
+    size_t queues = worker_queues.size();
+    
+    for (size_t level = PRIORITY_LEVELS; level-- > 0;) {
+        if (ready_count[level].load() == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < queues; ++i) {
+            WorkerQueue& queue = *worker_queues[(worker_id + i) % queues];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            auto& ready = queue.ready[level];
+            if (ready.empty()) {
+                continue;
             }
             
-            if (!job_queue.empty()) {
-                job = job_queue.top();
-                
-                // Check if job is ready to run
-                auto now = std::chrono::steady_clock::now();
-                if (job->scheduled_at > now) {
-                    // Not ready yet put it back and wait
-                    continue;
-                }
-                
-                job_queue.pop();
-                job->status = JobStatus::RUNNING;
+            std::shared_ptr<Job> job;
+            if (i == 0) {
+                job = std::move(ready.front());
+                ready.pop_front();
+            } else {
+                job = std::move(ready.back());
+                ready.pop_back();
             }
+            ready_count[level].fetch_sub(1);
+            return job;
         }
+    }
+    
+    return nullptr;
+}
+
+size_t JobScheduler::readyJobs() const {
+    size_t total = 0;
+    for (const auto& count : ready_count) {
+        total += count.load();
+    }
+    return total;
+}
+
+void JobScheduler::enqueueReady(std::shared_ptr<Job> job) {
+    size_t target = worker_scheduler == this ? worker_index
+                                             : next_queue.fetch_add(1) % worker_queues.size();
+    size_t level = static_cast<size_t>(job->priority);
+    
+    {
+        WorkerQueue& queue = *worker_queues[target];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.ready[level].push_back(std::move(job));
+        ready_count[level].fetch_add(1);  // Under the lock, so whoever takes the job sees it counted
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+    }
+    work_cv.notify_one();
+}
+
+void JobScheduler::workerThread(int worker_id) {
+    LOG_DEBUG("JobScheduler: Worker " << worker_id << " started");
+    
+    worker_scheduler = this;
+    worker_index = worker_id;
+    
+    while (true) {
+        std::shared_ptr<Job> job = takeJob(worker_id);
         
         if (job) {
-            executeJob(job);
+            // A job cancelled while it was queued stays in the deque, drop it here
+            JobStatus expected = JobStatus::PENDING;
+            if (job->status.compare_exchange_strong(expected, JobStatus::RUNNING)) {
+                pending_jobs.fetch_sub(1);
+                executeJob(job);
+            }
+            continue;
+        }
+        
+        // Wait for a job or shutdown signal, what is queued still runs before we stop
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        work_cv.wait(lock, [this] {
+            return readyJobs() > 0 || !running.load();
+        });
+        
+        if (!running.load() && readyJobs() == 0) {
+            break; // Shutdown
         }
     }
     
-    std::cout << "JobScheduler: Worker " << worker_id << " finished" << std::endl;
+    worker_scheduler = nullptr;
+    LOG_DEBUG("JobScheduler: Worker " << worker_id << " finished");
+}
+
+uint64_t JobScheduler::tickAt(std::chrono::steady_clock::time_point when) const {
+    if (when <= timer_epoch) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(when - timer_epoch).count() /
+           TimerWheel<TimerTask>::TICK.count();
+}
+
+void JobScheduler::addTimer(std::chrono::steady_clock::time_point when, TimerTask task) {
+    // Round up, a timer never fires early
+    uint64_t deadline = tickAt(when + TimerWheel<TimerTask>::TICK - std::chrono::nanoseconds(1));
+    
+    std::lock_guard<std::mutex> lock(timer_mutex);
+    timer_wheel.add(deadline, std::move(task));
+    if (deadline < timer_wakeup) {
+        timer_cv.notify_one();
+    }
 }
 
-void JobScheduler::schedulerThread() {
-    std::cout << "JobScheduler: Scheduler thread started" << std::endl;
+/*
+ Sleeps until the wheel's next event, or until a timer earlier than that
+ is added. Expired timers are handled outside timer_mutex, running a
+ recurring job schedules it and adds its next timer.
+*/
+void JobScheduler::timerThread() {
+    LOG_DEBUG("JobScheduler: Timer thread started");
+    
+    std::vector<TimerTask> expired;
+    std::unique_lock<std::mutex> lock(timer_mutex);
     
     while (running.load()) {
-        scheduleRecurringJobs();
+        timer_wheel.advance(tickAt(std::chrono::steady_clock::now()), expired);
         
-        // Sleep for a short interval
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (!expired.empty()) {
+            timer_wakeup = 0;  // Busy, whoever adds a timer doesn't need to wake us
+            lock.unlock();
+            for (const auto& task : expired) {
+                switch (task.kind) {
+                    case TimerTask::Kind::DELAYED_JOB:
+                        if (task.job->status.load() == JobStatus::PENDING) {
+                            enqueueReady(task.job);
+                        }
+                        break;
+                    case TimerTask::Kind::RECURRING_JOB:
+                        runRecurringJob(task);
+                        break;
+                    case TimerTask::Kind::JOB_TIMEOUT:
+                        if (auto job = task.running_job.lock()) {
+                            if (job->status.load() == JobStatus::RUNNING) {
+                                handleJobTimeout(job);
+                            }
+                        }
+                        break;
+                }
+            }
+            expired.clear();
+            lock.lock();
+            continue;
+        }
+        
+        timer_wakeup = timer_wheel.nextEvent();
+        if (timer_wakeup == TimerWheel<TimerTask>::NO_EVENT) {
+            timer_cv.wait(lock);
+        } else {
+            timer_cv.wait_until(lock, timer_epoch + TimerWheel<TimerTask>::TICK * timer_wakeup);
+        }
     }
     
-    std::cout << "JobScheduler: Scheduler thread finished" << std::endl;
+    timer_wakeup = TimerWheel<TimerTask>::NO_EVENT;
+    LOG_DEBUG("JobScheduler: Timer thread finished");
 }
 
 bool JobScheduler::executeJob(std::shared_ptr<Job> job) {
     auto start_time = std::chrono::steady_clock::now();
     
-    std::cout << "JobScheduler: Executing " << job->description 
-              << " (ID: " << job->job_id << ")" << std::endl;
+    LOG_DEBUG("JobScheduler: Executing " << job->description
+              << " (ID: " << job->job_id << ")");
+    
+    if (job->timeout.count() > 0) {
+        TimerTask timeout{TimerTask::Kind::JOB_TIMEOUT, nullptr, job, {}, 0};
+        addTimer(start_time + job->timeout, std::move(timeout));
+    }
     
     bool success = false;
     try {
@@ -215,8 +462,7 @@ bool JobScheduler::executeJob(std::shared_ptr<Job> job) {
         }
         
     } catch (const std::exception& e) {
-        std::cerr << "JobScheduler: Job " << job->job_id 
-                  << " threw exception: " << e.what() << std::endl;
+        LOG_ERROR("JobScheduler: Job " << job->job_id << " threw exception: " << e.what());
         job->status = JobStatus::FAILED;
         failed_jobs.fetch_add(1);
     }
@@ -226,8 +472,8 @@ bool JobScheduler::executeJob(std::shared_ptr<Job> job) {
     auto end_time = std::chrono::steady_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
     
-    std::cout << "JobScheduler: " << (success ? "Completed" : "Failed") 
-              << " " << job->description << " in " << duration.count() << "ms" << std::endl;
+    LOG_DEBUG("JobScheduler: " << (success ? "Completed" : "Failed")
+              << " " << job->description << " in " << duration.count() << "ms");
     
     {
         std::lock_guard<std::mutex> lock(jobs_mutex);
@@ -238,21 +484,67 @@ bool JobScheduler::executeJob(std::shared_ptr<Job> job) {
     return success;
 }
 
-void JobScheduler::scheduleRecurringJobs() {
+/*
+ A job can't be interrupted, so running past its timeout is reported and
+ counted, and the job gets to finish.
+*/
+void JobScheduler::handleJobTimeout(std::shared_ptr<Job> job) {
+    timed_out_jobs.fetch_add(1);
+    LOG_WARN("JobScheduler: " << job->description << " (ID: " << job->job_id
+             << ") is running past its " << job->timeout.count() << "ms timeout");
+}
+
+/*
+ Recurring jobs run at a fixed rate from when they were added. One that
+ fell more than an interval behind skips ahead instead of catching up.
+ A disabled job keeps its timer and just doesn't run.
+*/
+void JobScheduler::runRecurringJob(const TimerTask& task) {
     std::lock_guard<std::mutex> lock(recurring_jobs_mutex);
-    auto now = std::chrono::steady_clock::now();
     
-    for (auto& [name, info] : recurring_jobs) {
-        if (!info.enabled || now < info.next_execution) {
-            continue;
-        }
-        
-        // Schedule the recurring job
+    auto it = recurring_jobs.find(task.recurring_name);
+    if (it == recurring_jobs.end() || it->second.generation != task.generation) {
+        return; // Removed since
+    }
+    
+    auto& info = it->second;
+    if (info.enabled) {
         scheduleJob(JobType::CUSTOM, info.priority, info.job_func, 
                    info.description + " (recurring)");
-        
+    }
+    
+    auto now = std::chrono::steady_clock::now();
+    info.next_execution += info.interval;
+    if (info.next_execution <= now) {
         info.next_execution = now + info.interval;
     }
+    addTimer(info.next_execution, task);
+}
+
+bool JobScheduler::cancelJob(uint64_t job_id) {
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        
+        auto it = active_jobs.find(job_id);
+        if (it == active_jobs.end()) {
+            return false;
+        }
+        
+        // Whoever moves the job out of PENDING first wins, a worker taking it or us
+        JobStatus expected = JobStatus::PENDING;
+        if (!it->second->status.compare_exchange_strong(expected, JobStatus::CANCELLED)) {
+            return false;
+        }
+        
+        job = it->second;
+        active_jobs.erase(it);
+        completed_jobs[job_id] = job;
+    }
+    pending_jobs.fetch_sub(1);
+    
+    LOG_DEBUG("JobScheduler: Cancelled " << job->description << " (ID: " << job_id << ")");
+    return true;
 }
 
 JobStatus JobScheduler::getJobStatus(uint64_t job_id) {
@@ -290,7 +582,7 @@ std::shared_ptr<Job> JobScheduler::getJob(uint64_t job_id) {
 JobScheduler::SchedulerStats JobScheduler::getStats() const {
     std::lock_guard<std::mutex> lock(jobs_mutex);
     
-    size_t pending = job_queue.size();
+    size_t pending = pending_jobs.load();
     size_t active = active_jobs.size();
     size_t total = total_jobs_executed.load();
     size_t successful = successful_jobs.load();
@@ -299,7 +591,8 @@ JobScheduler::SchedulerStats JobScheduler::getStats() const {
     double success_rate = total > 0 ? (double)successful / total * 100.0 : 0.0;
     bool healthy = success_rate >= 99.98; // 99.98% uptime target
     
-    return {pending, active, total, successful, failed, success_rate, num_workers, healthy};
+    return {pending, active, total, successful, failed, success_rate, num_workers, healthy,
+            timed_out_jobs.load()};
 }
 
 void JobScheduler::printStats() const {
@@ -312,6 +605,7 @@ void JobScheduler::printStats() const {
     std::cout << "Successful: " << stats.successful << std::endl;
     std::cout << "Failed: " << stats.failed << std::endl;
     std::cout << "Success rate: " << stats.success_rate << "%" << std::endl;
+    std::cout << "Timed out: " << stats.timed_out << std::endl;
     std::cout << "Worker threads: " << stats.worker_threads << std::endl;
     std::cout << "Health status: " << (stats.is_healthy ? "HEALTHY" : "UNHEALTHY") << std::endl;
     std::cout << "================================" << std::endl;
@@ -339,6 +633,8 @@ void JobScheduler::cleanupCompletedJobs(std::chrono::hours max_age) {
     }
     
     if (cleaned > 0) {
-        std::cout << "JobScheduler: Cleaned up " << cleaned << " old completed jobs" << std::endl;
+        LOG_DEBUG("JobScheduler: Cleaned up " << cleaned << " old completed jobs");
     }
 }
+
+template class TimerWheel<JobScheduler::TimerTask>;
@@ -25,7 +25,12 @@ int main() {
         50  // Checkpoint when > 50 dirty pages
     );
     
+    // Checkpoints save the tree's page table, so a restart redoes the WAL from their redo LSN
+    checkpoint_mgr.setPageTableSaver([&tree] { return tree.checkpoint(); });
     checkpoint_mgr.start();
+
+    // Free the blocks of page contents nobody refers to anymore
+    tree.getContentStorage().startGarbageCollection(&scheduler, std::chrono::seconds(5));
     
     std::cout << "\n1. System started - scheduler and checkpoint manager active" << std::endl;
     scheduler.printStats();
@@ -146,6 +151,7 @@ int main() {
     std::cout << "\n12. Shutting down systems..." << std::endl;
     scheduler.removeRecurringJob("health_check");
     checkpoint_mgr.stop();
+    tree.getContentStorage().stopGarbageCollection();
     scheduler.stop();
     
     std::cout << "\n=== Demo completed successfully! ===" << std::endl;
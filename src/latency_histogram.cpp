@@ -0,0 +1,72 @@
+#include "latency_histogram.h"
+#include <algorithm>
+#include <cmath>
+
+/*
+ A value with its highest bit at position b >= SUB_BUCKET_BITS lands in
+ the group of b, at the sub-bucket given by the SUB_BUCKET_BITS bits
+ right below that highest bit.
+*/
+size_t LatencyHistogram::bucketFor(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+    size_t high_bit = 63 - static_cast<size_t>(__builtin_clzll(value));
+    size_t shift = high_bit - SUB_BUCKET_BITS;
+    size_t sub_bucket = static_cast<size_t>(value >> shift) & (SUB_BUCKETS - 1);
+    return (shift + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    size_t shift = bucket / SUB_BUCKETS - 1;
+    uint64_t sub_bucket = bucket % SUB_BUCKETS;
+    uint64_t first = (SUB_BUCKETS + sub_bucket) << shift;
+    return first + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t value) {
+    counts[bucketFor(value)]++;
+    total++;
+    sum += value;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+}
+
+void LatencyHistogram::reset() {
+    counts.fill(0);
+    total = 0;
+    sum = 0;
+    min_value = UINT64_MAX;
+    max_value = 0;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+    if (total == 0) {
+        return 0;
+    }
+    // The rank of the value we want, 1-based: p50 of 10 values is the 5th
+    uint64_t rank = static_cast<uint64_t>(std::ceil(percent / 100.0 * total));
+    rank = std::max<uint64_t>(1, std::min(rank, total));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::min(bucketUpperBound(i), max_value);
+        }
+    }
+    return max_value;
+}
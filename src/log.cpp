@@ -0,0 +1,44 @@
+#include "log.h"
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <cctype>
+
+// BTREE_LOG_LEVEL if it names a level, INFO otherwise
+static int initialLevel() {
+    LogLevel level = LogLevel::INFO;
+    if (const char* name = std::getenv("BTREE_LOG_LEVEL")) {
+        if (!Log::parseLevel(name, level)) {
+            std::cerr << "Log: Unknown BTREE_LOG_LEVEL '" << name << "', using info" << std::endl;
+        }
+    }
+    return static_cast<int>(level);
+}
+
+std::atomic<int> Log::current_level(initialLevel());
+
+bool Log::parseLevel(const std::string& name, LogLevel& level) {
+    std::string lower(name);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    static const std::pair<const char*, LogLevel> levels[] = {
+        {"trace", LogLevel::TRACE}, {"debug", LogLevel::DEBUG}, {"info", LogLevel::INFO},
+        {"warn", LogLevel::WARN}, {"error", LogLevel::ERROR}, {"off", LogLevel::OFF},
+    };
+    for (const auto& [level_name, value] : levels) {
+        if (lower == level_name) {
+            level = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Log::write(LogLevel level, const std::string& line) {
+    std::string out;
+    out.reserve(line.size() + 1);
+    out += line;
+    out += '\n';
+    std::ostream& stream = level >= LogLevel::WARN ? std::cerr : std::cout;
+    stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+}
@@ -1,21 +1,81 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <cstdlib>
 #include "btree.h"
+#include "read_only_btree.h"
+
+/*
+ Read-only shell over a snapshot file, what an analytic replica runs. Only
+ lookups and scans, straight from the mapped file.
+*/
+static int runReplica(const std::string& snapshot_path) {
+    ReadOnlyBTree<int, std::string> tree(snapshot_path);
+    std::cout << "=== Read-only replica of " << snapshot_path << " (" << tree.pageCount() << " pages) ===" << std::endl;
+    std::cout << "Commands: search <key>, scan <lo> <hi>, quit" << std::endl;
+
+    std::string command;
+    while (std::cout << "\n> " && std::getline(std::cin, command)) {
+        std::istringstream iss(command);
+        std::string cmd;
+        iss >> cmd;
+        int key, lo, hi;
+
+        if (cmd == "quit" || cmd == "exit") {
+            break;
+        } else if (cmd == "search" && iss >> key) {
+            auto result = tree.lookup(key);
+            if (result) {
+                std::cout << "Found key: " << key << " -> " << *result << std::endl;
+            } else {
+                std::cout << "Key not found: " << key << std::endl;
+            }
+        } else if (cmd == "scan" && iss >> lo >> hi) {
+            size_t count = 0;
+            for (auto cursor = tree.scan(lo, hi); cursor.valid(); cursor.next()) {
+                std::cout << cursor.key() << " -> " << cursor.value() << std::endl;
+                count++;
+            }
+            std::cout << "Scanned " << count << " keys" << std::endl;
+        } else if (!cmd.empty()) {
+            std::cout << "Read-only replica, available commands: search, scan, quit" << std::endl;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && std::string(argv[1]) == "--replica") {
+        try {
+            return runReplica(argv[2]);
+        } catch (const std::exception& e) {
+            std::cerr << "Error opening replica: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // --recover picks up the tree the last run left in btree.db, instead of starting empty
+    BTreeOptions options;
+    options.recover_from_wal = argc == 2 && std::string(argv[1]) == "--recover";
 
-int main() {
     std::cout << "=== B-Tree Database Test Interface ===" << std::endl;
     std::cout << "Commands:" << std::endl;
     std::cout << "  insert <key> <value>  - Insert a key-value pair" << std::endl;
     std::cout << "  delete <key>          - Delete a key" << std::endl;
     std::cout << "  search <key>          - Search for a key" << std::endl;
+    std::cout << "  scan <lo> <hi>        - List keys in [lo, hi] in order" << std::endl;
     std::cout << "  print                 - Print tree structure" << std::endl;
     std::cout << "  stats                 - Show storage statistics" << std::endl;
+    std::cout << "  snapshot <path>       - Write a snapshot for --replica <path>" << std::endl;
+    std::cout << "  commit                - Commit the changes so far" << std::endl;
+    std::cout << "  abort                 - Roll back the changes since the last commit" << std::endl;
+    std::cout << "  checkpoint            - Write every page and save the page table" << std::endl;
+    std::cout << "  crash                 - Exit without flushing anything, for --recover" << std::endl;
     std::cout << "  quit                  - Exit" << std::endl;
     std::cout << "=====================================" << std::endl;
 
     // Create a B-tree with max 3 keys per node for easy testing
-    BTree<int, std::string> tree(3);
+    BTree<int, std::string> tree(3, options);
     
     std::string command;
     while (true) {
@@ -60,10 +120,9 @@ int main() {
         else if (cmd == "search") {
             int key;
             if (iss >> key) {
-                std::string* result = tree.search(key);
+                auto result = tree.lookup(key);
                 if (result) {
                     std::cout << "Found key: " << key << " -> " << *result << std::endl;
-                    delete result; // Clean up the allocated memory
                 } else {
                     std::cout << "Key not found: " << key << std::endl;
                 }
@@ -71,6 +130,19 @@ int main() {
                 std::cout << "Usage: search <key>" << std::endl;
             }
         }
+        else if (cmd == "scan") {
+            int lo, hi;
+            if (iss >> lo >> hi) {
+                size_t count = 0;
+                for (auto cursor = tree.scan(lo, hi); cursor.valid(); cursor.next()) {
+                    std::cout << cursor.key() << " -> " << cursor.value() << std::endl;
+                    count++;
+                }
+                std::cout << "Scanned " << count << " keys" << std::endl;
+            } else {
+                std::cout << "Usage: scan <lo> <hi>" << std::endl;
+            }
+        }
         else if (cmd == "print") {
             std::cout << "Tree structure (simplified):" << std::endl;
             std::cout << "B-tree with max " << 3 << " keys per node" << std::endl;
@@ -78,12 +150,41 @@ int main() {
         else if (cmd == "stats") {
             tree.printStorageStats();
         }
+        else if (cmd == "snapshot") {
+            std::string path;
+            if (iss >> path) {
+                try {
+                    size_t pages = tree.exportSnapshot(path);
+                    std::cout << "Wrote " << pages << " pages to " << path << std::endl;
+                } catch (const std::exception& e) {
+                    std::cout << "Error writing snapshot: " << e.what() << std::endl;
+                }
+            } else {
+                std::cout << "Usage: snapshot <path>" << std::endl;
+            }
+        }
+        else if (cmd == "commit") {
+            tree.commitTransaction();
+            std::cout << "Committed" << std::endl;
+        }
+        else if (cmd == "abort") {
+            tree.abortTransaction();
+            std::cout << "Aborted" << std::endl;
+        }
+        else if (cmd == "checkpoint") {
+            uint64_t redo_lsn = tree.checkpoint();
+            std::cout << "Checkpoint saved, a restart redoes from LSN " << redo_lsn << std::endl;
+        }
+        else if (cmd == "crash") {
+            std::cout << "Crashing" << std::endl;
+            std::_Exit(0);  // No destructors, so no flush, commit or page table save
+        }
         else if (cmd.empty()) {
             continue;
         }
         else {
             std::cout << "Unknown command: " << cmd << std::endl;
-            std::cout << "Available commands: insert, delete, search, print, stats, quit" << std::endl;
+            std::cout << "Available commands: insert, delete, search, scan, print, stats, snapshot, commit, abort, checkpoint, crash, quit" << std::endl;
         }
     }
     
@@ -0,0 +1,115 @@
+#include "mapped_snapshot.h"
+#include "checksum.h"
+#include "log.h"
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int adviceFor(SnapshotAccess access) {
+    switch (access) {
+        case SnapshotAccess::RANDOM: return MADV_RANDOM;
+        case SnapshotAccess::SEQUENTIAL: return MADV_SEQUENTIAL;
+        default: return MADV_NORMAL;
+    }
+}
+
+/*
+ Map the whole file read-only and check that it is a snapshot we can read.
+ A bad file throws here rather than on some later lookup, except for
+ damaged page images, which PageView catches when they are read.
+*/
+MappedSnapshot::MappedSnapshot(const std::string& path, SnapshotAccess access)
+    : file_path(path), fd(-1), base(nullptr), length(0), header{}, table(nullptr) {
+    fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open snapshot: " + file_path + " (" + std::strerror(errno) + ")");
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < PAGE_SIZE_BYTES) {
+        ::close(fd);
+        throw std::runtime_error("Not a snapshot file (too small): " + file_path);
+    }
+    length = static_cast<size_t>(st.st_size);
+
+    void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Failed to map snapshot: " + file_path + " (" + std::strerror(errno) + ")");
+    }
+    base = static_cast<const uint8_t*>(mapping);
+
+    std::memcpy(&header, base, sizeof(header));
+    uint64_t blocks = length / PAGE_SIZE_BYTES;
+    const char* problem = nullptr;
+    if (header.magic != SNAPSHOT_MAGIC) {
+        problem = "bad magic";
+    } else if (header.format_version != SNAPSHOT_FORMAT_VERSION) {
+        problem = "unsupported format version";
+    } else if (header.page_size != PAGE_SIZE_BYTES) {
+        problem = "different page size";
+    } else if (header.table_block < 1 + header.num_images ||
+               header.table_block > blocks ||
+               header.num_pages > (length - header.table_block * PAGE_SIZE_BYTES) / sizeof(SnapshotPageEntry)) {
+        problem = "page table outside the file";
+    }
+    if (!problem) {
+        table = reinterpret_cast<const SnapshotPageEntry*>(base + header.table_block * PAGE_SIZE_BYTES);
+        if (crc32c(0, table, header.num_pages * sizeof(SnapshotPageEntry)) != header.table_checksum) {
+            problem = "page table checksum mismatch";
+        } else if (!pageImage(header.root_page_id)) {
+            problem = "no root page";
+        }
+    }
+    if (problem) {
+        ::munmap(mapping, length);
+        ::close(fd);
+        throw std::runtime_error("Bad snapshot " + file_path + ": " + problem);
+    }
+
+    advise(access);
+    LOG_INFO("MappedSnapshot: Mapped " << file_path << " (" << header.num_pages << " pages, "
+             << header.num_images << " images)");
+}
+
+MappedSnapshot::~MappedSnapshot() {
+    ::munmap(const_cast<uint8_t*>(base), length);
+    ::close(fd);
+}
+
+/*
+ Binary search the mapped page table. Entries pointing outside the image
+ blocks are treated as missing, so a lookup never leaves the mapping.
+*/
+const uint8_t* MappedSnapshot::pageImage(PageId page_id) const {
+    const SnapshotPageEntry* end = table + header.num_pages;
+    const SnapshotPageEntry* entry = std::lower_bound(table, end, page_id,
+        [](const SnapshotPageEntry& e, PageId id) { return e.page_id < id; });
+    if (entry == end || entry->page_id != page_id ||
+        entry->block < 1 || entry->block > header.num_images) {
+        return nullptr;
+    }
+    return base + entry->block * PAGE_SIZE_BYTES;
+}
+
+/*
+ Tell the kernel how the mapping is going to be used: random for point
+ lookups (readahead would only pull in pages nobody asked for), sequential
+ while scanning large ranges. Only a hint, errors are ignored.
+*/
+void MappedSnapshot::advise(SnapshotAccess access) const {
+    ::madvise(const_cast<uint8_t*>(base), length, adviceFor(access));
+}
+
+void MappedSnapshot::prefetch(PageId page_id) const {
+    const uint8_t* image = pageImage(page_id);
+    if (image) {
+        ::madvise(const_cast<uint8_t*>(image), PAGE_SIZE_BYTES, MADV_WILLNEED);
+    }
+}
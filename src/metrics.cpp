@@ -0,0 +1,272 @@
+#include "metrics.h"
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+
+namespace metrics {
+
+namespace {
+
+struct HistogramCells {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+};
+
+// One thread's block, value-initialized to zero. Aligned so no two threads share a cache line
+struct alignas(64) ThreadCells {
+    std::atomic<uint64_t> counters[MAX_COUNTERS];
+    HistogramCells histograms[MAX_HISTOGRAMS];
+};
+
+struct Descriptor {
+    std::string name;
+    std::string help;
+};
+
+struct Registry {
+    std::mutex mutex;  // Registration, and the list of live blocks. Recording never takes it
+    std::vector<std::pair<Descriptor, const Counter*>> counters;  // Indexed by Counter::id
+    std::vector<std::pair<Descriptor, const Histogram*>> histograms;
+    std::vector<std::pair<Descriptor, const Gauge*>> gauges;
+    std::vector<ThreadCells*> live;
+    ThreadCells retired{};  // What exited threads had recorded
+};
+
+// Constructed by the first metric, so before any thread records anything
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+// Only the owning thread writes its cells, so this needs no atomic add
+inline void bump(std::atomic<uint64_t>& cell, uint64_t n) {
+    cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void fold(ThreadCells& into, const ThreadCells& from) {
+    for (size_t i = 0; i < MAX_COUNTERS; ++i) {
+        bump(into.counters[i], from.counters[i].load(std::memory_order_relaxed));
+    }
+    for (size_t h = 0; h < MAX_HISTOGRAMS; ++h) {
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            bump(into.histograms[h].buckets[b], from.histograms[h].buckets[b].load(std::memory_order_relaxed));
+        }
+        bump(into.histograms[h].count, from.histograms[h].count.load(std::memory_order_relaxed));
+        bump(into.histograms[h].sum, from.histograms[h].sum.load(std::memory_order_relaxed));
+    }
+}
+
+// Hands the block over to retired when the thread exits
+struct ThreadSlot {
+    ThreadCells* cells = nullptr;
+
+    ~ThreadSlot() {
+        if (!cells) {
+            return;
+        }
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        fold(reg.retired, *cells);
+        reg.live.erase(std::find(reg.live.begin(), reg.live.end(), cells));
+        delete cells;
+    }
+};
+
+thread_local ThreadSlot thread_slot;
+
+ThreadCells& localCells() {
+    if (!thread_slot.cells) {
+        auto* cells = new ThreadCells();
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.live.push_back(cells);
+        thread_slot.cells = cells;
+    }
+    return *thread_slot.cells;
+}
+
+template <typename Metric>
+size_t registerMetric(std::vector<std::pair<Descriptor, const Metric*>>& list, size_t limit,
+                      const char* name, const char* help, const Metric* metric) {
+    if (list.size() >= limit) {
+        throw std::length_error(std::string("metrics: no room left for ") + name);
+    }
+    list.push_back({{name, help}, metric});
+    return list.size() - 1;
+}
+
+// Sums a cell over retired and every live block, the caller holds the registry mutex
+template <typename CellOf>
+uint64_t sumCells(const Registry& reg, CellOf&& cell_of) {
+    uint64_t total = cell_of(reg.retired).load(std::memory_order_relaxed);
+    for (const ThreadCells* cells : reg.live) {
+        total += cell_of(*cells).load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t bucketFor(uint64_t nanos) {
+    if (nanos == 0) {
+        return 0;
+    }
+    return std::min<size_t>(64 - __builtin_clzll(nanos), HISTOGRAM_BUCKETS - 1);
+}
+
+}  // namespace
+
+Counter::Counter(const char* name, const char* help) {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    id = registerMetric(reg.counters, MAX_COUNTERS, name, help, this);
+}
+
+void Counter::add(uint64_t n) {
+    bump(localCells().counters[id], n);
+}
+
+uint64_t Counter::value() const {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    return sumCells(reg, [this](const ThreadCells& cells) -> const std::atomic<uint64_t>& {
+        return cells.counters[id];
+    });
+}
+
+Histogram::Histogram(const char* name, const char* help) {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    id = registerMetric(reg.histograms, MAX_HISTOGRAMS, name, help, this);
+}
+
+void Histogram::record(uint64_t nanos) {
+    HistogramCells& cells = localCells().histograms[id];
+    bump(cells.buckets[bucketFor(nanos)], 1);
+    bump(cells.count, 1);
+    bump(cells.sum, nanos);
+}
+
+/*
+ Each cell is read on its own, so a snapshot taken while a thread records
+ may count a value in `count` but not yet in its bucket. Scrapers live
+ with that, it is off by the handful of values recorded meanwhile.
+*/
+Histogram::Snapshot Histogram::snapshot() const {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    Snapshot result{};
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+        result.buckets[b] = sumCells(reg, [this, b](const ThreadCells& cells) -> const std::atomic<uint64_t>& {
+            return cells.histograms[id].buckets[b];
+        });
+    }
+    result.count = sumCells(reg, [this](const ThreadCells& cells) -> const std::atomic<uint64_t>& {
+        return cells.histograms[id].count;
+    });
+    result.sum = sumCells(reg, [this](const ThreadCells& cells) -> const std::atomic<uint64_t>& {
+        return cells.histograms[id].sum;
+    });
+    return result;
+}
+
+Gauge::Gauge(const char* name, const char* help) : current(0.0) {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.gauges.push_back({{name, help}, this});
+}
+
+/*
+ Histograms are exported in seconds, with a bucket boundary at every power
+ of two nanoseconds from about a microsecond to about a minute.
+*/
+std::string prometheusText() {
+    constexpr size_t FIRST_EXPORTED_BUCKET = 10;  // le 1.024us
+    constexpr size_t LAST_EXPORTED_BUCKET = 36;   // le 68.7s
+
+    // Metrics are never unregistered, copying the lists is enough to walk them unlocked
+    std::vector<std::pair<Descriptor, const Counter*>> counters;
+    std::vector<std::pair<Descriptor, const Histogram*>> histograms;
+    std::vector<std::pair<Descriptor, const Gauge*>> gauges;
+    {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        counters = reg.counters;
+        histograms = reg.histograms;
+        gauges = reg.gauges;
+    }
+
+    std::ostringstream out;
+    out.precision(12);
+    auto header = [&out](const Descriptor& metric, const char* type) {
+        out << "# HELP " << metric.name << " " << metric.help << "\n";
+        out << "# TYPE " << metric.name << " " << type << "\n";
+    };
+
+    for (const auto& [metric, counter] : counters) {
+        header(metric, "counter");
+        out << metric.name << " " << counter->value() << "\n";
+    }
+
+    for (const auto& [metric, gauge] : gauges) {
+        header(metric, "gauge");
+        out << metric.name << " " << gauge->value() << "\n";
+    }
+
+    for (const auto& [metric, histogram] : histograms) {
+        header(metric, "histogram");
+        Histogram::Snapshot snapshot = histogram->snapshot();
+
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            cumulative += snapshot.buckets[b];
+            if (b >= FIRST_EXPORTED_BUCKET && b <= LAST_EXPORTED_BUCKET) {
+                out << metric.name << "_bucket{le=\"" << static_cast<double>(uint64_t(1) << b) / 1e9
+                    << "\"} " << cumulative << "\n";
+            }
+        }
+        // The bucket total rather than count, so +Inf and _count always agree
+        out << metric.name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+        out << metric.name << "_sum " << static_cast<double>(snapshot.sum) / 1e9 << "\n";
+        out << metric.name << "_count " << cumulative << "\n";
+    }
+
+    return out.str();
+}
+
+bool writePrometheusFile(const std::string& path) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file << prometheusText();
+        if (!file) {
+            return false;
+        }
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+Counter cache_hits("btree_cache_hits_total", "Page cache lookups served from the cache");
+Counter cache_misses("btree_cache_misses_total", "Page cache lookups that loaded the page from storage");
+Counter cache_evictions("btree_cache_evictions_total", "Pages evicted from the page cache");
+Counter wal_bytes("btree_wal_bytes_total", "Bytes appended to the WAL, frame headers included");
+Counter wal_fsyncs("btree_wal_fsyncs_total", "fdatasync calls on WAL segment files");
+Histogram wal_fsync_latency("btree_wal_fsync_seconds", "Duration of WAL fdatasync calls");
+Gauge writer_queue_depth("btree_writer_queue_depth", "Pages waiting in the writer queue");
+Counter writer_pages_written("btree_writer_pages_written_total", "Pages the writer queue stored");
+Counter btree_splits("btree_node_splits_total", "B-tree node splits");
+
+double cacheHitRatio() {
+    uint64_t hits = cache_hits.value();
+    uint64_t lookups = hits + cache_misses.value();
+    return lookups > 0 ? static_cast<double>(hits) / lookups : 0.0;
+}
+
+}  // namespace metrics
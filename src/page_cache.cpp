@@ -1,12 +1,36 @@
 #include "page_cache.h"
+#include "log.h"
+#include "metrics.h"
 #include <iostream>
+#include <algorithm>
+#include <thread>
 
 template <typename KeyType>
-PageCache<KeyType>::PageCache(ContentStorage<KeyType>* storage, size_t max_size) 
-    : content_storage(storage), max_cache_size(max_size) {
+PageCache<KeyType>::PageCache(ContentStorage<KeyType>* storage, size_t max_size, ReplacementPolicyType policy,
+                              size_t num_shards, bool huge_pages) 
+    : buffer_pool(max_size, huge_pages), max_cache_size(max_size), content_storage(storage) {
     if (!storage) { // Just include descriptive error messages
         throw std::invalid_argument("ContentStorage cannot be null");
     }
+    if (max_size == 0) {
+        throw std::invalid_argument("Cache size must be at least one page");
+    }
+
+    if (num_shards == 0) {
+        // A shard much smaller than that evicts hot pages just because of how IDs hash
+        size_t cores = std::max<size_t>(1, std::thread::hardware_concurrency());
+        num_shards = std::min(cores, std::max<size_t>(1, max_size / 16));
+    }
+    num_shards = std::min(num_shards, max_size);
+
+    // Capacities add up to max_size, the first max_size % num_shards shards get one more page
+    for (size_t i = 0; i < num_shards; ++i) {
+        std::unique_ptr<Shard> shard(new Shard());
+        shard->capacity = max_size / num_shards + (i < max_size % num_shards ? 1 : 0);
+        shard->replacement_policy = makeReplacementPolicy(policy, shard->capacity);
+        shards.push_back(std::move(shard));
+    }
+    shared_hits = shards.front()->replacement_policy->concurrentAccess();
 }
 
 template <typename KeyType>
@@ -14,114 +38,250 @@ PageCache<KeyType>::~PageCache() {
     flushAll();
 }
 
+/*
+ Evict the page the replacement policy picks among those nobody else is
+ using. A page whose shared_ptr is still held outside the cache (by a tree
+ operation, a cursor or a pending write) is pinned: dropping it would let
+ the next getPage load a second copy of a page that is still being
+ modified, and would hand its frame to another page. The victim's frame
+ goes back to the buffer pool. Returns false if every cached page is pinned.
+*/
 template <typename KeyType>
-void PageCache<KeyType>::updateLRU(uint16_t page_id) {
-    auto it = lru_iterators.find(page_id);
-    if (it != lru_iterators.end()) {
-        lru_order.erase(it->second);
+bool PageCache<KeyType>::evictOne(Shard& shard) {
+    auto& cache = shard.cache;
+    PageId victim;
+    bool found = shard.replacement_policy->evict([&cache](PageId page_id) {
+        auto it = cache.find(page_id);
+        return it == cache.end() || !it->second.inUse();
+    }, victim);
+    if (!found) {
+        return false;
     }
-    
-    lru_order.push_front(page_id);
-    lru_iterators[page_id] = lru_order.begin();
-}
 
-template <typename KeyType>
-void PageCache<KeyType>::evictLRU() {
-    if (lru_order.empty()) return;
-    
-    uint16_t lru_page_id = lru_order.back();
-    
-    auto cache_it = cache.find(lru_page_id);
+    auto cache_it = cache.find(victim);
     if (cache_it != cache.end() && cache_it->second.is_dirty) {
-        // Write back to content storage
-        content_storage->storePage(*(cache_it->second.page));
-        std::cout << "Cache: Writing back dirty page " << lru_page_id << " during eviction" << std::endl;
+        // Write back to content storage. Nobody else holds the page, so its latch is free.
+        // Cached pages have their IDs, so storing doesn't need a copy or a move
+        const Page<KeyType>& page = *cache_it->second.page;
+        std::shared_lock<std::shared_mutex> latch(page.latch.mutex);
+        content_storage->storePage(page);
+        LOG_DEBUG("Cache: Writing back dirty page " << victim << " during eviction");
     }
-    
-    // Remove from cache and LRU tracking
-    cache.erase(lru_page_id);
-    lru_order.pop_back();
-    lru_iterators.erase(lru_page_id);
+
+    metrics::cache_evictions.add();
+
+    // The policy has forgotten it already
+    int32_t frame = cache_it != cache.end() ? cache_it->second.frame : -1;
+    cache.erase(victim);
+    if (frame >= 0) {
+        buffer_pool.release(frame);
+    }
+    return true;
 }
 
+/*
+ Make room for one more page in the shard. If everything in it is pinned
+ the shard grows past its capacity for a while, and shrinks back on later
+ inserts.
+*/
 template <typename KeyType>
-void PageCache<KeyType>::evictIfNeeded() {
-    while (cache.size() >= max_cache_size) {
-        evictLRU();
+void PageCache<KeyType>::evictIfNeeded(Shard& shard) {
+    while (shard.cache.size() >= shard.capacity) {
+        if (!evictOne(shard)) {
+            break;
+        }
     }
 }
 
+/*
+ Hits only take the shard lock shared when the policy allows it (CLOCK, 2Q),
+ so readers of the same hot pages don't line up behind each other. A miss
+ takes it exclusively and checks again, another thread may have loaded the
+ page in between.
+*/
 template <typename KeyType>
-std::shared_ptr<Page<KeyType>> PageCache<KeyType>::getPage(uint16_t page_id) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
+std::shared_ptr<Page<KeyType>> PageCache<KeyType>::getPage(PageId page_id) {
+    Shard& shard = shardFor(page_id);
+
+    if (shared_hits) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.cache.find(page_id);
+        if (it != shard.cache.end()) {
+            // Let the policy know it got hit, that only sets a bit
+            shard.replacement_policy->recordAccess(page_id);
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+            metrics::cache_hits.add();
+            return it->second.page;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
     
     // Check if page is in cache
-    auto it = cache.find(page_id);
-    if (it != cache.end()) {
-        // Update LRU since cache got hit
-        updateLRU(page_id);
-        it->second.last_accessed = std::chrono::steady_clock::now();
+    auto it = shard.cache.find(page_id);
+    if (it != shard.cache.end()) {
+        shard.replacement_policy->recordAccess(page_id);
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        metrics::cache_hits.add();
         return it->second.page;
     }
     
-    // Cache miss so load from content storage
-    auto page = content_storage->getPage(page_id);
-    if (!page) {
-        return nullptr;
+    // Cache miss so load from content storage, into a frame the eviction frees if the shard is full
+    shard.misses.fetch_add(1, std::memory_order_relaxed);
+    metrics::cache_misses.add();
+    evictIfNeeded(shard);
+    std::shared_ptr<Page<KeyType>> page;
+    int32_t frame = buffer_pool.acquire();
+    if (frame >= 0) {
+        page = buffer_pool.page(frame);
+        if (!content_storage->readPage(page_id, *page)) {
+            page.reset();  // Our copy would pin the frame
+            buffer_pool.release(frame);
+            return nullptr;
+        }
+    } else {
+        page = content_storage->getPage(page_id);
+        if (!page) {
+            return nullptr;
+        }
+        heap_pages.fetch_add(1, std::memory_order_relaxed);
     }
     
     // Add to cache
-    evictIfNeeded();
-    cache.emplace(page_id, CachedPage<KeyType>(page, false));
-    updateLRU(page_id);
+    shard.cache.emplace(page_id, CachedPage<KeyType>(page, false, 0, frame));
+    shard.replacement_policy->recordInsert(page_id);
     
-    std::cout << "Cache: Loaded page " << page_id << " from storage" << std::endl;
+    LOG_DEBUG("Cache: Loaded page " << page_id << " from storage");
+    return page;
+}
+
+/*
+ A brand new page for the tree, in a frame if one is free. It goes in clean,
+ the caller holds it (so it stays) and marks it dirty once it has content.
+*/
+template <typename KeyType>
+std::shared_ptr<Page<KeyType>> PageCache<KeyType>::newPage(PageId page_id, bool is_leaf) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    evictIfNeeded(shard);
+    std::shared_ptr<Page<KeyType>> page;
+    int32_t frame = buffer_pool.acquire();
+    if (frame >= 0) {
+        page = buffer_pool.page(frame);
+        page->is_leaf = is_leaf;
+    } else {
+        page = std::make_shared<Page<KeyType>>(createPage<KeyType>(is_leaf));
+        heap_pages.fetch_add(1, std::memory_order_relaxed);
+    }
+    page->header.page_id = page_id;
+
+    // Page IDs are never reused, so there is no entry for it yet
+    shard.cache.emplace(page_id, CachedPage<KeyType>(page, false, 0, frame));
+    shard.replacement_policy->recordInsert(page_id);
     return page;
 }
 
 template <typename KeyType>
-void PageCache<KeyType>::putPage(uint16_t page_id, std::shared_ptr<Page<KeyType>> page) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
+void PageCache<KeyType>::putPage(PageId page_id, std::shared_ptr<Page<KeyType>> page, uint64_t rec_lsn) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
     
-    evictIfNeeded();
+    evictIfNeeded(shard);
     
     // Add or update page in cache
-    auto it = cache.find(page_id);
-    if (it != cache.end()) {
-        // Update existing entry
+    auto it = shard.cache.find(page_id);
+    if (it != shard.cache.end()) {
+        // Update existing entry, a page that was dirty already keeps its older rec_lsn.
+        // If that was another copy in a frame, the frame goes back once nobody holds that copy
+        int32_t old_frame = it->second.page != page ? it->second.frame : -1;
         it->second.page = page;
+        if (old_frame >= 0) {
+            it->second.frame = -1;
+            buffer_pool.releaseWhenUnpinned(old_frame);
+        }
+        if (!it->second.is_dirty) {
+            it->second.rec_lsn = rec_lsn;
+        }
         it->second.is_dirty = true;
-        it->second.last_accessed = std::chrono::steady_clock::now();
+        shard.replacement_policy->recordAccess(page_id);
     } else {
         // Add new entry
-        cache.emplace(page_id, CachedPage<KeyType>(page, true));
+        shard.cache.emplace(page_id, CachedPage<KeyType>(page, true, rec_lsn));
+        shard.replacement_policy->recordInsert(page_id);
     }
     
-    updateLRU(page_id);
-    std::cout << "Cache: Stored page " << page_id << " (marked as dirty)" << std::endl;
+    LOG_DEBUG("Cache: Stored page " << page_id << " (marked as dirty)");
 }
 
 template <typename KeyType>
-void PageCache<KeyType>::markDirty(uint16_t page_id) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
+bool PageCache<KeyType>::markDirty(PageId page_id, uint64_t rec_lsn) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
     
-    auto it = cache.find(page_id);
-    if (it != cache.end()) {
+    auto it = shard.cache.find(page_id);
+    if (it != shard.cache.end()) {
+        if (!it->second.is_dirty) {
+            it->second.rec_lsn = rec_lsn;
+        }
         it->second.is_dirty = true;
-        updateLRU(page_id);
-        std::cout << "Cache: Marked page " << page_id << " as dirty" << std::endl;
+        shard.replacement_policy->recordAccess(page_id);
+        LOG_DEBUG("Cache: Marked page " << page_id << " as dirty");
+        return true;
     }
+    return false;
 }
 
+/*
+ Hint that a page is about to be read, e.g. the next leaf of a range scan.
+ Cached pages need nothing, otherwise storage starts reading the block in the
+ background so the getPage that follows doesn't wait on the disk. The page
+ isn't added to the cache here, so a hint never evicts anything.
+*/
 template <typename KeyType>
-std::vector<std::pair<uint16_t, std::shared_ptr<Page<KeyType>>>> PageCache<KeyType>::getDirtyPages() {
-    std::lock_guard<std::mutex> lock(cache_mutex);
-    
-    std::vector<std::pair<uint16_t, std::shared_ptr<Page<KeyType>>>> dirty_pages;
+void PageCache<KeyType>::prefetch(PageId page_id) {
+    {
+        Shard& shard = shardFor(page_id);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        if (shard.cache.find(page_id) != shard.cache.end()) {
+            return;
+        }
+    }
+    content_storage->prefetchPage(page_id);
+}
+
+template <typename KeyType>
+bool PageCache<KeyType>::pinPage(PageId page_id) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.cache.find(page_id);
+    if (it == shard.cache.end()) {
+        return false;
+    }
+    it->second.pin_count++;
+    return true;
+}
+
+template <typename KeyType>
+void PageCache<KeyType>::unpinPage(PageId page_id) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.cache.find(page_id);
+    if (it != shard.cache.end() && it->second.pin_count > 0) {
+        it->second.pin_count--;
+    }
+}
+
+template <typename KeyType>
+std::vector<std::pair<PageId, std::shared_ptr<Page<KeyType>>>> PageCache<KeyType>::getDirtyPages() {
+    std::vector<std::pair<PageId, std::shared_ptr<Page<KeyType>>>> dirty_pages;
     
-    for (const auto& entry : cache) {
-        if (entry.second.is_dirty) {
-            dirty_pages.emplace_back(entry.first, entry.second.page);
+    for (const auto& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard->mutex);
+        for (const auto& entry : shard->cache) {
+            if (entry.second.is_dirty) {
+                dirty_pages.emplace_back(entry.first, entry.second.page);
+            }
         }
     }
     
@@ -129,31 +289,179 @@ std::vector<std::pair<uint16_t, std::shared_ptr<Page<KeyType>>>> PageCache<KeyTy
 }
 
 template <typename KeyType>
-void PageCache<KeyType>::clearDirtyFlag(uint16_t page_id) {
-    std::lock_guard<std::mutex> lock(cache_mutex);
+void PageCache<KeyType>::clearDirtyFlag(PageId page_id) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
     
-    auto it = cache.find(page_id);
-    if (it != cache.end()) {
+    auto it = shard.cache.find(page_id);
+    if (it != shard.cache.end()) {
         it->second.is_dirty = false;
     }
 }
 
+/*
+ Clear the dirty flag after a flush, but only if the cached page is still at
+ the version that was written. If the tree modified it again in the meantime
+ the page has to stay dirty so eviction doesn't drop the newer changes.
+*/
 template <typename KeyType>
-void PageCache<KeyType>::flushAll() {
-    std::lock_guard<std::mutex> lock(cache_mutex);
+void PageCache<KeyType>::clearDirtyFlag(PageId page_id, uint64_t flushed_version) {
+    Shard& shard = shardFor(page_id);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
     
-    std::cout << "Cache: Flushing all dirty pages" << std::endl;
+    auto it = shard.cache.find(page_id);
+    if (it != shard.cache.end() && it->second.page->latch.version.load() == flushed_version) {
+        it->second.is_dirty = false;
+    }
+}
+
+/*
+ Empty the cache as far as it can be, for a cold start: pages that are
+ pinned or held elsewhere (the tree's root) stay.
+*/
+template <typename KeyType>
+size_t PageCache<KeyType>::evictAll() {
+    size_t evicted = 0;
+    for (const auto& shard : shards) {
+        std::unique_lock<std::shared_mutex> lock(shard->mutex);
+        while (evictOne(*shard)) {
+            evicted++;
+        }
+    }
+    LOG_INFO("Cache: Evicted " << evicted << " pages");
+    return evicted;
+}
+
+/*
+ Write every dirty page to storage. Shard locks are only held while we
+ collect them, each page is then stored under its shared latch, so tree
+ operations holding latches can keep using the cache meanwhile.
+*/
+template <typename KeyType>
+void PageCache<KeyType>::flushAll() {
+    LOG_INFO("Cache: Flushing all dirty pages");
     size_t flushed = 0;
-    
-    for (auto& entry : cache) {
-        if (entry.second.is_dirty) {
-            content_storage->storePage(*(entry.second.page));
-            entry.second.is_dirty = false;
-            flushed++;
+
+    for (const auto& entry : getDirtyPages()) {
+        uint64_t flushed_version;
+        {
+            std::shared_lock<std::shared_mutex> latch(entry.second->latch.mutex);
+            flushed_version = entry.second->latch.version.load();
+            content_storage->storePage(*entry.second);
         }
+        clearDirtyFlag(entry.first, flushed_version);
+        flushed++;
+    }
+
+    LOG_INFO("Cache: Flushed " << flushed << " dirty pages");
+}
+
+/*
+ The dirty page table a fuzzy checkpoint starts from: every dirty page and
+ the LSN redo would have to start at to bring it up to date.
+*/
+template <typename KeyType>
+std::vector<std::pair<PageId, uint64_t>> PageCache<KeyType>::getDirtyPageTable() {
+    std::vector<std::pair<PageId, uint64_t>> table;
+    for (const auto& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard->mutex);
+        for (const auto& entry : shard->cache) {
+            if (entry.second.is_dirty) {
+                table.emplace_back(entry.first, entry.second.rec_lsn);
+            }
+        }
+    }
+    return table;
+}
+
+/*
+ Write some of the dirty pages, the way flushAll writes all of them. Pages
+ that were written back (or evicted) since the caller listed them are
+ skipped, so a checkpoint can flush its dirty page table a slice at a time.
+*/
+template <typename KeyType>
+size_t PageCache<KeyType>::flushPages(const std::vector<PageId>& page_ids) {
+    size_t flushed = 0;
+    for (PageId page_id : page_ids) {
+        std::shared_ptr<Page<KeyType>> page;
+        {
+            Shard& shard = shardFor(page_id);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.cache.find(page_id);
+            if (it == shard.cache.end() || !it->second.is_dirty) {
+                continue;
+            }
+            page = it->second.page;
+        }
+
+        uint64_t flushed_version;
+        {
+            std::shared_lock<std::shared_mutex> latch(page->latch.mutex);
+            flushed_version = page->latch.version.load();
+            content_storage->storePage(*page);
+        }
+        clearDirtyFlag(page_id, flushed_version);
+        flushed++;
+    }
+    return flushed;
+}
+
+// Smallest rec_lsn of any dirty page, redo from there covers everything not written yet
+template <typename KeyType>
+uint64_t PageCache<KeyType>::oldestDirtyLSN() {
+    uint64_t oldest = UINT64_MAX;
+    for (const auto& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard->mutex);
+        for (const auto& entry : shard->cache) {
+            if (entry.second.is_dirty && entry.second.rec_lsn < oldest) {
+                oldest = entry.second.rec_lsn;
+            }
+        }
+    }
+    return oldest;
+}
+
+template <typename KeyType>
+std::vector<PageCacheShardStats> PageCache<KeyType>::getShardStats() const {
+    std::vector<PageCacheShardStats> stats;
+    for (const auto& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard->mutex);
+        stats.push_back({shard->cache.size(), shard->capacity,
+                         shard->hits.load(std::memory_order_relaxed),
+                         shard->misses.load(std::memory_order_relaxed)});
+    }
+    return stats;
+}
+
+template <typename KeyType>
+void PageCache<KeyType>::printStats() const {
+    size_t pages = 0;
+    uint64_t hits = 0, misses = 0;
+    std::vector<PageCacheShardStats> stats = getShardStats();
+    for (const auto& shard : stats) {
+        pages += shard.pages;
+        hits += shard.hits;
+        misses += shard.misses;
+    }
+
+    std::cout << "Page Cache Statistics:" << std::endl;
+    std::cout << "  Policy: " << shards.front()->replacement_policy->name()
+              << ", " << shards.size() << " shard(s)" << std::endl;
+    std::cout << "  Cached pages: " << pages << " / " << max_cache_size << std::endl;
+    const FrameArena& arena = buffer_pool.getArena();
+    std::cout << "  Buffer pool: " << buffer_pool.frameCount() << " frames ("
+              << arena.bytes() / 1024 << " KB arena" << (arena.onHugePages() ? ", huge pages" : "")
+              << "), " << buffer_pool.freeFrames() << " free, "
+              << heap_pages.load(std::memory_order_relaxed) << " pages loaded outside the pool" << std::endl;
+    std::cout << "  Hits: " << hits << ", misses: " << misses;
+    if (hits + misses > 0) {
+        std::cout << " (" << (100.0 * hits / (hits + misses)) << "% hit rate)";
+    }
+    std::cout << std::endl;
+    for (size_t i = 0; i < stats.size() && stats.size() > 1; ++i) {
+        std::cout << "  Shard " << i << ": " << stats[i].pages << "/" << stats[i].capacity
+                  << " pages, " << stats[i].hits << " hits, " << stats[i].misses << " misses" << std::endl;
     }
-    
-    std::cout << "Cache: Flushed " << flushed << " dirty pages" << std::endl;
 }
 
 
@@ -0,0 +1,306 @@
+#include "page_file.h"
+#include "log.h"
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+AlignedPageBuffer::AlignedPageBuffer(size_t pages)
+    : buffer(static_cast<uint8_t*>(std::aligned_alloc(PAGE_IO_ALIGNMENT, pages * PAGE_SIZE_BYTES))),
+      num_pages(pages) {
+    if (!buffer) {
+        throw std::bad_alloc();
+    }
+    std::memset(buffer, 0, pages * PAGE_SIZE_BYTES);
+}
+
+AlignedPageBuffer::~AlignedPageBuffer() {
+    std::free(buffer);
+}
+
+/*
+ Open (or create) the page file. What its blocks hold is only known from
+ the page table ContentStorage saves next to it, so a new storage starts
+ from an empty file and only a storage that loads that table opens with
+ Open, which keeps the blocks. CreateNew is for files written next to
+ live ones (snapshot exports), where truncating whatever the path names
+ would be a disaster.
+*/
+PageFile::PageFile(const std::string& path, OpenMode mode)
+    : file_path(path), fd(-1), num_blocks(0), blocks_freed(0), blocks_trimmed(0),
+      blocks_written(0), blocks_read(0), write_calls(0) {
+    int flags = O_RDWR | O_CREAT;
+    if (mode != OpenMode::Open) {
+        flags |= mode == OpenMode::CreateNew ? O_EXCL : O_TRUNC;
+    }
+    fd = ::open(file_path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open page file: " + file_path + " (" + std::strerror(errno) + ")");
+    }
+    if (mode == OpenMode::Open) {
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Failed to stat page file: " + file_path + " (" + std::strerror(error) + ")");
+        }
+        // A partly written last block reads back padded with zeroes
+        num_blocks.store((static_cast<uint64_t>(st.st_size) + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES);
+    }
+
+    LOG_INFO("PageFile: Opened " << file_path << " with " << PAGE_SIZE_BYTES << " byte pages");
+}
+
+bool PageFile::isFile(const std::string& path) const {
+    struct stat ours, theirs;
+    if (::fstat(fd, &ours) != 0 || ::stat(path.c_str(), &theirs) != 0) {
+        return false;
+    }
+    return ours.st_dev == theirs.st_dev && ours.st_ino == theirs.st_ino;
+}
+
+/*
+ Make sure everything written is on disk before closing the file.
+*/
+PageFile::~PageFile() {
+    if (fd >= 0) {
+        ::fdatasync(fd);
+        ::close(fd);
+    }
+}
+
+/*
+ Hand out the lowest free block, or the next block at the end of the file.
+*/
+uint64_t PageFile::allocateBlock() {
+    std::lock_guard<std::mutex> lock(alloc_mutex);
+    if (!free_blocks.empty()) {
+        uint64_t block_id = free_blocks.back();
+        free_blocks.pop_back();
+        return block_id;
+    }
+    return num_blocks.fetch_add(1);
+}
+
+uint64_t PageFile::allocateBlocks(uint32_t count) {
+    std::lock_guard<std::mutex> lock(alloc_mutex);
+    return num_blocks.fetch_add(count);
+}
+
+/*
+ Take blocks back. Their disk space is released right away by punching a
+ hole over each one (where the file system can), a later write to the block
+ fills it in again. Free blocks that end up at the end of the file are cut
+ off with ftruncate, so a file that shrank doesn't keep its old size.
+*/
+void PageFile::freeBlocks(const std::vector<uint64_t>& blocks) {
+    if (blocks.empty()) {
+        return;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    for (uint64_t block_id : blocks) {
+        off_t offset = static_cast<off_t>(block_id) * PAGE_SIZE_BYTES;
+        // Only an optimization, a file system without holes just keeps the bytes
+        ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, PAGE_SIZE_BYTES);
+    }
+#endif
+
+    std::lock_guard<std::mutex> lock(alloc_mutex);
+    free_blocks.insert(free_blocks.end(), blocks.begin(), blocks.end());
+    std::sort(free_blocks.begin(), free_blocks.end(), std::greater<uint64_t>());
+    blocks_freed.fetch_add(blocks.size());
+
+    uint64_t end = num_blocks.load();
+    size_t trimmed = 0;
+    while (trimmed < free_blocks.size() && free_blocks[trimmed] == end - 1) {
+        end--;
+        trimmed++;
+    }
+    if (trimmed > 0) {
+        free_blocks.erase(free_blocks.begin(), free_blocks.begin() + trimmed);
+        num_blocks.store(end);
+        if (::ftruncate(fd, static_cast<off_t>(end) * PAGE_SIZE_BYTES) != 0) {
+            LOG_WARN("PageFile: ftruncate failed (" << std::strerror(errno) << ")");
+        }
+        blocks_trimmed.fetch_add(trimmed);
+    }
+}
+
+size_t PageFile::getFreeBlocks() const {
+    std::lock_guard<std::mutex> lock(alloc_mutex);
+    return free_blocks.size();
+}
+
+/*
+ Write one full page image at the block's offset.
+*/
+void PageFile::writeBlock(uint64_t block_id, const uint8_t* buffer) {
+    writeBlocks(block_id, buffer, 1);
+}
+
+/*
+ Write count consecutive page images with a single pwrite, this is what
+ bulk loads use to lay pages out sequentially. pwrite can return short
+ writes, so keep going until every block is written.
+*/
+void PageFile::writeBlocks(uint64_t first_block, const uint8_t* buffer, uint32_t count) {
+    off_t offset = static_cast<off_t>(first_block) * PAGE_SIZE_BYTES;
+    size_t total = static_cast<size_t>(count) * PAGE_SIZE_BYTES;
+    size_t written = 0;
+
+    while (written < total) {
+        ssize_t n = ::pwrite(fd, buffer + written, total - written, offset + written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("PageFile: pwrite failed for block " + std::to_string(first_block) +
+                                     " (" + std::strerror(errno) + ")");
+        }
+        written += static_cast<size_t>(n);
+        write_calls.fetch_add(1);
+    }
+
+    blocks_written.fetch_add(count);
+}
+
+void PageFile::setMaxBlocksPerWrite(size_t blocks) {
+    max_blocks_per_write = std::min<size_t>(std::max<size_t>(blocks, 1), IOV_MAX);
+}
+
+/*
+ Write a batch of page images that can go anywhere in the file, e.g. the
+ new content of a writer queue batch. Sorted by block, every run of
+ consecutive blocks is one pwritev (split after max_blocks_per_write), so
+ a batch costs one system call per run instead of one per page, and the
+ kernel sees the writes in file order.
+*/
+void PageFile::writeBlockList(std::vector<BlockWrite>& writes) {
+    std::sort(writes.begin(), writes.end(),
+              [](const BlockWrite& a, const BlockWrite& b) { return a.block_id < b.block_id; });
+
+    std::vector<struct iovec> iov;
+    iov.reserve(std::min(writes.size(), max_blocks_per_write));
+    size_t run_start = 0;
+    for (size_t i = 0; i < writes.size(); ++i) {
+        bool continues = !iov.empty() && writes[i].block_id == writes[i - 1].block_id + 1 &&
+                         iov.size() < max_blocks_per_write;
+        if (!continues && !iov.empty()) {
+            writeVector(writes[run_start].block_id, iov.data(), iov.size());
+            iov.clear();
+        }
+        if (iov.empty()) {
+            run_start = i;
+        }
+        iov.push_back({const_cast<uint8_t*>(writes[i].buffer), PAGE_SIZE_BYTES});
+    }
+    if (!iov.empty()) {
+        writeVector(writes[run_start].block_id, iov.data(), iov.size());
+    }
+}
+
+// One run of consecutive blocks, resuming after short writes. Consumes iov
+void PageFile::writeVector(uint64_t first_block, struct iovec* iov, size_t count) {
+    off_t offset = static_cast<off_t>(first_block) * PAGE_SIZE_BYTES;
+    size_t blocks = count;
+
+    while (count > 0) {
+        ssize_t n = ::pwritev(fd, iov, static_cast<int>(count), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("PageFile: pwritev failed for block " + std::to_string(first_block) +
+                                     " (" + std::strerror(errno) + ")");
+        }
+        write_calls.fetch_add(1);
+        offset += n;
+        size_t done = static_cast<size_t>(n);
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    blocks_written.fetch_add(blocks);
+}
+
+/*
+ Read one full page image from the block's offset.
+*/
+void PageFile::readBlock(uint64_t block_id, uint8_t* buffer) const {
+    if (block_id >= num_blocks.load()) {
+        throw std::out_of_range("PageFile: block " + std::to_string(block_id) + " was never allocated");
+    }
+
+    off_t offset = static_cast<off_t>(block_id) * PAGE_SIZE_BYTES;
+    size_t read_bytes = 0;
+
+    while (read_bytes < PAGE_SIZE_BYTES) {
+        ssize_t n = ::pread(fd, buffer + read_bytes, PAGE_SIZE_BYTES - read_bytes, offset + read_bytes);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("PageFile: pread failed for block " + std::to_string(block_id) +
+                                     " (" + std::strerror(errno) + ")");
+        }
+        if (n == 0) {
+            // Block was allocated but never written, treat the rest as zeroes
+            std::memset(buffer + read_bytes, 0, PAGE_SIZE_BYTES - read_bytes);
+            break;
+        }
+        read_bytes += static_cast<size_t>(n);
+    }
+
+    blocks_read.fetch_add(1);
+}
+
+/*
+ Ask the kernel to start reading a block we expect to need soon, so the
+ later readBlock finds it in the page cache. This is only a hint, errors
+ are ignored.
+*/
+void PageFile::prefetchBlock(uint64_t block_id) const {
+    if (block_id >= num_blocks.load()) {
+        return;
+    }
+    off_t offset = static_cast<off_t>(block_id) * PAGE_SIZE_BYTES;
+    ::posix_fadvise(fd, offset, PAGE_SIZE_BYTES, POSIX_FADV_WILLNEED);
+}
+
+/*
+ Force written blocks to disk.
+*/
+void PageFile::sync() {
+    if (::fdatasync(fd) != 0) {
+        throw std::runtime_error("PageFile: fdatasync failed (" + std::string(std::strerror(errno)) + ")");
+    }
+}
+
+/*
+ fsync the directory holding the file, so a file created or renamed in
+ it is still there after a crash, not just its contents.
+*/
+void PageFile::syncDirectory() const {
+    size_t slash = file_path.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : file_path.substr(0, slash));
+    int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        throw std::runtime_error("PageFile: can't open directory " + directory + " (" + std::strerror(errno) + ")");
+    }
+    int rc = ::fsync(dir_fd);
+    int error = errno;
+    ::close(dir_fd);
+    if (rc != 0) {
+        throw std::runtime_error("PageFile: fsync of directory " + directory + " failed (" + std::strerror(error) + ")");
+    }
+}
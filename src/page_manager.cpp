@@ -19,10 +19,10 @@ bool insertRecord(Page<KeyType> *page, const std::vector<uint8_t>& record) {
         page->data.push_back(info);
     }
     
-    // Update content hash after modifying page content
-    page->updateContentHash();
+    // The content hash is recomputed when it's next needed
+    page->invalidateContentHash();
     
-    // updatePageChecksum(page); // Commented out to avoid hash dependency
+    updatePageChecksum(page);
     return true;
 }
 
@@ -35,8 +35,8 @@ bool deleteRecord(Page<KeyType> *page, uint16_t slot_id) {
     if (slot_id >= page->header.num_slots || slot_id < 0) return false;
     page->slot_directory[slot_id].is_deleted = true;
 
-    // Update content hash after modifying page content
-    page->updateContentHash();
+    // The content hash is recomputed when it's next needed
+    page->invalidateContentHash();
     
     return true;
 }
@@ -71,23 +71,22 @@ bool deleteRecord(Page<KeyType> *page) {
     }
 
     page -> slot_directory = new_directory;
-    page -> data = new_data;
+    page -> data.assign(new_data.begin(), new_data.end());
 
-    // Update content hash after modifying page content
-    page->updateContentHash();
+    // The content hash is recomputed when it's next needed
+    page->invalidateContentHash();
 
-    // updatePageChecksum(page); // Commented out to avoid hash dependency
+    updatePageChecksum(page);
     return true;
 }
 
 /*
-    When you add or delete a record, you have to update the checksum hash
-
+    When you add or delete a record, you have to update the checksum
+    (a CRC32C of the record bytes, cheap enough to redo on every change)
 */
 template <typename KeyType>
 void updatePageChecksum(Page<KeyType> *page) {
-    page->header.checksum = compute_sha256_page_management(page->data); // Commented out to avoid hash dependency
-    //page->header.checksum = "dummy_checksum"; // Placeholder
+    page->header.checksum = crc32c(0, page->data.data(), page->data.size());
 }
 
 /*
@@ -95,26 +94,148 @@ void updatePageChecksum(Page<KeyType> *page) {
  */
 template <typename KeyType>
 Page<KeyType> createPage(bool is_leaf) {
-    Page<KeyType> page;
+    Page<KeyType> page{};
     page.is_leaf = is_leaf;
     page.keys = std::vector<KeyType>();
 
     if (is_leaf) {
         // Leaf nodes store actual data in values
         // Children are not used, but we leave the vector empty
-        page.data = std::vector<uint8_t>();
+        page.data.clear();
     } else {
         // Internal nodes store keys for indexing, and pointers to children
         // They dont store values
-        page.children = std::vector<uint16_t>();
+        page.children = std::vector<PageId>();
     }
     
-    // Initialize content hash for the empty page
-    page.updateContentHash();
-    
+    // Starts dirty, hashed when it is first stored
     return page;
 }
 
+/*
+ Encode a page into the slotted image layout described in page_manager.h.
+ The slot directory grows up from the header and cells grow down from the
+ end of the buffer, so the image is valid for any capacity that fits it.
+*/
+template <typename KeyType>
+size_t serializePage(const Page<KeyType>& page, uint8_t* buffer, size_t capacity) {
+    size_t num_slots = page.keys.size();
+    size_t directory_end = sizeof(PageImageHeader) + num_slots * sizeof(SlotEntry);
+    if (directory_end > capacity || capacity > UINT16_MAX + 1) {
+        throw std::length_error("page image does not fit in a page");
+    }
+    if (!page.is_leaf && (num_slots > 0 || !page.children.empty()) && page.children.size() != num_slots + 1) {
+        throw std::logic_error("internal page needs one more child than keys");
+    }
+
+    size_t cell_offset = capacity;
+    for (size_t i = 0; i < num_slots; ++i) {
+        uint16_t key_len = Codec<KeyType>::encodedSize(page.keys[i]);
+        ByteView payload = page.is_leaf
+            ? page.valueAt(i)
+            : ByteView{reinterpret_cast<const uint8_t*>(&page.children[i + 1]), sizeof(PageId)};
+        size_t cell_len = sizeof(key_len) + key_len + payload.size;
+
+        if (cell_len > cell_offset - directory_end) {
+            throw std::length_error("page image does not fit in a page");
+        }
+        cell_offset -= cell_len;
+
+        uint8_t* cell = buffer + cell_offset;
+        std::memcpy(cell, &key_len, sizeof(key_len));
+        Codec<KeyType>::encode(page.keys[i], cell + sizeof(key_len));
+        std::memcpy(cell + sizeof(key_len) + key_len, payload.data, payload.size);
+
+        SlotEntry slot{static_cast<uint16_t>(i), static_cast<uint16_t>(cell_offset),
+                       static_cast<uint16_t>(cell_len), 0};
+        std::memcpy(buffer + sizeof(PageImageHeader) + i * sizeof(SlotEntry), &slot, sizeof(slot));
+    }
+
+    PageImageHeader image_header{};
+    image_header.magic = PAGE_IMAGE_MAGIC;
+    image_header.page_id = page.header.page_id;
+    image_header.num_slots = num_slots;
+    image_header.free_space_offset = directory_end;
+    image_header.cell_offset = cell_offset;
+    image_header.leftmost_child = page.is_leaf || page.children.empty() ? 0 : page.children[0];
+    image_header.is_leaf = page.is_leaf ? 1 : 0;
+    image_header.flags = page.header.flags;
+    image_header.prev_leaf = page.is_leaf ? page.header.prev_leaf : 0;
+    image_header.next_leaf = page.is_leaf ? page.header.next_leaf : 0;
+    std::memcpy(buffer, &image_header, sizeof(image_header));
+
+    // Zero the free gap so images are deterministic
+    std::memset(buffer + directory_end, 0, cell_offset - directory_end);
+
+    // The checksum covers the whole image, so it is filled in last
+    uint32_t checksum = pageImageChecksum(buffer, capacity);
+    std::memcpy(buffer + offsetof(PageImageHeader, checksum), &checksum, sizeof(checksum));
+    return capacity;
+}
+
+/*
+ Rebuild an in-memory page from its image. This is only needed when the
+ tree is going to modify the page, readers can use a PageView directly.
+ The content hash is not part of the image, the caller already knows it.
+*/
+template <typename KeyType>
+Page<KeyType> deserializePage(const uint8_t* buffer, size_t size) {
+    Page<KeyType> page{};
+    deserializePageInto(buffer, size, page);
+    return page;
+}
+
+/*
+ Overwrite page with the image. The vectors are cleared rather than
+ replaced, so a page the buffer pool recycles keeps its capacity (and its
+ frame) and loading it allocates nothing.
+*/
+template <typename KeyType>
+void deserializePageInto(const uint8_t* buffer, size_t size, Page<KeyType>& page) {
+    PageView<KeyType> view(buffer, size);
+
+    // Every header field but the content hash, which keeps its memory for the caller to fill
+    page.header.page_id = view.pageId();
+    page.header.num_slots = 0;
+    page.header.free_space_offset = 0;
+    page.header.free_space_size = 0;
+    page.header.checksum = 0;
+    page.header.flags = view.flags();
+    page.header.prev_leaf = view.prevLeaf();
+    page.header.next_leaf = view.nextLeaf();
+    page.is_leaf = view.isLeaf();
+    page.keys.clear();
+    page.children.clear();
+    page.slot_directory.clear();
+    page.data.clear();
+
+    uint16_t num_keys = view.numKeys();
+    page.keys.reserve(num_keys);
+    for (uint16_t i = 0; i < num_keys; ++i) {
+        auto key = view.keyAt(i);
+        page.keys.emplace_back(key);
+    }
+
+    if (page.is_leaf) {
+        page.slot_directory.reserve(num_keys);
+        for (uint16_t i = 0; i < num_keys; ++i) {
+            ByteView value = view.valueAt(i);
+            page.insertValue(i, value.data, value.size);
+        }
+    } else {
+        page.children.reserve(num_keys + 1);
+        for (uint16_t i = 0; i <= num_keys; ++i) {
+            page.children.push_back(view.childAt(i));
+        }
+    }
+}
+
 // Explicit template instantiations
 template Page<int> createPage<int>(bool);
-template Page<std::string> createPage<std::string>(bool);
\ No newline at end of file
+template Page<std::string> createPage<std::string>(bool);
+template size_t serializePage<int>(const Page<int>&, uint8_t*, size_t);
+template size_t serializePage<std::string>(const Page<std::string>&, uint8_t*, size_t);
+template Page<int> deserializePage<int>(const uint8_t*, size_t);
+template Page<std::string> deserializePage<std::string>(const uint8_t*, size_t);
+template void deserializePageInto<int>(const uint8_t*, size_t, Page<int>&);
+template void deserializePageInto<std::string>(const uint8_t*, size_t, Page<std::string>&);
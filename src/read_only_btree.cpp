@@ -0,0 +1,152 @@
+#include "read_only_btree.h"
+#include <stdexcept>
+
+/*
+ Open a snapshot written by BTree::exportSnapshot. access is the initial
+ madvise hint for the whole file, see setAccessPattern.
+*/
+template <typename KeyType, typename ValueType>
+ReadOnlyBTree<KeyType, ValueType>::ReadOnlyBTree(const std::string& snapshot_path, SnapshotAccess access)
+    : snapshot(snapshot_path, access) {}
+
+// A page of the snapshot, its checksum verified. Every page a node points at must be there
+template <typename KeyType, typename ValueType>
+PageView<KeyType> ReadOnlyBTree<KeyType, ValueType>::view(PageId page_id) const {
+    const uint8_t* image = snapshot.pageImage(page_id);
+    if (!image) {
+        throw std::runtime_error("Snapshot " + snapshot.getPath() + " has no page " + std::to_string(page_id));
+    }
+    return PageView<KeyType>(image, PAGE_SIZE_BYTES);
+}
+
+/*
+ Descend from the root to the leaf key belongs in, like BTree::findLeaf
+ but without latches. A damaged snapshot could link pages in a cycle, so
+ the descent gives up after more levels than any real tree has.
+*/
+template <typename KeyType, typename ValueType>
+PageView<KeyType> ReadOnlyBTree<KeyType, ValueType>::findLeaf(const KeyType& key) const {
+    constexpr int MAX_DEPTH = 64;
+    PageView<KeyType> node = view(snapshot.rootPageId());
+    for (int depth = 0; !node.isLeaf(); ++depth) {
+        if (depth == MAX_DEPTH) {
+            throw std::runtime_error("Snapshot " + snapshot.getPath() + " is deeper than any tree, damaged?");
+        }
+        // Keys equal to a separator live in its right subtree
+        node = view(node.childAt(node.upperBound(key)));
+    }
+    return node;
+}
+
+/*
+ Point lookup, the value is decoded straight out of the mapped leaf.
+*/
+template <typename KeyType, typename ValueType>
+bool ReadOnlyBTree<KeyType, ValueType>::lookup(const KeyType& key, ValueType& value) const {
+    PageView<KeyType> leaf = findLeaf(key);
+    uint16_t idx = leaf.lowerBound(key);
+    if (idx < leaf.numKeys() && !(key < leaf.keyAt(idx))) {
+        ByteView bytes = leaf.valueAt(idx);
+        Codec<ValueType>::decodeInto(bytes.data, bytes.size, value);
+        return true;
+    }
+    return false;
+}
+
+template <typename KeyType, typename ValueType>
+std::optional<ValueType> ReadOnlyBTree<KeyType, ValueType>::lookup(const KeyType& key) const {
+    ValueType value{};
+    if (!lookup(key, value)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// Same as BTree::search, the caller owns (and has to delete) the returned value
+template <typename KeyType, typename ValueType>
+ValueType* ReadOnlyBTree<KeyType, ValueType>::search(const KeyType& key) const {
+    ValueType value{};
+    if (!lookup(key, value)) {
+        return nullptr;
+    }
+    return new ValueType(std::move(value));
+}
+
+template <typename KeyType, typename ValueType>
+ReadOnlyCursor<KeyType, ValueType> ReadOnlyBTree<KeyType, ValueType>::scan(const KeyType& lo, const KeyType& hi) const {
+    return ReadOnlyCursor<KeyType, ValueType>(this, lo, hi, true);
+}
+
+template <typename KeyType, typename ValueType>
+ReadOnlyCursor<KeyType, ValueType> ReadOnlyBTree<KeyType, ValueType>::scanReverse(const KeyType& lo, const KeyType& hi) const {
+    return ReadOnlyCursor<KeyType, ValueType>(this, lo, hi, false);
+}
+
+template <typename KeyType, typename ValueType>
+ReadOnlyCursor<KeyType, ValueType>::ReadOnlyCursor(const ReadOnlyBTree<KeyType, ValueType>* tree,
+                                                   const KeyType& lo, const KeyType& hi, bool forward)
+    : tree(tree), leaf(), slot(0), lo(lo), hi(hi), current_key(), current_value(), is_valid(false) {
+    leaf.emplace(tree->findLeaf(forward ? lo : hi));
+    PageId readahead_id = forward ? leaf->nextLeaf() : leaf->prevLeaf();
+    if (readahead_id != 0) {
+        tree->snapshot.prefetch(readahead_id);
+    }
+    settle(forward ? leaf->lowerBound(lo) : leaf->upperBound(hi), forward);
+}
+
+/*
+ Load the entry at pos (forward) or the one before it (backward), moving
+ on to the sibling leaves while the current one has none, and start
+ paging in the leaf after that. The cursor becomes invalid once it leaves
+ [lo, hi] or runs out of leaves.
+*/
+template <typename KeyType, typename ValueType>
+void ReadOnlyCursor<KeyType, ValueType>::settle(size_t pos, bool forward) {
+    while (leaf) {
+        if (forward ? pos < leaf->numKeys() : pos > 0) {
+            slot = forward ? pos : pos - 1;
+            current_key = KeyType(leaf->keyAt(slot));
+            ByteView bytes = leaf->valueAt(slot);
+            Codec<ValueType>::decodeInto(bytes.data, bytes.size, current_value);
+            is_valid = !(current_key < lo) && !(hi < current_key);
+            if (!is_valid) {
+                leaf.reset();
+            }
+            return;
+        }
+
+        PageId sibling_id = forward ? leaf->nextLeaf() : leaf->prevLeaf();
+        if (sibling_id == 0) {
+            break;
+        }
+        leaf.emplace(tree->view(sibling_id));
+        pos = forward ? 0 : leaf->numKeys();
+        PageId readahead_id = forward ? leaf->nextLeaf() : leaf->prevLeaf();
+        if (readahead_id != 0) {
+            tree->snapshot.prefetch(readahead_id);
+        }
+    }
+
+    is_valid = false;
+    leaf.reset();
+}
+
+template <typename KeyType, typename ValueType>
+void ReadOnlyCursor<KeyType, ValueType>::next() {
+    if (!is_valid) return;
+    settle(slot + 1, true);
+}
+
+template <typename KeyType, typename ValueType>
+void ReadOnlyCursor<KeyType, ValueType>::prev() {
+    if (!is_valid) return;
+    settle(slot, false);
+}
+
+// Explicit template instantiations
+template class ReadOnlyBTree<int, std::string>;
+template class ReadOnlyBTree<std::string, std::string>;
+template class ReadOnlyBTree<int, int>;
+template class ReadOnlyCursor<int, std::string>;
+template class ReadOnlyCursor<std::string, std::string>;
+template class ReadOnlyCursor<int, int>;
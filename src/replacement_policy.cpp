@@ -0,0 +1,184 @@
+#include "replacement_policy.h"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+std::unique_ptr<ReplacementPolicy> makeReplacementPolicy(ReplacementPolicyType type, size_t capacity) {
+    switch (type) {
+        case ReplacementPolicyType::LRU:
+            return std::unique_ptr<ReplacementPolicy>(new LRUPolicy());
+        case ReplacementPolicyType::CLOCK:
+            return std::unique_ptr<ReplacementPolicy>(new ClockPolicy());
+        case ReplacementPolicyType::TWO_Q:
+            return std::unique_ptr<ReplacementPolicy>(new TwoQueuePolicy(capacity));
+    }
+    throw std::invalid_argument("Unknown replacement policy");
+}
+
+void LRUPolicy::recordInsert(PageId page_id) {
+    recordAccess(page_id);
+}
+
+void LRUPolicy::recordAccess(PageId page_id) {
+    auto it = lru_iterators.find(page_id);
+    if (it != lru_iterators.end()) {
+        lru_order.erase(it->second);
+    }
+
+    lru_order.push_front(page_id);
+    lru_iterators[page_id] = lru_order.begin();
+}
+
+void LRUPolicy::recordRemove(PageId page_id) {
+    auto it = lru_iterators.find(page_id);
+    if (it != lru_iterators.end()) {
+        lru_order.erase(it->second);
+        lru_iterators.erase(it);
+    }
+}
+
+// The least recently used page that can go
+bool LRUPolicy::evict(const std::function<bool(PageId)>& can_evict, PageId& victim) {
+    for (auto lru_it = lru_order.rbegin(); lru_it != lru_order.rend(); ++lru_it) {
+        if (!can_evict(*lru_it)) {
+            continue;
+        }
+        victim = *lru_it;
+        lru_order.erase(std::next(lru_it).base());
+        lru_iterators.erase(victim);
+        return true;
+    }
+    return false;
+}
+
+void ClockRing::add(PageId page_id) {
+    if (contains(page_id)) {
+        return;
+    }
+    size_t slot;
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        pages[slot] = page_id;
+    } else {
+        slot = pages.size();
+        pages.push_back(page_id);
+        referenced.emplace_back(false);
+    }
+    // A new page has to be used again before the hand passes it to stay
+    referenced[slot].store(false, std::memory_order_relaxed);
+    slots[page_id] = slot;
+}
+
+void ClockRing::remove(PageId page_id) {
+    auto it = slots.find(page_id);
+    if (it == slots.end()) {
+        return;
+    }
+    pages[it->second] = 0;
+    free_slots.push_back(it->second);
+    slots.erase(it);
+}
+
+void ClockRing::reference(PageId page_id) const {
+    auto it = slots.find(page_id);
+    if (it != slots.end()) {
+        referenced[it->second].store(true, std::memory_order_relaxed);
+    }
+}
+
+/*
+ Sweep the hand: a referenced page loses its bit and gets another round,
+ the first unreferenced page that can go is the victim. Two full turns are
+ enough to clear every bit, after that everything left is pinned.
+*/
+bool ClockRing::evict(const std::function<bool(PageId)>& can_evict, PageId& victim) {
+    for (size_t steps = 0; steps < 2 * pages.size(); ++steps) {
+        size_t slot = hand;
+        hand = (hand + 1) % pages.size();
+        PageId page_id = pages[slot];
+        if (page_id == 0 || referenced[slot].exchange(false, std::memory_order_relaxed) ||
+            !can_evict(page_id)) {
+            continue;
+        }
+        victim = page_id;
+        remove(page_id);
+        return true;
+    }
+    return false;
+}
+
+TwoQueuePolicy::TwoQueuePolicy(size_t capacity)
+    : max_in(std::max<size_t>(1, capacity / 4)), max_ghosts(std::max<size_t>(1, capacity / 2)) {}
+
+/*
+ A page we evicted from A1in not long ago is back, so it is worth keeping:
+ it goes straight into Am. Any other new page starts in A1in.
+*/
+void TwoQueuePolicy::recordInsert(PageId page_id) {
+    if (in_iterators.count(page_id) || am.contains(page_id)) {
+        return;
+    }
+    auto ghost = ghost_iterators.find(page_id);
+    if (ghost != ghost_iterators.end()) {
+        a1_out.erase(ghost->second);
+        ghost_iterators.erase(ghost);
+        am.add(page_id);
+        return;
+    }
+    a1_in.push_front(page_id);
+    in_iterators[page_id] = a1_in.begin();
+}
+
+// Hits in A1in are ignored, a scan touching a page a few times in a row is still one use
+void TwoQueuePolicy::recordAccess(PageId page_id) {
+    am.reference(page_id);
+}
+
+void TwoQueuePolicy::recordRemove(PageId page_id) {
+    auto it = in_iterators.find(page_id);
+    if (it != in_iterators.end()) {
+        a1_in.erase(it->second);
+        in_iterators.erase(it);
+        return;
+    }
+    am.remove(page_id);
+}
+
+void TwoQueuePolicy::addGhost(PageId page_id) {
+    a1_out.push_front(page_id);
+    ghost_iterators[page_id] = a1_out.begin();
+    while (a1_out.size() > max_ghosts) {
+        ghost_iterators.erase(a1_out.back());
+        a1_out.pop_back();
+    }
+}
+
+// Oldest page in A1in that can go, it is remembered in A1out
+bool TwoQueuePolicy::evictFromIn(const std::function<bool(PageId)>& can_evict, PageId& victim) {
+    for (auto it = a1_in.rbegin(); it != a1_in.rend(); ++it) {
+        if (!can_evict(*it)) {
+            continue;
+        }
+        victim = *it;
+        a1_in.erase(std::next(it).base());
+        in_iterators.erase(victim);
+        addGhost(victim);
+        return true;
+    }
+    return false;
+}
+
+/*
+ Take from A1in while it is over its share, otherwise from Am. If one of
+ them has nothing that can go (everything in it is pinned), try the other.
+*/
+bool TwoQueuePolicy::evict(const std::function<bool(PageId)>& can_evict, PageId& victim) {
+    if (a1_in.size() > max_in && evictFromIn(can_evict, victim)) {
+        return true;
+    }
+    if (am.evict(can_evict, victim)) {
+        return true;
+    }
+    return evictFromIn(can_evict, victim);
+}
@@ -1,310 +1,611 @@
 #include "version_manager.h"
+#include "log.h"
 #include <iostream>
 #include <algorithm>
 
 template<typename KeyType>
 VersionManager<KeyType>::VersionManager(std::chrono::hours retention, size_t max_versions)
-    : next_transaction_id(1), total_versions(0), cleaned_versions(0),
+    : active_count(0), low_water_mark(0), next_transaction_id(1), last_commit_ts(0),
+      total_versions(0), cleaned_versions(0),
       last_cleanup(std::chrono::steady_clock::now()),
-      version_retention_period(retention), max_versions_per_key(max_versions) {
+      version_retention_period(retention), max_versions_per_key(max_versions),
+      cleanup_slice_size(1024) {
     
-    std::cout << "VersionManager: Initialized with " << retention.count() 
-              << "h retention, max " << max_versions << " versions per key" << std::endl;
+    LOG_INFO("VersionManager: Initialized with " << retention.count()
+             << "h retention, max " << max_versions << " versions per key");
 }
 
 template<typename KeyType>
 VersionManager<KeyType>::~VersionManager() {
     // Clean up remaining transactions
-    std::lock_guard<std::mutex> lock(transactions_mutex);
-    for (auto& [txn_id, txn] : active_transactions) {
-        if (!txn->is_committed && !txn->is_aborted) {
-            txn->is_aborted = true;
+    {
+        std::unique_lock<std::shared_mutex> lock(transactions_mutex);
+        for (auto& [txn_id, txn] : active_transactions) {
+            if (!txn->is_committed && !txn->is_aborted) {
+                txn->is_aborted = true;
+            }
+        }
+    }
+
+    // Take the chains apart one link at a time, dropping a long one as a whole would recurse once per version
+    std::unique_lock<std::shared_mutex> lock(versions_mutex);
+    for (auto& [key, chain] : versions) {
+        std::shared_ptr<VersionedRecord<KeyType>> version = std::move(chain->newest_owner);
+        while (version && version.use_count() == 1) {
+            std::shared_ptr<VersionedRecord<KeyType>> older = std::move(version->older_owner);
+            version = std::move(older);
         }
     }
 }
 
+// Make version the newest of the chain, the caller holds the chain's write_mutex
 template<typename KeyType>
-TransactionId VersionManager<KeyType>::beginTransaction() {
+static void pushNewest(VersionChain<KeyType>& chain, std::shared_ptr<VersionedRecord<KeyType>> version) {
+    VersionedRecord<KeyType>* raw = version.get();
+    raw->older.store(chain.newest.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    raw->older_owner = std::move(chain.newest_owner);
+    chain.newest_owner = std::move(version);
+    // Published only now, readers never see it half built
+    chain.newest.store(raw, std::memory_order_release);
+}
+
+/*
+ A new transaction reads the snapshot of everything committed so far.
+ The timestamp is taken under the same lock commits publish theirs
+ under, so a snapshot never sees half a commit.
+*/
+template<typename KeyType>
+TransactionId VersionManager<KeyType>::startTransaction(bool read_only) {
     TransactionId txn_id = next_transaction_id.fetch_add(1);
     
-    auto transaction = std::make_shared<Transaction<KeyType>>(txn_id);
-    
     {
-        std::lock_guard<std::mutex> lock(transactions_mutex);
-        active_transactions[txn_id] = transaction;
+        std::unique_lock<std::shared_mutex> lock(transactions_mutex);
+        CommitTimestamp snapshot = last_commit_ts.load(std::memory_order_acquire);
+        active_transactions[txn_id] = std::make_shared<Transaction<KeyType>>(txn_id, snapshot, read_only);
+        active_count.store(active_transactions.size());
+        active_snapshots[snapshot]++;
+        updateLowWaterMark();
     }
     
-    std::cout << "VersionManager: Started transaction " << txn_id << std::endl;
+    LOG_DEBUG("VersionManager: Started " << (read_only ? "read-only " : "") << "transaction " << txn_id);
     return txn_id;
 }
 
+template<typename KeyType>
+TransactionId VersionManager<KeyType>::beginTransaction() {
+    return startTransaction(false);
+}
+
+/*
+ For transactions that only read: they keep no read set, skipping a lock
+ and a push per read, refuse writes and commit without a timestamp.
+*/
+template<typename KeyType>
+TransactionId VersionManager<KeyType>::beginReadOnlyTransaction() {
+    return startTransaction(true);
+}
+
+// Called with transactions_mutex held exclusively, once the transaction left active_transactions
+template<typename KeyType>
+void VersionManager<KeyType>::endTransaction(const Transaction<KeyType>& txn) {
+    active_count.store(active_transactions.size());
+    auto it = active_snapshots.find(txn.snapshot_ts);
+    if (it != active_snapshots.end() && --it->second == 0) {
+        active_snapshots.erase(it);
+    }
+    updateLowWaterMark();
+}
+
+/*
+ The oldest snapshot an active transaction reads, or the one a new
+ transaction would, under transactions_mutex held exclusively. It only
+ ever moves forward, so cleanup can read it once per slice.
+*/
+template<typename KeyType>
+void VersionManager<KeyType>::updateLowWaterMark() {
+    low_water_mark.store(active_snapshots.empty() ? last_commit_ts.load(std::memory_order_relaxed)
+                                                  : active_snapshots.begin()->first);
+}
+
+/*
+ Take the next commit timestamp and stamp it into every version the
+ transaction wrote (begin_ts) and replaced or deleted (end_ts), then
+ publish it. Versions another commit already ended keep that one.
+*/
 template<typename KeyType>
 bool VersionManager<KeyType>::commitTransaction(TransactionId txn_id) {
-    std::lock_guard<std::mutex> lock(transactions_mutex);
+    std::unique_lock<std::shared_mutex> lock(transactions_mutex);
     
     auto it = active_transactions.find(txn_id);
     if (it == active_transactions.end()) {
-        std::cerr << "VersionManager: Transaction " << txn_id << " not found" << std::endl;
+        LOG_WARN("VersionManager: Transaction " << txn_id << " not found");
         return false;
     }
     
-    auto& txn = it->second;
+    auto txn = it->second;
+    {
+        std::lock_guard<std::mutex> sets_lock(txn->sets_mutex);
+        if (!txn->created.empty() || !txn->ended.empty()) {
+            CommitTimestamp commit_ts = last_commit_ts.load(std::memory_order_relaxed) + 1;
+            for (const auto& version : txn->created) {
+                version->begin_ts.store(commit_ts, std::memory_order_release);
+            }
+            for (const auto& version : txn->ended) {
+                CommitTimestamp current = TIMESTAMP_INFINITY;
+                version->end_ts.compare_exchange_strong(current, commit_ts, std::memory_order_acq_rel);
+            }
+            last_commit_ts.store(commit_ts, std::memory_order_release);
+            txn->commit_ts = commit_ts;
+        }
+    }
     txn->is_committed = true;
     txn->commit_time = std::chrono::steady_clock::now();
     
-    // Move to committed transactions
-    committed_transactions[txn_id] = txn;
+    committed_count++;
     active_transactions.erase(it);
+    endTransaction(*txn);
     
-    std::cout << "VersionManager: Committed transaction " << txn_id << std::endl;
+    LOG_DEBUG("VersionManager: Committed transaction " << txn_id);
     return true;
 }
 
+/*
+ The aborted transaction's versions were never stamped so nobody else can
+ see them, they stay in their chains until cleanupAbortedTransactions.
+ Its deletions are undone right away.
+*/
 template<typename KeyType>
 bool VersionManager<KeyType>::abortTransaction(TransactionId txn_id) {
-    std::lock_guard<std::mutex> lock(transactions_mutex);
-    
-    auto it = active_transactions.find(txn_id);
-    if (it == active_transactions.end()) {
-        return false;
+    std::shared_ptr<Transaction<KeyType>> txn;
+    {
+        std::unique_lock<std::shared_mutex> lock(transactions_mutex);
+        auto it = active_transactions.find(txn_id);
+        if (it == active_transactions.end()) {
+            return false;
+        }
+        txn = it->second;
+        txn->is_aborted = true;
+        active_transactions.erase(it);
+        endTransaction(*txn);
+        aborted_transactions.push_back(txn);
     }
     
-    auto& txn = it->second;
-    txn->is_aborted = true;
-    
-    active_transactions.erase(it);
+    std::vector<std::shared_ptr<VersionedRecord<KeyType>>> ended;
+    {
+        std::lock_guard<std::mutex> sets_lock(txn->sets_mutex);
+        ended = txn->ended;
+    }
+    for (const auto& version : ended) {
+        withChain(version->key, false, [&](VersionChain<KeyType>&) {
+            if (version->deleted_by.load() == txn_id) {
+                version->is_deleted.store(false);
+                version->deleted_by.store(0);
+            }
+        });
+    }
     
-    std::cout << "VersionManager: Aborted transaction " << txn_id << std::endl;
+    LOG_DEBUG("VersionManager: Aborted transaction " << txn_id);
     return true;
 }
 
 template<typename KeyType>
 bool VersionManager<KeyType>::isTransactionActive(TransactionId txn_id) const {
-    std::lock_guard<std::mutex> lock(transactions_mutex);
-    return active_transactions.find(txn_id) != active_transactions.end();
+    return findActive(txn_id) != nullptr;
 }
 
 template<typename KeyType>
-bool VersionManager<KeyType>::insert(TransactionId txn_id, const KeyType& key, const std::vector<uint8_t>& data) {
-    if (!isTransactionActive(txn_id)) {
-        std::cerr << "VersionManager: Transaction " << txn_id << " not active" << std::endl;
+std::shared_ptr<Transaction<KeyType>> VersionManager<KeyType>::findActive(TransactionId txn_id) const {
+    std::shared_lock<std::shared_mutex> lock(transactions_mutex);
+    auto it = active_transactions.find(txn_id);
+    return it != active_transactions.end() ? it->second : nullptr;
+}
+
+/*
+ Run fn on the key's chain with its write_mutex held, creating the chain
+ if asked to. Only a key that isn't in the map yet takes versions_mutex
+ exclusively, which keeps everyone else off that chain as well.
+*/
+template<typename KeyType>
+template<typename Fn>
+bool VersionManager<KeyType>::withChain(const KeyType& key, bool create, Fn&& fn) {
+    {
+        std::shared_lock<std::shared_mutex> lock(versions_mutex);
+        auto it = versions.find(key);
+        if (it != versions.end()) {
+            std::lock_guard<std::mutex> chain_lock(it->second->write_mutex);
+            fn(*it->second);
+            return true;
+        }
+    }
+    if (!create) {
         return false;
     }
-    
+
+    std::unique_lock<std::shared_mutex> lock(versions_mutex);
+    auto& chain = versions[key];
+    if (!chain) {
+        chain = std::make_unique<VersionChain<KeyType>>();
+    }
+    fn(*chain);
+    return true;
+}
+
+/*
+ Put a new version at the head of the key's chain. The version it
+ shadows for this transaction, if any, ends when the transaction commits.
+*/
+template<typename KeyType>
+bool VersionManager<KeyType>::addVersion(TransactionId txn_id, const KeyType& key, const std::vector<uint8_t>& data) {
+    auto txn = findActive(txn_id);
+    if (!txn) {
+        LOG_WARN("VersionManager: Transaction " << txn_id << " not active");
+        return false;
+    }
+    if (txn->read_only) {
+        LOG_WARN("VersionManager: Transaction " << txn_id << " is read-only");
+        return false;
+    }
+
     auto version = std::make_shared<VersionedRecord<KeyType>>(key, data, txn_id);
-    
-    {
-        std::lock_guard<std::mutex> lock(versions_mutex);
-        versions[key].insert(versions[key].begin(), version);
-        total_versions.fetch_add(1);
+    std::shared_ptr<VersionedRecord<KeyType>> replaced;
+
+    bool conflict = false;
+    withChain(key, true, [&](VersionChain<KeyType>& chain) {
+        VersionedRecord<KeyType>* visible = findVisibleVersion(chain, *txn);
+        if (hasWriteConflict(chain, visible, *txn)) {
+            conflict = true;
+            return;
+        }
+        if (visible) {
+            replaced = visible->shared_from_this();
+        }
+        pushNewest(chain, version);
+    });
+    if (conflict) {
+        return false;
     }
-    
+    total_versions.fetch_add(1);
+
     // Add to transaction's write set
-    {
-        std::lock_guard<std::mutex> lock(transactions_mutex);
-        auto it = active_transactions.find(txn_id);
-        if (it != active_transactions.end()) {
-            it->second->write_set.push_back(key);
-        }
+    std::lock_guard<std::mutex> sets_lock(txn->sets_mutex);
+    txn->write_set.push_back(key);
+    txn->created.push_back(std::move(version));
+    if (replaced) {
+        txn->ended.push_back(std::move(replaced));
     }
-    
     return true;
 }
 
+template<typename KeyType>
+bool VersionManager<KeyType>::insert(TransactionId txn_id, const KeyType& key, const std::vector<uint8_t>& data) {
+    return addVersion(txn_id, key, data);
+}
+
 template<typename KeyType>
 bool VersionManager<KeyType>::update(TransactionId txn_id, const KeyType& key, const std::vector<uint8_t>& new_data) {
-    if (!isTransactionActive(txn_id)) {
+    return addVersion(txn_id, key, new_data);
+}
+
+/*
+ Mark the version this transaction sees as deleted by it. Fails if another
+ transaction wrote the key first, see hasWriteConflict.
+*/
+template<typename KeyType>
+bool VersionManager<KeyType>::remove(TransactionId txn_id, const KeyType& key) {
+    auto txn = findActive(txn_id);
+    if (!txn || txn->read_only) {
         return false;
     }
     
-    // Create new version
-    auto new_version = std::make_shared<VersionedRecord<KeyType>>(key, new_data, txn_id);
-    
-    {
-        std::lock_guard<std::mutex> lock(versions_mutex);
-        versions[key].insert(versions[key].begin(), new_version);
-        total_versions.fetch_add(1);
-    }
-    
-    // Add to transaction's write set
-    {
-        std::lock_guard<std::mutex> lock(transactions_mutex);
-        auto it = active_transactions.find(txn_id);
-        if (it != active_transactions.end()) {
-            it->second->write_set.push_back(key);
+    std::shared_ptr<VersionedRecord<KeyType>> version;
+    withChain(key, false, [&](VersionChain<KeyType>& chain) {
+        VersionedRecord<KeyType>* visible = findVisibleVersion(chain, *txn);
+        if (!visible || hasWriteConflict(chain, visible, *txn)) {
+            return;
         }
+        visible->deleted_at = std::chrono::steady_clock::now();
+        visible->deleted_by.store(txn_id);
+        visible->is_deleted.store(true);
+        version = visible->shared_from_this();
+    });
+    if (!version) {
+        return false;
     }
     
+    std::lock_guard<std::mutex> sets_lock(txn->sets_mutex);
+    txn->write_set.push_back(key);
+    txn->ended.push_back(std::move(version));
     return true;
 }
 
+/*
+ Readers only hold versions_mutex shared, which cleanup never takes any
+ other way while it prunes, and walk the chain pinned to an epoch, so a
+ version cleanup unlinks meanwhile stays valid until they are done.
+*/
 template<typename KeyType>
-bool VersionManager<KeyType>::remove(TransactionId txn_id, const KeyType& key) {
-    if (!isTransactionActive(txn_id)) {
-        return false;
+std::shared_ptr<VersionedRecord<KeyType>> VersionManager<KeyType>::read(TransactionId txn_id, const KeyType& key) {
+    auto txn = findActive(txn_id);
+    if (!txn) {
+        return nullptr;
     }
     
-    std::lock_guard<std::mutex> lock(versions_mutex);
+    // Add to transaction's read set, read-only transactions don't keep one
+    if (!txn->read_only) {
+        std::lock_guard<std::mutex> sets_lock(txn->sets_mutex);
+        txn->read_set.push_back(key);
+    }
     
+    std::shared_lock<std::shared_mutex> lock(versions_mutex);
     auto it = versions.find(key);
-    if (it == versions.end() || it->second.empty()) {
-        return false;
+    if (it == versions.end()) {
+        return nullptr;
     }
+    auto guard = epochs.enter();
+    VersionedRecord<KeyType>* version = findVisibleVersion(*it->second, *txn);
+    return version ? version->shared_from_this() : nullptr;
+}
     
-    // Find the visible version and mark it as deleted
-    for (auto& version : it->second) {
-        if (isVisible(version, txn_id) && !version->is_deleted) {
-            version->is_deleted = true;
-            version->deleted_by = txn_id;
-            version->deleted_at = std::chrono::steady_clock::now();
+template<typename KeyType>
+bool VersionManager<KeyType>::isVisible(const VersionedRecord<KeyType>& version, const Transaction<KeyType>& reader) {
+    // A transaction sees its own writes but not what it deleted, everyone
+    // else only sees versions committed by the time their snapshot was taken
+    if (version.deleted_by.load(std::memory_order_relaxed) == reader.id) {
+        return false;
+    }
+    if (version.created_by == reader.id) {
+        return true;
+    }
+    return version.visibleAt(reader.snapshot_ts);
+}
+
+/*
+ First writer wins: a transaction may only write a key nobody else did
+ since its snapshot. It conflicts when a version newer than the one it sees
+ was committed since, or is still pending from another active transaction,
+ or when the version it sees is deleted or ended by someone else. Versions
+ of aborted transactions don't count. The caller holds the chain's write_mutex.
+*/
+template<typename KeyType>
+bool VersionManager<KeyType>::hasWriteConflict(const VersionChain<KeyType>& chain,
+                                               const VersionedRecord<KeyType>* visible,
+                                               const Transaction<KeyType>& writer) const {
+    for (VersionedRecord<KeyType>* version = chain.newest.load(std::memory_order_acquire);
+         version && version != visible; version = version->older.load(std::memory_order_acquire)) {
+        if (version->created_by == writer.id) {
+            continue;
+        }
+        if (version->begin_ts.load(std::memory_order_acquire) != TIMESTAMP_INFINITY ||
+            findActive(version->created_by)) {
             return true;
         }
     }
-    
-    return false;
+    if (!visible) {
+        return false;
+    }
+    TransactionId deleted_by = visible->deleted_by.load();
+    return (deleted_by != 0 && deleted_by != writer.id) ||
+           visible->end_ts.load(std::memory_order_acquire) != TIMESTAMP_INFINITY;
 }
 
+// Find the newest visible version. The caller holds the chain's write_mutex or an epoch
 template<typename KeyType>
-std::shared_ptr<VersionedRecord<KeyType>> VersionManager<KeyType>::read(TransactionId txn_id, const KeyType& key) {
-    // Add to transaction's read set
-    {
-        std::lock_guard<std::mutex> lock(transactions_mutex);
-        auto it = active_transactions.find(txn_id);
-        if (it != active_transactions.end()) {
-            it->second->read_set.push_back(key);
+VersionedRecord<KeyType>* VersionManager<KeyType>::findVisibleVersion(const VersionChain<KeyType>& chain,
+                                                                      const Transaction<KeyType>& reader) {
+    for (VersionedRecord<KeyType>* version = chain.newest.load(std::memory_order_acquire); version;
+         version = version->older.load(std::memory_order_acquire)) {
+        if (isVisible(*version, reader)) {
+            return version;
         }
     }
-    
-    return findVisibleVersion(key, txn_id);
+    return nullptr;
 }
 
+/*
+ Call before the store changes key, while nothing else can change it.
+ The image ends at a new commit timestamp, so the snapshots active now
+ keep seeing it, and begins where the one before it ended (at 0 if there
+ is none left, no snapshot that old is active then).
+*/
 template<typename KeyType>
-bool VersionManager<KeyType>::isVisible(const std::shared_ptr<VersionedRecord<KeyType>>& version, TransactionId reader_txn) const {
-    // Version is visible if:
-    // 1. It was created by a committed transaction that committed before reader started
-    // 2. OR it was created by the reader transaction itself
-    // 3. AND it's not deleted by a committed transaction that committed before reader started
-    
-    if (version->created_by == reader_txn) {
-        return !version->is_deleted || version->deleted_by == reader_txn;
-    }
-    
-    // Check if creating transaction is committed
-    auto creator_it = committed_transactions.find(version->created_by);
-    if (creator_it == committed_transactions.end()) {
-        return false; // Creator not committed
+void VersionManager<KeyType>::recordBeforeImage(const KeyType& key, const std::vector<uint8_t>* before) {
+    auto version = std::make_shared<VersionedRecord<KeyType>>(key, before ? *before : std::vector<uint8_t>(), 0);
+    version->is_tombstone = before == nullptr;
+
+    withChain(key, true, [&](VersionChain<KeyType>& chain) {
+        VersionedRecord<KeyType>* newest = chain.newest.load(std::memory_order_relaxed);
+        version->begin_ts.store(newest ? newest->end_ts.load(std::memory_order_acquire) : 0, std::memory_order_relaxed);
+        {
+            // Takes the timestamp the same way a commit does, so it is ordered against beginning snapshots
+            std::unique_lock<std::shared_mutex> txn_lock(transactions_mutex);
+            CommitTimestamp commit_ts = last_commit_ts.load(std::memory_order_relaxed) + 1;
+            version->end_ts.store(commit_ts, std::memory_order_relaxed);
+            last_commit_ts.store(commit_ts, std::memory_order_release);
+            updateLowWaterMark();
+        }
+        pushNewest(chain, version);
+    });
+    total_versions.fetch_add(1);
+}
+
+// Chains cleanup emptied but didn't erase yet are skipped
+template<typename KeyType>
+bool VersionManager<KeyType>::findVersionedKey(const KeyType& from, bool inclusive, bool forward, KeyType& key) const {
+    std::shared_lock<std::shared_mutex> lock(versions_mutex);
+    if (forward) {
+        auto it = inclusive ? versions.lower_bound(from) : versions.upper_bound(from);
+        while (it != versions.end() && !it->second->newest.load(std::memory_order_acquire)) {
+            ++it;
+        }
+        if (it == versions.end()) {
+            return false;
+        }
+        key = it->first;
+        return true;
     }
-    
-    // Check if deleted by a committed transaction
-    if (version->is_deleted && version->deleted_by != reader_txn) {
-        auto deleter_it = committed_transactions.find(version->deleted_by);
-        if (deleter_it != committed_transactions.end()) {
-            return false; // Deleted by committed transaction
+
+    auto it = inclusive ? versions.upper_bound(from) : versions.lower_bound(from);
+    while (it != versions.begin()) {
+        --it;
+        if (it->second->newest.load(std::memory_order_acquire)) {
+            key = it->first;
+            return true;
         }
     }
-    
-    return true;
+    return false;
 }
 
+/*
+ Unlink the versions of one chain no transaction can see any more and
+ that are too old, or one too many, and hand them to retired. Readers
+ that are on one of them already can still go on from it, only the link
+ to it changes.
+*/
 template<typename KeyType>
-std::shared_ptr<VersionedRecord<KeyType>> VersionManager<KeyType>::findVisibleVersion(const KeyType& key, TransactionId reader_txn) const {
-    std::lock_guard<std::mutex> lock(versions_mutex);
-    
-    auto it = versions.find(key);
-    if (it == versions.end()) {
-        return nullptr;
-    }
-    
-    // Find the newest visible version
-    for (const auto& version : it->second) {
-        if (isVisible(version, reader_txn)) {
-            return version;
+size_t VersionManager<KeyType>::pruneChain(VersionChain<KeyType>& chain, CommitTimestamp low_water, Timestamp cutoff_time,
+                                           std::vector<std::shared_ptr<void>>& retired) {
+    std::lock_guard<std::mutex> chain_lock(chain.write_mutex);
+
+    std::atomic<VersionedRecord<KeyType>*>* link = &chain.newest;
+    std::shared_ptr<VersionedRecord<KeyType>>* owner = &chain.newest_owner;
+    size_t kept = 0;
+    size_t cleaned = 0;
+
+    // The current version never ends, so at least that one is always kept
+    while (VersionedRecord<KeyType>* version = link->load(std::memory_order_relaxed)) {
+        // Ended at or before the low-water mark, so no transaction can see it any more
+        bool unreachable = version->end_ts.load(std::memory_order_acquire) <= low_water;
+
+        if (unreachable && (version->created_at < cutoff_time || kept >= max_versions_per_key)) {
+            link->store(version->older.load(std::memory_order_relaxed), std::memory_order_release);
+            retired.push_back(std::move(*owner));
+            *owner = version->older_owner;
+            cleaned++;
+        } else {
+            link = &version->older;
+            owner = &version->older_owner;
+            ++kept;
         }
     }
-    
-    return nullptr;
+    return cleaned;
 }
 
+/*
+ One slice of incremental cleanup: prune the next cleanup_slice_size keys
+ after where the last slice stopped, wrapping around at the end, against
+ the low-water mark. It only holds versions_mutex shared and one chain's
+ write_mutex at a time, so readers never wait for it and writers only
+ for the chain being pruned. Unlinked versions are freed a couple of
+ slices later, once epochs says no reader can be on them.
+*/
 template<typename KeyType>
 size_t VersionManager<KeyType>::cleanupOldVersions() {
-    std::lock_guard<std::mutex> versions_lock(versions_mutex);
-    std::lock_guard<std::mutex> txn_lock(transactions_mutex);
+    std::lock_guard<std::mutex> cleanup_lock(cleanup_mutex);
+    epochs.tryReclaim();
     
-    size_t cleaned = 0;
+    CommitTimestamp low_water = low_water_mark.load();
     auto cutoff_time = std::chrono::steady_clock::now() - version_retention_period;
+    std::vector<std::shared_ptr<void>> retired;
+    size_t cleaned = 0;
     
-    for (auto& [key, version_list] : versions) {
-        auto it = version_list.begin();
-        size_t kept = 0;
-        
-        while (it != version_list.end()) {
-            // Always keep at least one version
-            if (kept == 0) {
-                ++it;
-                ++kept;
-                continue;
-            }
-            
-            // Remove if too old and can be safely cleaned
-            if ((*it)->created_at < cutoff_time && canCleanupVersion(*it)) {
-                it = version_list.erase(it);
-                cleaned++;
-            } else if (kept >= max_versions_per_key && canCleanupVersion(*it)) {
-                // Remove excess versions
-                it = version_list.erase(it);
-                cleaned++;
-            } else {
-                ++it;
-                ++kept;
+    {
+        std::shared_lock<std::shared_mutex> versions_lock(versions_mutex);
+        auto chain = cleanup_cursor ? versions.upper_bound(*cleanup_cursor) : versions.begin();
+        for (size_t visited = 0; chain != versions.end() && visited < cleanup_slice_size; ++chain, ++visited) {
+            cleaned += pruneChain(*chain->second, low_water, cutoff_time, retired);
+            if (!chain->second->newest.load(std::memory_order_acquire)) {
+                emptied_chains.push_back(chain->first);
             }
+            cleanup_cursor = chain->first;
+        }
+        if (chain == versions.end()) {
+            cleanup_cursor.reset();  // The next slice starts over
         }
     }
+
+    epochs.retire(std::move(retired));
+    eraseEmptiedChains();
+    epochs.tryReclaim();
     
     cleaned_versions.fetch_add(cleaned);
     last_cleanup = std::chrono::steady_clock::now();
     
     if (cleaned > 0) {
-        std::cout << "VersionManager: Cleaned up " << cleaned << " old versions" << std::endl;
+        LOG_DEBUG("VersionManager: Cleaned up " << cleaned << " old versions");
     }
     
     return cleaned;
 }
 
+/*
+ Erasing from the map is the one thing that needs versions_mutex
+ exclusively. Under cleanup_mutex, and only if nobody holds the map right
+ now: otherwise the keys wait for the next slice.
+*/
+template<typename KeyType>
+void VersionManager<KeyType>::eraseEmptiedChains() {
+    if (emptied_chains.empty()) {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> versions_lock(versions_mutex, std::try_to_lock);
+    if (!versions_lock.owns_lock()) {
+        return;
+    }
+    for (const KeyType& key : emptied_chains) {
+        auto it = versions.find(key);
+        // A writer may have put a version there in the meantime
+        if (it != versions.end() && !it->second->newest.load(std::memory_order_acquire)) {
+            versions.erase(it);
+        }
+    }
+    emptied_chains.clear();
+}
+
+/*
+ Unlink the versions aborted transactions left behind. Each one knows
+ what it created, so only those keys' chains are walked.
+*/
 template<typename KeyType>
 size_t VersionManager<KeyType>::cleanupAbortedTransactions() {
-    std::lock_guard<std::mutex> versions_lock(versions_mutex);
-    std::lock_guard<std::mutex> txn_lock(transactions_mutex);
+    std::vector<std::shared_ptr<Transaction<KeyType>>> aborted;
+    {
+        std::unique_lock<std::shared_mutex> txn_lock(transactions_mutex);
+        aborted.swap(aborted_transactions);
+    }
     
+    std::lock_guard<std::mutex> cleanup_lock(cleanup_mutex);
+    std::vector<std::shared_ptr<void>> retired;
     size_t cleaned = 0;
     
-    // Find aborted transaction IDs
-    std::vector<TransactionId> aborted_txns;
-    for (const auto& [txn_id, txn] : active_transactions) {
-        if (txn->is_aborted) {
-            aborted_txns.push_back(txn_id);
-        }
-    }
-    
-    // Remove versions created by aborted transactions
-    for (auto& [key, version_list] : versions) {
-        auto it = version_list.begin();
-        while (it != version_list.end()) {
-            if (std::find(aborted_txns.begin(), aborted_txns.end(), (*it)->created_by) != aborted_txns.end()) {
-                it = version_list.erase(it);
-                cleaned++;
-            } else {
-                ++it;
-            }
+    for (const auto& txn : aborted) {
+        for (const auto& version : txn->created) {
+            withChain(version->key, false, [&](VersionChain<KeyType>& chain) {
+                std::atomic<VersionedRecord<KeyType>*>* link = &chain.newest;
+                std::shared_ptr<VersionedRecord<KeyType>>* owner = &chain.newest_owner;
+                while (VersionedRecord<KeyType>* current = link->load(std::memory_order_relaxed)) {
+                    if (current == version.get()) {
+                        link->store(current->older.load(std::memory_order_relaxed), std::memory_order_release);
+                        retired.push_back(std::move(*owner));
+                        *owner = current->older_owner;
+                        cleaned++;
+                        break;
+                    }
+                    link = &current->older;
+                    owner = &current->older_owner;
+                }
+                if (!chain.newest.load(std::memory_order_relaxed)) {
+                    emptied_chains.push_back(version->key);
+                }
+            });
         }
     }
     
-    // Remove aborted transactions
-    for (TransactionId txn_id : aborted_txns) {
-        active_transactions.erase(txn_id);
-    }
+    epochs.retire(std::move(retired));
+    eraseEmptiedChains();
+    epochs.tryReclaim();
     
     if (cleaned > 0) {
-        std::cout << "VersionManager: Cleaned up " << cleaned << " versions from aborted transactions" << std::endl;
+        LOG_DEBUG("VersionManager: Cleaned up " << cleaned << " versions from aborted transactions");
     }
     
     return cleaned;
@@ -313,14 +614,13 @@ size_t VersionManager<KeyType>::cleanupAbortedTransactions() {
 template<typename KeyType>
 bool VersionManager<KeyType>::canCleanupVersion(const std::shared_ptr<VersionedRecord<KeyType>>& version) const {
     // Can cleanup if no active transaction could potentially read this version
-    // For simplicity just check if the creating transaction is committed
-    return committed_transactions.find(version->created_by) != committed_transactions.end();
+    return version->end_ts.load(std::memory_order_acquire) <= low_water_mark.load();
 }
 
 template<typename KeyType>
 typename VersionManager<KeyType>::VersionStats VersionManager<KeyType>::getStats() const {
-    std::lock_guard<std::mutex> versions_lock(versions_mutex);
-    std::lock_guard<std::mutex> txn_lock(transactions_mutex);
+    std::shared_lock<std::shared_mutex> versions_lock(versions_mutex);
+    std::shared_lock<std::shared_mutex> txn_lock(transactions_mutex);
     
     size_t total_keys = versions.size();
     size_t avg_versions = total_keys > 0 ? total_versions.load() / total_keys : 0;
@@ -330,11 +630,13 @@ typename VersionManager<KeyType>::VersionStats VersionManager<KeyType>::getStats
     return {
         total_versions.load(),
         active_transactions.size(),
-        committed_transactions.size(),
+        committed_count,
         avg_versions,
         cleaned_versions.load(),
         cleanup_efficiency,
-        last_cleanup
+        last_cleanup,
+        low_water_mark.load(),
+        epochs.awaitingReclaim()
     };
 }
 
@@ -349,19 +651,29 @@ void VersionManager<KeyType>::printStats() const {
     std::cout << "Avg versions per key: " << stats.versions_per_key_avg << std::endl;
     std::cout << "Cleaned versions: " << stats.cleaned_versions << std::endl;
     std::cout << "Cleanup efficiency: " << stats.cleanup_efficiency << "%" << std::endl;
+    std::cout << "Last commit timestamp: " << last_commit_ts.load() << std::endl;
+    std::cout << "Low-water mark: " << stats.low_water_mark << std::endl;
+    std::cout << "Awaiting reclaim: " << stats.awaiting_reclaim << std::endl;
     std::cout << "==================================" << std::endl;
 }
 
 template<typename KeyType>
 void VersionManager<KeyType>::setRetentionPeriod(std::chrono::hours period) {
     version_retention_period = period;
-    std::cout << "VersionManager: Updated retention period to " << period.count() << " hours" << std::endl;
+    LOG_INFO("VersionManager: Updated retention period to " << period.count() << " hours");
 }
 
 template<typename KeyType>
 void VersionManager<KeyType>::setMaxVersionsPerKey(size_t max_versions) {
     max_versions_per_key = max_versions;
-    std::cout << "VersionManager: Updated max versions per key to " << max_versions << std::endl;
+    LOG_INFO("VersionManager: Updated max versions per key to " << max_versions);
+}
+
+template<typename KeyType>
+void VersionManager<KeyType>::setCleanupSliceSize(size_t keys) {
+    std::lock_guard<std::mutex> cleanup_lock(cleanup_mutex);
+    cleanup_slice_size = keys > 0 ? keys : 1;
+    LOG_INFO("VersionManager: Updated cleanup slice size to " << cleanup_slice_size << " keys");
 }
 
 // Explicit template instantiations
@@ -1,70 +1,572 @@
 #include "wal.h"
+#include "codec.h"
+#include "checksum.h"
+#include "log.h"
+#include "metrics.h"
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <functional>
+#include <type_traits>
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+namespace {
+// Values an insert slot holds when it isn't publishing a record's start position
+constexpr uint64_t SLOT_IDLE = UINT64_MAX;
+constexpr uint64_t SLOT_RESERVING = UINT64_MAX - 1;
+
+// fdatasync, counted and timed for the metrics
+void syncData(int fd) {
+    auto start = std::chrono::steady_clock::now();
+    int error = ::fdatasync(fd) != 0 ? errno : 0;
+    metrics::wal_fsyncs.add();
+    metrics::wal_fsync_latency.record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    if (error != 0) {
+        throw std::runtime_error(std::string("fdatasync failed (") + std::strerror(error) + ")");
+    }
+}
+
+// LEB128: 7 bits per byte, low bits first, high bit set on all but the last byte
+void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool getVarint(const uint8_t*& pos, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A length-prefixed run of bytes, with pos moved past it
+bool getBytes(const uint8_t*& pos, const uint8_t* end, const uint8_t*& bytes, size_t& size) {
+    uint64_t length;
+    if (!getVarint(pos, end, length) || length > static_cast<uint64_t>(end - pos)) {
+        return false;
+    }
+    bytes = pos;
+    size = static_cast<size_t>(length);
+    pos += size;
+    return true;
+}
+
+// Bodies start with the type, the transaction and, for page-level records, the page
+void beginBody(std::vector<uint8_t>& body, WALRecordType type, uint64_t txn_id, PageId page_id) {
+    body.clear();
+    body.push_back(static_cast<uint8_t>(type) | (page_id != 0 ? WAL_FLAG_PAGE_REDO : 0));
+    putVarint(body, txn_id);
+    if (page_id != 0) {
+        putVarint(body, page_id);
+    }
+}
+
+template<typename KeyType>
+void putKey(std::vector<uint8_t>& body, const KeyType& key) {
+    putVarint(body, Codec<KeyType>::encodedSize(key));
+    Codec<KeyType>::append(key, body);
+}
+
+void putFixed32(uint8_t* out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+uint32_t getFixed32(const uint8_t* in) {
+    return static_cast<uint32_t>(in[0]) | static_cast<uint32_t>(in[1]) << 8 |
+           static_cast<uint32_t>(in[2]) << 16 | static_cast<uint32_t>(in[3]) << 24;
+}
+
+// A frame's checksum goes on over the position the frame starts at
+uint32_t positionChecksum(uint32_t crc, uint64_t position) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = static_cast<uint8_t>(position >> (8 * i));
+    }
+    return crc32c(crc, bytes, sizeof(bytes));
+}
+
+std::string directoryOf(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+}
 
 /*
  Ensure we are able to write to a file and have enough space on our buffer
- This is what appends records to our binary WAL file, and the WAL file can:
+ This is what appends records to our binary WAL segment files, and the WAL can:
     - buffer writes in memory and flush to disk when needed
     - replay WAL from specific checkpoint/LSN
     - keeps track of next lsn and transaction ids
- The function below is just a constructor which opens the WAL file in binary append mode
- and initializes its counters (next_ls, transaction id, etc).
+ The function below is just a constructor which finds the existing segment files,
+ initializes its counters (next_ls, transaction id, etc) and starts the flusher thread.
+ LSNs are byte positions, so they carry on from the end of the existing log,
+ after any torn record a crash left behind has been cut off.
 */
 template<typename KeyType>
-WALManager<KeyType>::WALManager(const std::string& wal_path, size_t buffer_limit)
-    : wal_file_path(wal_path), buffer_size_limit(buffer_limit),
-      next_lsn(1), next_transaction_id(1), last_checkpoint_lsn(0) {
+WALManager<KeyType>::WALManager(const std::string& wal_path, size_t buffer_limit, GroupCommitOptions options,
+                                size_t segment_bytes)
+    : wal_file_path(wal_path), segment_size(segment_bytes),
+      // Half the ring, so a record and the pad in front of it always fit in the ring together
+      max_record_bytes(std::min(WAL_LOG_BUFFER_BYTES / 2, segment_bytes)),
+      first_segment(0), end_segment(0), segment_files(0), log_start_lsn(0), segment_fd(-1), open_segment(0),
+      next_lsn(0), next_transaction_id(1), last_checkpoint_lsn(0), retain_lsn(UINT64_MAX),
+      log_buffer(new uint8_t[WAL_LOG_BUFFER_BYTES]), buffer_size_limit(buffer_limit), group_commit(options),
+      durable_lsn(0), wanted_lsn(0), pending_commits(0), flush_requested(false), stop_flusher(false),
+      flush_failed(false) {
     
-    wal_file.open(wal_file_path, std::ios::binary | std::ios::app);
-    if (!wal_file.is_open()) {
-        throw std::runtime_error("Failed to open WAL file: " + wal_file_path);
+    if (segment_size < WAL_MIN_SEGMENT_FILE_BYTES) {
+        throw std::invalid_argument("WAL: Segment files must be at least " +
+                                    std::to_string(WAL_MIN_SEGMENT_FILE_BYTES) + " bytes");
+    }
+    findSegments();
+    uint64_t log_end = recoverLogEnd();
+    next_lsn.store(log_end);
+    durable_lsn.store(log_end);
+    if (group_commit.max_batch == 0) {
+        group_commit.max_batch = 1;
+    }
+    if (buffer_size_limit == 0 || buffer_size_limit > WAL_LOG_BUFFER_BYTES / 2) {
+        buffer_size_limit = WAL_LOG_BUFFER_BYTES / 2;
+    }
+    for (auto& slot : insert_slots) {
+        slot.store(SLOT_IDLE);
     }
     
-    write_buffer.reserve(buffer_size_limit);
+    flusher_thread = std::thread(&WALManager<KeyType>::flusherLoop, this);
     
-    std::cout << "WAL: Initialized with file " << wal_file_path << std::endl;
+    LOG_INFO("WAL: Initialized with file " << wal_file_path);
 }
 
 /*
- When the WAL is destroyed we need to flush any pending buffers,
- and close the file, which is what happens below.
+ When the WAL is destroyed the flusher writes out any pending buffer
+ before it exits, then we close the file.
 */
 template<typename KeyType>
 WALManager<KeyType>::~WALManager() {
-    if (wal_file.is_open()) {
-        flushBuffer();
-        wal_file.close();
+    {
+        std::lock_guard<std::mutex> lock(wal_mutex);
+        stop_flusher = true;
+    }
+    flush_cv.notify_one();
+    if (flusher_thread.joinable()) {
+        flusher_thread.join();
+    }
+    if (segment_fd >= 0) {
+        ::close(segment_fd);
+    }
+}
+
+// Segment files are named after the WAL path and their number, in hex
+template<typename KeyType>
+std::string WALManager<KeyType>::segmentPath(uint64_t segment) const {
+    std::ostringstream path;
+    path << wal_file_path << '.' << std::hex << std::setw(16) << std::setfill('0') << segment;
+    return path.str();
+}
+
+/*
+ Find the segment files already on disk. The log starts at the lowest
+ numbered one, everything before it was truncated. LSNs are positions,
+ so they only make sense with the segment size the files were made with.
+*/
+template<typename KeyType>
+void WALManager<KeyType>::findSegments() {
+    std::string directory = directoryOf(wal_file_path);
+    size_t slash = wal_file_path.find_last_of('/');
+    std::string prefix = (slash == std::string::npos ? wal_file_path : wal_file_path.substr(slash + 1)) + ".";
+
+    DIR* dir = ::opendir(directory.c_str());
+    if (!dir) {
+        throw std::runtime_error("Failed to open WAL directory: " + directory + " (" + std::strerror(errno) + ")");
+    }
+    size_t count = 0;
+    uint64_t lowest = UINT64_MAX;
+    uint64_t highest = 0;
+    while (dirent* entry = ::readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() != prefix.size() + 16 || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.find_first_not_of("0123456789abcdef", prefix.size()) != std::string::npos) {
+            continue;
+        }
+        uint64_t segment = std::stoull(name.substr(prefix.size()), nullptr, 16);
+        lowest = std::min(lowest, segment);
+        highest = std::max(highest, segment);
+        count++;
+    }
+    ::closedir(dir);
+
+    if (count == 0) {
+        return;  // A new log
+    }
+    struct stat st;
+    if (::stat(segmentPath(lowest).c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) != segment_size) {
+        throw std::invalid_argument("WAL: " + segmentPath(lowest) + " is " + std::to_string(st.st_size) +
+                                    " bytes, expected segments of " + std::to_string(segment_size));
+    }
+    first_segment = lowest;
+    end_segment = highest + 1;
+    segment_files.store(count);
+    log_start_lsn.store(first_segment * segment_size);
+}
+
+/*
+ Open a segment file for the flusher to write. A segment that doesn't exist
+ yet is created and preallocated at its full size, so writing into it never
+ has to grow the file, and the directory is synced so the file survives a
+ crash. A recycled segment is reused as it is.
+*/
+template<typename KeyType>
+int WALManager<KeyType>::openSegment(uint64_t segment) {
+    std::lock_guard<std::mutex> lock(segment_mutex);
+    std::string path = segmentPath(segment);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("open " + path + " failed (" + std::strerror(errno) + ")");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < segment_size) {
+        int rc = ::posix_fallocate(fd, 0, static_cast<off_t>(segment_size));
+        if (rc != 0) {
+            ::close(fd);
+            throw std::runtime_error("preallocating " + path + " failed (" + std::strerror(rc) + ")");
+        }
+    }
+    if (segment >= end_segment) {
+        end_segment = segment + 1;
+        segment_files.fetch_add(1);
+        syncDirectory();
+    }
+    return fd;
+}
+
+/*
+ Zero a segment file from keep to its end. Cutting it off and preallocating
+ it again only changes metadata, the freed part reads back as zeros.
+*/
+template<typename KeyType>
+void WALManager<KeyType>::clearSegment(const std::string& path, uint64_t keep) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT) return;  // Not created yet
+        throw std::runtime_error("open " + path + " failed (" + std::strerror(errno) + ")");
+    }
+    int rc = ::ftruncate(fd, static_cast<off_t>(keep)) != 0 ? errno
+             : ::posix_fallocate(fd, 0, static_cast<off_t>(segment_size));
+    ::close(fd);
+    if (rc != 0) {
+        throw std::runtime_error("Failed to clear WAL segment " + path + " (" + std::strerror(rc) + ")");
+    }
+}
+
+/*
+ Throw away whatever follows position in the segment files. After a crash
+ the segment the log ends in (and any written after it) can still hold
+ records that were never made durable. Those sit at their own positions, so
+ their checksums would still match, and a new record that happens to end
+ where one of them starts would lead replay right into it.
+*/
+template<typename KeyType>
+void WALManager<KeyType>::clearSegmentsFrom(uint64_t position) {
+    for (uint64_t segment = position / segment_size; segment < end_segment; ++segment) {
+        clearSegment(segmentPath(segment), segment == position / segment_size ? position % segment_size : 0);
+    }
+}
+
+// Make creating, renaming and deleting segment files durable
+template<typename KeyType>
+void WALManager<KeyType>::syncDirectory() {
+    int fd = ::open(directoryOf(wal_file_path).c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("open WAL directory failed (") + std::strerror(errno) + ")");
+    }
+    int rc = ::fsync(fd);
+    int error = errno;
+    ::close(fd);
+    if (rc != 0) {
+        throw std::runtime_error(std::string("fsync of WAL directory failed (") + std::strerror(error) + ")");
     }
 }
 
 /*
  In order to see if logs are corrupt, we need to have this function
- so we are able to calculate the Checksum over the record bytes. If
- the data is corrupt, then
+ so we are able to calculate the Checksum over the record bytes. It is a
+ CRC32C, continued from crc so a body in several pieces can be summed up.
+ Replay stops at the first record whose checksum doesn't match.
+*/
+template<typename KeyType>
+uint32_t WALManager<KeyType>::calculateChecksum(uint32_t crc, const void* data, size_t size) {
+    return crc32c(crc, data, size);
+}
+
+/*
+ Take a free insert slot. Each thread starts at its own slot, so threads
+ normally don't touch each other's slots at all.
+*/
+template<typename KeyType>
+std::atomic<uint64_t>& WALManager<KeyType>::claimInsertSlot() {
+    thread_local size_t slot_hint = std::hash<std::thread::id>()(std::this_thread::get_id()) % WAL_INSERT_SLOTS;
+    for (size_t attempt = 0;; ++attempt) {
+        size_t index = (slot_hint + attempt) % WAL_INSERT_SLOTS;
+        uint64_t expected = SLOT_IDLE;
+        if (insert_slots[index].compare_exchange_strong(expected, SLOT_RESERVING)) {
+            slot_hint = index;
+            return insert_slots[index];
+        }
+        if (attempt % WAL_INSERT_SLOTS == WAL_INSERT_SLOTS - 1) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Copy bytes into the ring at a log position, wrapping around its end
+template<typename KeyType>
+void WALManager<KeyType>::copyToBuffer(uint64_t position, const uint8_t* bytes, size_t size) {
+    size_t offset = position % WAL_LOG_BUFFER_BYTES;
+    size_t first = std::min(size, WAL_LOG_BUFFER_BYTES - offset);
+    std::memcpy(log_buffer.get() + offset, bytes, first);
+    std::memcpy(log_buffer.get(), bytes + first, size - first);
+}
+
+// Wake the flusher, only the first request until it runs takes wal_mutex
+template<typename KeyType>
+void WALManager<KeyType>::requestFlush() {
+    if (!flush_requested.exchange(true)) {
+        std::lock_guard<std::mutex> lock(wal_mutex);
+        flush_cv.notify_one();
+    }
+}
+
+/*
+ Append a record, given as the pieces of its body, to the log. This is
+ the lock-free path every log function goes through:
+    1. sum up the body and work out its size
+    2. claim an insert slot, then reserve our bytes with a CAS on next_lsn,
+       plus the rest of the segment file if the record doesn't fit in it
+    3. publish where our bytes start in the slot
+    4. wait for room if the ring is still full of unflushed bytes
+    5. copy the frame (checksum finished with our position) into the ring
+       and free the slot
+ Threads copy in parallel. The flusher never writes past the start of a
+ record that is still being copied, so it only ever writes filled bytes.
+ Returns the record's LSN.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::appendRecord(std::initializer_list<WALBytes> body) {
+    size_t body_size = 0;
+    uint32_t crc = 0;
+    for (const WALBytes& part : body) {
+        body_size += part.size;
+        crc = calculateChecksum(crc, part.data, part.size);
+    }
+    size_t total = WAL_FRAME_HEADER_BYTES + body_size;
+    if (total > max_record_bytes) {
+        throw std::length_error("WAL: Record of " + std::to_string(total) + " bytes is larger than the limit of " +
+                                std::to_string(max_record_bytes));
+    }
+    metrics::wal_bytes.add(total);
+
+    std::atomic<uint64_t>& slot = claimInsertSlot();
+    uint64_t start = next_lsn.load();
+    uint64_t record_start;
+    do {
+        size_t room = segment_size - start % segment_size;
+        record_start = room < total ? start + room : start;
+    } while (!next_lsn.compare_exchange_weak(start, record_start + total));
+    slot.store(start);
+    uint64_t lsn = record_start + total;
+
+    // The ring only holds WAL_LOG_BUFFER_BYTES past the durable position
+    while (lsn - durable_lsn.load() > WAL_LOG_BUFFER_BYTES) {
+        if (flush_failed.load()) {
+            slot.store(SLOT_IDLE);
+            throw std::runtime_error("WAL: Log flush failed, can't append");
+        }
+        requestFlush();
+        std::this_thread::yield();
+    }
+
+    uint8_t frame[WAL_FRAME_HEADER_BYTES];
+    if (record_start != start && record_start - start >= WAL_FRAME_HEADER_BYTES) {
+        // Pad marker, readers skip from here to the next segment
+        putFixed32(frame, 0);
+        putFixed32(frame + 4, positionChecksum(0, start));
+        copyToBuffer(start, frame, sizeof(frame));
+    }
+    putFixed32(frame, static_cast<uint32_t>(body_size));
+    putFixed32(frame + 4, positionChecksum(crc, record_start));
+    copyToBuffer(record_start, frame, sizeof(frame));
+    uint64_t position = record_start + sizeof(frame);
+    for (const WALBytes& part : body) {
+        if (part.size > 0) {
+            copyToBuffer(position, part.data, part.size);
+            position += part.size;
+        }
+    }
+    slot.store(SLOT_IDLE);
+
+    if (lsn - durable_lsn.load() >= buffer_size_limit) {
+        requestFlush();
+    }
+    return lsn;
+}
+
+/*
+ How far the log is filled in without gaps. Everything reserved so far is
+ filled, except from the start of the lowest record still being copied.
+ A slot in the middle of reserving is about to publish its start, and that
+ start may be below what we read from next_lsn, so wait for it.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::filledLSN() {
+    uint64_t filled = next_lsn.load();
+    for (auto& slot : insert_slots) {
+        uint64_t start = slot.load();
+        while (start == SLOT_RESERVING) {
+            std::this_thread::yield();
+            start = slot.load();
+        }
+        if (start < filled) {
+            filled = start;
+        }
+    }
+    return filled;
+}
+
+/*
+ Block until everything up to lsn is durable. force skips the group commit
+ delay, for callers like sync() that aren't a commit joining a group.
+*/
+template<typename KeyType>
+void WALManager<KeyType>::waitDurable(std::unique_lock<std::mutex>& lock, uint64_t lsn, bool force) {
+    if (lsn > wanted_lsn) {
+        wanted_lsn = lsn;
+    }
+    if (force) {
+        flush_requested.store(true);
+    }
+    flush_cv.notify_one();
+    durable_cv.wait(lock, [this, lsn] { return durable_lsn.load() >= lsn || !flush_error.empty(); });
+    if (durable_lsn.load() < lsn) {
+        throw std::runtime_error("WAL: " + flush_error);
+    }
+}
+
+/*
+ Write log positions [from, to) from the ring to their segment files and
+ force them to disk. The range may wrap around the end of the ring or run
+ into the next segment, which is opened (or created) once a segment is
+ done and synced. pwrite can return short writes, so keep going until all
+ is written.
 */
 template<typename KeyType>
-uint32_t WALManager<KeyType>::calculateChecksum(const void* data, size_t size) {
-    uint32_t checksum = 0;
-    const uint8_t* bytes = static_cast<const uint8_t*>(data);
-    for (size_t i = 0; i < size; ++i) {
-        checksum = (checksum << 1) ^ bytes[i];
+void WALManager<KeyType>::writeRange(uint64_t from, uint64_t to) {
+    while (from < to) {
+        uint64_t segment = from / segment_size;
+        if (segment_fd < 0 || segment != open_segment) {
+            if (segment_fd >= 0) {
+                syncData(segment_fd);
+                ::close(segment_fd);
+                segment_fd = -1;
+            }
+            segment_fd = openSegment(segment);
+            open_segment = segment;
+        }
+        size_t offset = from % WAL_LOG_BUFFER_BYTES;
+        size_t file_offset = from % segment_size;
+        size_t size = std::min<uint64_t>({to - from, WAL_LOG_BUFFER_BYTES - offset, segment_size - file_offset});
+        ssize_t n = ::pwrite(segment_fd, log_buffer.get() + offset, size, static_cast<off_t>(file_offset));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("write failed (") + std::strerror(errno) + ")");
+        }
+        from += static_cast<uint64_t>(n);
     }
-    return checksum;
+    syncData(segment_fd);
 }
 
 /*
- Write in memory write_buffer to WAL and then flush it 
- to disk. This is called when the buffer limit is reached.
+ The flusher thread, this is group commit. Commits only append their record
+ and wait, the flusher writes everything filled in so far with one write +
+ fdatasync outside of wal_mutex, and wakes every waiter whose LSN is now
+ durable. Commits that arrive during the fdatasync form the next group.
+ If a waiter's record sits behind one that is still being copied, we yield
+ and try again, the copy is only a memcpy away from done.
 */
 template<typename KeyType>
-void WALManager<KeyType>::flushBuffer() {
-    if (!write_buffer.empty()) {
-        wal_file.write(reinterpret_cast<const char*>(write_buffer.data()), write_buffer.size());
-        wal_file.flush();
-        write_buffer.clear();
-        std::cout << "WAL: Flushed buffer to disk" << std::endl;
+void WALManager<KeyType>::flusherLoop() {
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    while (true) {
+        flush_cv.wait(lock, [this] {
+            return stop_flusher || flush_requested.load() || pending_commits > 0 ||
+                   (durable_lsn.load() < wanted_lsn && flush_error.empty());
+        });
+
+        // Give more commits a chance to join the group
+        if (!stop_flusher && !flush_requested.load() && group_commit.max_delay.count() > 0 && pending_commits > 0) {
+            flush_cv.wait_until(lock, first_pending_commit + group_commit.max_delay, [this] {
+                return stop_flusher || flush_requested.load() || pending_commits >= group_commit.max_batch;
+            });
+        }
+
+        bool stopping = stop_flusher;
+        size_t group_size = pending_commits;
+        pending_commits = 0;
+        flush_requested.store(false);
+
+        if (!flush_error.empty()) {
+            if (stopping) break;
+            continue;
+        }
+
+        lock.unlock();
+        uint64_t from = durable_lsn.load();
+        uint64_t to = filledLSN();
+        std::string error;
+        if (to > from) {
+            try {
+                writeRange(from, to);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        } else if (!stopping) {
+            std::this_thread::yield();
+        }
+        lock.lock();
+
+        if (!error.empty()) {
+            flush_error = error;
+            flush_failed.store(true);
+            LOG_ERROR("WAL: Flush failed, " << error);
+        } else if (to > from) {
+            durable_lsn.store(to);
+            LOG_DEBUG("WAL: Flushed group of " << group_size << " commits to disk (durable LSN: "
+                      << to << ")");
+        }
+        durable_cv.notify_all();
+        if (stopping) break;
     }
 }
 
@@ -75,35 +577,37 @@ void WALManager<KeyType>::flushBuffer() {
 template<typename KeyType>
 uint64_t WALManager<KeyType>::beginTransaction() {
     uint64_t txn_id = next_transaction_id.fetch_add(1);
-    std::cout << "WAL: Started transaction " << txn_id << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(transaction_mutex);
+        active_transactions.emplace(txn_id, next_lsn.load());
+    }
+    LOG_DEBUG("WAL: Started transaction " << txn_id);
     return txn_id;
 }
 
 /*
- When committing a transaction, we need a new LSN,
- we create a commit record, find its checksum, and then
- writes it to the buffer, which is then flushed.
+ When committing a transaction, we append a commit record (which gets its
+ LSN and checksum on the way in). The flusher makes it durable together
+ with every other commit waiting at the same time, we return once it has.
 */
 template<typename KeyType>
 void WALManager<KeyType>::commitTransaction(uint64_t txn_id) {
-    // We don't want this to be interrupted so lock the mutex
-    std::lock_guard<std::mutex> lock(wal_mutex);
-    
-    uint64_t lsn = next_lsn.fetch_add(1);
-    WALRecordHeader commit_record(WALRecordType::COMMIT, sizeof(WALRecordHeader), txn_id, lsn);
-    // checkSum is used to create the hash
-    commit_record.checksum = calculateChecksum(&commit_record, sizeof(commit_record) - sizeof(commit_record.checksum));
-    
-    const uint8_t* record_bytes = reinterpret_cast<const uint8_t*>(&commit_record);
-    write_buffer.insert(write_buffer.end(), record_bytes, record_bytes + sizeof(commit_record));
-    
-    if (write_buffer.size() >= buffer_size_limit) {
-        flushBuffer();
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::COMMIT, txn_id, 0);
+    uint64_t lsn = appendRecord({{body.data(), body.size()}});
+    {
+        std::lock_guard<std::mutex> lock(transaction_mutex);
+        active_transactions.erase(txn_id);
     }
     
-    flushBuffer();
+    // Only waiting for the flush needs the mutex
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    if (pending_commits++ == 0) {
+        first_pending_commit = std::chrono::steady_clock::now();
+    }
+    waitDurable(lock, lsn, false);
     
-    std::cout << "WAL: Committed transaction " << txn_id << " (LSN: " << lsn << ")" << std::endl;
+    LOG_DEBUG("WAL: Committed transaction " << txn_id << " (LSN: " << lsn << ")");
 }
 
 /*
@@ -111,104 +615,151 @@ void WALManager<KeyType>::commitTransaction(uint64_t txn_id) {
 */
 template<typename KeyType>
 void WALManager<KeyType>::abortTransaction(uint64_t txn_id) {
-    std::lock_guard<std::mutex> lock(wal_mutex);
-    
-    uint64_t lsn = next_lsn.fetch_add(1);
-    WALRecordHeader abort_record(WALRecordType::ABORT, sizeof(WALRecordHeader), txn_id, lsn);
-    abort_record.checksum = calculateChecksum(&abort_record, sizeof(abort_record) - sizeof(abort_record.checksum));
-    
-    const uint8_t* record_bytes = reinterpret_cast<const uint8_t*>(&abort_record);
-    write_buffer.insert(write_buffer.end(), record_bytes, record_bytes + sizeof(abort_record));
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::ABORT, txn_id, 0);
+    uint64_t lsn = appendRecord({{body.data(), body.size()}});
+    {
+        std::lock_guard<std::mutex> lock(transaction_mutex);
+        active_transactions.erase(txn_id);
+    }
     
-    std::cout << "WAL: Aborted transaction " << txn_id << " (LSN: " << lsn << ")" << std::endl;
+    LOG_DEBUG("WAL: Aborted transaction " << txn_id << " (LSN: " << lsn << ")");
 }
 
 /*
  Now we have functions to log data operations such as insert, delete, update.
- Each of these functions creates a WALDataRecord with metadata, fills in the details, and
- adds it to the write buffer. If the buffer is full, it might automatically flush.
+ Each of these functions encodes the fixed part of the record (type,
+ transaction, key and lengths) and appends it together with the data, so
+ the data itself is only copied once, straight into the log buffer.
  I will add comments to this function as an example.
 */
 template<typename KeyType>
-uint64_t WALManager<KeyType>::logInsert(uint64_t txn_id, uint16_t page_id, const KeyType& key, 
+uint64_t WALManager<KeyType>::logInsert(uint64_t txn_id, PageId page_id, const KeyType& key, 
                                         const std::vector<uint8_t>& data) {
-    // All of these functions will lock the mutex since our writer queue is shared
-    std::lock_guard<std::mutex> lock(wal_mutex);
-    // Get the next LSN for this record
-    uint64_t lsn = next_lsn.fetch_add(1);
-    // Create the WALDataRecord for INSERT
-    WALDataRecord<KeyType> record(WALRecordType::INSERT, txn_id, lsn, page_id, key);
-    record.new_data = data;
+    // Encode everything in front of the data, its LSN is assigned when it is appended
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::INSERT, txn_id, page_id);
+    putKey(body, key);
+    putVarint(body, data.size());
     
-    // Calculate actual record size including variable data
-    record.header.record_size = sizeof(WALDataRecord<KeyType>) + data.size();
-    // Calculate checksum over the record (excluding checksum field itself)
-    record.header.checksum = calculateChecksum(&record, sizeof(record) - sizeof(record.header.checksum));
+    // Append it followed by the actual data payload, no lock needed
+    uint64_t lsn = appendRecord({{body.data(), body.size()}, {data.data(), data.size()}});
     
-    // Append the record bytes to the write buffer
-    const uint8_t* record_bytes = reinterpret_cast<const uint8_t*>(&record);
-    write_buffer.insert(write_buffer.end(), record_bytes, record_bytes + sizeof(record));
-    
-    // Append the actual data payload
-    write_buffer.insert(write_buffer.end(), data.begin(), data.end());
-    
-    // Check if the buffer is full, if so then flush.
-    if (write_buffer.size() >= buffer_size_limit) {
-        flushBuffer();
-    }
-    
-    std::cout << "WAL: Logged INSERT for key " << key << " (LSN: " << lsn << ")" << std::endl;
+    LOG_DEBUG("WAL: Logged INSERT for key " << key << " (LSN: " << lsn << ")");
     return lsn;
 }
 
 template<typename KeyType>
-uint64_t WALManager<KeyType>::logDelete(uint64_t txn_id, uint16_t page_id, const KeyType& key, 
+uint64_t WALManager<KeyType>::logDelete(uint64_t txn_id, PageId page_id, const KeyType& key, 
                                         const std::vector<uint8_t>& old_data) {
-    std::lock_guard<std::mutex> lock(wal_mutex);
-    
-    uint64_t lsn = next_lsn.fetch_add(1);
-    WALDataRecord<KeyType> record(WALRecordType::DELETE, txn_id, lsn, page_id, key);
-    record.old_data = old_data;
-    
-    record.header.record_size = sizeof(WALDataRecord<KeyType>) + old_data.size();
-    record.header.checksum = calculateChecksum(&record, sizeof(record) - sizeof(record.header.checksum));
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::DELETE, txn_id, page_id);
+    putKey(body, key);
+    putVarint(body, old_data.size());
+    uint64_t lsn = appendRecord({{body.data(), body.size()}, {old_data.data(), old_data.size()}});
     
-    const uint8_t* record_bytes = reinterpret_cast<const uint8_t*>(&record);
-    write_buffer.insert(write_buffer.end(), record_bytes, record_bytes + sizeof(record));
-    write_buffer.insert(write_buffer.end(), old_data.begin(), old_data.end());
-    
-    if (write_buffer.size() >= buffer_size_limit) {
-        flushBuffer();
-    }
-    
-    std::cout << "WAL: Logged DELETE for key " << key << " (LSN: " << lsn << ")" << std::endl;
+    LOG_DEBUG("WAL: Logged DELETE for key " << key << " (LSN: " << lsn << ")");
     return lsn;
 }
 
 template<typename KeyType>
-uint64_t WALManager<KeyType>::logUpdate(uint64_t txn_id, uint16_t page_id, const KeyType& key,
+uint64_t WALManager<KeyType>::logUpdate(uint64_t txn_id, PageId page_id, const KeyType& key,
                                         const std::vector<uint8_t>& old_data, 
                                         const std::vector<uint8_t>& new_data) {
-    std::lock_guard<std::mutex> lock(wal_mutex);
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::UPDATE, txn_id, page_id);
+    putKey(body, key);
+    putVarint(body, old_data.size());
+    size_t old_size_end = body.size();
+    putVarint(body, new_data.size());
     
-    uint64_t lsn = next_lsn.fetch_add(1);
-    WALDataRecord<KeyType> record(WALRecordType::UPDATE, txn_id, lsn, page_id, key);
-    record.old_data = old_data;
-    record.new_data = new_data;
+    // The new data's length goes between the two payloads
+    uint64_t lsn = appendRecord({{body.data(), old_size_end},
+                                 {old_data.data(), old_data.size()},
+                                 {body.data() + old_size_end, body.size() - old_size_end},
+                                 {new_data.data(), new_data.size()}});
     
-    record.header.record_size = sizeof(WALDataRecord<KeyType>) + old_data.size() + new_data.size();
-    record.header.checksum = calculateChecksum(&record, sizeof(record) - sizeof(record.header.checksum));
-    
-    const uint8_t* record_bytes = reinterpret_cast<const uint8_t*>(&record);
-    write_buffer.insert(write_buffer.end(), record_bytes, record_bytes + sizeof(record));
-    write_buffer.insert(write_buffer.end(), old_data.begin(), old_data.end());
-    write_buffer.insert(write_buffer.end(), new_data.begin(), new_data.end());
+    LOG_DEBUG("WAL: Logged UPDATE for key " << key << " (LSN: " << lsn << ")");
+    return lsn;
+}
+
+/*
+ One record for a batch of inserts instead of one record per key. Keys and
+ values are length-prefixed so replay can split them up again. A batch too
+ big for one record is split into several, all in the same transaction.
+ Returns the LSN of the last one.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::logInsertBatch(uint64_t txn_id,
+                                             const std::vector<std::pair<KeyType, std::vector<uint8_t>>>& entries) {
+    uint64_t lsn = 0;
+    std::vector<uint8_t> payload;
+    uint64_t num_entries = 0;
+
+    auto append_batch = [&]() {
+        std::vector<uint8_t> body;
+        beginBody(body, WALRecordType::INSERT_BATCH, txn_id, 0);
+        putVarint(body, num_entries);
+        lsn = appendRecord({{body.data(), body.size()}, {payload.data(), payload.size()}});
+        LOG_DEBUG("WAL: Logged INSERT_BATCH of " << num_entries << " keys (LSN: " << lsn << ")");
+        payload.clear();
+        num_entries = 0;
+    };
+
+    for (const auto& entry : entries) {
+        size_t entry_size = Codec<KeyType>::encodedSize(entry.first) + entry.second.size() + 20;
+        if (num_entries > 0 && payload.size() + entry_size > max_record_bytes / 4) {
+            append_batch();
+        }
+        putKey(payload, entry.first);
+        putVarint(payload, entry.second.size());
+        payload.insert(payload.end(), entry.second.begin(), entry.second.end());
+        num_entries++;
+    }
+    if (num_entries > 0 || entries.empty()) {
+        append_batch();
+    }
+    return lsn;
+}
+
+/*
+ One record for a whole bulk load instead of one INSERT per key. The caller
+ must have synced the loaded pages to the page file already, so there is
+ nothing to redo, the record just marks where the new tree came from.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::logBulkLoad(uint64_t txn_id, PageId root_page_id, uint64_t num_pages, uint64_t num_keys) {
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::BULK_LOAD, txn_id, 0);
+    putVarint(body, root_page_id);
+    putVarint(body, num_pages);
+    putVarint(body, num_keys);
+    uint64_t lsn = appendRecord({{body.data(), body.size()}});
     
-    if (write_buffer.size() >= buffer_size_limit) {
-        flushBuffer();
+    LOG_INFO("WAL: Logged BULK_LOAD of " << num_keys << " keys in " << num_pages
+             << " pages, root page " << root_page_id << " (LSN: " << lsn << ")");
+    return lsn;
+}
+
+/*
+ The page file may get saved while a transaction is still open, with its
+ changes in the pages. Before that, the tree logs what each key it changed
+ held before, and recover puts it back unless the transaction commits.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::logUndo(uint64_t txn_id, const KeyType& key, const std::vector<uint8_t>* old_data) {
+    static const std::vector<uint8_t> none;
+    const std::vector<uint8_t>& data = old_data ? *old_data : none;
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::UNDO, txn_id, 0);
+    putKey(body, key);
+    putVarint(body, old_data ? 1 : 0);
+    if (old_data) {
+        putVarint(body, data.size());
     }
+    uint64_t lsn = appendRecord({{body.data(), body.size()}, {data.data(), data.size()}});
     
-    std::cout << "WAL: Logged UPDATE for key " << key << " (LSN: " << lsn << ")" << std::endl;
+    LOG_DEBUG("WAL: Logged UNDO for key " << key << " (LSN: " << lsn << ")");
     return lsn;
 }
 
@@ -219,175 +770,408 @@ uint64_t WALManager<KeyType>::logUpdate(uint64_t txn_id, uint16_t page_id, const
 */
 template<typename KeyType>
 uint64_t WALManager<KeyType>::writeCheckpoint() {
-    std::lock_guard<std::mutex> lock(wal_mutex);
-    
-    // Make sure to flush any pending writes first
-    flushBuffer();
-    
-    uint64_t lsn = next_lsn.fetch_add(1);
     uint64_t checkpoint_txn = next_transaction_id.fetch_add(1);
     
-    // Create checkpoint record
-    WALRecordHeader checkpoint_record(WALRecordType::CHECKPOINT, sizeof(WALRecordHeader), checkpoint_txn, lsn);
-    checkpoint_record.checksum = calculateChecksum(&checkpoint_record, sizeof(checkpoint_record) - sizeof(checkpoint_record.checksum));
+    // Create checkpoint record, it goes out behind any pending writes
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::CHECKPOINT, checkpoint_txn, 0);
+    uint64_t lsn = appendRecord({{body.data(), body.size()}});
     
-    // Write checkpoint record directly to file
-    wal_file.write(reinterpret_cast<const char*>(&checkpoint_record), sizeof(checkpoint_record));
-    wal_file.flush();
+    // and is durable before we report it
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    waitDurable(lock, lsn, true);
     
     // Update last checkpoint LSN, so we can use this during recovery
     last_checkpoint_lsn.store(lsn);
     
-    std::cout << "WAL: Wrote checkpoint at LSN " << lsn << std::endl;
+    LOG_INFO("WAL: Wrote checkpoint at LSN " << lsn);
     return lsn;
 }
 
 /*
- This just forces a flush of any buffered WAL records to the disk.
+ Start a fuzzy checkpoint. The record lists the transactions still running
+ and the dirty page table, and nobody waits for it: the checkpoint only
+ counts once its end record is durable. Returns the begin LSN.
 */
 template<typename KeyType>
-void WALManager<KeyType>::sync() {
-    // Lock the mutex to avoid concurrent writes
-    std::lock_guard<std::mutex> lock(wal_mutex);
-    flushBuffer();
+uint64_t WALManager<KeyType>::beginCheckpoint(const std::vector<std::pair<PageId, uint64_t>>& dirty_pages) {
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::CHECKPOINT_BEGIN, 0, 0);
+    {
+        std::lock_guard<std::mutex> lock(transaction_mutex);
+        putVarint(body, active_transactions.size());
+        for (const auto& txn : active_transactions) {
+            putVarint(body, txn.first);
+        }
+    }
+    putVarint(body, dirty_pages.size());
+    for (const auto& page : dirty_pages) {
+        putVarint(body, page.first);
+        putVarint(body, page.second);
+    }
+    uint64_t lsn = appendRecord({{body.data(), body.size()}});
+    
+    LOG_INFO("WAL: Began checkpoint at LSN " << lsn << " with " << dirty_pages.size()
+             << " dirty pages");
+    return lsn;
 }
 
 /*
- Currently a stub function, since in a real function we would
- delete all of the WAL records up to a specified LSN (typically checkpoint LSN).
+ Finish the fuzzy checkpoint that began at begin_lsn. Its dirty pages have
+ been written, so redo only has to start at redo_lsn (the oldest rec LSN of
+ a page that is dirty now, at most begin_lsn, or the LSN the tree's page
+ table was saved at). From here on that is where recovery can start and
+ how far the log can be truncated.
 */
 template<typename KeyType>
-void WALManager<KeyType>::truncate(uint64_t up_to_lsn) {
-    std::lock_guard<std::mutex> lock(wal_mutex);
+uint64_t WALManager<KeyType>::endCheckpoint(uint64_t begin_lsn, uint64_t redo_lsn) {
+    std::vector<uint8_t> body;
+    beginBody(body, WALRecordType::CHECKPOINT_END, 0, 0);
+    putVarint(body, begin_lsn);
+    putVarint(body, redo_lsn);
+    uint64_t lsn = appendRecord({{body.data(), body.size()}});
+    
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    waitDurable(lock, lsn, true);
+    if (redo_lsn > last_checkpoint_lsn.load()) {
+        last_checkpoint_lsn.store(redo_lsn);
+    }
     
-    std::cout << "WAL: Truncated up to LSN " << up_to_lsn << std::endl;
+    LOG_INFO("WAL: Ended checkpoint at LSN " << lsn << " (began at " << begin_lsn
+             << ", redo from " << redo_lsn << ")");
+    return lsn;
+}
+
+// A transaction begins before it logs anything, so the LSN it began at covers all of it
+template<typename KeyType>
+uint64_t WALManager<KeyType>::oldestActiveLSN() {
+    uint64_t oldest = next_lsn.load();
+    std::lock_guard<std::mutex> lock(transaction_mutex);
+    for (const auto& txn : active_transactions) {
+        oldest = std::min(oldest, txn.second);
+    }
+    return oldest;
 }
 
 /*
- Just get the current size of the WAL file, which is used
- for monitoring purposes.
+ This just forces a flush of any buffered WAL records to the disk,
+ and waits until they are durable.
 */
 template<typename KeyType>
-size_t WALManager<KeyType>::getWALSize() const {
-    std::ifstream file(wal_file_path, std::ios::binary | std::ios::ate);
-    if (file.is_open()) {
-        return file.tellg();
+void WALManager<KeyType>::sync() {
+    uint64_t lsn = next_lsn.load();
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    if (durable_lsn.load() < lsn) {
+        waitDurable(lock, lsn, true);
     }
-    return 0;
 }
 
 /*
- This is mainly for debugging, we read through the WAL file from a given LSN.
- We read the headers then payloads, and print information about each record with
- an LSN at or after from_lsn.
+ Delete the WAL records up to a specified LSN (typically checkpoint LSN).
+ Records live in segment files, so this drops every segment that ends at or
+ before the LSN, never past the last checkpoint, the redo LSN of the saved
+ page table or what is durable. Instead of deleting them, up to
+ WAL_SPARE_SEGMENTS segments are renamed to come after the newest one and
+ cleared, the flusher then writes into them without having to create a new
+ file. Even if clearing one didn't make it to disk, what it held has
+ checksums for its old positions, so replay never mistakes it for records.
 */
 template<typename KeyType>
-void WALManager<KeyType>::replay(uint64_t from_lsn) {
-    std::cout << "WAL: Replaying from LSN " << from_lsn << std::endl;
-    std::ifstream file(wal_file_path, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "WAL: Failed to open WAL file for replay: " << wal_file_path << std::endl;
-        return;
+void WALManager<KeyType>::truncate(uint64_t up_to_lsn) {
+    uint64_t durable = durable_lsn.load();
+    uint64_t limit = std::min({up_to_lsn, last_checkpoint_lsn.load(), retain_lsn.load(), durable});
+    size_t deleted = 0;
+    size_t recycled = 0;
+    {
+        std::lock_guard<std::mutex> lock(segment_mutex);
+        uint64_t active_segment = durable / segment_size;
+        while (first_segment < end_segment && (first_segment + 1) * segment_size <= limit) {
+            std::string path = segmentPath(first_segment);
+            size_t spares = end_segment > active_segment + 1 ? end_segment - active_segment - 1 : 0;
+            if (spares < WAL_SPARE_SEGMENTS && ::rename(path.c_str(), segmentPath(end_segment).c_str()) == 0) {
+                clearSegment(segmentPath(end_segment), 0);
+                end_segment++;
+                recycled++;
+            } else if (::unlink(path.c_str()) == 0 || errno == ENOENT) {
+                segment_files.fetch_sub(1);
+                deleted++;
+            } else {
+                throw std::runtime_error("Failed to delete WAL segment " + path + " (" + std::strerror(errno) + ")");
+            }
+            first_segment++;
+        }
+        if (deleted + recycled > 0) {
+            syncDirectory();
+        }
+        if (limit > log_start_lsn.load()) {
+            log_start_lsn.store(limit);
+        }
     }
+    
+    LOG_INFO("WAL: Truncated up to LSN " << limit << " (" << deleted << " segments deleted, "
+             << recycled << " recycled)");
+}
 
-    uint64_t max_seen_lsn = 0;
-    uint64_t max_seen_txn = 0;
-    uint64_t last_ckpt = last_checkpoint_lsn.load();
+/*
+ Decode a record body (the bytes after the frame header). Returns false if
+ the body doesn't parse as a record with our key type.
+*/
+template<typename KeyType>
+bool WALManager<KeyType>::decodeRecord(const uint8_t* body, size_t size, WALRecord<KeyType>& record) {
+    const uint8_t* pos = body;
+    const uint8_t* end = body + size;
+    if (pos == end) {
+        return false;
+    }
+    uint8_t type_byte = *pos++;
+    record.type = static_cast<WALRecordType>(type_byte & ~WAL_FLAG_PAGE_REDO);
 
-    while (true) {
-        WALRecordHeader header(WALRecordType::ABORT, 0, 0, 0);
-        // Read just the header portion at the start of each record
-        file.read(reinterpret_cast<char*>(&header), sizeof(header));
-        if (!file) {
-            break;
-        }
+    uint64_t value;
+    if (!getVarint(pos, end, record.transaction_id)) return false;
+    record.page_id = 0;
+    if (type_byte & WAL_FLAG_PAGE_REDO) {
+        if (!getVarint(pos, end, value)) return false;
+        record.page_id = value;
+    }
 
-        // Track maxima for internal counters
-        if (header.lsn > max_seen_lsn) max_seen_lsn = header.lsn;
-        if (header.transaction_id > max_seen_txn) max_seen_txn = header.transaction_id;
+    const uint8_t* bytes;
+    size_t length;
+    auto get_key = [&](KeyType& key) {
+        if (!getBytes(pos, end, bytes, length)) return false;
+        // Fixed-width keys have to be exactly their size (a tree with other keys may share the file)
+        if (std::is_trivially_copyable<KeyType>::value && length != sizeof(KeyType)) return false;
+        key = Codec<KeyType>::decode(bytes, length);
+        return true;
+    };
+    auto get_data = [&](std::vector<uint8_t>& data) {
+        if (!getBytes(pos, end, bytes, length)) return false;
+        data.assign(bytes, bytes + length);
+        return true;
+    };
 
-        // Shouldn't happen but bail out to avoid infinite loop
-        if (header.record_size < sizeof(WALRecordHeader)) {
-            std::cerr << "WAL: Corrupt record encountered (record_size < header). Stopping replay." << std::endl;
-            break;
+    record.old_data.clear();
+    record.new_data.clear();
+    record.entries.clear();
+    switch (record.type) {
+        case WALRecordType::INSERT:
+            return get_key(record.key) && get_data(record.new_data) && pos == end;
+        case WALRecordType::DELETE:
+            return get_key(record.key) && get_data(record.old_data) && pos == end;
+        case WALRecordType::UPDATE:
+            return get_key(record.key) && get_data(record.old_data) && get_data(record.new_data) && pos == end;
+        case WALRecordType::UNDO:
+            if (!get_key(record.key) || !getVarint(pos, end, value) || value > 1) return false;
+            record.had_key = value == 1;
+            return (!record.had_key || get_data(record.old_data)) && pos == end;
+        case WALRecordType::INSERT_BATCH: {
+            uint64_t num_entries;
+            if (!getVarint(pos, end, num_entries) || num_entries > size) return false;
+            record.entries.resize(static_cast<size_t>(num_entries));
+            for (auto& entry : record.entries) {
+                if (!get_key(entry.first) || !get_data(entry.second)) return false;
+            }
+            return pos == end;
         }
+        case WALRecordType::BULK_LOAD:
+            if (!getVarint(pos, end, value)) return false;
+            record.root_page_id = value;
+            return getVarint(pos, end, record.num_pages) && getVarint(pos, end, record.num_keys) && pos == end;
+        case WALRecordType::CHECKPOINT_BEGIN: {
+            uint64_t count;
+            record.active_transactions.clear();
+            record.dirty_pages.clear();
+            if (!getVarint(pos, end, count) || count > size) return false;
+            for (uint64_t i = 0; i < count; ++i) {
+                if (!getVarint(pos, end, value)) return false;
+                record.active_transactions.push_back(value);
+            }
+            if (!getVarint(pos, end, count) || count > size) return false;
+            for (uint64_t i = 0; i < count; ++i) {
+                uint64_t rec_lsn;
+                if (!getVarint(pos, end, value) || !getVarint(pos, end, rec_lsn)) return false;
+                record.dirty_pages.emplace_back(value, rec_lsn);
+            }
+            return pos == end;
+        }
+        case WALRecordType::CHECKPOINT_END:
+            return getVarint(pos, end, record.checkpoint_begin_lsn) && getVarint(pos, end, record.redo_lsn) &&
+                   pos == end;
+        case WALRecordType::COMMIT:
+        case WALRecordType::ABORT:
+        case WALRecordType::CHECKPOINT:
+            return pos == end;
+    }
+    return false; // Unknown type
+}
 
-        const auto remaining_record_bytes = static_cast<std::streamoff>(header.record_size - sizeof(WALRecordHeader));
+/*
+ Read the log from the start, segment by segment and frame by frame.
+ Records before from_lsn's segment all end before from_lsn, so reading can
+ start there. A pad marker sends us on to the next segment. An empty frame
+ is the preallocated rest of the segment, and a frame that runs past the
+ segment end or fails its checksum is where a crash cut the log off (or
+ old data from a recycled file), nothing after either one is part of the
+ log. An intact record that doesn't decode is skipped.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::readRecords(uint64_t from_lsn, const std::function<void(const WALRecord<KeyType>&)>& visit) {
+    uint64_t segment;
+    {
+        std::lock_guard<std::mutex> lock(segment_mutex);
+        segment = first_segment;
+    }
+    // The first record of a segment may end exactly at from_lsn, so start one segment early
+    if (from_lsn > 0) {
+        segment = std::max(segment, (from_lsn - 1) / segment_size);
+    }
 
-        // Process only records at or after from_lsn (still need to move cursor regardless)
-        switch (header.type) {
-            case WALRecordType::CHECKPOINT: {
-                if (header.lsn >= from_lsn) {
-                    std::cout << "WAL: [LSN " << header.lsn << "] CHECKPOINT" << std::endl;
-                }
-                last_ckpt = header.lsn;
+    uint64_t position = segment * segment_size;
+    size_t skipped = 0;
+    std::vector<uint8_t> body;
+    WALRecord<KeyType> record;
+    for (bool next_segment = true; next_segment; ++segment) {
+        next_segment = false;
+        std::ifstream file(segmentPath(segment), std::ios::binary);
+        if (!file.is_open()) {
+            break;
+        }
+        uint64_t segment_end = (segment + 1) * segment_size;
+        while (true) {
+            if (segment_end - position < WAL_FRAME_HEADER_BYTES) {
+                next_segment = true;  // Too little room left for any record
                 break;
             }
-            case WALRecordType::COMMIT: {
-                if (header.lsn >= from_lsn) {
-                    std::cout << "WAL: [LSN " << header.lsn << "] COMMIT txn=" << header.transaction_id << std::endl;
-                }
+            uint8_t frame[WAL_FRAME_HEADER_BYTES];
+            file.read(reinterpret_cast<char*>(frame), sizeof(frame));
+            if (!file) {
                 break;
             }
-            case WALRecordType::ABORT: {
-                if (header.lsn >= from_lsn) {
-                    std::cout << "WAL: [LSN " << header.lsn << "] ABORT txn=" << header.transaction_id << std::endl;
-                }
+            uint32_t body_size = getFixed32(frame);
+            uint32_t checksum = getFixed32(frame + 4);
+            if (body_size == 0) {
+                next_segment = checksum == positionChecksum(0, position);
                 break;
             }
-            case WALRecordType::INSERT:
-            case WALRecordType::DELETE:
-            case WALRecordType::UPDATE: {
-                // For data records, the bytes immediately after the header are:
-                // uint16_t page_id; KeyType key; followed by vector internals and variable payload.
-                uint16_t page_id = 0;
-                KeyType key{};
-
-                std::streampos after_header_pos = file.tellg();
-                bool ok = true;
-
-                file.read(reinterpret_cast<char*>(&page_id), sizeof(page_id));
-                if (!file) ok = false;
- 
-                if (ok) {
-                    file.read(reinterpret_cast<char*>(&key), sizeof(KeyType));
-                    if (!file) ok = false;
-                }
 
-                if (ok && header.lsn >= from_lsn) {
-                    const char* t = (header.type == WALRecordType::INSERT) ? "INSERT" :
-                                    (header.type == WALRecordType::DELETE) ? "DELETE" : "UPDATE";
-                    std::cout << "WAL: [LSN " << header.lsn << "] " << t
-                              << " pid=" << page_id << " key=" << key << std::endl;
-                }
-
-                // Seek to the end of this record (skip remaining payload and vector internals)
-                // Current position is after header + sizeof(page_id) + sizeof(KeyType)
-                if (ok) {
-                    std::streamoff bytes_read_after_header = static_cast<std::streamoff>(sizeof(page_id) + sizeof(KeyType));
-                    std::streamoff to_skip = remaining_record_bytes - bytes_read_after_header;
-                    if (to_skip > 0) {
-                        file.seekg(to_skip, std::ios::cur);
-                    }
-                } else {
-                    // Failed to read expected fields, try to realign by skipping remaining_record_bytes
-                    file.clear();
-                    file.seekg(after_header_pos + remaining_record_bytes);
-                }
-                break;
+            body.resize(body_size);
+            if (body_size <= segment_end - position - sizeof(frame)) {
+                file.read(reinterpret_cast<char*>(body.data()), body_size);
             }
-            default: {
-                // Unknown type so skip the rest of this record safely
-                file.seekg(remaining_record_bytes, std::ios::cur);
+            if (body_size > segment_end - position - sizeof(frame) || !file ||
+                positionChecksum(calculateChecksum(0, body.data(), body.size()), position) != checksum) {
+                LOG_WARN("WAL: Torn, corrupt or stale record at position " << position
+                         << ", the log ends there");
                 break;
             }
+
+            position += sizeof(frame) + body_size;
+            if (position < from_lsn || !visit) {
+                continue;
+            }
+            if (!decodeRecord(body.data(), body.size(), record)) {
+                skipped++;
+                continue;
+            }
+            record.lsn = position;
+            visit(record);
+        }
+        if (next_segment) {
+            position = segment_end;
         }
     }
-
-    // Update internal counters based on what weve seen
-    if (max_seen_lsn >= from_lsn && max_seen_lsn >= next_lsn.load()) {
-        next_lsn.store(max_seen_lsn + 1);
+    if (skipped > 0) {
+        LOG_WARN("WAL: Skipped " << skipped << " records that don't decode with this key type");
     }
+    return position;
+}
+
+/*
+ Find the end of the intact log when we open it. Whatever follows (a torn
+ write from a crash) is cleared, so new records go right after the last
+ good one instead of behind bytes replay would stop at. Transaction IDs
+ carry on after the highest one in the log, and the last checkpoint is
+ picked up from it too.
+*/
+template<typename KeyType>
+uint64_t WALManager<KeyType>::recoverLogEnd() {
+    uint64_t max_seen_txn = 0;
+    uint64_t last_ckpt = 0;
+    uint64_t log_end = readRecords(0, [&](const WALRecord<KeyType>& record) {
+        if (record.transaction_id > max_seen_txn) max_seen_txn = record.transaction_id;
+        if (record.type == WALRecordType::CHECKPOINT) last_ckpt = record.lsn;
+        if (record.type == WALRecordType::CHECKPOINT_END) last_ckpt = record.redo_lsn;
+    });
+    next_transaction_id.store(max_seen_txn + 1);
+    last_checkpoint_lsn.store(last_ckpt);
+    clearSegmentsFrom(log_end);
+    return log_end;
+}
+
+/*
+ This is mainly for debugging, we read through the WAL file and print
+ information about each record with an LSN at or after from_lsn. Every
+ record still counts towards the transaction ID and checkpoint we resume from.
+*/
+template<typename KeyType>
+void WALManager<KeyType>::replay(uint64_t from_lsn) {
+    std::cout << "WAL: Replaying from LSN " << from_lsn << std::endl;
+
+    uint64_t max_seen_txn = 0;
+    uint64_t last_ckpt = last_checkpoint_lsn.load();
+    readRecords(0, [&](const WALRecord<KeyType>& record) {
+        // Track maxima for internal counters
+        if (record.transaction_id > max_seen_txn) max_seen_txn = record.transaction_id;
+        if (record.type == WALRecordType::CHECKPOINT) last_ckpt = record.lsn;
+        if (record.type == WALRecordType::CHECKPOINT_END) last_ckpt = record.redo_lsn;
+        if (record.lsn < from_lsn) {
+            return;
+        }
+
+        std::cout << "WAL: [LSN " << record.lsn << "] ";
+        switch (record.type) {
+            case WALRecordType::CHECKPOINT:
+                std::cout << "CHECKPOINT";
+                break;
+            case WALRecordType::CHECKPOINT_BEGIN:
+                std::cout << "CHECKPOINT_BEGIN active=" << record.active_transactions.size()
+                          << " dirty=" << record.dirty_pages.size();
+                break;
+            case WALRecordType::CHECKPOINT_END:
+                std::cout << "CHECKPOINT_END begin=" << record.checkpoint_begin_lsn << " redo=" << record.redo_lsn;
+                break;
+            case WALRecordType::COMMIT:
+                std::cout << "COMMIT txn=" << record.transaction_id;
+                break;
+            case WALRecordType::ABORT:
+                std::cout << "ABORT txn=" << record.transaction_id;
+                break;
+            case WALRecordType::BULK_LOAD:
+                // Pages were synced before the record was written, so there's nothing to redo
+                std::cout << "BULK_LOAD txn=" << record.transaction_id << " root=" << record.root_page_id
+                          << " keys=" << record.num_keys;
+                break;
+            case WALRecordType::INSERT_BATCH:
+                std::cout << "INSERT_BATCH txn=" << record.transaction_id << " entries=" << record.entries.size();
+                break;
+            case WALRecordType::UNDO:
+                std::cout << "UNDO txn=" << record.transaction_id << " key=" << record.key
+                          << (record.had_key ? "" : " (absent)");
+                break;
+            case WALRecordType::INSERT:
+            case WALRecordType::DELETE:
+            case WALRecordType::UPDATE: {
+                const char* t = (record.type == WALRecordType::INSERT) ? "INSERT" :
+                                (record.type == WALRecordType::DELETE) ? "DELETE" : "UPDATE";
+                std::cout << t << " txn=" << record.transaction_id << " pid=" << record.page_id
+                          << " key=" << record.key;
+                break;
+            }
+        }
+        std::cout << std::endl;
+    });
+
+    // Update internal counters based on what weve seen, LSNs are positions
+    // in the file so next_lsn is past every record already
     if (max_seen_txn >= next_transaction_id.load()) {
         next_transaction_id.store(max_seen_txn + 1);
     }
@@ -401,118 +1185,213 @@ void WALManager<KeyType>::replay(uint64_t from_lsn) {
 /*
  This function replays the WAL from a given LSN but also invokes
  REDO handlers for data records to apply changes to the db state.
+ Batch entries are handed to on_insert one at a time, with page ID 0.
 */
 template<typename KeyType>
 void WALManager<KeyType>::replay(uint64_t from_lsn, const typename WALManager<KeyType>::RedoHandlers& handlers) {
     std::cout << "WAL: Replaying (with REDO) from LSN " << from_lsn << std::endl;
-    std::ifstream file(wal_file_path, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "WAL: Failed to open WAL file for replay: " << wal_file_path << std::endl;
-        return;
-    }
 
-    uint64_t max_seen_lsn = 0;
     uint64_t max_seen_txn = 0;
     uint64_t last_ckpt = last_checkpoint_lsn.load();
+    readRecords(0, [&](const WALRecord<KeyType>& record) {
+        if (record.transaction_id > max_seen_txn) max_seen_txn = record.transaction_id;
+        if (record.type == WALRecordType::CHECKPOINT) last_ckpt = record.lsn;
+        if (record.type == WALRecordType::CHECKPOINT_END) last_ckpt = record.redo_lsn;
+        if (record.lsn < from_lsn) {
+            return;
+        }
 
-    while (true) {
-        WALRecordHeader header(WALRecordType::ABORT, 0, 0, 0);
-        file.read(reinterpret_cast<char*>(&header), sizeof(header));
-        if (!file) {
-            break;
+        switch (record.type) {
+            case WALRecordType::INSERT:
+                if (handlers.on_insert) handlers.on_insert(record.page_id, record.key, record.new_data);
+                break;
+            case WALRecordType::DELETE:
+                if (handlers.on_delete) handlers.on_delete(record.page_id, record.key, record.old_data);
+                break;
+            case WALRecordType::UPDATE:
+                if (handlers.on_update) handlers.on_update(record.page_id, record.key, record.old_data, record.new_data);
+                break;
+            case WALRecordType::INSERT_BATCH:
+                for (const auto& entry : record.entries) {
+                    if (handlers.on_insert) handlers.on_insert(0, entry.first, entry.second);
+                }
+                break;
+            default:
+                break;
         }
+    });
 
-        if (header.lsn > max_seen_lsn) max_seen_lsn = header.lsn;
-        if (header.transaction_id > max_seen_txn) max_seen_txn = header.transaction_id;
+    if (max_seen_txn >= next_transaction_id.load()) {
+        next_transaction_id.store(max_seen_txn + 1);
+    }
+    last_checkpoint_lsn.store(last_ckpt);
 
-        if (header.record_size < sizeof(WALRecordHeader)) {
-            std::cerr << "WAL: Corrupt record encountered (record_size < header). Stopping replay." << std::endl;
-            break;
+    std::cout << "WAL: Replay (with REDO) finished. next_lsn=" << next_lsn.load()
+              << ", next_txn_id=" << next_transaction_id.load()
+              << ", last_checkpoint_lsn=" << last_checkpoint_lsn.load() << std::endl;
+}
+
+/*
+ ARIES-style restart:
+    1. analysis: read the log from from_lsn and collect every transaction
+       that has a COMMIT record
+    2. redo and undo: read it again and deal each committed change out to a
+       worker. A change of a transaction that never committed isn't redone,
+       the saved pages can only hold it if a checkpoint saved them while the
+       transaction was open, and that checkpoint logged an UNDO record for
+       every key the transaction had changed. Those are dealt out too, in
+       their place in the log, and put the key back.
+       A page (or key, for logical records) always goes to the same worker,
+       so changes to it are applied in log order, and different pages are
+       redone in parallel.
+ The reader hands records over in batches, and stops reading while a worker
+ is far behind, so memory stays bounded for a long log.
+*/
+template<typename KeyType>
+RecoveryStats WALManager<KeyType>::recover(uint64_t from_lsn, size_t num_threads,
+                                           const std::function<void(const WALRecord<KeyType>&)>& apply) {
+    constexpr size_t REDO_BATCH = 256;
+    constexpr size_t MAX_QUEUED = 64 * 1024;
+
+    RecoveryStats stats;
+    stats.redo_lsn = from_lsn;
+    stats.threads = num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+
+    // Analysis pass
+    std::unordered_set<uint64_t> committed;
+    stats.end_lsn = readRecords(from_lsn, [&](const WALRecord<KeyType>& record) {
+        if (record.type == WALRecordType::COMMIT) {
+            committed.insert(record.transaction_id);
         }
+    });
+    stats.committed = committed.size();
+    LOG_INFO("WAL: Recovery analysis found " << committed.size() << " committed transactions between LSN "
+             << from_lsn << " and " << stats.end_lsn);
 
-        const auto remaining_record_bytes = static_cast<std::streamoff>(header.record_size - sizeof(WALRecordHeader));
+    // Redo pass, one queue per worker
+    struct RedoQueue {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<WALRecord<KeyType>> records;
+        bool done = false;
+    };
+    std::vector<RedoQueue> queues(stats.threads);
+    std::vector<std::vector<WALRecord<KeyType>>> pending(stats.threads);
+    std::mutex error_mutex;
+    std::exception_ptr error;
 
-        switch (header.type) {
-            case WALRecordType::CHECKPOINT: {
-                if (header.lsn >= from_lsn) {
-                    std::cout << "WAL: [LSN " << header.lsn << "] CHECKPOINT" << std::endl;
-                }
-                last_ckpt = header.lsn;
-                break;
-            }
-            case WALRecordType::COMMIT: {
-                if (header.lsn >= from_lsn) {
-                    std::cout << "WAL: [LSN " << header.lsn << "] COMMIT txn=" << header.transaction_id << std::endl;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < stats.threads; ++i) {
+        workers.emplace_back([&, i] {
+            RedoQueue& queue = queues[i];
+            std::vector<WALRecord<KeyType>> batch;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(queue.mutex);
+                    queue.cv.wait(lock, [&] { return queue.done || !queue.records.empty(); });
+                    if (queue.records.empty()) {
+                        return;
+                    }
+                    batch.swap(queue.records);
                 }
-                break;
-            }
-            case WALRecordType::ABORT: {
-                if (header.lsn >= from_lsn) {
-                    std::cout << "WAL: [LSN " << header.lsn << "] ABORT txn=" << header.transaction_id << std::endl;
+                queue.cv.notify_all();  // The reader may be waiting for room
+                for (const auto& record : batch) {
+                    try {
+                        apply(record);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!error) error = std::current_exception();
+                    }
                 }
-                break;
+                batch.clear();
             }
+        });
+    }
+
+    auto hand_over = [&](size_t worker) {
+        RedoQueue& queue = queues[worker];
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.cv.wait(lock, [&] { return queue.records.size() < MAX_QUEUED; });
+        for (auto& record : pending[worker]) {
+            queue.records.push_back(std::move(record));
+        }
+        pending[worker].clear();
+        lock.unlock();
+        queue.cv.notify_all();
+    };
+    auto dispatch = [&](WALRecord<KeyType>&& record) {
+        size_t worker = record.page_id != 0 ? std::hash<PageId>()(record.page_id) % stats.threads
+                                            : std::hash<KeyType>()(record.key) % stats.threads;
+        if (record.type == WALRecordType::UNDO) {
+            stats.undone++;
+        } else {
+            stats.redone++;
+        }
+        pending[worker].push_back(std::move(record));
+        if (pending[worker].size() >= REDO_BATCH) {
+            hand_over(worker);
+        }
+    };
+
+    readRecords(from_lsn, [&](const WALRecord<KeyType>& record) {
+        switch (record.type) {
             case WALRecordType::INSERT:
             case WALRecordType::DELETE:
-            case WALRecordType::UPDATE: {
-                uint16_t page_id = 0;
-                KeyType key{};
-                std::streampos after_header_pos = file.tellg();
-                bool ok = true;
-                file.read(reinterpret_cast<char*>(&page_id), sizeof(page_id));
-                if (!file) ok = false;
-                if (ok) {
-                    file.read(reinterpret_cast<char*>(&key), sizeof(KeyType));
-                    if (!file) ok = false;
+            case WALRecordType::UPDATE:
+                if (!committed.count(record.transaction_id)) {
+                    stats.skipped++;
+                    return;
                 }
-
-                // Compute how many bytes remain in the record payload after page_id+key
-                std::streamoff bytes_read_after_header = static_cast<std::streamoff>(sizeof(page_id) + sizeof(KeyType));
-                std::streamoff variable_bytes = remaining_record_bytes - bytes_read_after_header;
-
-                std::vector<uint8_t> var_payload;
-                if (ok && variable_bytes > 0) {
-                    var_payload.resize(static_cast<size_t>(variable_bytes));
-                    file.read(reinterpret_cast<char*>(var_payload.data()), variable_bytes);
-                    if (!file) ok = false;
+                dispatch(WALRecord<KeyType>(record));
+                break;
+            case WALRecordType::INSERT_BATCH:
+                if (!committed.count(record.transaction_id)) {
+                    stats.skipped += record.entries.size();
+                    return;
                 }
-
-                if (ok && header.lsn >= from_lsn) {
-                    if (header.type == WALRecordType::INSERT) {
-                        if (handlers.on_insert) handlers.on_insert(page_id, key, var_payload);
-                    } else if (header.type == WALRecordType::DELETE) {
-                        if (handlers.on_delete) handlers.on_delete(page_id, key, var_payload);
-                    } else { // UPDATE
-                        // Heuristic split of var_payload into old/new halves is not reliable without lengths.
-                        // Pass entire payload as new_data and leave old_data empty unless the caller knows layout.
-                        if (handlers.on_update) handlers.on_update(page_id, key, std::vector<uint8_t>{}, var_payload);
-                    }
+                for (const auto& entry : record.entries) {
+                    WALRecord<KeyType> insert;
+                    insert.type = WALRecordType::INSERT;
+                    insert.lsn = record.lsn;
+                    insert.transaction_id = record.transaction_id;
+                    insert.key = entry.first;
+                    insert.new_data = entry.second;
+                    dispatch(std::move(insert));
                 }
-
-                if (!ok) {
-                    file.clear();
-                    file.seekg(after_header_pos + remaining_record_bytes);
+                break;
+            case WALRecordType::UNDO:
+                if (!committed.count(record.transaction_id)) {
+                    dispatch(WALRecord<KeyType>(record));
                 }
                 break;
-            }
-            default: {
-                file.seekg(remaining_record_bytes, std::ios::cur);
+            case WALRecordType::BULK_LOAD:
+                stats.bulk_loads++;
+                break;
+            default:
                 break;
-            }
         }
-    }
+    });
 
-    if (max_seen_lsn >= from_lsn && max_seen_lsn >= next_lsn.load()) {
-        next_lsn.store(max_seen_lsn + 1);
+    for (size_t i = 0; i < stats.threads; ++i) {
+        if (!pending[i].empty()) {
+            hand_over(i);
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues[i].mutex);
+            queues[i].done = true;
+        }
+        queues[i].cv.notify_all();
     }
-    if (max_seen_txn >= next_transaction_id.load()) {
-        next_transaction_id.store(max_seen_txn + 1);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
     }
-    last_checkpoint_lsn.store(last_ckpt);
 
-    std::cout << "WAL: Replay (with REDO) finished. next_lsn=" << next_lsn.load()
-              << ", next_txn_id=" << next_transaction_id.load()
-              << ", last_checkpoint_lsn=" << last_checkpoint_lsn.load() << std::endl;
+    LOG_INFO("WAL: Recovery redid " << stats.redone << " changes on " << stats.threads << " threads, skipped "
+             << stats.skipped << " and undid " << stats.undone << " from uncommitted transactions");
+    return stats;
 }
 
 template class WALManager<int>;
@@ -1,6 +1,12 @@
 #include "writer_queue.h"
+#include "log.h"
+#include "metrics.h"
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+
+// How long a writer waits after a failed write before it takes more work
+static constexpr std::chrono::milliseconds WRITE_RETRY_DELAY(100);
 
 /*
  This is where we manage async writes to the ContentStorage.
@@ -10,10 +16,10 @@
 */
 template <typename KeyType>
 WriterQueue<KeyType>::WriterQueue(ContentStorage<KeyType>* storage, PageCache<KeyType>* cache, 
-                                  size_t num_threads, size_t max_queue)
-    : content_storage(storage), page_cache(cache), running(false), 
-      num_writer_threads(num_threads), max_queue_size(max_queue),
-      batch_timeout(std::chrono::milliseconds(10)) {
+                                  size_t num_threads, size_t max_queue, size_t max_batch)
+    : running(false), num_writer_threads(num_threads),
+      content_storage(storage), page_cache(cache),
+      max_queue_size(max_queue), max_batch_size(max_batch > 0 ? max_batch : 1) {
     
     if (!storage || !cache) {
         throw std::invalid_argument("ContentStorage and PageCache cannot be null");
@@ -47,7 +53,7 @@ void WriterQueue<KeyType>::start() {
         writer_threads.emplace_back(&WriterQueue::writerWorker, this, i);
     }
     
-    std::cout << "WriterQueue: Started " << num_writer_threads << " writer threads" << std::endl;
+    LOG_INFO("WriterQueue: Started " << num_writer_threads << " writer threads");
 }
 
 /*
@@ -59,11 +65,15 @@ void WriterQueue<KeyType>::stop() {
         return; // Already stopped
     }
     
-    std::cout << "WriterQueue: Stopping writer threads" << std::endl;
+    LOG_INFO("WriterQueue: Stopping writer threads");
     
     // Set running to false and notify all waiting threads to wake up
-    running.store(false);
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        running.store(false);
+    }
     queue_cv.notify_all();
+    space_cv.notify_all();
     
     // Wait for all threads to finish
     for (auto& thread : writer_threads) {
@@ -74,116 +84,241 @@ void WriterQueue<KeyType>::stop() {
     }
     
     writer_threads.clear();
-    std::cout << "WriterQueue: All writer threads stopped" << std::endl;
+    LOG_INFO("WriterQueue: All writer threads stopped");
 }
 /*
- Enqueue write request for a page, returns false if queue is full,
- and wake up one writer thread if possible.
+ Queue a page to be written. A page that is already waiting isn't queued
+ twice, its request just takes the newer page object. Never blocks and
+ never drops anything, see throttle for backpressure.
 */
 template <typename KeyType>
-bool WriterQueue<KeyType>::enqueueWrite(uint16_t page_id, std::shared_ptr<Page<KeyType>> page) {
-    std::unique_lock<std::mutex> lock(queue_mutex);
-    
-    // Check if queue is full
-    if (write_queue.size() >= max_queue_size) {
-        std::cout << "WriterQueue: Queue overflow, dropping write request for page " << page_id << std::endl;
-        return false;
+bool WriterQueue<KeyType>::enqueueWrite(PageId page_id, std::shared_ptr<Page<KeyType>> page) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        auto it = pending.find(page_id);
+        if (it != pending.end()) {
+            it->second.page = std::move(page);
+            writes_coalesced.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        pending.emplace(page_id, WriteRequest<KeyType>(page_id, std::move(page)));
+        pending_order.push_back(page_id);
+        metrics::writer_queue_depth.set(static_cast<double>(pending.size()));
     }
-    
-    // Enqueue the write request to the write queue
-   write_queue.emplace(page_id, page);
+    pages_queued.fetch_add(1, std::memory_order_relaxed);
     
     // Wake up one writer thread to process the new request
     queue_cv.notify_one();
-    
     return true;
 }
 
 /*
- Wait until the write queue is empty.
+ Backpressure: wait until fewer than max_queue_size pages are pending. The
+ tree calls this at the start of an operation, before it latches anything,
+ so the pages the writers are waiting to latch are never held by a thread
+ stuck here.
 */
 template <typename KeyType>
-void WriterQueue<KeyType>::waitForEmpty() {
+void WriterQueue<KeyType>::throttle() {
     std::unique_lock<std::mutex> lock(queue_mutex);
-    empty_cv.wait(lock, [this] { return write_queue.empty(); });
+    if (pending.size() < max_queue_size || !running.load()) {
+        return;
+    }
+    throttle_waits.fetch_add(1, std::memory_order_relaxed);
+    space_cv.wait(lock, [this] { return pending.size() < max_queue_size || !running.load(); });
 }
 
 /*
- This function collects a batch of write requests
- that can be up to max_batch_size in size, and 
- returns the batch.
+ Wait until every queued page has been written, including the ones
+ writers have taken but not stored yet. If a write failed since the last
+ call, throws its error instead: the page is queued again, but the caller
+ should know its data isn't on disk.
 */
+template <typename KeyType>
+void WriterQueue<KeyType>::waitForEmpty() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    empty_cv.wait(lock, [this] {
+        return (pending.empty() && in_flight == 0) || write_error || !running.load();
+    });
+    if (write_error) {
+        std::exception_ptr error = write_error;
+        write_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
 
 template <typename KeyType>
-std::vector<WriteRequest<KeyType>> WriterQueue<KeyType>::getBatch(size_t max_batch_size) {
+size_t WriterQueue<KeyType>::pendingWrites() const {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return pending.size();
+}
+
+/*
+ Wait for work and take the oldest pending pages. The batch size adapts
+ to the backlog: each writer takes its share of what is pending (at least
+ one page, at most max_batch_size), so a short queue is spread over the
+ writers and a long one is drained in big batches.
+*/
+template <typename KeyType>
+std::vector<WriteRequest<KeyType>> WriterQueue<KeyType>::getBatch() {
     std::vector<WriteRequest<KeyType>> batch;
     std::unique_lock<std::mutex> lock(queue_mutex);
-    
-    auto timeout = std::chrono::steady_clock::now() + batch_timeout;
-    // Wait until there are write requests or a time out
-    queue_cv.wait_until(lock, timeout, [this] { return !write_queue.empty() || !running.load(); });
-    
-    // Collect batch
-    while (!write_queue.empty() && batch.size() < max_batch_size) {
-        batch.push_back(std::move(write_queue.front()));
-        write_queue.pop();
+    queue_cv.wait(lock, [this] { return !pending.empty() || !running.load(); });
+
+    size_t share = (pending.size() + num_writer_threads - 1) / num_writer_threads;
+    size_t batch_size = std::min(std::max<size_t>(share, 1), max_batch_size);
+    batch.reserve(std::min(batch_size, pending.size()));
+
+    while (!pending_order.empty() && batch.size() < batch_size) {
+        auto it = pending.find(pending_order.front());
+        pending_order.pop_front();
+        batch.push_back(std::move(it->second));
+        pending.erase(it);
     }
-    
-    // Notify any thread waiting for empty queue if empty
-    if (write_queue.empty()) {
-        empty_cv.notify_all();
+    in_flight += batch.size();
+    metrics::writer_queue_depth.set(static_cast<double>(pending.size()));
+
+    if (!batch.empty() && pending.size() < max_queue_size) {
+        space_cv.notify_all();
     }
-    
     return batch;
 }
 
 /*
- Helper function to process a batch of write requests.
+ Store every page of a batch. Each page is snapshotted under its latch,
+ one at a time (holding several latches at once could deadlock against
+ the tree), and the whole batch then goes to storage together, so its new
+ content is written with a few vectored writes. A page that was queued
+ again meanwhile is back in pending with a fresh request, and gets
+ written again then. Pages that fail stay dirty in the cache and go back
+ in the queue, see requeueFailed. Returns false if any did.
 */
 template <typename KeyType>
-void WriterQueue<KeyType>::processBatch(const std::vector<WriteRequest<KeyType>>& batch, int worker_id) {
-    if (batch.empty()) return;
-    
-    std::cout << "WriterQueue: Worker " << worker_id << " processing batch of " << batch.size() << " pages" << std::endl;
-    
-    for (const auto& request : batch) {
+bool WriterQueue<KeyType>::processBatch(const std::vector<WriteRequest<KeyType>>& batch, int worker_id,
+                                        AlignedPageBuffer& images) {
+    std::vector<typename ContentStorage<KeyType>::PageSnapshot> snapshots;
+    std::vector<size_t> snapshot_requests;  // Index in batch of each snapshot
+    std::vector<size_t> failed;
+    std::exception_ptr error;
+    size_t stored = 0;
+    snapshots.reserve(batch.size());
+    snapshot_requests.reserve(batch.size());
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const auto& request = batch[i];
         try {
-            // Write to content storage (this is where deduplication happens yayy)
-            uint16_t stored_page_id = content_storage->storePage(*(request.page));
-            
-            // Clear dirty flag in cache since weve written it
-            page_cache->clearDirtyFlag(request.page_id);
-            
+            // Snapshot the page under its latch, the tree mutates pages in place
+            std::shared_lock<std::shared_mutex> latch(request.page->latch.mutex);
+            if (request.page->header.page_id == 0) {
+                content_storage->storePage(*(request.page));  // Needs an ID first, goes through a copy
+                stored++;
+                continue;
+            }
+            snapshots.push_back(ContentStorage<KeyType>::snapshotPage(*(request.page),
+                                                                      images.page(snapshots.size())));
+            snapshot_requests.push_back(i);
         } catch (const std::exception& e) {
-            std::cerr << "WriterQueue: Error writing page " << request.page_id << ": " << e.what() << std::endl;
+            LOG_ERROR("WriterQueue: Worker " << worker_id << " error writing page " << request.page_id
+                      << ": " << e.what());
+            failed.push_back(i);
+            error = std::current_exception();
+        }
+    }
+
+    try {
+        // Write to content storage (this is where deduplication happens yayy)
+        content_storage->storeSnapshots(snapshots.data(), snapshots.size());
+
+        // Clear dirty flags in cache since weve written the pages, unless they changed again
+        for (const auto& snapshot : snapshots) {
+            page_cache->clearDirtyFlag(snapshot.page_id, snapshot.version);
         }
+        stored += snapshots.size();
+    } catch (const std::exception& e) {
+        LOG_ERROR("WriterQueue: Worker " << worker_id << " error writing a batch of "
+                  << snapshots.size() << " pages: " << e.what());
+        failed.insert(failed.end(), snapshot_requests.begin(), snapshot_requests.end());
+        error = std::current_exception();
     }
+    pages_written.fetch_add(stored, std::memory_order_relaxed);
+    metrics::writer_pages_written.add(stored);
+    if (stored > 0) {
+        batches_written.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (!failed.empty()) {
+        requeueFailed(batch, failed, error);
+    }
+    in_flight -= batch.size();
+    if ((pending.empty() && in_flight == 0) || write_error) {
+        empty_cv.notify_all();
+    }
+    return failed.empty();
 }
 
 /*
- Actually process a batch of write requests after collecting them.
+ Put the failed requests of a batch back in line, called with queue_mutex
+ held. A page queued again since has a newer request already, which
+ writes its newest state anyway. While stopping, nothing goes back: the
+ pages are still dirty in the cache, and flushAll writes them (or throws).
+*/
+template <typename KeyType>
+void WriterQueue<KeyType>::requeueFailed(const std::vector<WriteRequest<KeyType>>& batch,
+                                         const std::vector<size_t>& failed, std::exception_ptr error) {
+    write_failures.fetch_add(failed.size(), std::memory_order_relaxed);
+    if (!write_error) {
+        write_error = error;
+    }
+    if (!running.load()) {
+        return;
+    }
+    for (size_t i : failed) {
+        const auto& request = batch[i];
+        if (pending.emplace(request.page_id, request).second) {
+            pending_order.push_back(request.page_id);
+        }
+    }
+    metrics::writer_queue_depth.set(static_cast<double>(pending.size()));
+}
+
+/*
+ Writer thread: sleeps on the queue until there is work, no polling. On
+ stop it keeps going until everything queued has been written. After a
+ failed write it waits WRITE_RETRY_DELAY, so a full or broken disk isn't
+ retried in a busy loop.
 */
 template <typename KeyType>
 void WriterQueue<KeyType>::writerWorker(int worker_id) {
-    std::cout << "WriterQueue: Worker " << worker_id << " started" << std::endl;
-    
-    const size_t max_batch_size = 10;
+    LOG_DEBUG("WriterQueue: Worker " << worker_id << " started");
+    AlignedPageBuffer images(max_batch_size);  // Page images of the batch being written
     
-    while (running.load() || !write_queue.empty()) {
-        auto batch = getBatch(max_batch_size);
-        
-        if (!batch.empty()) {
-            processBatch(batch, worker_id);
+    while (true) {
+        auto batch = getBatch();
+        if (batch.empty()) {
+            break;  // Stopped and drained
+        }
+        if (!processBatch(batch, worker_id, images)) {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait_for(lock, WRITE_RETRY_DELAY, [this] { return !running.load(); });
         }
-        
-        // Small delay to prevent busy waiting
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
     }
     
-    std::cout << "WriterQueue: Worker " << worker_id << " finished" << std::endl;
+    LOG_DEBUG("WriterQueue: Worker " << worker_id << " finished");
 }
 
-
+template <typename KeyType>
+void WriterQueue<KeyType>::printStats() const {
+    size_t batches = batches_written.load();
+    std::cout << "\n=== Writer Queue Statistics ===" << std::endl;
+    std::cout << "Pages queued: " << pages_queued.load() << ", coalesced writes: "
+              << writes_coalesced.load() << std::endl;
+    std::cout << "Pages written: " << pages_written.load() << " in " << batches << " batches (avg "
+              << (batches > 0 ? pages_written.load() / batches : 0) << " per batch)" << std::endl;
+    std::cout << "Pending: " << pendingWrites() << ", producer throttle waits: "
+              << throttle_waits.load() << ", failed writes: " << write_failures.load() << std::endl;
+    std::cout << "===============================" << std::endl;
+}
 
 template class WriterQueue<int>;
 template class WriterQueue<std::string>;